@@ -479,7 +479,6 @@ public:
                 Image *magPyramid, Image *ornPyramid,
                 vector<float> *sigma, float orientation) :
             LocalMaxima::Maximum(m.x, m.y, floor(m.t+0.5), m.value),
-            usage(0),
             descriptor(m, magPyramid, ornPyramid, sigma, orientation)
         {}
 
@@ -496,10 +495,6 @@ public:
             return dist;
         }
 
-        // It's useful to keep track of how many times any one given
-        // features is used, so we don't depend too heavily on a
-        // single feature.
-        int usage;
         Descriptor descriptor;
     };
 
@@ -510,6 +505,11 @@ public:
             b = b_;
             distance = a->distance(b);
         }
+        Correspondence(Feature *a_, Feature *b_, float distance_) {
+            a = a_;
+            b = b_;
+            distance = distance_;
+        }
         float distance;
         Feature *a, *b;
 
@@ -544,14 +544,19 @@ public:
             sig *= sigScale;
         }
 
-        // Magnitude and phase of gradient images
+        // Magnitude and phase of gradient images. All levels share a
+        // single allocation, with one level per frame.
+        Image mag(gray.width, gray.height, gaussianLevels-3, 1);
+        Image orn(gray.width, gray.height, gaussianLevels-3, 1);
         for (int i=0; i<gaussianLevels-3; i++) {
-            ornPyramid[i] = Image(gray.width, gray.height, gray.frames, gray.channels);
-            magPyramid[i] = Image(gray.width, gray.height, gray.frames, gray.channels);
+            magPyramid[i] = mag.frame(i);
+            ornPyramid[i] = orn.frame(i);
+            Image level = gPyramid.frame(i+2);
 
+            #ifdef _OPENMP
+            #pragma omp parallel for
+            #endif
             for (int y=1; y<gray.height-1; y++) {
-
-                Image level = gPyramid.frame(i+2);
                 for (int x=1; x<gray.width-1; x++) {
                     float dx = level(x-1, y) - level(x+1, y);
                     float dy = level(x, y-1) - level(x, y+1);
@@ -625,144 +630,226 @@ public:
         }
 
         printf("%u / %u features found\n", (unsigned int)corners.size(), (unsigned int)maxima.size());
+
+        // Pack the descriptors into a structure-of-arrays table so
+        // that matching can stream through many features at once.
+        descriptors.resize(corners.size() * 128);
+        for (size_t j = 0; j < corners.size(); j++) {
+            for (int d = 0; d < 128; d++) {
+                descriptors[d * corners.size() + j] = corners[j].descriptor.desc[d];
+            }
+        }
+    }
+
+    // For each of our features, find its nearest and second-nearest
+    // neighbours in descriptor space among the other digest's
+    // features, and keep the nearest one as a correspondence if it
+    // passes Lowe's ratio test. This is a brute force search, but it
+    // only ever holds one block of distances per query feature, rather
+    // than materializing every possible pair.
+    void match(Digest &other, vector<Correspondence> *result) {
+        const int n = (int)corners.size();
+        const int m = (int)other.corners.size();
+        const int block = 256;
+
+        // Squared distance to the nearest and second nearest feature
+        vector<float> best(n), second(n);
+        vector<int> bestIdx(n, -1);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 16)
+        #endif
+        for (int i = 0; i < n; i++) {
+            const float *query = corners[i].descriptor.desc;
+            float dist[block];
+            float d1 = INF, d2 = INF;
+            int j1 = -1;
+            for (int j0 = 0; j0 < m; j0 += block) {
+                const int size = std::min(block, m - j0);
+                for (int j = 0; j < size; j++) { dist[j] = 0; }
+                for (int d = 0; d < 128; d++) {
+                    const float q = query[d];
+                    const float *row = &other.descriptors[d * m + j0];
+                    for (int j = 0; j < size; j++) {
+                        float diff = row[j] - q;
+                        dist[j] += diff * diff;
+                    }
+                }
+                for (int j = 0; j < size; j++) {
+                    if (dist[j] < d1) {
+                        d2 = d1;
+                        d1 = dist[j];
+                        j1 = j0 + j;
+                    } else if (dist[j] < d2) {
+                        d2 = dist[j];
+                    }
+                }
+            }
+            best[i] = d1;
+            second[i] = d2;
+            bestIdx[i] = j1;
+        }
+
+        // Lowe's ratio test (0.8 on distances, so 0.64 on squared
+        // distances). If that leaves too few matches to be useful
+        // (e.g. on tiny or very repetitive images), fall back to the
+        // unfiltered nearest neighbours.
+        for (int pass = 0; pass < 2 && result->size() < 16; pass++) {
+            result->clear();
+            for (int i = 0; i < n; i++) {
+                if (bestIdx[i] < 0) { continue; }
+                if (pass == 0 && best[i] > 0.64f * second[i]) { continue; }
+                result->push_back(Correspondence(&corners[i], &other.corners[bestIdx[i]], best[i]));
+            }
+        }
+    }
+
+    // Make a fresh transform of the given type
+    static Transform *makeTransform(Align::Mode m) {
+        switch (m) {
+        case Align::Translate:
+            return new Translation();
+        case Align::Similarity:
+            return new Similarity();
+        case Align::Rigid:
+            return new Rigid();
+        case Align::Affine:
+            return new Affine();
+        case Align::Perspective:
+            return new Perspective();
+        default:
+            panic("Unknown transform type: %i\n", m);
+        }
+        return NULL;
+    }
+
+    // Each RANSAC hypothesis draws its minimal set of correspondences
+    // from a hash of the run's seed and the hypothesis number, rather
+    // than from the global rand(). This means hypotheses can be tested
+    // on any thread in any order, and the winning one can be
+    // regenerated afterwards.
+    static void fitHypothesis(Transform *transform, const vector<Correspondence> &correspondences,
+                              unsigned seed, int iter) {
+        transform->reset();
+        for (int i = 0; i < transform->constraintsRequired(); i++) {
+            unsigned h = seed ^ (iter * 0x9e3779b9u) ^ (i * 0x85ebca6bu);
+            h ^= h >> 16;
+            h *= 0x7feb352du;
+            h ^= h >> 15;
+            h *= 0x846ca68bu;
+            h ^= h >> 16;
+            const Correspondence &c = correspondences[h % correspondences.size()];
+            transform->addCorrespondence(c.a->x, c.a->y, c.b->x, c.b->y);
+        }
+        transform->solve();
     }
 
     // Once we have computed a digest for each of the images to align,
     // we can attempt to solve for the best alignment using RANSAC and
-    // least squares
+    // least squares. This doesn't modify either digest, so many
+    // alignments may run at once.
     Transform *align(Digest &other, Align::Mode m, int *inliers) {
-        Transform *transform = NULL, *refined = NULL;
-        if (m == Align::Translate) {
-            transform = new Translation();
-            refined   = new Translation();
-        } else if (m == Align::Similarity) {
-            transform = new Similarity();
-            refined   = new Similarity();
-        } else if (m == Align::Rigid) {
-            transform = new Rigid();
-            refined   = new Rigid();
-        } else if (m == Align::Affine) {
-            transform = new Affine();
-            refined   = new Affine();
-        } else if (m == Align::Perspective) {
-            transform = new Perspective();
-            refined   = new Perspective();
-        } else {
-            panic("Unknown transform type: %i\n", m);
-        }
+        Transform *transform = makeTransform(m);
+        Transform *refined = makeTransform(m);
 
         // Associate the features with other features to produce
         // correspondences.
-        vector<Correspondence> allCorrespondences, correspondences, tempCorr;
-
-        for (unsigned i = 0; i < corners.size(); i++) {
-            for (unsigned j = 0; j < other.corners.size(); j++) {
-                allCorrespondences.push_back(Correspondence(&corners[i], &other.corners[j]));
-            }
-        }
+        vector<Correspondence> allCorrespondences, correspondences;
+        match(other, &allCorrespondences);
 
         // Sort the correspondences by how good they are. Ones with a
         // low distance between their features will be at the start of
-        // this list. This is a little inefficient, given that we're
-        // going to throw out most of these, but compared to the image
-        // processing steps, everything is cheap.
+        // this list.
         ::std::sort(allCorrespondences.begin(), allCorrespondences.end());
 
-        // Select up to 1024 of the best correspondences.
+        // Select up to 1024 of the best correspondences. It's useful
+        // to keep track of how many times any one given feature is
+        // used, so we don't depend too heavily on a single feature.
+        vector<int> usageA(corners.size(), 0), usageB(other.corners.size(), 0);
         for (unsigned i = 0; i < allCorrespondences.size() && correspondences.size() < 1024; i++) {
             // No feature may be selected more than three times. If
             // you get a single image patch that matches everything,
             // it can make a big mess.
-            if (allCorrespondences[i].a->usage < 3 &&
-                allCorrespondences[i].b->usage < 3) {
+            int &a = usageA[allCorrespondences[i].a - &corners[0]];
+            int &b = usageB[allCorrespondences[i].b - &other.corners[0]];
+            if (a < 3 && b < 3) {
                 correspondences.push_back(allCorrespondences[i]);
-                allCorrespondences[i].a->usage++;
-                allCorrespondences[i].b->usage++;
+                a++;
+                b++;
             }
         }
 
         printf("%d correspondences found \n", (int)correspondences.size());
-        /*
-        // Print out the correspondences found for debugging.
-        for (unsigned i = 0; i < correspondences.size(); i++) {
-            printf("%f %f -> %f %f (%f)\n",
-                   correspondences[i].a->x,
-                   correspondences[i].a->y,
-                   correspondences[i].b->x,
-                   correspondences[i].b->y,
-                   correspondences[i].distance);
-        }
-        */
-
-        // Run RANSAC
-        int bestSeed = 0;
+        assert(correspondences.size() > 0, "No correspondences found between the images\n");
+
+        // Run RANSAC. Hypotheses are tested in batches spread across
+        // the available cores, with a check for early termination
+        // after each batch. Ties are broken in favor of the earliest
+        // hypothesis, so the result doesn't depend on the number of
+        // threads.
+        const unsigned seed = (unsigned)rand();
+        const int maxIterations = 50000, batch = 256;
+        const float goodEnough = transform->constraintsRequired()*20;
+        int bestIter = 0;
         float bestScore = 0;
 
-        for (int iter = 0; iter < 50000; iter++) {
-            // Reset the transform
-            transform->reset();
-
-            // Choose a random seed
-            int seed = rand();
-            srand(seed);
-
-            // Pick the minimum number of correspondences required to generate a model
-            for (int i = 0; i < transform->constraintsRequired(); i++) {
-                int j = rand() % correspondences.size();
-                transform->addCorrespondence(correspondences[j].a->x,
-                                             correspondences[j].a->y,
-                                             correspondences[j].b->x,
-                                             correspondences[j].b->y);
-            }
-
-            // Do a least squares solve using the minimal number of constraints
-            transform->solve();
-
-            // Test the remaining correspondences against the model, counting the inliers
-            float score = 0;
-            for (unsigned i = 0; i < correspondences.size(); i++) {
-                float x, y;
-                transform->apply(correspondences[i].a->x,
-                                 correspondences[i].a->y,
-                                 &x, &y);
-                x -= correspondences[i].b->x;
-                y -= correspondences[i].b->y;
-
-                // When does something count as an inlier? Using this
-                // formula, a perfect match is 1, 1 pixel off is 0.5,
-                // and it tails off with distance squared.
-                score += 1.0/(x*x + y*y + 1);
-            }
+        for (int start = 0; start < maxIterations && bestScore <= goodEnough; start += batch) {
+            #ifdef _OPENMP
+            #pragma omp parallel
+            #endif
+            {
+                Transform *hypothesis = makeTransform(m);
+                int localIter = -1;
+                float localScore = 0;
+
+                #ifdef _OPENMP
+                #pragma omp for
+                #endif
+                for (int iter = start; iter < start + batch; iter++) {
+                    // Do a least squares solve using the minimal number of constraints
+                    fitHypothesis(hypothesis, correspondences, seed, iter);
+
+                    // Test the remaining correspondences against the model, counting the inliers
+                    float score = 0;
+                    for (unsigned i = 0; i < correspondences.size(); i++) {
+                        float x, y;
+                        hypothesis->apply(correspondences[i].a->x,
+                                          correspondences[i].a->y,
+                                          &x, &y);
+                        x -= correspondences[i].b->x;
+                        y -= correspondences[i].b->y;
+
+                        // When does something count as an inlier? Using this
+                        // formula, a perfect match is 1, 1 pixel off is 0.5,
+                        // and it tails off with distance squared.
+                        score += 1.0/(x*x + y*y + 1);
+                    }
 
-            // See if this is the best model we've found so far (highest number of inliers)
-            if (score > bestScore) {
-                bestScore = score;
-                bestSeed = seed;
-                //printf("%i %f\n", bestSeed, bestScore);
-            }
+                    // See if this is the best model this thread has found so far
+                    if (score > localScore) {
+                        localScore = score;
+                        localIter = iter;
+                    }
+                }
 
-            if (bestScore > transform->constraintsRequired()*20) { break; }
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                {
+                    if (localIter >= 0 &&
+                        (localScore > bestScore ||
+                         (localScore == bestScore && localIter < bestIter))) {
+                        bestScore = localScore;
+                        bestIter = localIter;
+                    }
+                }
 
+                delete hypothesis;
+            }
         }
 
-        // Use the best seed we found again to compute its model
-        transform->reset();
-        srand(bestSeed);
-        for (int i = 0; i < transform->constraintsRequired(); i++) {
-            int j = rand() % correspondences.size();
-            /*
-            printf("Using constraint: %f %f -> %f %f\n",
-                   correspondences[j].a->x,
-                   correspondences[j].a->y,
-                   correspondences[j].b->x,
-                   correspondences[j].b->y);
-            */
-            transform->addCorrespondence(correspondences[j].a->x,
-                                         correspondences[j].a->y,
-                                         correspondences[j].b->x,
-                                         correspondences[j].b->y);
-        }
-        transform->solve();
+        // Use the best hypothesis we found again to compute its model
+        fitHypothesis(transform, correspondences, seed, bestIter);
 
         // Now we're going to throw in all the inliers under that
         // model into a single big least squares solve to refine the
@@ -778,13 +865,6 @@ public:
             y -= correspondences[i].b->y;
             if (x*x + y*y < 2) {
                 numInliers++;
-                /*
-                printf("Inlier: %f %f -> %f %f\n",
-                       correspondences[i].a->x,
-                       correspondences[i].a->y,
-                       correspondences[i].b->x,
-                       correspondences[i].b->y);
-                */
                 refined->addCorrespondence(correspondences[i].a->x,
                                            correspondences[i].a->y,
                                            correspondences[i].b->x,
@@ -799,15 +879,6 @@ public:
 
         *inliers = numInliers;
 
-        // Reset the usage counts in case we're going to reuse this digest
-        for (size_t i = 0; i < corners.size(); i++) {
-            corners[i].usage = 0;
-        }
-
-        for (size_t i = 0; i < other.corners.size(); i++) {
-            other.corners[i].usage = 0;
-        }
-
         delete transform;
         return refined;
     }
@@ -839,6 +910,10 @@ public:
 
     vector<Feature> corners;
 
+    // The descriptors of all the corners, stored component-major
+    // (component d of corner j is at d * corners.size() + j).
+    vector<float> descriptors;
+
 };
 
 
@@ -988,14 +1063,30 @@ void AlignFrames::apply(Image im, Align::Mode m) {
 
     assert(im.frames > 1, "Input must have at least two frames\n");
 
-    // make a digest for each input frame
+    // make a digest for each input frame. These are independent, so
+    // we compute them concurrently.
+
+    vector<Digest *> digests(im.frames, (Digest *)NULL);
+    vector<Transform *> transforms(im.frames * im.frames, (Transform *)NULL);
 
-    vector<Digest *> digests;
-    map<pair<int, int>, Transform *> transforms;
+    // Exceptions can't propagate out of a parallel loop, so we catch
+    // them and rethrow the first one once the loop is done.
+    bool failed = false;
+    Exception failure("");
 
     printf("Extracting features...\n");
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
     for (int t = 0; t < im.frames; t++) {
-        digests.push_back(new Digest(im.frame(t)));
+        try {
+            digests[t] = new Digest(im.frame(t));
+        } catch (Exception &e) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            if (!failed) { failed = true; failure = e; }
+        }
     }
 
     printf("Matching features...\n");
@@ -1006,19 +1097,43 @@ void AlignFrames::apply(Image im, Align::Mode m) {
     for (int t1 = 0; t1 < im.frames; t1++) {
         printf("Aligning everything to frame %d\n", t1);
         float score = 100000;
+
+        // Align every other frame to t1 in parallel. Once any of them
+        // does worse than the best reference frame so far, t1 can't
+        // win, so the remaining alignments are skipped.
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+        #endif
         for (int t2 = 0; t2 < im.frames; t2++) {
             if (t1 == t2) { continue; }
 
+            float current;
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            current = score;
+            if (current < bestScore) { continue; }
+
             int inliers = 0;
-            Transform *t = digests[t1]->align(*digests[t2], m, &inliers);
+            try {
+                if (!failed) {
+                    transforms[t1 * im.frames + t2] = digests[t1]->align(*digests[t2], m, &inliers);
+                }
+            } catch (Exception &e) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                if (!failed) { failed = true; failure = e; }
+            }
 
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
             if (inliers < score) { score = inliers; }
-
-            transforms[make_pair(t1, t2)] = t;
-
-            if (score < bestScore) { break; }
         }
 
+        if (failed) { break; }
+
         printf("\nScore %d = %f\n\n", t1, score);
         if (score > bestScore) {
             bestScore = score;
@@ -1027,19 +1142,21 @@ void AlignFrames::apply(Image im, Align::Mode m) {
     }
 
     // We did the best when we aligned everything to frame bestT
-    //Image out(im);
 
     printf("Warping");
-    for (int t = 0; t < im.frames; t++) {
+    for (int t = 0; t < im.frames && !failed; t++) {
         printf("."); fflush(stdout);
         if (t == bestT) { continue; }
         Image tmp = im.frame(t).copy();
+        Transform *trans = transforms[bestT * im.frames + t];
 
-        vector<float> sample(im.channels);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
         for (int y = 0; y < im.height; y++) {
+            vector<float> sample(im.channels);
             for (int x = 0; x < im.width; x++) {
                 float fx, fy;
-                Transform *trans = transforms[make_pair(bestT, t)];
                 trans->apply(x, y, &fx, &fy);
                 tmp.sample2D(fx, fy, 0, sample);
                 for (int c = 0; c < im.channels; c++) {
@@ -1050,18 +1167,15 @@ void AlignFrames::apply(Image im, Align::Mode m) {
     }
     printf("\n");
 
-    //Display::apply(out);
-
     for (size_t i = 0; i < digests.size(); i++) {
         delete digests[i];
     }
 
-    for (int t1 = 0; t1 < im.frames; t1++) {
-        for (int t2 = 0; t2 < im.frames; t2++) {
-            if (t1 == t2) { continue; }
-            delete transforms[make_pair(t1, t2)];
-        }
+    for (size_t i = 0; i < transforms.size(); i++) {
+        delete transforms[i];
     }
+
+    if (failed) { throw failure; }
 }
 
 }
@@ -4,6 +4,90 @@
 
 namespace ImageStack {
 
+namespace {
+// A pointwise stage computing Op::scalar(x, a, b), where a may vary per
+// channel. Ops that set vectorize provide Op::vec, which does the same
+// thing to a whole vector.
+template<typename Op>
+class Stage : public Pointwise {
+public:
+    Stage(const vector<float> &a_, float b_ = 0) : a(a_), b(b_) {}
+    Stage(float a_ = 0, float b_ = 0) : a(1, a_), b(b_) {}
+    void apply(float *x, int n, int c) const {
+        const float ac = a[c % a.size()];
+        int i = 0;
+        if (Op::vectorize) {
+            const Vec::type va = Vec::broadcast(ac), vb = Vec::broadcast(b);
+            for (; i + Vec::width <= n; i += Vec::width) {
+                Vec::store(Op::vec(Vec::load(x + i), va, vb), x + i);
+            }
+        }
+        for (; i < n; i++) {
+            x[i] = Op::scalar(x[i], ac, b);
+        }
+    }
+private:
+    vector<float> a;
+    float b;
+};
+
+struct ScalarOp {
+    static const bool vectorize = false;
+    static Vec::type vec(Vec::type x, Vec::type, Vec::type) {return x;}
+};
+
+struct LogOp : public ScalarOp {
+    static float scalar(float x, float, float) {return logf(x);}
+};
+struct ExpOp : public ScalarOp {
+    static float scalar(float x, float base, float) {return powf(base, x);}
+};
+struct AbsOp : public ScalarOp {
+    static float scalar(float x, float, float) {return fabs(x);}
+};
+struct OffsetOp {
+    static const bool vectorize = true;
+    static float scalar(float x, float a, float) {return x + a;}
+    static Vec::type vec(Vec::type x, Vec::type a, Vec::type) {return Vec::Add::vec(x, a);}
+};
+struct ScaleOp {
+    static const bool vectorize = true;
+    static float scalar(float x, float a, float) {return x * a;}
+    static Vec::type vec(Vec::type x, Vec::type a, Vec::type) {return Vec::Mul::vec(x, a);}
+};
+struct GammaOp : public ScalarOp {
+    static float scalar(float x, float g, float) {return x > 0 ? powf(x, g) : -powf(-x, g);}
+};
+struct ModOp : public ScalarOp {
+    static float scalar(float x, float m, float) {return x > 0 ? fmodf(x, m) : fmodf(x, m) + m;}
+};
+struct ClampOp {
+    static const bool vectorize = true;
+    static float scalar(float x, float lower, float upper) {return min(max(x, lower), upper);}
+    static Vec::type vec(Vec::type x, Vec::type lower, Vec::type upper) {
+        return Vec::Min::vec(Vec::Max::vec(x, lower), upper);
+    }
+};
+struct DeNaNOp : public ScalarOp {
+    static float scalar(float x, float replacement, float) {return isnan(x) ? replacement : x;}
+};
+struct ThresholdOp : public ScalarOp {
+    static float scalar(float x, float val, float) {return x > val ? 1.0f : 0.0f;}
+};
+struct QuantizeOp : public ScalarOp {
+    // Mod does the wrong thing when its arg is less than zero
+    static float scalar(float x, float inc, float) {return x - fmodf(x, inc) - (x > 0 ? 0 : inc);}
+};
+
+vector<float> readFloats(const vector<string> &args) {
+    vector<float> result(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+        result[i] = readFloat(args[i]);
+    }
+    return result;
+}
+}
+
 void Add::help() {
     printf("\n-add adds the second image in the stack to the top image in the stack.\n\n"
            "Usage: ImageStack -load a.tga -load b.tga -add -save out.tga.\n");
@@ -353,9 +437,9 @@ bool Log::test() {
     return fabs(delta) < 0.01;
 }
 
-void Log::parse(vector<string> args) {
+Pointwise *Log::pointwise(vector<string> args) {
     assert(args.size() == 0, "-log takes no arguments\n");
-    apply(stack(0));
+    return new Stage<LogOp>();
 }
 
 void Log::apply(Image a) {
@@ -376,10 +460,11 @@ void Exp::help() {
            "Usage: ImageStack -load a.tga -log -load b.tga -log -add -exp -save product.tga.\n");
 }
 
-void Exp::parse(vector<string> args) {
-    if (args.size() == 0) { apply(stack(0)); }
-    else if (args.size() == 1) { apply(stack(0), readFloat(args[1])); }
-    else { panic("-exp takes zero or one arguments\n"); }
+Pointwise *Exp::pointwise(vector<string> args) {
+    if (args.size() == 0) { return new Stage<ExpOp>(E); }
+    else if (args.size() == 1) { return new Stage<ExpOp>(readFloat(args[0])); }
+    panic("-exp takes zero or one arguments\n");
+    return NULL;
 }
 
 void Exp::apply(Image a, float base) {
@@ -412,9 +497,9 @@ bool Abs::test() {
     return a(10, 2, 1, 2) == -before;
 }
 
-void Abs::parse(vector<string> args) {
+Pointwise *Abs::pointwise(vector<string> args) {
     assert(args.size() == 0, "-abs takes no arguments\n");
-    apply(stack(0));
+    return new Stage<AbsOp>();
 }
 
 void Abs::apply(Image a) {
@@ -449,18 +534,10 @@ bool Offset::test() {
     return true;
 }
 
-void Offset::parse(vector<string> args) {
+Pointwise *Offset::pointwise(vector<string> args) {
     assert(args.size() == 1 || (int)args.size() == stack(0).channels,
            "-offset takes either one argument, or one argument per channel\n");
-
-    vector<float> fargs;
-    for (size_t i = 0; i < args.size(); i++) {
-        fargs.push_back(readFloat(args[i]));
-    }
-
-    for (int c = 0; c < stack(0).channels; c++) {
-        stack(0).channel(c) += fargs[c % fargs.size()];
-    }
+    return new Stage<OffsetOp>(readFloats(args));
 }
 
 void Scale::help() {
@@ -480,21 +557,31 @@ bool Scale::test() {
     before = a(10, 2, 1, 2);
     a *= 17.0f;
     if (!nearlyEqual(a(10, 2, 1, 2), before * 17.0f)) return false;
-    return true;
+
+    // A chain of pointwise operations run through the command parser
+    // gets fused, and should match running them one at a time
+    Image b = a.copy();
+    push(a);
+    vector<string> args;
+    args.push_back("-scale"); args.push_back("0.1"); args.push_back("0.2"); args.push_back("0.3");
+    args.push_back("-offset"); args.push_back("0.5");
+    args.push_back("-gamma"); args.push_back("2");
+    args.push_back("-clamp"); args.push_back("0"); args.push_back("1");
+    parseCommands(args);
+    pop();
+    for (int c = 0; c < b.channels; c++) {
+        b.channel(c) *= 0.1f * (c + 1);
+    }
+    b += 0.5f;
+    Gamma::apply(b, 2);
+    Clamp::apply(b, 0, 1);
+    return nearlyEqual(a, b);
 }
 
-void Scale::parse(vector<string> args) {
+Pointwise *Scale::pointwise(vector<string> args) {
     assert(args.size() == 1 || (int)args.size() == stack(0).channels,
            "-scale takes either one argument, or one argument per channel\n");
-
-    vector<float> fargs;
-    for (size_t i = 0; i < args.size(); i++) {
-        fargs.push_back(readFloat(args[i]));
-    }
-
-    for (int c = 0; c < stack(0).channels; c++) {
-        stack(0).channel(c) *= fargs[c % fargs.size()];
-    }
+    return new Stage<ScaleOp>(readFloats(args));
 }
 
 void Gamma::help() {
@@ -519,20 +606,10 @@ bool Gamma::test() {
     return true;
 }
 
-void Gamma::parse(vector<string> args) {
+Pointwise *Gamma::pointwise(vector<string> args) {
     assert(args.size() == 1 || (int)args.size() == stack(0).channels,
            "-gamma takes either one argument, or one argument per channel\n");
-
-    vector<float> fargs(args.size());
-    for (size_t i = 0; i < args.size(); i++) {
-        fargs[i] = readFloat(args[i]);
-    }
-
-    Image im = stack(0);
-    for (int c = 0; c < stack(0).channels; c++) {
-        float gamma = fargs[c % args.size()];
-        apply(im.channel(c), gamma);
-    }
+    return new Stage<GammaOp>(readFloats(args));
 }
 
 void Gamma::apply(Image a, float gamma) {
@@ -558,20 +635,10 @@ bool Mod::test() {
     return before == after;
 }
 
-void Mod::parse(vector<string> args) {
+Pointwise *Mod::pointwise(vector<string> args) {
     assert(args.size() == 1 || (int)args.size() == stack(0).channels,
-           "-gamma takes either one argument, or one argument per channel\n");
-
-    vector<float> fargs(args.size());
-    for (size_t i = 0; i < args.size(); i++) {
-        fargs[i] = readFloat(args[i]);
-    }
-
-    Image im = stack(0);
-    for (int c = 0; c < stack(0).channels; c++) {
-        float m = fargs[c % args.size()];
-        apply(im.channel(c), m);
-    }
+           "-mod takes either one argument, or one argument per channel\n");
+    return new Stage<ModOp>(readFloats(args));
 }
 
 void Mod::apply(Image a, float m) {
@@ -599,14 +666,14 @@ bool Clamp::test() {
     return before == after;
 }
 
-void Clamp::parse(vector<string> args) {
+Pointwise *Clamp::pointwise(vector<string> args) {
     if (args.size() == 0) {
-        apply(stack(0), 0, 1);
+        return new Stage<ClampOp>(0, 1);
     } else if (args.size() == 2) {
-        apply(stack(0), readFloat(args[0]), readFloat(args[1]));
-    } else {
-        panic("-clamp takes zero or two arguments\n");
+        return new Stage<ClampOp>(readFloat(args[0]), readFloat(args[1]));
     }
+    panic("-clamp takes zero or two arguments\n");
+    return NULL;
 }
 
 void Clamp::apply(Image a, float lower, float upper) {
@@ -634,14 +701,14 @@ bool DeNaN::test() {
     else return after == 17.0f;
 }
 
-void DeNaN::parse(vector<string> args) {
+Pointwise *DeNaN::pointwise(vector<string> args) {
     if (args.size() == 0) {
-        apply(stack(0), 0);
+        return new Stage<DeNaNOp>(0);
     } else if (args.size() == 1) {
-        apply(stack(0), readFloat(args[0]));
-    } else {
-        panic("-denan takes zero or one arguments\n");
+        return new Stage<DeNaNOp>(readFloat(args[0]));
     }
+    panic("-denan takes zero or one arguments\n");
+    return NULL;
 }
 
 namespace {
@@ -666,9 +733,9 @@ bool Threshold::test() {
     return true;
 }
 
-void Threshold::parse(vector<string> args) {
+Pointwise *Threshold::pointwise(vector<string> args) {
     assert(args.size() == 1, "-threshold takes exactly one argument\n");
-    stack(0).set(Select(stack(0) > readFloat(args[0]), 1.0f, 0.0f));
+    return new Stage<ThresholdOp>(readFloat(args[0]));
 }
 
 void Threshold::apply(Image a, float val) {
@@ -741,12 +808,9 @@ bool Quantize::test() {
     return false;
 }
 
-void Quantize::parse(vector<string> args) {
+Pointwise *Quantize::pointwise(vector<string> args) {
     assert(args.size() <= 1, "-quantize takes zero or one arguments\n");
-
-    if (args.size()) { apply(stack(0), readFloat(args[0])); }
-    else { apply(stack(0), 1); }
-
+    return new Stage<QuantizeOp>(args.size() ? readFloat(args[0]) : 1.0f);
 }
 
 void Quantize::apply(Image a, float increment) {
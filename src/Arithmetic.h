@@ -48,81 +48,81 @@ public:
     static void apply(Image a, Image b);
 };
 
-class Log : public Operation {
+class Log : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a);
 };
 
-class Exp : public Operation {
+class Exp : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float base = E);
 };
 
-class Abs : public Operation {
+class Abs : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a);
 };
 
-class Offset : public Operation {
+class Offset : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
 };
 
-class Scale : public Operation {
+class Scale : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
 };
 
-class Gamma : public Operation {
+class Gamma : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float);
 };
 
-class Mod : public Operation {
+class Mod : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float);
 };
 
-class Clamp : public Operation {
+class Clamp : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float lower = 0, float upper = 1);
 };
 
-class DeNaN : public Operation {
+class DeNaN : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float replacement = 0);
 };
 
-class Threshold : public Operation {
+class Threshold : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float val);
 };
 
@@ -134,11 +134,11 @@ public:
     static void apply(Image a);
 };
 
-class Quantize : public Operation {
+class Quantize : public PointwiseOperation {
 public:
     void help();
     bool test();
-    void parse(vector<string> args);
+    Pointwise *pointwise(vector<string> args);
     static void apply(Image a, float increment);
 };
 
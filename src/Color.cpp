@@ -5,6 +5,274 @@
 #include "File.h"
 namespace ImageStack {
 
+namespace {
+// A per-pixel color transform. It is built up as a chain of steps -
+// affine maps between any numbers of channels, and nonlinear curves -
+// and then run over an image in a single pass. Each scanline is cut
+// into tiles; every input channel of a tile is pushed through the whole
+// chain in scratch space and the results are written straight to the
+// output, so a chain of conversions never makes intermediate
+// images. Consecutive affine steps are multiplied together as they are
+// added.
+class ColorPipeline {
+public:
+    enum Curve {
+        SRGBDecode, SRGBEncode,   // gamma-encoded srgb to linear and back
+        ARGBDecode, ARGBEncode,   // the same for adobe rgb
+        LabF, LabFInverse,        // the cube-root-ish curve used by lab
+        RGBToHSV, HSVToRGB        // operate on three channels at once
+    };
+
+    ColorPipeline(int channels) : inChannels(channels), outChannels(channels), widest(channels) {}
+
+    // Append out = m * in + offset, where m is row major with one row
+    // per output channel. A NULL offset means zero.
+    ColorPipeline &affine(const float *m, const float *offset, int channels) {
+        Step s;
+        s.affine = true;
+        s.in = outChannels;
+        s.out = channels;
+        s.m.assign(m, m + s.in * s.out);
+        s.offset.assign(s.out, 0.0f);
+        if (offset) s.offset.assign(offset, offset + s.out);
+
+        if (!steps.empty() && steps.back().affine) {
+            // Fold the new map into the previous one
+            const Step &prev = steps.back();
+            Step fused;
+            fused.affine = true;
+            fused.in = prev.in;
+            fused.out = s.out;
+            fused.m.assign(fused.out * fused.in, 0.0f);
+            fused.offset = s.offset;
+            for (int i = 0; i < s.out; i++) {
+                for (int j = 0; j < s.in; j++) {
+                    float mij = s.m[i*s.in + j];
+                    if (mij == 0) continue;
+                    for (int k = 0; k < prev.in; k++) {
+                        fused.m[i*fused.in + k] += mij * prev.m[j*prev.in + k];
+                    }
+                    fused.offset[i] += mij * prev.offset[j];
+                }
+            }
+            steps.back() = fused;
+        } else {
+            steps.push_back(s);
+        }
+
+        outChannels = channels;
+        widest = max(widest, channels);
+        return *this;
+    }
+
+    ColorPipeline &matrix(const float *m, int channels) {
+        return affine(m, NULL, channels);
+    }
+
+    ColorPipeline &curve(Curve c) {
+        assert(outChannels == 3 || (c != RGBToHSV && c != HSVToRGB),
+               "Image does not have 3 channels\n");
+        Step s;
+        s.affine = false;
+        s.curve = c;
+        s.in = s.out = outChannels;
+        steps.push_back(s);
+        return *this;
+    }
+
+    Image apply(Image im) const {
+        assert(im.channels == inChannels, "Image does not have %d channels\n", inChannels);
+
+        Image out(im.width, im.height, im.frames, outChannels);
+        const int rows = im.height * im.frames;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            const int y = r % im.height, t = r / im.height;
+
+            // Two banks of scratch space that steps ping-pong between
+            vector<float> scratch(2 * widest * Tile);
+            vector<const float *> src(widest);
+            vector<float *> dst(widest);
+
+            for (int x = 0; x < im.width; x += Tile) {
+                const int n = min(im.width - x, (int)Tile);
+                for (int c = 0; c < im.channels; c++) {
+                    src[c] = &im(x, y, t, c);
+                }
+                for (size_t i = 0; i < steps.size(); i++) {
+                    const Step &s = steps[i];
+                    if (i + 1 == steps.size()) {
+                        for (int c = 0; c < s.out; c++) dst[c] = &out(x, y, t, c);
+                    } else {
+                        float *bank = &scratch[(i & 1) * widest * Tile];
+                        for (int c = 0; c < s.out; c++) dst[c] = bank + c * Tile;
+                    }
+                    if (s.affine) {
+                        applyAffine(s, &src[0], &dst[0], n);
+                    } else {
+                        applyCurve(s, &src[0], &dst[0], n);
+                    }
+                    for (int c = 0; c < s.out; c++) src[c] = dst[c];
+                }
+                if (steps.empty()) {
+                    for (int c = 0; c < im.channels; c++) {
+                        memcpy(&out(x, y, t, c), src[c], n * sizeof(float));
+                    }
+                }
+            }
+        }
+
+        return out;
+    }
+
+private:
+    static const int Tile = 256;
+
+    struct Step {
+        bool affine;
+        Curve curve;
+        int in, out;
+        vector<float> m, offset;
+    };
+
+    static void applyAffine(const Step &s, const float *const *src, float *const *dst, int n) {
+        for (int i = 0; i < s.out; i++) {
+            const float *m = &s.m[i*s.in];
+            float *d = dst[i];
+            int x = 0;
+            const Vec::type off = Vec::broadcast(s.offset[i]);
+            for (; x + Vec::width <= n; x += Vec::width) {
+                Vec::type acc = off;
+                for (int c = 0; c < s.in; c++) {
+                    // Matrices with many zero elements are common
+                    if (m[c] == 0) continue;
+                    acc = Vec::fma(Vec::broadcast(m[c]), Vec::load(src[c] + x), acc);
+                }
+                Vec::store(acc, d + x);
+            }
+            for (; x < n; x++) {
+                float acc = s.offset[i];
+                for (int c = 0; c < s.in; c++) {
+                    acc += m[c] * src[c][x];
+                }
+                d[x] = acc;
+            }
+        }
+    }
+
+    static float srgbDecode(float v) {
+        return v <= 0.04045f ? v/12.95f : powf(max((v + 0.055f)/1.055f, 0.0f), 2.4f);
+    }
+
+    static float srgbEncode(float v) {
+        return v <= 0.0031308f ? 12.92f * v : 1.055f * powf(max(v, 0.0f), 1.0f/2.4f) - 0.055f;
+    }
+
+    static float labF(float v) {
+        return v > 0.00856f ? powf(v, 1/3.0f) : 7.787f * v + 16.0f/116.0f;
+    }
+
+    static float labFInverse(float v) {
+        const float s = 6.0f/29;
+        return v > s ? v*v*v : (v - 16.0f/116) * 3*s*s;
+    }
+
+    static void rgbToHSV(float r, float g, float b, float *h_, float *s_, float *v_) {
+        float minV = min(r, g, b);
+        float maxV = max(r, g, b);
+        float delta = maxV - minV;
+        float h, s;
+        if (delta != 0) {
+            s = delta / maxV;
+            if (r == maxV) { h = 0 + (g - b) / delta; } // between yellow & magenta
+            else if (g == maxV) { h = 2 + (b - r) / delta; } // between cyan & yellow
+            else { h = 4 + (r - g) / delta; } // between magenta & cyan
+            h *= 1.0f/6;
+            if (h < 0) { h++; }
+        } else {
+            // r = g = b = 0 so s = 0, h is undefined
+            s = 0;
+            h = 0;
+        }
+        *h_ = h;
+        *s_ = s;
+        *v_ = maxV;
+    }
+
+    static void hsvToRGB(float h, float s, float v, float *r, float *g, float *b) {
+        if (s == 0) {
+            // achromatic (grey)
+            *r = *g = *b = v;
+            return;
+        }
+
+        h *= 6;        // sector 0 to 5
+        int i = (int)h;
+        if (i == 6) { i = 5; }
+        float f = h - i;
+        float p = v * (1 - s);
+        float q = v * (1 - s * f);
+        float u = v * (1 - s * (1 - f));
+
+        switch (i) {
+        case 0: *r = v; *g = u; *b = p; break;
+        case 1: *r = q; *g = v; *b = p; break;
+        case 2: *r = p; *g = v; *b = u; break;
+        case 3: *r = p; *g = q; *b = v; break;
+        case 4: *r = u; *g = p; *b = v; break;
+        default: *r = v; *g = p; *b = q; break; // case 5
+        }
+    }
+
+    static void applyCurve(const Step &s, const float *const *src, float *const *dst, int n) {
+        if (s.curve == RGBToHSV || s.curve == HSVToRGB) {
+            const float *a = src[0], *b = src[1], *c = src[2];
+            for (int x = 0; x < n; x++) {
+                if (s.curve == RGBToHSV) {
+                    rgbToHSV(a[x], b[x], c[x], dst[0] + x, dst[1] + x, dst[2] + x);
+                } else {
+                    hsvToRGB(a[x], b[x], c[x], dst[0] + x, dst[1] + x, dst[2] + x);
+                }
+            }
+            return;
+        }
+
+        for (int c = 0; c < s.in; c++) {
+            const float *in = src[c];
+            float *o = dst[c];
+            switch (s.curve) {
+            case SRGBDecode:
+                for (int x = 0; x < n; x++) o[x] = srgbDecode(in[x]);
+                break;
+            case SRGBEncode:
+                for (int x = 0; x < n; x++) o[x] = srgbEncode(in[x]);
+                break;
+            case ARGBDecode:
+                for (int x = 0; x < n; x++) o[x] = powf(max(in[x], 0.0f), 563.0f/256);
+                break;
+            case ARGBEncode:
+                for (int x = 0; x < n; x++) o[x] = powf(max(in[x], 0.0f), 256/563.0f);
+                break;
+            case LabF:
+                for (int x = 0; x < n; x++) o[x] = labF(in[x]);
+                break;
+            case LabFInverse:
+                for (int x = 0; x < n; x++) o[x] = labFInverse(in[x]);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    vector<Step> steps;
+    int inChannels, outChannels, widest;
+};
+}
+
 void ColorMatrix::help() {
     pprintf("-colormatrix treats each pixel as a vector over its channels and multiplies "
             "the vector by the given matrix. The matrix size and shape is deduced from the "
@@ -47,24 +315,9 @@ Image ColorMatrix::apply(Image im, const vector<float> &matrix) {
 }
 
 Image ColorMatrix::apply(Image im, const float *matrix, int outChannels) {
-
-    Image out(im.width, im.height, im.frames, outChannels);
-
-    for (int i = 0; i < out.channels; i++) {
-        for (int c = 0; c < im.channels; c++) {
-            float m = matrix[i*im.channels + c];
-            // This makes matrices with many zero elements faster
-            if (m == 0) continue;
-            if (m == 1) {
-                // Another common case
-                out.channel(i) += im.channel(c);
-            } else {
-                out.channel(i) += im.channel(c) * m;
-            }
-        }
-    }
-
-    return out;
+    ColorPipeline p(im.channels);
+    p.matrix(matrix, outChannels);
+    return p.apply(im);
 }
 
 
@@ -86,6 +339,11 @@ bool ColorConvert::test() {
 
     if (!nearlyEqual(a, xyz2rgb(rgb2xyz(a)))) return false;
 
+    // Chains of conversions are fused into one pass, which should
+    // match doing them one at a time
+    if (!nearlyEqual(rgb2lab(a), xyz2lab(rgb2xyz(a)))) return false;
+    if (!nearlyEqual(apply(a, "lab", "hsv"), rgb2hsv(xyz2rgb(lab2xyz(a))))) return false;
+
     string spaces[] = {"xyz", "rgb", "argb", "yuv", "lab", "hsv"};
     for (int i = 0; i < 6; i++) {
         for (int j = 0; j < i; j++) {
@@ -113,321 +371,243 @@ void ColorConvert::parse(vector<string> args) {
     push(im);
 }
 
-Image ColorConvert::apply(Image im, string from, string to) {
-    // check for the trivial case
-    assert(from != to, "color conversion from %s to %s is pointless\n", from.c_str(), to.c_str());
-
-    // unsupported destination color spaces
-    if (to == "yuyv" ||
-        to == "uyvy") {
-        panic("Unsupported destination color space: %s\n", to.c_str());
-    }
-
-    // direct conversions that don't have to go via rgb
-    if (from == "yuyv" && to == "yuv") {
-        return yuyv2yuv(im);
-    } else if (from == "uyvy" && to == "yuv") {
-        return uyvy2yuv(im);
-    } else if (from == "xyz" && to == "lab") {
-        return xyz2lab(im);
-    } else if (from == "lab" && to == "xyz") {
-        return lab2xyz(im);
-    } else if (from == "argb" && to == "xyz") {
-        return argb2xyz(im);
-    } else if (from == "xyz" && to == "argb") {
-        return xyz2argb(im);
-    } else if (from != "rgb" && to != "rgb") {
-        // conversions that go through rgb
-        Image halfway = apply(im, from, "rgb");
-        return apply(halfway, "rgb", to);
-    } else if (from == "rgb") { // from rgb
-        if (to == "hsv" || to == "hsl" || to == "hsb") {
-            return rgb2hsv(im);
-        } else if (to == "yuv") {
-            return rgb2yuv(im);
-        } else if (to == "xyz") {
-            return rgb2xyz(im);
-        } else if (to == "y" || to == "gray" ||
-                   to == "grayscale" || to == "luminance") {
-            return rgb2y(im);
-        } else if (to == "lab") {
-            return rgb2lab(im);
-        } else if (to == "argb") {
-            return rgb2argb(im);
-        } else {
-            panic("Unknown color space %s\n", to.c_str());
-        }
-    } else { //(to == "rgb")
-        if (from == "hsv" || from == "hsl" || from == "hsb") {
-            return hsv2rgb(im);
-        } else if (from == "yuv") {
-            return yuv2rgb(im);
-        } else if (from == "xyz") {
-            return xyz2rgb(im);
-        } else if (from == "y" || from == "gray" ||
-                   from == "grayscale" || from == "luminance") {
-            return y2rgb(im);
-        } else if (from == "lab") {
-            return lab2rgb(im);
-        } else if (from == "uyvy") {
-            return uyvy2rgb(im);
-        } else if (from == "yuyv") {
-            return yuyv2rgb(im);
-        } else if (from == "argb") {
-            return argb2rgb(im);
-        } else {
-            panic("Unknown color space %s\n", from.c_str());
-        }
-    }
+namespace {
+// Each of these appends the steps for one conversion to a pipeline
 
-    // keep the compiler happy
-    return Image();
+ColorPipeline &rgbToXYZ(ColorPipeline &p) {
+    // convert to linear luminance srgb, then apply the linear transform to get to xyz
+    const float m[] = {0.4124f, 0.3576f, 0.1805f,
+                       0.2126f, 0.7152f, 0.0722f,
+                       0.0193f, 0.1192f, 0.9505f};
+    return p.curve(ColorPipeline::SRGBDecode).matrix(m, 3);
+}
 
+ColorPipeline &xyzToRGB(ColorPipeline &p) {
+    // Apply linear transform to get to linear-luminance rgb, then
+    // convert to gamma-encoded srgb
+    const float m[] = {3.2406f, -1.5372f, -0.4986f,
+                       -0.9689f, 1.8758f, 0.0415f,
+                       0.0557f, -0.2040f, 1.0570f};
+    return p.matrix(m, 3).curve(ColorPipeline::SRGBEncode);
 }
 
 //conversions to and from lab inspired by CImg (http://cimg.sourceforge.net/)
-Image ColorConvert::xyz2lab(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    Image out(im.width, im.height, im.frames, im.channels);
-
-    //left in this form to allow for changes/fine-tuning
-    float Xn = 1.0f/(0.412453 + 0.357580 + 0.180423);
-    float Yn = 1.0f/(0.212671 + 0.715160 + 0.072169);
-    float Zn = 1.0f/(0.019334 + 0.119193 + 0.950227);
-
-    Image X = im.channel(0), Y = im.channel(1), Z = im.channel(2);
-    Image L = out.channel(0), a = out.channel(1), b = out.channel(2);
-
-    // First apply a non-linear mapping to X, Y, Z. use the output as scratch space.
-    Image Xt = L, Yt = a, Zt = b;
-    Xt.set(Select(X > 0.00856f/Xn, pow(X*Xn, 1/3.0f), (7.787f*Xn)*X + 16.0f/116.0f));
-    Yt.set(Select(Y > 0.00856f/Yn, pow(Y*Yn, 1/3.0f), (7.787f*Yn)*Y + 16.0f/116.0f));
-    Zt.set(Select(Z > 0.00856f/Zn, pow(Z*Zn, 1/3.0f), (7.787f*Zn)*Z + 16.0f/116.0f));
-
-    // Then apply the affine transform
-    out.setChannels(1.16f * Yt - 0.16f,
-                    5.0f * (Xt - Yt),
-                    2.0f * (Yt - Zt));
-    return out;
+//left in this form to allow for changes/fine-tuning
+const float Xn = 0.412453f + 0.357580f + 0.180423f;
+const float Yn = 0.212671f + 0.715160f + 0.072169f;
+const float Zn = 0.019334f + 0.119193f + 0.950227f;
+
+ColorPipeline &xyzToLab(ColorPipeline &p) {
+    // Normalize by the white point, apply a non-linear mapping to X,
+    // Y, Z, and then the affine transform.
+    const float white[] = {1/Xn, 0, 0,
+                           0, 1/Yn, 0,
+                           0, 0, 1/Zn};
+    const float m[] = {0, 1.16f, 0,
+                       5.0f, -5.0f, 0,
+                       0, 2.0f, -2.0f};
+    const float offset[] = {-0.16f, 0, 0};
+    return p.matrix(white, 3).curve(ColorPipeline::LabF).affine(m, offset, 3);
 }
 
-Image ColorConvert::lab2xyz(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-    Image out(im.width, im.height, im.frames, im.channels);
-
-    float s = 6.0/29;
+ColorPipeline &labToXYZ(ColorPipeline &p) {
+    // Y = (L + 0.16)/1.16, X = Y + a/5, Z = Y - b/2, then the
+    // nonlinear curve, then scale back up by the white point.
+    const float m[] = {1/1.16f, 1/5.0f, 0,
+                       1/1.16f, 0, 0,
+                       1/1.16f, 0, -1/2.0f};
+    const float offset[] = {0.16f/1.16f, 0.16f/1.16f, 0.16f/1.16f};
+    const float white[] = {Xn, 0, 0,
+                           0, Yn, 0,
+                           0, 0, Zn};
+    return p.affine(m, offset, 3).curve(ColorPipeline::LabFInverse).matrix(white, 3);
+}
 
-    float Xn = 0.412453 + 0.357580 + 0.180423;
-    float Yn = 0.212671 + 0.715160 + 0.072169;
-    float Zn = 0.019334 + 0.119193 + 0.950227;
+ColorPipeline &argbToXYZ(ColorPipeline &p) {
+    // Apply inverse adobe rgb gamma curve to get to linear-luminance,
+    // then the argb to xyz linear transform
+    const float m[] = {0.57667f, 0.18556f, 0.18823f,
+                       0.29734f, 0.62736f, 0.07529f,
+                       0.02703f, 0.07069f, 0.99134f};
+    return p.curve(ColorPipeline::ARGBDecode).matrix(m, 3);
+}
 
-    Image X = out.channel(0), Y = out.channel(1), Z = out.channel(2);
-    Image L = im.channel(0), a = im.channel(1), b = im.channel(2);
+ColorPipeline &xyzToARGB(ColorPipeline &p) {
+    const float m[] = {2.04159f, -0.56501f, -0.34473f,
+                       -0.96924f, 1.87597f, 0.04156f,
+                       0.01344f, -0.11836f, 1.01517f};
+    return p.matrix(m, 3).curve(ColorPipeline::ARGBEncode);
+}
 
-    // Apply the affine transform
-    Y.set((L + 0.16f)/1.16f);
-    X.set(Y + a/5.0f);
-    Z.set(Y - b/2.0f);
+ColorPipeline &rgbToYUV(ColorPipeline &p) {
+    const float m[] = {0.299f, 0.587f, 0.114f,
+                       -0.169f, -0.332f, 0.500f,
+                       0.500f, -0.419f, -0.0813f};
+    const float offset[] = {0, 0.5f, 0.5f};
+    return p.affine(m, offset, 3);
+}
 
-    // Then the nonlinear curve
-    X.set(Select(X > s, Xn*X*X*X, (X-16.0/116)*3*s*s*Xn));
-    Y.set(Select(Y > s, Yn*Y*Y*Y, (Y-16.0/116)*3*s*s*Yn));
-    Z.set(Select(Z > s, Zn*Z*Z*Z, (Z-16.0/116)*3*s*s*Zn));
+ColorPipeline &yuvToRGB(ColorPipeline &p) {
+    const float m[] = {1, 0, 1.4075f,
+                       1, -0.3455f, -0.7169f,
+                       1, 1.7790f, 0};
+    const float offset[] = {-0.70375f, 0.5312f, -0.8895f};
+    return p.affine(m, offset, 3);
+}
 
-    return out;
+ColorPipeline &rgbToY(ColorPipeline &p) {
+    const float m[] = {0.299f, 0.587f, 0.114f};
+    return p.matrix(m, 1);
 }
 
-Image ColorConvert::rgb2lab(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-    return xyz2lab(rgb2xyz(im));
+ColorPipeline &yToRGB(ColorPipeline &p) {
+    const float m[] = {1, 1, 1};
+    return p.matrix(m, 3);
 }
 
-Image ColorConvert::lab2rgb(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-    return xyz2rgb(lab2xyz(im));
+bool isLuminance(const string &space) {
+    return (space == "y" || space == "gray" ||
+            space == "grayscale" || space == "luminance");
 }
 
+bool isHSV(const string &space) {
+    return space == "hsv" || space == "hsl" || space == "hsb";
+}
 
-Image ColorConvert::rgb2hsv(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
+// Append the steps that take the given color space to srgb
+void toRGB(ColorPipeline &p, const string &from) {
+    if (isHSV(from)) {
+        p.curve(ColorPipeline::HSVToRGB);
+    } else if (from == "yuv") {
+        yuvToRGB(p);
+    } else if (from == "xyz") {
+        xyzToRGB(p);
+    } else if (isLuminance(from)) {
+        yToRGB(p);
+    } else if (from == "lab") {
+        xyzToRGB(labToXYZ(p));
+    } else if (from == "argb") {
+        xyzToRGB(argbToXYZ(p));
+    } else if (from != "rgb") {
+        panic("Unknown color space %s\n", from.c_str());
+    }
+}
 
-    float mult = 1.0f / 6;
+// Append the steps that take srgb to the given color space
+void fromRGB(ColorPipeline &p, const string &to) {
+    if (isHSV(to)) {
+        p.curve(ColorPipeline::RGBToHSV);
+    } else if (to == "yuv") {
+        rgbToYUV(p);
+    } else if (to == "xyz") {
+        rgbToXYZ(p);
+    } else if (isLuminance(to)) {
+        rgbToY(p);
+    } else if (to == "lab") {
+        xyzToLab(rgbToXYZ(p));
+    } else if (to == "argb") {
+        xyzToARGB(rgbToXYZ(p));
+    } else if (to != "rgb") {
+        panic("Unknown color space %s\n", to.c_str());
+    }
+}
+}
 
-    Image out(im.width, im.height, im.frames, im.channels);
+Image ColorConvert::apply(Image im, string from, string to) {
+    // check for the trivial case
+    assert(from != to, "color conversion from %s to %s is pointless\n", from.c_str(), to.c_str());
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                float minV, maxV, delta;
-                float h, s, v;
-                float r = im(x, y, t, 0);
-                float g = im(x, y, t, 1);
-                float b = im(x, y, t, 2);
-
-                minV = min(r, g, b);
-                maxV = max(r, g, b);
-                v = maxV;
-
-                delta = maxV - minV;
-
-                if (delta != 0) {
-                    s = delta / maxV;
-                    if (r == maxV) { h = 0 + (g - b) / delta; } // between yellow & magenta
-                    else if (g == maxV) { h = 2 + (b - r) / delta; } // between cyan & yellow
-                    else { h = 4 + (r - g) / delta; } // between magenta & cyan
-                    h *= mult;
-                    if (h < 0) { h++; }
-                } else {
-                    // r = g = b = 0 so s = 0, h is undefined
-                    s = 0;
-                    h = 0;
-                }
+    // unsupported destination color spaces
+    if (to == "yuyv" ||
+        to == "uyvy") {
+        panic("Unsupported destination color space: %s\n", to.c_str());
+    }
 
-                out(x, y, t, 0) = h;
-                out(x, y, t, 1) = s;
-                out(x, y, t, 2) = v;
-            }
-        }
+    // Packed 4:2:2 formats need a pixel's neighbour, so they are
+    // unpacked on their own before the per-pixel pipeline.
+    if (from == "yuyv" || from == "uyvy") {
+        im = (from == "yuyv") ? yuyv2yuv(im) : uyvy2yuv(im);
+        from = "yuv";
+        if (to == "yuv") return im;
     }
 
-    return out;
+    // Compose the whole conversion into one pipeline, so that even
+    // conversions that go via rgb or xyz take a single pass.
+    ColorPipeline p(isLuminance(from) ? 1 : 3);
+    if (from == "xyz" && to == "lab") {
+        // direct conversions that don't have to go via rgb
+        xyzToLab(p);
+    } else if (from == "lab" && to == "xyz") {
+        labToXYZ(p);
+    } else if (from == "argb" && to == "xyz") {
+        argbToXYZ(p);
+    } else if (from == "xyz" && to == "argb") {
+        xyzToARGB(p);
+    } else {
+        toRGB(p, from);
+        fromRGB(p, to);
+    }
+    return p.apply(im);
 }
 
-Image ColorConvert::hsv2rgb(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
+Image ColorConvert::xyz2lab(Image im) {
+    ColorPipeline p(3);
+    return xyzToLab(p).apply(im);
+}
 
-    Image out(im.width, im.height, im.frames, im.channels);
+Image ColorConvert::lab2xyz(Image im) {
+    ColorPipeline p(3);
+    return labToXYZ(p).apply(im);
+}
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                float h = im(x, y, t, 0);
-                float s = im(x, y, t, 1);
-                float v = im(x, y, t, 2);
+Image ColorConvert::rgb2lab(Image im) {
+    ColorPipeline p(3);
+    return xyzToLab(rgbToXYZ(p)).apply(im);
+}
 
-                if (s == 0) {
-                    // achromatic (grey)
-                    out(x, y, t, 0) = out(x, y, t, 1) = out(x, y, t, 2) = v;
-                } else {
+Image ColorConvert::lab2rgb(Image im) {
+    ColorPipeline p(3);
+    return xyzToRGB(labToXYZ(p)).apply(im);
+}
 
-                    h *= 6;        // sector 0 to 5
-                    int i = (int)h;
-                    if (i == 6) { i = 5; }
-                    float f = h - i;
-                    float p = v * (1 - s);
-                    float q = v * (1 - s * f);
-                    float u = v * (1 - s * (1 - f));
-
-                    switch (i) {
-                    case 0:
-                        out(x, y, t, 0) = v;
-                        out(x, y, t, 1) = u;
-                        out(x, y, t, 2) = p;
-                        break;
-                    case 1:
-                        out(x, y, t, 0) = q;
-                        out(x, y, t, 1) = v;
-                        out(x, y, t, 2) = p;
-                        break;
-                    case 2:
-                        out(x, y, t, 0) = p;
-                        out(x, y, t, 1) = v;
-                        out(x, y, t, 2) = u;
-                        break;
-                    case 3:
-                        out(x, y, t, 0) = p;
-                        out(x, y, t, 1) = q;
-                        out(x, y, t, 2) = v;
-                        break;
-                    case 4:
-                        out(x, y, t, 0) = u;
-                        out(x, y, t, 1) = p;
-                        out(x, y, t, 2) = v;
-                        break;
-                    default:  // case 5:
-                        out(x, y, t, 0) = v;
-                        out(x, y, t, 1) = p;
-                        out(x, y, t, 2) = q;
-                        break;
-                    }
-                }
-            }
-        }
-    }
+Image ColorConvert::rgb2hsv(Image im) {
+    ColorPipeline p(3);
+    return p.curve(ColorPipeline::RGBToHSV).apply(im);
+}
 
-    return out;
+Image ColorConvert::hsv2rgb(Image im) {
+    ColorPipeline p(3);
+    return p.curve(ColorPipeline::HSVToRGB).apply(im);
 }
 
 Image ColorConvert::rgb2y(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-    return im.channel(0) * 0.299f + im.channel(1) * 0.587f + im.channel(2) * 0.114f;
+    ColorPipeline p(3);
+    return rgbToY(p).apply(im);
 }
 
 Image ColorConvert::y2rgb(Image im) {
-    assert(im.channels == 1, "Image does not have one channel\n");
-
-    Image out(im.width, im.height, im.frames, 3);
-
-    out.setChannels(im, im, im);
-
-    return out;
+    ColorPipeline p(1);
+    return yToRGB(p).apply(im);
 }
 
 Image ColorConvert::rgb2yuv(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    Image out(im.width, im.height, im.frames, 3);
-    Image r = im.channel(0), g = im.channel(1), b = im.channel(2);
-    out.setChannels(0.299f * r + 0.587f * g + 0.114f * b,
-                    -0.169f * r - 0.332f * g + 0.500f * b + 0.5f,
-                    0.500f * r - 0.419f * g - 0.0813f * b + 0.5f);
-    return out;
+    ColorPipeline p(3);
+    return rgbToYUV(p).apply(im);
 }
 
 Image ColorConvert::yuv2rgb(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    Image out(im.width, im.height, im.frames, 3);
-    Image y = im.channel(0), u = im.channel(1), v = im.channel(2);
-    out.setChannels(y + 1.4075f * v - 0.70375f,
-                    y - 0.3455f * u - 0.7169f * v + 0.5312f,
-                    y + 1.7790f * u - 0.8895f);
-    return out;
+    ColorPipeline p(3);
+    return yuvToRGB(p).apply(im);
 }
 
 Image ColorConvert::rgb2xyz(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    // convert to linear luminance srgb
-    Image out = Select(im <= 0.04045f,
-                       im/12.95f,
-                       pow(max((im + 0.055f)/1.055f, 0), 2.4f));
-    Image r = out.channel(0), g = out.channel(1), b = out.channel(2);
-
-    // Apply the linear transform to get to xyz
-    out.setChannels(0.4124f * r + 0.3576f * g + 0.1805f * b,
-                    0.2126f * r + 0.7152f * g + 0.0722f * b,
-                    0.0193f * r + 0.1192f * g + 0.9505f * b);
-    return out;
+    ColorPipeline p(3);
+    return rgbToXYZ(p).apply(im);
 }
 
 Image ColorConvert::xyz2rgb(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    // Apply linear transform to get to linear-luminance rgb
-    Image out(im.width, im.height, im.frames, 3);
-    Image x = im.channel(0), y = im.channel(1), z = im.channel(2);
-    out.setChannels(3.2406f * x - 1.5372f * y - 0.4986f * z,
-                    -0.9689f * x + 1.8758f * y + 0.0415f * z,
-                    0.0557f * x - 0.2040f * y + 1.0570f * z);
-
-    // Convert from linear luminance to gamma-encoded srgb
-    out.set(Select(out <= 0.0031308f,
-                   12.92f * out,
-                   1.055f * pow(Expr::max(out, 0), 1.0f/2.4f) - 0.055f));
-
-    return out;
+    ColorPipeline p(3);
+    return xyzToRGB(p).apply(im);
 }
 
 Image ColorConvert::uyvy2yuv(Image im) {
@@ -489,52 +669,41 @@ Image ColorConvert::yuyv2rgb(Image im) {
 }
 
 Image ColorConvert::argb2xyz(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    // Apply inverse adobe rgb gamma curve to get to linear-luminance
-    Image out = pow(Expr::max(im, 0), 563.0f/256);
-    Image r = out.channel(0), g = out.channel(1), b = out.channel(2);
-
-    // Apply argb to xyz linear transform
-    out.setChannels(0.57667f * r + 0.18556f * g + 0.18823f * b,
-                    0.29734f * r + 0.62736f * g + 0.07529f * b,
-                    0.02703f * r + 0.07069f * g + 0.99134f * b);
-
-    return out;
+    ColorPipeline p(3);
+    return argbToXYZ(p).apply(im);
 }
 
 Image ColorConvert::xyz2argb(Image im) {
-    assert(im.channels == 3, "Image does not have 3 channels\n");
-
-    // xyz to argb linear transform
-    Image x = im.channel(0), y = im.channel(1), z = im.channel(2);
-    Image out(im.width, im.height, im.frames, 3);
-    out.setChannels(2.04159f * x - 0.56501f * y - 0.34473f * z,
-                    -0.96924f * x + 1.87597f * y + 0.04156f * z,
-                    0.01344f * x - 0.11836f * y + 1.01517f * z);
-
-    // Apply adobe rgb gamma curve
-    out.set(pow(Expr::max(out, 0), 256/563.0f));
-
-    return out;
+    ColorPipeline p(3);
+    return xyzToARGB(p).apply(im);
 }
 
 Image ColorConvert::argb2rgb(Image im) {
-    return xyz2rgb(argb2xyz(im));
+    ColorPipeline p(3);
+    return xyzToRGB(argbToXYZ(p)).apply(im);
 }
 
 Image ColorConvert::rgb2argb(Image im) {
-    return xyz2argb(rgb2xyz(im));
+    ColorPipeline p(3);
+    return xyzToARGB(rgbToXYZ(p)).apply(im);
 }
 
 void Demosaic::help() {
-    printf("\n-demosaic demosaics a raw bayer mosaiced image camera. It should be a one\n"
-           "channel image. The algorithm used is adaptive color plane interpolation (ACPI).\n"
-           "Demosaic optionally takes two or three arguments. Two arguments specify an offset\n"
-           "of the standard bayer pattern in x and y. The presence of a third argument\n"
-           "indicates that auto-white-balancing should be performed.\n\n"
-           "Usage: ImageStack -load photo.dng -demosaic -save out.png\n"
-           "       ImageStack -load raw.yuv -demosaic 0 1 awb -save out.png\n");
+    pprintf("-demosaic demosaics a raw bayer mosaiced image camera. It should be a one"
+            " channel image. Demosaic optionally takes two arguments that specify an"
+            " offset of the standard bayer pattern in x and y. These may be followed by"
+            " the name of the algorithm to use, and by the word awb, which indicates that"
+            " auto-white-balancing should be performed. The algorithms available are:"
+            " acpi (adaptive color plane interpolation, the default); bilinear (faster,"
+            " but blurrier and prone to color fringes); and hq (adaptive color plane"
+            " interpolation with its full second-order correction, followed by median"
+            " filtering of the color differences to suppress zippering and false"
+            " color). Any other third argument is also taken to request"
+            " auto-white-balancing.\n"
+            "\n"
+            "Usage: ImageStack -load photo.dng -demosaic -save out.png\n"
+            "       ImageStack -load raw.yuv -demosaic 0 1 awb -save out.png\n"
+            "       ImageStack -load raw.yuv -demosaic 0 1 hq awb -save out.png\n");
 }
 
 bool Demosaic::test() {
@@ -549,73 +718,155 @@ bool Demosaic::test() {
         }
     }
 
-    Image demo = Demosaic::apply(raw, 1, 0, false);
-    Save::apply(demo, "demo.tmp");
-    return nearlyEqual(dog, demo);
+    Image before = raw.copy();
+    Method methods[] = {ACPI, Bilinear, HighQuality};
+    for (int i = 0; i < 3; i++) {
+        Image demo = Demosaic::apply(raw, 1, 0, false, methods[i]);
+        if (!nearlyEqual(dog, demo)) return false;
+        // Auto-white-balancing shouldn't touch the input
+        Demosaic::apply(raw, 1, 0, true, methods[i]);
+        if (!nearlyEqual(raw, before)) return false;
+    }
+    return true;
 }
 
 void Demosaic::parse(vector<string> args) {
     bool awb = false;
     int xoff = 0, yoff = 0;
-    if (args.size() == 0) {
-        awb = false;
-    } else if (args.size() == 2) {
-        xoff = readInt(args[0]);
-        yoff = readInt(args[1]);
-    } else if (args.size() == 3) {
+    Method method = ACPI;
+    if (args.size() == 1 || args.size() > 4) {
+        panic("-demosaic takes zero, two, three, or four arguments");
+    }
+    if (args.size() >= 2) {
         xoff = readInt(args[0]);
         yoff = readInt(args[1]);
-        awb = true;
-    } else {
-        panic("-demosaic takes zero, two, or three arguments");
     }
-    Image im = apply(stack(0), xoff, yoff, awb);
+    for (size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "acpi") {
+            method = ACPI;
+        } else if (args[i] == "bilinear") {
+            method = Bilinear;
+        } else if (args[i] == "hq") {
+            method = HighQuality;
+        } else {
+            awb = true;
+        }
+    }
+    Image im = apply(stack(0), xoff, yoff, awb, method);
     pop();
     push(im);
 }
 
-Image Demosaic::apply(Image im, int xoff, int yoff, bool awb) {
+namespace {
+// Median of nine values with a fixed network of min/max exchanges, so
+// it has no branches and vectorizes
+inline void exchange(float &a, float &b) {
+    float lo = min(a, b);
+    b = max(a, b);
+    a = lo;
+}
+
+inline float median9(float p0, float p1, float p2, float p3, float p4,
+                     float p5, float p6, float p7, float p8) {
+    exchange(p1, p2); exchange(p4, p5); exchange(p7, p8);
+    exchange(p0, p1); exchange(p3, p4); exchange(p6, p7);
+    exchange(p1, p2); exchange(p4, p5); exchange(p7, p8);
+    p3 = max(p0, p3); p5 = min(p5, p8); exchange(p4, p7);
+    p6 = max(p3, p6); p4 = max(p1, p4); p2 = min(p2, p5);
+    p4 = min(p4, p7); exchange(p4, p2); p4 = max(p6, p4);
+    return min(p4, p2);
+}
+}
+
+Image Demosaic::apply(Image im, int xoff, int yoff, bool awb, Method method) {
 
     assert(im.channels == 1, "Mosaiced images should have a single channel\n");
 
     Image out(im.width, im.height, im.frames, 3);
 
-    // This algorithm is roughly adaptive color plane interpolation (ACPI)
-    // by Runs Hamilton and Adams
+    // The default algorithm is roughly adaptive color plane
+    // interpolation (ACPI) by Runs Hamilton and Adams
     // (The Adams is not Andrew Adams)
 
+    // Every pass below walks each scanline as two strided planes:
+    // the pixels where green is known, and the pixels where red or
+    // blue is known. Which channel is where is fixed for a whole
+    // plane, so the loop bodies have no per-pixel tests on the bayer
+    // phase. Scanlines are independent within a pass, so they run in
+    // parallel.
+
     // make sure the image is of even width and height
     if (im.width & 1 || im.height & 1) {
         im = im.region(0, 0, 0, 0,
                        im.width & (~1), im.height & (~1), im.frames, im.channels);
     }
 
+    const int width = im.width, height = im.height;
+    const int rows = height * im.frames;
+
+    // x parity of the green pixels on scanline y
+    #define GREEN_PHASE(y) (((y) + yoff + xoff) & 1)
+    // the color known on scanline y at the pixels that aren't green
+    #define ROW_COLOR(y) ((((y) + yoff) & 1) ? 2 : 0)
+
+    // Step 1
+    // auto white balance: make sure all channels have the same mean
+    double multiplier[2][2] = {{1, 1}, {1, 1}};
     if (awb) {
+        // Gather statistics per scanline and then combine them, so
+        // the result doesn't depend on the number of threads
+        vector<double> rowSum(rows * 2, 0), rowMax(rows * 2, 0);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            const int y = r % height, t = r / height;
+            const float *in = &im(0, y, t, 0);
+            for (int p = 0; p < 2; p++) {
+                double sum = 0, maximum = 0;
+                for (int x = p; x < width; x += 2) {
+                    sum += in[x];
+                    maximum = max(maximum, (double)in[x]);
+                }
+                rowSum[r*2 + p] = sum;
+                rowMax[r*2 + p] = maximum;
+            }
+        }
 
-        // Step 1
-        // auto white balance: make sure all channels have the same mean
         double sum[2][2] = {{0, 0}, {0, 0}};
         double maximum[2][2] = {{0, 0}, {0, 0}};
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                for (int x = 0; x < im.width; x++) {
-                    double val = im(x, y, t, 0);
-                    maximum[x & 1][y & 1] = max(maximum[x & 1][y & 1], val);
-                    sum[x & 1][y & 1] += val;
-                }
+        for (int r = 0; r < rows; r++) {
+            const int y = r % height;
+            for (int p = 0; p < 2; p++) {
+                sum[p][y & 1] += rowSum[r*2 + p];
+                maximum[p][y & 1] = max(maximum[p][y & 1], rowMax[r*2 + p]);
             }
         }
 
         double scale = sum[0][0]/maximum[0][0];
-        double multiplier[2][2] = {{1.0/maximum[0][0], scale/sum[0][1]},
-            {scale/sum[1][0],   scale/sum[1][1]}
-        };
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                for (int x = 0; x < im.width; x++) {
-                    im(x, y, t, 0) = (float)(im(x, y, t, 0) * multiplier[x & 1][y & 1]);
-                }
-            }
+        multiplier[0][0] = 1.0/maximum[0][0];
+        multiplier[0][1] = scale/sum[0][1];
+        multiplier[1][0] = scale/sum[1][0];
+        multiplier[1][1] = scale/sum[1][1];
+    }
+
+    // Scatter the known samples into their channels of the output,
+    // white balancing them on the way. Everything after this reads
+    // from the output only, so the input is never modified.
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int y = r % height, t = r / height;
+        const float *in = &im(0, y, t, 0);
+        const int gp = GREEN_PHASE(y);
+        float *g = &out(0, y, t, 1), *c = &out(0, y, t, ROW_COLOR(y));
+        const float gm = (float)multiplier[gp][y & 1], cm = (float)multiplier[1-gp][y & 1];
+        for (int x = gp; x < width; x += 2) {
+            g[x] = in[x] * gm;
+        }
+        for (int x = 1-gp; x < width; x += 2) {
+            c[x] = in[x] * cm;
         }
     }
 
@@ -626,44 +877,46 @@ Image Demosaic::apply(Image im, int xoff, int yoff, bool awb) {
     // Ie, calculate |dI/dx| + |d2I/dx2| and |dI/dy| + |d2I/dy2|, and interpolate
     // horizontally or vertically depending on which is smaller
     // if they're both the same, use both
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 2; y < im.height-2; y++) {
-            for (int x = 2; x < im.width-2; x++) {
-                if (((x + xoff) & 1) == ((y + yoff) & 1)) {
-                    // GREEN IS KNOWN
-                    // we already know green here, just use it
-                    out(x, y, t, 1) = im(x, y, t, 0);
-                } else {
-                    // RED OR BLUE IS KNOWN
-                    // gather neighbouring greens
-                    float left1 = im(x-1, y, t, 0), right1 = im(x+1, y, t, 0);
-                    float up1 = im(x, y-1, t, 0), down1 = im(x, y+1, t, 0);
-                    // gather neighbouring reds or blues
-                    float here = im(x, y, t, 0);
-                    float left2 = im(x-2, y, t, 0), right2 = im(x+1, y, t, 0);
-                    float up2 = im(x, y-2, t, 0), down2 = im(x, y+2, t, 0);
-
-                    // decide which way to interpolate
-                    // (divide laplacian by two because it's across twice the baseline)
-                    // the correction terms have been removed because they look retarded
-                    float interpHoriz = fabs(right1 - left1) + fabs(2*here - right2 - left2)/2;
-                    float interpVert  = fabs(up1    - down1) + fabs(2*here - up2    - down2)/2;
-                    if (interpHoriz < interpVert) { // horizontally
-                        //float colAverage = (left2 + right2)/2;
-                        //float correction = here - colAverage;
-                        // only apply half the correction, because it's across twice the baseline
-                        out(x, y, t, 1) = (left1 + right1)/2;// + correction/2;
-                    } else if (interpVert < interpHoriz) { // vertically
-                        //float colAverage = (up2 + down2)/2;
-                        //float correction = here - colAverage;
-                        out(x, y, t, 1) = (up1 + down1)/2;// + correction/2;
-                    } else { // both
-                        float colAverage = (up2 + down2 + left2 + right2)/4;
-                        float correction = here - colAverage;
-                        out(x, y, t, 1) = (left1 + up1 + right1 + down1)/4 + correction/2;
-                    }
-                }
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int y = r % height, t = r / height;
+        if (y < 2 || y >= height-2) continue;
+        const int rc = ROW_COLOR(y);
+        // green is known directly above and below a red or blue pixel,
+        // and the same color is known two pixels away in each direction
+        float *g = &out(0, y, t, 1);
+        const float *gUp = &out(0, y-1, t, 1), *gDown = &out(0, y+1, t, 1);
+        const float *c = &out(0, y, t, rc);
+        const float *cUp = &out(0, y-2, t, rc), *cDown = &out(0, y+2, t, rc);
+        for (int x = 3 - GREEN_PHASE(y); x < width-2; x += 2) {
+            // gather neighbouring greens
+            float left1 = g[x-1], right1 = g[x+1];
+            float up1 = gUp[x], down1 = gDown[x];
+            if (method == Bilinear) {
+                g[x] = (left1 + right1 + up1 + down1)/4;
+                continue;
+            }
+            // gather neighbouring reds or blues
+            float here = c[x];
+            float left2 = c[x-2], right2 = c[x+2];
+            float up2 = cUp[x], down2 = cDown[x];
+
+            // decide which way to interpolate
+            // (divide laplacian by two because it's across twice the baseline)
+            float interpHoriz = fabs(right1 - left1) + fabs(2*here - right2 - left2)/2;
+            float interpVert  = fabs(up1    - down1) + fabs(2*here - up2    - down2)/2;
+            float horiz = (left1 + right1)/2;
+            float vert = (up1 + down1)/2;
+            if (method == HighQuality) {
+                // only apply half the correction, because it's across twice the baseline
+                horiz += (here - (left2 + right2)/2)/2;
+                vert += (here - (up2 + down2)/2)/2;
             }
+            float colAverage = (up2 + down2 + left2 + right2)/4;
+            float both = (left1 + up1 + right1 + down1)/4 + (here - colAverage)/2;
+            g[x] = (interpHoriz < interpVert) ? horiz : ((interpVert < interpHoriz) ? vert : both);
         }
     }
 
@@ -678,99 +931,114 @@ Image Demosaic::apply(Image im, int xoff, int yoff, bool awb) {
     // we have 4 neighbours, diagonally around us
     // use the same approach as step 2, but take diagonal derivatives and interpolate diagonally
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 2; y < im.height-2; y++) {
-            for (int x = 2; x < im.width-2; x++) {
-                if (((x + xoff) & 1) == ((y + yoff) & 1)) {
-                    // GREEN IS KNOWN (step 3)
-
-                    // figure out which of red/blue is horizontally interpolated
-                    // and which is vertically interpolated
-                    int horizChannel, vertChannel;
-                    if ((y + yoff) & 1) {
-                        horizChannel = 2;
-                        vertChannel = 0;
-                    } else {
-                        horizChannel = 0;
-                        vertChannel = 2;
-                    }
-
-                    // do the horizontal interpolation
-
-                    // compute an average for the color
-                    float colLeft = im(x-1, y, t, 0), colRight = im(x+1, y, t, 0);
-                    float colAverage = (colLeft + colRight)/2;
-                    // compute the same average for green
-                    float greenLeft = out(x-1, y, t, 1);
-                    float greenRight = out(x+1, y, t, 1);
-                    float greenHere = out(x, y, t, 1);
-                    float greenAverage = (greenLeft + greenRight)/2;
-                    // see how wrong the green average was
-                    float correction = greenHere - greenAverage;
-                    // set the output to the average color plus the
-                    // correction factor needed for green
-                    out(x, y, t, horizChannel) = colAverage + correction;
-
-                    // do the vertical interpolation
-                    float colUp = im(x, y-1, t, 0), colDown = im(x, y+1, t, 0);
-                    float greenUp = out(x, y-1, t, 1), greenDown = out(x, y+1, t, 1);
-                    colAverage = (colUp + colDown)/2;
-                    greenAverage = (greenUp + greenDown)/2;
-                    correction = greenHere - greenAverage;
-                    out(x, y, t, vertChannel) = colAverage + correction;
-
-                } else {
-                    // RED OR BLUE IS KNOWN (step 4)
+    // Bilinear interpolation is the same with the corrections left out
+    const float k = (method == Bilinear) ? 0.0f : 1.0f;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int y = r % height, t = r / height;
+        if (y < 2 || y >= height-2) continue;
+        const int gp = GREEN_PHASE(y);
+        const float *g = &out(0, y, t, 1);
+        const float *gUp = &out(0, y-1, t, 1), *gDown = &out(0, y+1, t, 1);
+
+        // GREEN IS KNOWN (step 3)
+        // red/blue on this scanline is horizontally interpolated
+        // and the other one is vertically interpolated
+        const int horizChannel = ROW_COLOR(y), vertChannel = 2 - horizChannel;
+        float *horiz = &out(0, y, t, horizChannel), *vert = &out(0, y, t, vertChannel);
+        const float *vertUp = &out(0, y-1, t, vertChannel), *vertDown = &out(0, y+1, t, vertChannel);
+        for (int x = 2 + gp; x < width-2; x += 2) {
+            // compute an average for the color, and the same average
+            // for green, and correct the color by how wrong the green
+            // average was
+            float greenHere = g[x];
+            horiz[x] = (horiz[x-1] + horiz[x+1])/2 + k*(greenHere - (g[x-1] + g[x+1])/2);
+            vert[x] = (vertUp[x] + vertDown[x])/2 + k*(greenHere - (gUp[x] + gDown[x])/2);
+        }
 
-                    // figure out which channel is known exactly
-                    int knownChannel, unknownChannel;
-                    if ((y+yoff) & 1) {
-                        knownChannel = 2;
-                        unknownChannel = 0;
-                    } else {
-                        knownChannel = 0;
-                        unknownChannel = 2;
-                    }
+        // RED OR BLUE IS KNOWN (step 4)
+        // for the unknown channel, do diagonal interpolation
+        // u is up left, v is down right, s is up right, t is down left
+        // p is the channel to be predicted, g is green (already interpolated)
+        float *unknown = vert;
+        const float *pUp = vertUp, *pDown = vertDown;
+        for (int x = 3 - gp; x < width-2; x += 2) {
+            float up = pUp[x-1], ug = gUp[x-1];
+            float vp = pDown[x+1], vg = gDown[x+1];
+            float sp = pUp[x+1], sg = gUp[x+1];
+            float tp = pDown[x-1], tg = gDown[x-1];
+            float greenHere = g[x];
+
+            float interpUV = fabs(vp - up) + fabs(2*greenHere - vg - ug);
+            float interpST = fabs(sp - tp) + fabs(2*greenHere - sg - tg);
+
+            float uv = (up + vp)/2 + k*(greenHere - (ug + vg)/2);
+            float st = (sp + tp)/2 + k*(greenHere - (sg + tg)/2);
+            float all = (up + vp + sp + tp)/4 + k*(greenHere - (ug + vg + sg + tg)/4);
+            if (method == Bilinear) {
+                unknown[x] = all;
+            } else {
+                unknown[x] = (interpUV < interpST) ? uv : ((interpST < interpUV) ? st : all);
+            }
+        }
+    }
 
-                    // set the known channel to the correct value
-                    out(x, y, t, knownChannel) = im(x, y, t, 0);
-
-                    // for the unknown channel, do diagonal interpolation
-                    // u is up left, v is down right, s is up right, t is down left
-                    // p is the channel to be predicted, g is green (already interpolated)
-                    float up = im(x-1, y-1, t, 0), ug = out(x-1, y-1, t, 1);
-                    float vp = im(x+1, y+1, t, 0), vg = out(x+1, y+1, t, 1);
-                    float sp = im(x+1, y-1, t, 0), sg = out(x+1, y-1, t, 1);
-                    float tp = im(x-1, y+1, t, 0), tg = out(x-1, t+1, t, 1);
-                    float greenHere = out(x, y, t, 1);
-
-                    float interpUV = fabs(vp - up) + fabs(2*greenHere - vg - ug);
-                    float interpST = fabs(sp - tp) + fabs(2*greenHere - sg - tg);
-
-                    if (interpUV < interpST) {
-                        float greenAverage = (ug + vg)/2;
-                        float correction = greenHere - greenAverage;
-                        out(x, y, t, unknownChannel) = (up + vp)/2 + correction;
-                    } else if (interpST < interpUV) {
-                        float greenAverage = (sg + tg)/2;
-                        float correction = greenHere - greenAverage;
-                        out(x, y, t, unknownChannel) = (sp + tp)/2 + correction;
-                    } else {
-                        float greenAverage = (ug + vg + sg + tg)/4;
-                        float correction = greenHere - greenAverage;
-                        out(x, y, t, unknownChannel) = (up + vp + sp + tp)/4 + correction;
-                    }
+    // Step 4b (hq only)
+    // Replace each interpolated red or blue value by green plus the
+    // median of the color difference around it. Color differences
+    // are smooth in natural images, so this removes the zippering
+    // and false color along edges that ACPI leaves behind.
+    if (method == HighQuality) {
+        Image diff(width, height, im.frames, 2);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            const int y = r % height, t = r / height;
+            const float *g = &out(0, y, t, 1);
+            for (int i = 0; i < 2; i++) {
+                const float *c = &out(0, y, t, i*2);
+                float *d = &diff(0, y, t, i);
+                for (int x = 0; x < width; x++) {
+                    d[x] = c[x] - g[x];
+                }
+            }
+        }
 
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            const int y = r % height, t = r / height;
+            if (y < 3 || y >= height-3) continue;
+            const int gp = GREEN_PHASE(y), rc = ROW_COLOR(y);
+            const float *g = &out(0, y, t, 1);
+            for (int i = 0; i < 2; i++) {
+                float *c = &out(0, y, t, i*2);
+                const float *d0 = &diff(0, y-1, t, i), *d1 = &diff(0, y, t, i), *d2 = &diff(0, y+1, t, i);
+                // This channel is unknown at every green pixel, and
+                // at the other pixels if it isn't this scanline's color
+                const int first = (i*2 == rc) ? 4 - gp : 3;
+                const int step = (i*2 == rc) ? 2 : 1;
+                for (int x = first; x < width-3; x += step) {
+                    c[x] = g[x] + median9(d0[x-1], d0[x], d0[x+1],
+                                          d1[x-1], d1[x], d1[x+1],
+                                          d2[x-1], d2[x], d2[x+1]);
                 }
             }
         }
     }
 
+    #undef GREEN_PHASE
+    #undef ROW_COLOR
 
     // Step 5
     // zero the margins, which weren't interpolated, to avoid annoying checkerboard there
     // we could also do some more basic interpolation, but the margins don't really matter anyway
-    for (int c = 0; c < im.channels; c++) {
+    for (int c = 0; c < out.channels; c++) {
         for (int t = 0; t < im.frames; t++) {
             for (int x = 0; x < im.width; x++) {
                 out(x, 0, t, c) = 0;
@@ -45,10 +45,12 @@ public:
 
 class Demosaic : public Operation {
 public:
+    enum Method {ACPI = 0, Bilinear, HighQuality};
+
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image win, int xoff, int yoff, bool awb);
+    static Image apply(Image win, int xoff, int yoff, bool awb, Method method = ACPI);
 };
 
 }
@@ -0,0 +1,169 @@
+#include "main.h"
+#include "CompactImage.h"
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+namespace ImageStack {
+
+namespace {
+
+// Scalar conversions, rounding to nearest even like the F16C
+// instructions do. NaNs stay NaNs and overflow goes to infinity.
+uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x > 0x7f800000) {
+        // NaN
+        return sign | 0x7e00 | ((x >> 13) & 0x3ff);
+    } else if (x >= 0x47800000) {
+        // Too large, or infinity
+        return sign | 0x7c00;
+    } else if (x < 0x38800000) {
+        // Subnormal half, or zero
+        if (x < 0x33000000) return sign;
+        int shift = 126 - (x >> 23);
+        uint32_t m = (x & 0x7fffff) | 0x800000;
+        uint32_t h = m >> shift;
+        uint32_t rem = m & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1))) h++;
+        return sign | h;
+    } else {
+        // Normal. Rounding may carry into the exponent, which is what
+        // we want, including the carry into infinity.
+        uint32_t h = (x - 0x38000000) >> 13;
+        uint32_t rem = x & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+        return sign | h;
+    }
+}
+
+float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    uint32_t x;
+    if (e == 0) {
+        float f = m * (1.0f / 16777216);
+        memcpy(&x, &f, 4);
+        x |= sign;
+    } else if (e == 31) {
+        // Infinity, or NaN, which comes back quiet
+        x = sign | 0x7f800000 | (m << 13) | (m ? 0x400000 : 0);
+    } else {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    }
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+}
+
+void packRowHalf(const float *src, uint16_t *dst, int n) {
+    int x = 0;
+    #ifdef __F16C__
+    for (; x + 8 <= n; x += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + x), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + x), h);
+    }
+    #endif
+    for (; x < n; x++) {
+        dst[x] = floatToHalf(src[x]);
+    }
+}
+
+void unpackRowHalf(const uint16_t *src, float *dst, int n) {
+    int x = 0;
+    #ifdef __F16C__
+    for (; x + 8 <= n; x += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i *)(src + x));
+        _mm256_storeu_ps(dst + x, _mm256_cvtph_ps(h));
+    }
+    #endif
+    for (; x < n; x++) {
+        dst[x] = halfToFloat(src[x]);
+    }
+}
+
+// These two vectorize as written
+IMAGESTACK_MULTIVERSION
+void packRowUNorm(const float *src, uint16_t *dst, int n) {
+    for (int x = 0; x < n; x++) {
+        float v = src[x];
+        v = v < 0 ? 0 : (v > 1 ? 1 : v);
+        dst[x] = (uint16_t)(v * 65535 + 0.5f);
+    }
+}
+
+IMAGESTACK_MULTIVERSION
+void unpackRowUNorm(const uint16_t *src, float *dst, int n) {
+    const float scale = 1.0f / 65535;
+    for (int x = 0; x < n; x++) {
+        dst[x] = src[x] * scale;
+    }
+}
+
+}
+
+CompactImage::CompactImage(Image im, Format format_) :
+    width(im.width), height(im.height), frames(im.frames), channels(im.channels),
+    format(format_) {
+    if (format == Float32) {
+        full = im;
+        return;
+    }
+
+    packed.reset(new vector<uint16_t>((size_t)width * height * frames * channels));
+    uint16_t *dst = &(*packed)[0];
+    const int rows = height * frames * channels;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        int y = r % height, t = (r / height) % frames, c = r / (height * frames);
+        if (format == Float16) {
+            packRowHalf(&im(0, y, t, c), dst + (size_t)r * width, width);
+        } else {
+            packRowUNorm(&im(0, y, t, c), dst + (size_t)r * width, width);
+        }
+    }
+}
+
+Image CompactImage::expand() const {
+    if (format == Float32) return full;
+
+    Image im(width, height, frames, channels);
+    const uint16_t *src = &(*packed)[0];
+    const int rows = height * frames * channels;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        int y = r % height, t = (r / height) % frames, c = r / (height * frames);
+        if (format == Float16) {
+            unpackRowHalf(src + (size_t)r * width, &im(0, y, t, c), width);
+        } else {
+            unpackRowUNorm(src + (size_t)r * width, &im(0, y, t, c), width);
+        }
+    }
+    return im;
+}
+
+size_t CompactImage::bytes() const {
+    size_t n = (size_t)width * height * frames * channels;
+    return format == Float32 ? n * sizeof(float) : n * sizeof(uint16_t);
+}
+
+CompactImage::Format CompactImage::parseFormat(string name) {
+    if (name == "float32" || name == "float") {
+        return Float32;
+    } else if (name == "float16" || name == "half") {
+        return Float16;
+    } else if (name == "uint16") {
+        return UNorm16;
+    }
+    panic("Unknown storage format %s. It should be float32, float16, or uint16\n", name.c_str());
+    return Float32;
+}
+
+}
@@ -0,0 +1,43 @@
+#ifndef IMAGESTACK_COMPACT_IMAGE_H
+#define IMAGESTACK_COMPACT_IMAGE_H
+#include <stdint.h>
+namespace ImageStack {
+
+// A copy of an image held at reduced precision, for keeping large
+// intermediates around in half the memory. It is read only: to do
+// anything with the pixels, expand it back into an Image. Converting
+// in either direction is done in parallel over rows, and uses the
+// hardware half float conversions when they're available.
+//
+// Float16 stores IEEE half floats, which keep about three significant
+// digits over a range of +-65504. UNorm16 stores values clamped to [0,
+// 1] in steps of 1/65535, which is lossless for data that came from 16
+// bit files. Float32 just keeps a reference to the original image.
+class CompactImage {
+public:
+    enum Format {Float32 = 0, Float16, UNorm16};
+
+    int width, height, frames, channels;
+    Format format;
+
+    CompactImage() : width(0), height(0), frames(0), channels(0), format(Float32) {}
+    CompactImage(Image im, Format format);
+
+    // Returns a full precision image. For Float32 this is the original
+    // image rather than a copy.
+    Image expand() const;
+
+    // The number of bytes used to hold the pixels
+    size_t bytes() const;
+
+    // Parses float32, float16 (or half), and uint16
+    static Format parseFormat(string name);
+
+private:
+    Image full;
+    // Densely packed samples, x varying fastest, then y, t, and c
+    shared_ptr<vector<uint16_t> > packed;
+};
+
+}
+#endif
@@ -23,5 +23,12 @@ public:
     void parse(vector<string> args);
 };
 
+class Seed : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
 }
 #endif
@@ -98,13 +98,13 @@ void Convolve::parse(vector<string> args) {
         }
 
     } else if (args.size() < 3) {
-        filter = stack(1);
+        filter = peek(1);
         if (args.size() >= 1) {
             boundaryCondition = args[0];
         }
         if (args.size() == 2) {
             channelMode = args[1];
-        } else if (stack(0).channels == filter.channels) {
+        } else if (peek(0).channels == filter.channels) {
             channelMode = "elementwise";
         }
     } else {
@@ -129,7 +129,7 @@ void Convolve::parse(vector<string> args) {
         panic("Unknown vector-vector multiplication: %s\n", channelMode.c_str());
     }
 
-    Image im = apply(stack(0), filter, b, m);
+    Image im = apply(peek(0), filter, b, m);
     pop();
     push(im);
 
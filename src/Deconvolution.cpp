@@ -522,7 +522,7 @@ Image Deconvolve::applyCho2009(Image blurred, Image kernel) {
 
     float alpha = 1.f; // TODO
     Image FK = KernelEstimation::enlargeKernel(kernel, B.width, B.height);
-    Image FB = RealComplex::apply(Transpose::apply(B, 'c', 't'));
+    Image FB = RealComplex::apply(Transpose::view(B, 'c', 't'));
     FFT::apply(FK, true, true, false);
     FFT::apply(FB, true, true, false);
     Image FK2 = FK.copy();
@@ -593,7 +593,7 @@ Image Deconvolve::applyCho2009(Image blurred, Image kernel) {
     IFFT::apply(FB, true, true, false);
     const int x_padding = (B.width - blurred.width) / 2;
     const int y_padding = (B.height - blurred.height) / 2;
-    return Crop::apply(Transpose::apply(ComplexReal::apply(FB), 'c', 't'),
+    return Crop::apply(Transpose::view(ComplexReal::apply(FB), 'c', 't'),
                        x_padding, y_padding, 0, blurred.width, blurred.height, blurred.frames);
 }
 
@@ -23,7 +23,7 @@ bool Display::test() {
 
 void Display::parse(vector<string> args) {
     assert(args.size() < 2, "-display takes zero or one arguments\n");
-    apply(stack(0), args.size() == 1);
+    apply(peek(0), args.size() == 1);
 }
 
 void Display::apply(Image im, bool fullscreen) {
@@ -7,6 +7,10 @@
 // Include structures describing various primitive ops like add and floor
 // Scalar versions of the ops
 #include "Expr_scalar.h"
+#ifdef __AVX512F__
+// vectors are 16-wide floats
+#include "Expr_avx512.h"
+#else
 #ifdef __AVX__
 // vectors are 8-wide floats
 #include "Expr_avx.h"
@@ -19,6 +23,7 @@
 #include "Expr_scalar_fallback.h"
 #endif
 #endif
+#endif
 
 namespace ImageStack {
 
@@ -307,6 +312,65 @@ struct C {
 };
 
 // Arithmetic binary operators
+// The iterator of FBinaryOp. It's a separate template so that
+// multiply-adds can be specialized to use Vec::fma.
+template<typename AIter, typename BIter, typename Op>
+struct FBinaryIterBase {
+    const AIter a;
+    const BIter b;
+    FBinaryIterBase() {}
+    FBinaryIterBase(const AIter &a_, const BIter &b_) : a(a_), b(b_) {}
+    float operator[](int x) const {
+        return Op::scalar_f(a[x], b[x]);
+    }
+};
+
+template<typename AIter, typename BIter, typename Op>
+struct FBinaryIter : public FBinaryIterBase<AIter, BIter, Op> {
+    FBinaryIter() {}
+    FBinaryIter(const AIter &a_, const BIter &b_) : FBinaryIterBase<AIter, BIter, Op>(a_, b_) {}
+    Vec::type vec(int x) const {
+        return Op::vec(this->a.vec(x), this->b.vec(x));
+    }
+};
+
+// a*b + c
+template<typename P, typename Q, typename BIter>
+struct FBinaryIter<FBinaryIter<P, Q, Vec::Mul>, BIter, Vec::Add> : 
+        public FBinaryIterBase<FBinaryIter<P, Q, Vec::Mul>, BIter, Vec::Add> {
+    typedef FBinaryIter<P, Q, Vec::Mul> AIter;
+    FBinaryIter() {}
+    FBinaryIter(const AIter &a_, const BIter &b_) : FBinaryIterBase<AIter, BIter, Vec::Add>(a_, b_) {}
+    Vec::type vec(int x) const {
+        return Vec::fma(this->a.a.vec(x), this->a.b.vec(x), this->b.vec(x));
+    }
+};
+
+// c + a*b
+template<typename AIter, typename P, typename Q>
+struct FBinaryIter<AIter, FBinaryIter<P, Q, Vec::Mul>, Vec::Add> : 
+        public FBinaryIterBase<AIter, FBinaryIter<P, Q, Vec::Mul>, Vec::Add> {
+    typedef FBinaryIter<P, Q, Vec::Mul> BIter;
+    FBinaryIter() {}
+    FBinaryIter(const AIter &a_, const BIter &b_) : FBinaryIterBase<AIter, BIter, Vec::Add>(a_, b_) {}
+    Vec::type vec(int x) const {
+        return Vec::fma(this->b.a.vec(x), this->b.b.vec(x), this->a.vec(x));
+    }
+};
+
+// a*b + c*d, which would otherwise match both of the above
+template<typename P, typename Q, typename R, typename S>
+struct FBinaryIter<FBinaryIter<P, Q, Vec::Mul>, FBinaryIter<R, S, Vec::Mul>, Vec::Add> : 
+        public FBinaryIterBase<FBinaryIter<P, Q, Vec::Mul>, FBinaryIter<R, S, Vec::Mul>, Vec::Add> {
+    typedef FBinaryIter<P, Q, Vec::Mul> AIter;
+    typedef FBinaryIter<R, S, Vec::Mul> BIter;
+    FBinaryIter() {}
+    FBinaryIter(const AIter &a_, const BIter &b_) : FBinaryIterBase<AIter, BIter, Vec::Add>(a_, b_) {}
+    Vec::type vec(int x) const {
+        return Vec::fma(this->a.a.vec(x), this->a.b.vec(x), this->b.vec(x));
+    }
+};
+
 template<typename A, typename B, typename Op>
 struct FBinaryOp {
     typedef FBinaryOp<typename A::FloatExpr, typename B::FloatExpr, Op> FloatExpr;
@@ -330,18 +394,7 @@ struct FBinaryOp {
         return b.getSize(i);
     }
         
-    struct Iter {
-        const typename A::Iter a;
-        const typename B::Iter b;
-        Iter() {}
-        Iter(const typename A::Iter &a_, const typename B::Iter &b_) : a(a_), b(b_) {}
-        float operator[](int x) const {
-            return Op::scalar_f(a[x], b[x]);
-        }
-        Vec::type vec(int x) const {
-            return Op::vec(a.vec(x), b.vec(x));
-        }
-    };
+    typedef FBinaryIter<typename A::Iter, typename B::Iter, Op> Iter;
     Iter scanline(int x, int y, int t, int c, int width) const {
         return Iter(a.scanline(x, y, t, c, width), b.scanline(x, y, t, c, width));
     }
@@ -8,6 +8,7 @@ namespace ImageStack {
 namespace Vec {
     typedef __m256 type;
     const int width = 8;
+    const char *const name = "avx";
     
     inline type broadcast(float v) {
         return _mm256_set1_ps(v);
@@ -41,6 +42,15 @@ namespace Vec {
         static type vec(type a, type b) {return _mm256_max_ps(a, b);}
     };
 
+    // a*b + c, rounded once if the cpu has fma
+    inline type fma(type a, type b, type c) {
+#ifdef __FMA__
+        return _mm256_fmadd_ps(a, b, c);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+
     // Comparisons
     struct GT : public ImageStack::Scalar::GT {
         static type vec(type a, type b) {return _mm256_cmp_ps(a, b, _CMP_GT_OQ);}
@@ -0,0 +1,132 @@
+#ifndef IMAGESTACK_EXPR_AVX512_H
+#define IMAGESTACK_EXPR_AVX512_H
+
+#include <immintrin.h>
+
+namespace ImageStack {
+
+namespace Vec {
+    typedef __m512 type;
+    const int width = 16;
+    const char *const name = "avx512";
+
+    inline type broadcast(float v) {
+        return _mm512_set1_ps(v);
+    }
+
+    inline type set(float a, float b, float c, float d = 0, float e = 0, float f = 0, float g = 0, float h = 0,
+                    float i = 0, float j = 0, float k = 0, float l = 0, float m = 0, float n = 0, float o = 0, float p = 0) {
+        return _mm512_set_ps(p, o, n, m, l, k, j, i, h, g, f, e, d, c, b, a);
+    }
+
+    inline type zero() {
+        return _mm512_setzero_ps();
+    }
+
+    // Comparisons produce a bit mask rather than a vector. We expand
+    // it to all ones or all zeros per lane, like the sse and avx
+    // comparisons, so the rest of Expr can treat masks as vectors.
+    inline type fromMask(__mmask16 m) {
+        return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(m, -1));
+    }
+
+    inline __mmask16 toMask(type v) {
+        __m512i i = _mm512_castps_si512(v);
+        return _mm512_test_epi32_mask(i, i);
+    }
+
+    // Arithmetic binary operators
+    struct Add : public ImageStack::Scalar::Add {
+        static type vec(type a, type b) {return _mm512_add_ps(a, b);}
+    };
+    struct Sub : public ImageStack::Scalar::Sub {
+        static type vec(type a, type b) {return _mm512_sub_ps(a, b);}
+    };
+    struct Mul : public ImageStack::Scalar::Mul {
+        static type vec(type a, type b) {return _mm512_mul_ps(a, b);}
+    };
+    struct Div : public ImageStack::Scalar::Div {
+        static type vec(type a, type b) {return _mm512_div_ps(a, b);}
+    };
+    struct Min : public ImageStack::Scalar::Min {
+        static type vec(type a, type b) {return _mm512_min_ps(a, b);}
+    };
+    struct Max : public ImageStack::Scalar::Max {
+        static type vec(type a, type b) {return _mm512_max_ps(a, b);}
+    };
+
+    // a*b + c, rounded once
+    inline type fma(type a, type b, type c) {
+        return _mm512_fmadd_ps(a, b, c);
+    }
+
+    // Comparisons
+    struct GT : public ImageStack::Scalar::GT {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ));}
+    };
+    struct LT : public ImageStack::Scalar::LT {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ));}
+    };
+    struct GE : public ImageStack::Scalar::GE {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_GE_OQ));}
+    };
+    struct LE : public ImageStack::Scalar::LE {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ));}
+    };
+    struct EQ : public ImageStack::Scalar::EQ {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ));}
+    };
+    struct NEQ : public ImageStack::Scalar::NEQ {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_NEQ_OQ));}
+    };
+
+    // Logical ops
+    inline type blend(type a, type b, type mask) {
+        return _mm512_mask_blend_ps(toMask(mask), a, b);
+    }
+
+    inline type interleave(type a, type b) {
+        // Given vectors a and b, return a[0] b[0] a[1] b[1] ... a[7] b[7]
+        const __m512i idx = _mm512_set_epi32(23, 7, 22, 6, 21, 5, 20, 4,
+                                             19, 3, 18, 2, 17, 1, 16, 0);
+        return _mm512_permutex2var_ps(a, idx, b);
+    }
+
+    inline type subsample(type a, type b) {
+        // Given vectors a and b, return a[0], a[2], ... a[14], b[1], b[3], ... b[15]
+        const __m512i idx = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17,
+                                             14, 12, 10, 8, 6, 4, 2, 0);
+        return _mm512_permutex2var_ps(a, idx, b);
+    }
+
+    inline type reverse(type a) {
+        const __m512i idx = _mm512_set_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                             8, 9, 10, 11, 12, 13, 14, 15);
+        return _mm512_permutexvar_ps(idx, a);
+    }
+
+
+    // Unary ops
+    struct Floor : public ImageStack::Scalar::Floor {
+        static type vec(type a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);}
+    };
+    struct Ceil : public ImageStack::Scalar::Ceil {
+        static type vec(type a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);}
+    };
+    struct Sqrt : public ImageStack::Scalar::Sqrt {
+        static type vec(type a) {return _mm512_sqrt_ps(a);}
+    };
+
+    // Loads and stores
+    inline type load(const float *f) {
+        return _mm512_loadu_ps(f);
+    }
+
+    inline void store(type a, float *f) {
+        _mm512_storeu_ps(f, a);
+    }
+}
+
+}
+
+#endif
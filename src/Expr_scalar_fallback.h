@@ -9,6 +9,7 @@ namespace ImageStack {
 namespace Vec {
     typedef float type;
     const int width = 1;
+    const char *const name = "scalar";
 
     inline type broadcast(float v) {
         return v;
@@ -28,6 +29,10 @@ namespace Vec {
     struct Mul : public ImageStack::Scalar::Mul {
         static type vec(type a, type b) {return scalar_f(a, b);}
     };
+
+    inline type fma(type a, type b, type c) {
+        return a*b + c;
+    }
     struct Div : public ImageStack::Scalar::Div {
         static type vec(type a, type b) {return scalar_f(a, b);}
     };
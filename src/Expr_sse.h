@@ -8,6 +8,7 @@ namespace ImageStack {
 namespace Vec {
     typedef __m128 type;
     const int width = 4;
+    const char *const name = "sse";
     
     inline type broadcast(float v) {
         return _mm_set1_ps(v);
@@ -40,6 +41,15 @@ namespace Vec {
     struct Max : public ImageStack::Scalar::Max {
         static type vec(type a, type b) {return _mm_max_ps(a, b);}
     };
+
+    // a*b + c, rounded once if the cpu has fma
+    inline type fma(type a, type b, type c) {
+#ifdef __FMA__
+        return _mm_fmadd_ps(a, b, c);
+#else
+        return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+    }
     
     // Comparisons
     struct GT : public ImageStack::Scalar::GT {
@@ -5,6 +5,10 @@
 #include "Arithmetic.h"
 #include "Statistics.h"
 #include "Filter.h"
+#include "Geometry.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
 namespace {
@@ -48,6 +52,8 @@ void Load::help() {
     printf("\n");
     FileTMP::help();
     printf("\n");
+    FileCTMP::help();
+    printf("\n");
     FileHDR::help();
     printf("\n");
     FileJPG::help();
@@ -81,6 +87,7 @@ bool Load::test() {
     Quantize::apply(a, 1.0/256);
 
     testFormat(a, "tmp");
+    if (!testFormat(a, "ctmp")) return false;
 
     // tmp is the only multi-frame format, so now we switch to a single frame
     a = a.frame(0);
@@ -128,6 +135,8 @@ void Load::parse(vector<string> args) {
 Image Load::apply(string filename) {
     if (suffixMatch(filename, ".tmp")) {
         return FileTMP::load(filename);
+    } else if (suffixMatch(filename, ".ctmp")) {
+        return FileCTMP::load(filename);
     } else if (suffixMatch(filename, ".hdr")) {
         return FileHDR::load(filename);
     } else if (suffixMatch(filename, ".jpg") ||
@@ -161,6 +170,53 @@ Image Load::apply(string filename) {
     return Image();
 }
 
+void Load::apply(string filename, Image into) {
+    // jpegs and pngs can be decoded in place, everything else goes
+    // via a temporary
+    if (suffixMatch(filename, ".jpg") ||
+        suffixMatch(filename, ".jpeg")) {
+        FileJPG::load(filename, into);
+    } else if (suffixMatch(filename, ".png")) {
+        FilePNG::load(filename, into);
+    } else {
+        Image im = apply(filename);
+        assert(im.width == into.width &&
+               im.height == into.height &&
+               im.frames == into.frames &&
+               im.channels == into.channels,
+               "%s does not match the size of the image it is being loaded into\n", filename.c_str());
+        into.set(im);
+    }
+}
+
+namespace {
+// Load the files after the first into the frames or channels of an
+// image in parallel. Each thread decodes one file at a time, so at most
+// one file per thread is in flight.
+void loadSlices(const vector<string> &files, Image result, bool frames) {
+    // Exceptions can't propagate out of a parallel loop, so we catch
+    // them and rethrow the first one once the loop is done.
+    bool failed = false;
+    Exception failure("");
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int i = 1; i < (int)files.size(); i++) {
+        try {
+            Load::apply(files[i], frames ? result.frame(i) : result.channel(i));
+        } catch (Exception &e) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            if (!failed) { failed = true; failure = e; }
+        }
+    }
+
+    if (failed) { throw failure; }
+}
+}
+
 void LoadFrames::help() {
     printf("\n-loadframes accepts a sequence of images and loads them as the frames of a\n"
            "single stack entry. See the help for -load for details on file formats.\n\n"
@@ -195,21 +251,13 @@ void LoadFrames::parse(vector<string> args) {
 Image LoadFrames::apply(vector<string> args) {
     assert(args.size() > 0, "-loadframes requires at least one file argument.\n");
 
+    // The first file tells us the size of the output
     Image im = Load::apply(args[0]);
     assert(im.frames == 1, "-loadframes can only load many single frame images\n");
     Image result(im.width, im.height, (int)args.size(), im.channels);
     result.frame(0).set(im);
 
-    for (size_t i = 1; i < args.size(); i++) {
-        im = Load::apply(args[i]);
-        // check dimensions and channels match
-        assert(im.frames == 1, "-loadframes can only load many single frame images\n");
-        assert((im.width == result.width) &&
-               (im.height == result.height) &&
-               (im.channels == result.channels),
-               "-loadframes can only load file sequences of matching width, height, and channel count\n");
-        result.frame(i).set(im);
-    }
+    loadSlices(args, result, true);
 
     return result;
 }
@@ -247,26 +295,78 @@ void LoadChannels::parse(vector<string> args) {
 Image LoadChannels::apply(vector<string> args) {
     assert(args.size() > 0, "-loadchannels requires at least one file argument.\n");
 
+    // The first file tells us the size of the output
     Image im = Load::apply(args[0]);
     assert(im.channels == 1, "-loadchannels can only load many single channel images\n");
     Image result(im.width, im.height, im.frames, (int)args.size());
     result.channel(0).set(im);
 
-    for (size_t i = 1; i < args.size(); i++) {
-        im = Load::apply(args[i]);
-        // check dimensions and channels match
-        assert(im.channels == 1, "-loadchannels can only load many single frame images\n");
-        assert((im.width == result.width) &&
-               (im.height == result.height) &&
-               (im.frames == result.frames),
-               "-loadchannels can only load file sequences of matching size\n");
-        result.channel(i).set(im);
-    }
+    loadSlices(args, result, false);
 
     return result;
 }
 
 
+void LoadScaled::help() {
+    pprintf("-loadscaled loads a file and resamples it to the given width and"
+            " height. If either is zero, it is chosen to preserve the aspect"
+            " ratio. Jpegs are first decoded at the smallest of 1/2, 1/4, or 1/8"
+            " size that is still at least as large as the target, which is much"
+            " faster than decoding them at full size. The rest of the way is done"
+            " with the same filter as -resample.\n"
+            "\n"
+            "Usage: ImageStack -loadscaled photo.jpg 256 0 -save thumb.jpg\n");
+}
+
+bool LoadScaled::test() {
+    Image a(400, 300, 1, 3);
+    Noise::apply(a, 0, 1);
+    FastBlur::apply(a, 8, 8, 0);
+
+    string name = "_test.jpg";
+    TempFile t(name);
+    Save::apply(a, name);
+
+    Image full = Resample::apply(Load::apply(name), 90, 60);
+    Image b = LoadScaled::apply(name, 90, 0);
+    if (b.width != 90 || b.height != 68) return false;
+    b = LoadScaled::apply(name, 90, 60);
+    if (b.width != 90 || b.height != 60) return false;
+
+    // The DCT-domain downscale won't match exactly, but should be close
+    return Stats(b - full).variance() < 0.0001 &&
+           fabs(Stats(b).mean() - Stats(full).mean()) < 0.01;
+}
+
+void LoadScaled::parse(vector<string> args) {
+    assert(args.size() == 3, "-loadscaled takes three arguments\n");
+    push(apply(args[0], readInt(args[1]), readInt(args[2])));
+}
+
+Image LoadScaled::apply(string filename, int width, int height) {
+    assert(width >= 0 && height >= 0 && (width > 0 || height > 0),
+           "-loadscaled needs a positive width or height\n");
+
+    Image im;
+    if (suffixMatch(filename, ".jpg") ||
+        suffixMatch(filename, ".jpeg")) {
+        // Leave the unconstrained dimension free for the scaled decode
+        im = FileJPG::loadScaled(filename, width, height);
+    } else {
+        im = Load::apply(filename);
+    }
+
+    if (width == 0) {
+        width = max(1, (int)(height * (float)im.width / im.height + 0.5f));
+    } else if (height == 0) {
+        height = max(1, (int)(width * (float)im.height / im.width + 0.5f));
+    }
+
+    if (im.width == width && im.height == height) return im;
+    return Resample::apply(im, width, height);
+}
+
+
 void Save::help() {
     printf("\n-save stores the image at the top of the stack to a file. The stack is not\n"
            "altered. The following file formats are supported:\n\n");
@@ -274,6 +374,8 @@ void Save::help() {
     printf("\n");
     FileTMP::help();
     printf("\n");
+    FileCTMP::help();
+    printf("\n");
     FileHDR::help();
     printf("\n");
     FileJPG::help();
@@ -310,8 +412,8 @@ bool Save::test() {
 
 void Save::parse(vector<string> args) {
     assert(args.size() == 1 || args.size() == 2, "-save requires exactly one or two arguments\n");
-    if (args.size() == 1) { apply(stack(0), args[0], ""); }
-    else if (args.size() == 2) { apply(stack(0), args[0], args[1]); }
+    if (args.size() == 1) { apply(peek(0), args[0], ""); }
+    else if (args.size() == 2) { apply(peek(0), args[0], args[1]); }
 }
 
 
@@ -319,6 +421,8 @@ void Save::apply(Image im, string filename, string arg) {
     if (suffixMatch(filename, ".tmp")) {
         if (arg == "") { arg = "float32"; }
         FileTMP::save(im, filename, arg);
+    } else if (suffixMatch(filename, ".ctmp")) {
+        FileCTMP::save(im, filename, arg);
     } else if (suffixMatch(filename, ".hdr")) {
         FileHDR::save(im, filename);
     } else if (suffixMatch(filename, ".jpg") ||
@@ -361,6 +465,245 @@ void Save::apply(Image im, string filename, string arg) {
     }
 }
 
+RowReader *openRowReader(string filename) {
+    if (suffixMatch(filename, ".tmp")) {
+        return FileTMP::openReader(filename);
+    } else if (suffixMatch(filename, ".jpg") ||
+               suffixMatch(filename, ".jpeg")) {
+        return FileJPG::openReader(filename);
+    } else if (suffixMatch(filename, ".png")) {
+        return FilePNG::openReader(filename);
+    } else if (suffixMatch(filename, ".ppm") ||
+               suffixMatch(filename, ".pgm")) {
+        return FilePPM::openReader(filename);
+    }
+
+    panic("Can't stream rows from %s. Only jpg, png, ppm, pgm, and tmp files can be streamed.\n",
+          filename.c_str());
+    return NULL;
+}
+
+RowWriter *openRowWriter(string filename, int width, int height, int frames, int channels, string arg) {
+    if (suffixMatch(filename, ".tmp")) {
+        if (arg == "") { arg = "float32"; }
+        return FileTMP::openWriter(filename, width, height, frames, channels, arg);
+    }
+
+    assert(frames == 1, "Can only stream multiple frames to tmp files\n");
+    if (suffixMatch(filename, ".jpg") ||
+        suffixMatch(filename, ".jpeg")) {
+        return FileJPG::openWriter(filename, width, height, channels, arg == "" ? 90 : readInt(arg));
+    } else if (suffixMatch(filename, ".png")) {
+        return FilePNG::openWriter(filename, width, height, channels, arg == "" ? 8 : readInt(arg));
+    } else if (suffixMatch(filename, ".ppm") ||
+               suffixMatch(filename, ".pgm")) {
+        return FilePPM::openWriter(filename, width, height, channels, arg == "" ? 16 : readInt(arg));
+    }
+
+    panic("Can't stream rows to %s. Only jpg, png, ppm, pgm, and tmp files can be streamed.\n",
+          filename.c_str());
+    return NULL;
+}
+
+void Stream::help() {
+    pprintf("-stream loads a file a band of rows at a time, runs a sequence of"
+            " commands on each band, and saves the results to another file as"
+            " they are produced. Loading, processing, and saving of consecutive"
+            " bands overlap, and only a few bands are in memory at once, so"
+            " large images can be processed in little memory. The commands"
+            " must only use the rows they are given (e.g. pointwise arithmetic"
+            " and color conversions), see each band as an image of its own"
+            " (so y coordinates start at zero in every band), must replace the top of the stack with"
+            " a single result, and must not change the number of rows. Like"
+            " -loop, the commands are prefixed with an extra dash. The first"
+            " two arguments are the input and output file names, and an optional"
+            " third argument is passed to the output format as with -save. Only"
+            " jpg, png, ppm, pgm, and tmp files can be streamed.\n"
+            "\n"
+            "Usage: ImageStack -stream in.jpg out.png 16 --gamma 0.5 --scale 2\n");
+}
+
+bool Stream::test() {
+    Image a(123, 234, 1, 3);
+    Noise::apply(a, 0, 1);
+    FastBlur::apply(a, 1, 1, 0);
+
+    TempFile in("_test_in.tmp"), out("_test_out.tmp");
+    Save::apply(a, in.name);
+    vector<string> commands;
+    commands.push_back("-eval");
+    commands.push_back("val*2+x");
+    Stream::apply(in.name, out.name, "", commands);
+    Image correct = a*2;
+    for (int y = 0; y < a.height; y++) {
+        for (int x = 0; x < a.width; x++) {
+            for (int c = 0; c < a.channels; c++) {
+                correct(x, y, c) += x;
+            }
+        }
+    }
+    if (!nearlyEqual(Load::apply(out.name), correct)) return false;
+
+    // Streaming through each codec should give the same file as
+    // loading and saving it whole
+    commands.clear();
+    const char *formats[] = {"jpg", "png", "ppm"};
+    for (int i = 0; i < 3; i++) {
+        TempFile src(string("_test_src.") + formats[i]);
+        TempFile whole(string("_test_whole.") + formats[i]);
+        TempFile streamed(string("_test_streamed.") + formats[i]);
+        Save::apply(a, src.name);
+        Save::apply(Load::apply(src.name), whole.name);
+        Stream::apply(src.name, streamed.name, "", commands);
+        if (!nearlyEqual(Load::apply(whole.name), Load::apply(streamed.name))) return false;
+    }
+
+    return true;
+}
+
+void Stream::parse(vector<string> args) {
+    size_t fileArgs = 0;
+    while (fileArgs < args.size() &&
+           !(args[fileArgs].size() > 2 && args[fileArgs][0] == '-' && args[fileArgs][1] == '-')) {
+        fileArgs++;
+    }
+    assert(fileArgs == 2 || fileArgs == 3, "-stream takes an input file, an output file, "
+           "an optional output argument, and then a sequence of commands\n");
+
+    vector<string> commands;
+    for (size_t i = fileArgs; i < args.size(); i++) {
+        if (args[i].size() > 1 && args[i][0] == '-' && args[i][1] == '-') {
+            commands.push_back(args[i].substr(1, args[i].size() - 1));
+        } else {
+            commands.push_back(args[i]);
+        }
+    }
+
+    apply(args[0], args[1], fileArgs == 3 ? args[2] : "", commands);
+}
+
+void Stream::apply(string input, string output, string arg, vector<string> commands) {
+    const int bandHeight = 64;
+
+    RowReader *reader = openRowReader(input);
+    RowWriter *writer = NULL;
+
+    // Bands never straddle frames
+    vector<int> bandFrame, bandY;
+    for (int t = 0; t < reader->frames; t++) {
+        for (int y = 0; y < reader->height; y += bandHeight) {
+            bandFrame.push_back(t);
+            bandY.push_back(y);
+        }
+    }
+    const int bands = (int)bandFrame.size();
+
+    // Band k is read at step k, processed at step k+1, and written at
+    // step k+2, so three bands are in flight at once. The commands
+    // manipulate the stack, so they all run on one thread, but they
+    // can still use their own threads for the work.
+    Image in[2], out[2];
+    int outWidth = 0, outChannels = 0;
+
+    // Exceptions can't propagate out of a parallel region, so we catch
+    // them and rethrow the first one once the pipeline stops.
+    bool failed = false;
+    Exception failure("");
+
+    #ifdef _OPENMP
+    int oldLevels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+    #endif
+
+    for (int step = 0; step < bands + 2 && !failed; step++) {
+        #ifdef _OPENMP
+        #pragma omp parallel sections num_threads(3)
+        #endif
+        {
+            #ifdef _OPENMP
+            #pragma omp section
+            #endif
+            if (step < bands) {
+                try {
+                    int h = min(bandHeight, reader->height - bandY[step]);
+                    in[step % 2] = Image(reader->width, h, 1, reader->channels);
+                    reader->read(in[step % 2]);
+                } catch (Exception &e) {
+                    #ifdef _OPENMP
+                    #pragma omp critical
+                    #endif
+                    if (!failed) { failed = true; failure = e; }
+                }
+            }
+
+            #ifdef _OPENMP
+            #pragma omp section
+            #endif
+            if (step >= 1 && step <= bands) {
+                try {
+                    Image band = in[(step - 1) % 2];
+                    push(band);
+                    parseCommands(commands);
+                    Image result = stack(0);
+                    pop();
+                    assert(result.height == band.height && result.frames == 1,
+                           "The commands given to -stream must not change the number of rows or frames\n");
+                    if (step == 1) {
+                        outWidth = result.width;
+                        outChannels = result.channels;
+                    }
+                    assert(result.width == outWidth && result.channels == outChannels,
+                           "The commands given to -stream must produce bands of the same size\n");
+                    out[(step - 1) % 2] = result;
+                } catch (Exception &e) {
+                    #ifdef _OPENMP
+                    #pragma omp critical
+                    #endif
+                    if (!failed) { failed = true; failure = e; }
+                }
+            }
+
+            #ifdef _OPENMP
+            #pragma omp section
+            #endif
+            if (step >= 2) {
+                try {
+                    Image band = out[step % 2];
+                    if (!writer) {
+                        writer = openRowWriter(output, band.width, reader->height,
+                                               reader->frames, band.channels, arg);
+                    }
+                    writer->write(band);
+                } catch (Exception &e) {
+                    #ifdef _OPENMP
+                    #pragma omp critical
+                    #endif
+                    if (!failed) { failed = true; failure = e; }
+                }
+            }
+        }
+    }
+
+    #ifdef _OPENMP
+    omp_set_max_active_levels(oldLevels);
+    #endif
+
+    if (!failed && writer) {
+        try {
+            writer->finish();
+        } catch (Exception &e) {
+            failed = true;
+            failure = e;
+        }
+    }
+
+    delete reader;
+    delete writer;
+
+    if (failed) { throw failure; }
+}
+
+
 void SaveFrames::help() {
     printf("\n-saveframes takes a printf style format argument, and saves all the frames in\n"
            "the current image as separate files. See the help for save for details on file\n"
@@ -377,9 +720,9 @@ bool SaveFrames::test() {
 void SaveFrames::parse(vector<string> args) {
     assert(args.size() == 1 || args.size() == 2, "-saveframes takes one or two arguments.\n");
     if (args.size() == 1) {
-        apply(stack(0), args[0], "");
+        apply(peek(0), args[0], "");
     } else {
-        apply(stack(0), args[0], args[1]);
+        apply(peek(0), args[0], args[1]);
     }
 }
 
@@ -416,9 +759,9 @@ bool SaveChannels::test() {
 void SaveChannels::parse(vector<string> args) {
     assert(args.size() == 1 || args.size() == 2, "-savechannels takes one or two arguments.\n");
     if (args.size() == 1) {
-        apply(stack(0), args[0], "");
+        apply(peek(0), args[0], "");
     } else {
-        apply(stack(0), args[0], args[1]);
+        apply(peek(0), args[0], args[1]);
     }
 }
 
@@ -440,7 +783,8 @@ void LoadBlock::help() {
             " given, all frames are used and the arguments specify x and y. If three"
             " arguments are given, they specify frames and all x, y, and channels"
             " are loaded. Loading out of bounds from the tmp file is"
-            " permitted. Undefined areas will be zero-filled.\n\n"
+            " permitted. Undefined areas will be zero-filled. For .ctmp files only the"
+            " chunks overlapping the block are read and decompressed.\n\n"
             "This example multiplies a 512x512x128x3 volume by two, without ever loading it\n"
             "all into memory:\n"
             "ImageStack -loadblock foo.tmp 0 0 0 0 512 512 64 3 \\\n"
@@ -469,7 +813,45 @@ bool LoadBlock::test() {
     // Check other regions are zero
     b = LoadBlock::apply(f.name, 130, 0, 0, 0, 50, 50, 5, 5);
     Stats s(b);
-    return (s.mean() == 0 && s.variance() == 0);
+    if (s.mean() != 0 || s.variance() != 0) return false;
+
+    // The same again with a chunked file, using chunks that the block
+    // straddles
+    TempFile g(string("_test") + ".ctmp");
+    CreateTmp::apply(g.name, 234, 342, 5, 5);
+    SaveBlock::apply(a, g.name, 4, 3, 2, 1);
+    b = LoadBlock::apply(g.name, 4, 3, 2, 1, 123, 234, 3, 3);
+    if (!nearlyEqual(a, b)) return false;
+    b = LoadBlock::apply(g.name, 130, 0, 0, 0, 50, 50, 5, 5);
+    Stats s2(b);
+    if (s2.mean() != 0 || s2.variance() != 0) return false;
+
+    // Overwrite part of the block, growing some chunks and shrinking
+    // others, and check the rest of the block survived
+    Image c(100, 100, 5, 1);
+    Noise::apply(c, -1, 1);
+    c.region(0, 0, 0, 0, 100, 50, 5, 1).set(0);
+    SaveBlock::apply(c, g.name, 50, 60, 0, 2);
+    b = LoadBlock::apply(g.name, 0, 0, 0, 0, -1, -1, -1, -1);
+    if (!nearlyEqual(b.region(50, 60, 0, 2, 100, 100, 5, 1), c)) return false;
+    if (!nearlyEqual(b.region(4, 3, 2, 1, 123, 234, 3, 1), a.channel(0))) return false;
+    if (!nearlyEqual(b.region(4, 3, 2, 3, 123, 234, 3, 1), a.channel(2))) return false;
+    if (!nearlyEqual(b.region(4, 3, 2, 2, 46, 234, 3, 1),
+                     a.region(0, 0, 0, 1, 46, 234, 3, 1))) return false;
+
+    // Save a block that partly covers chunks of a fresh file, and
+    // check everything around it reads back as zero
+    TempFile h(string("_test") + ".ctmp");
+    CreateTmp::apply(h.name, 256, 256, 1, 1);
+    Image d(100, 100, 1, 1);
+    d.set(5);
+    SaveBlock::apply(d, h.name, 10, 10, 0, 0);
+    b = LoadBlock::apply(h.name, 0, 0, 0, 0, -1, -1, -1, -1);
+    Stats s3(b.region(10, 10, 0, 0, 100, 100, 1, 1));
+    if (s3.minimum() != 5 || s3.maximum() != 5) return false;
+    b.region(10, 10, 0, 0, 100, 100, 1, 1).set(0);
+    Stats s4(b);
+    return s4.minimum() == 0 && s4.maximum() == 0;
 }
 
 void LoadBlock::parse(vector<string> args) {
@@ -518,6 +900,11 @@ void fread_(void *ptr, size_t size, size_t n, FILE *f) {
 
 Image LoadBlock::apply(string filename, int xoff, int yoff, int toff, int coff,
                        int width, int height, int frames, int channels) {
+    if (suffixMatch(filename, ".ctmp")) {
+        return FileCTMP::loadBlock(filename, xoff, yoff, toff, coff,
+                                   width, height, frames, channels);
+    }
+
     // peek in the header
 
     struct {
@@ -589,7 +976,8 @@ void SaveBlock::help() {
             " the filename, followed by the offset at which to paste the volume in"
             " x, y, t, and c. When given four arguments c is assumed to be"
             " zero. When given three arguments t is also set to zero. With two"
-            " arguments, x, y, and c are set to zero.\n\n"
+            " arguments, x, y, and c are set to zero. For .ctmp files only the"
+            " chunks overlapping the volume are rewritten.\n\n"
             "This example multiplies a 128x512x512x3 volume by two, without ever loading it\n"
             "all into memory:\n"
             "ImageStack -loadblock foo.tmp 0 0 0 0 64 512 512 3 \\\n"
@@ -623,10 +1011,15 @@ void SaveBlock::parse(vector<string> args) {
         panic("-saveblock takes 2 to 5 arguments\n");
     }
 
-    SaveBlock::apply(stack(0), args[0], x, y, t, c);
+    SaveBlock::apply(peek(0), args[0], x, y, t, c);
 }
 
 void SaveBlock::apply(Image im, string filename, int xoff, int yoff, int toff, int coff) {
+    if (suffixMatch(filename, ".ctmp")) {
+        FileCTMP::saveBlock(im, filename, xoff, yoff, toff, coff);
+        return;
+    }
+
     // Peek in the header
     struct {
         int width, height, frames, channels, type;
@@ -684,7 +1077,8 @@ void CreateTmp::help() {
             " dimensions. It can be used to create tmp files larger than can fit in"
             " memory. The five arguments are the filename, width, height, frames and"
             " channels. If only four arguments are specified, frames is assumed to"
-            " be one.\n\n"
+            " be one. If the filename ends in .ctmp, a chunked compressed file is"
+            " created instead, which takes almost no space until written to.\n\n"
             "The following example creates a giant volume, and fills some of it with noise:\n"
             "ImageStack -createtmp volume.tmp 1024 1024 1024 1 \\\n"
             "           -push 256 256 256 1 -noise \\\n"
@@ -720,6 +1114,10 @@ void CreateTmp::apply(string filename, int width, int height, int frames, int ch
     assert(frames > 0 && width > 0 && height > 0 && channels > 0,
            "Some of the specified dimensions are less than 1\n");
 
+    if (suffixMatch(filename, ".ctmp")) {
+        FileCTMP::create(filename, width, height, frames, channels);
+        return;
+    }
 
     FILE *f = fopen(filename.c_str(), "wb");
     assert(f, "Could not open/create file %s\n", filename.c_str());
@@ -865,21 +1263,21 @@ void SaveArray::parse(vector<string> args) {
     string filename = args[0];
     string type = args[1];
     if (type == "int8" || type == "char") {
-        apply<int8_t>(stack(0), filename);
+        apply<int8_t>(peek(0), filename);
     } else if (type == "uint8" || type == "unsigned char") {
-        apply<uint8_t>(stack(0), filename);
+        apply<uint8_t>(peek(0), filename);
     } else if (type == "int16" || type == "short") {
-        apply<int16_t>(stack(0), filename);
+        apply<int16_t>(peek(0), filename);
     } else if (type == "uint16" || type == "unsigned short") {
-        apply<uint16_t>(stack(0), filename);
+        apply<uint16_t>(peek(0), filename);
     } else if (type == "int32" || type == "int") {
-        apply<int32_t>(stack(0), filename);
+        apply<int32_t>(peek(0), filename);
     } else if (type == "uint32" || type == "unsigned int") {
-        apply<uint32_t>(stack(0), filename);
+        apply<uint32_t>(peek(0), filename);
     } else if (type == "float32" || type == "float") {
-        apply<float>(stack(0), filename);
+        apply<float>(peek(0), filename);
     } else if (type == "float64" || type == "double") {
-        apply<double>(stack(0), filename);
+        apply<double>(peek(0), filename);
     } else {
         panic("Unknown type %s\n", type.c_str());
     }
@@ -8,6 +8,8 @@ public:
     bool test();
     void parse(vector<string> args);
     static Image apply(string filename);
+    // Load a file into an existing image of the same size
+    static void apply(string filename, Image into);
 };
 
 class LoadFrames : public Operation {
@@ -26,6 +28,14 @@ public:
     static Image apply(vector<string> args);
 };
 
+class LoadScaled : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static Image apply(string filename, int width, int height);
+};
+
 class Save : public Operation {
 public:
     void help();
@@ -50,6 +60,14 @@ public:
     static void apply(Image im, string pattern, string arg = "");
 };
 
+class Stream : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(string input, string output, string arg, vector<string> commands);
+};
+
 class LoadBlock : public Operation {
 public:
     void help();
@@ -95,6 +113,33 @@ public:
     static void apply(Image im, string filename);
 };
 
+// Streaming access to the formats that can be read or written a band
+// of rows at a time: jpg, png, ppm/pgm, and tmp. Rows are numbered
+// through the frames in order, so a multi-frame tmp file is streamed
+// one frame after another.
+class RowReader {
+public:
+    virtual ~RowReader() {}
+    // Read the next rows.height rows into rows, which must be a single
+    // frame with the same width and channel count as the file.
+    virtual void read(Image rows) = 0;
+    int width, height, frames, channels;
+};
+
+class RowWriter {
+public:
+    virtual ~RowWriter() {}
+    // Write the next rows.height rows
+    virtual void write(Image rows) = 0;
+    // Complete the file once every row has been written
+    virtual void finish() = 0;
+};
+
+// The optional argument is the same as for Save::apply
+RowReader *openRowReader(string filename);
+RowWriter *openRowWriter(string filename, int width, int height, int frames, int channels,
+                         string arg = "");
+
 namespace FileEXR {
 void help();
 Image load(string filename);
@@ -117,18 +162,29 @@ namespace FileJPG {
 void help();
 void save(Image im, string filename, int quality);
 Image load(string filename);
+void load(string filename, Image into);
+// Decode at 1/2, 1/4, or 1/8 size, whichever is smallest while
+// still being at least minWidth by minHeight
+Image loadScaled(string filename, int minWidth, int minHeight);
+RowReader *openReader(string filename);
+RowWriter *openWriter(string filename, int width, int height, int channels, int quality);
 }
 
 namespace FilePNG {
 void help();
 Image load(string filename);
+void load(string filename, Image into);
  void save(Image im, string filename, int bits);
+RowReader *openReader(string filename);
+RowWriter *openWriter(string filename, int width, int height, int channels, int bits);
 }
 
 namespace FilePPM {
 void help();
 Image load(string filename);
 void save(Image im, string filename, int depth);
+RowReader *openReader(string filename);
+RowWriter *openWriter(string filename, int width, int height, int channels, int depth);
 }
 
 namespace FilePGM {
@@ -158,6 +214,18 @@ namespace FileTMP {
 void help();
 void save(Image im, string filename, string type);
 Image load(string filename);
+RowReader *openReader(string filename);
+RowWriter *openWriter(string filename, int width, int height, int frames, int channels, string type);
+}
+
+namespace FileCTMP {
+void help();
+void save(Image im, string filename, string chunkSize);
+Image load(string filename);
+void create(string filename, int width, int height, int frames, int channels);
+Image loadBlock(string filename, int x, int y, int t, int c,
+                int width, int height, int frames, int channels);
+void saveBlock(Image im, string filename, int x, int y, int t, int c);
 }
 
 namespace FileYUV {
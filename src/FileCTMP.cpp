@@ -0,0 +1,536 @@
+#include "main.h"
+#include "File.h"
+#include <stdint.h>
+#include <string.h>
+namespace ImageStack {
+
+// 64 bit systems may not have fseeko. In this case fseek is just fine.
+#ifndef fseeko
+#define fseeko fseek
+#endif
+#ifndef ftello
+#define ftello ftell
+#endif
+
+namespace FileCTMP {
+
+void help() {
+    pprintf(".ctmp files. This is a chunked, compressed variant of .tmp intended"
+            " for volumes too large to comfortably hold in memory. The image is"
+            " cut into fixed size chunks (64x64x16x1 by default) which are"
+            " compressed independently, so -loadblock and -saveblock on a .ctmp"
+            " file only read or rewrite the chunks they touch. Each chunk is"
+            " stored as 32-bit floats with their bytes shuffled into planes and"
+            " then compressed with a fast LZ77 coder. Chunks that are entirely"
+            " zero take no space, so -createtmp can create a .ctmp file of any"
+            " size instantly. When saving, an optional second argument gives"
+            " the chunk size as WxHxF or WxHxFxC.\n");
+}
+
+namespace {
+
+// The file starts with this header, followed by one Entry per chunk
+// (x varying fastest, then y, t, and c), followed by the chunk data.
+struct Header {
+    int32_t magic;
+    int32_t width, height, frames, channels;
+    int32_t chunkWidth, chunkHeight, chunkFrames, chunkChannels;
+};
+
+struct Entry {
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t codec;
+};
+
+enum Codec {Empty = 0, Raw, ShuffleLZ};
+
+const int32_t MAGIC = 0x544d5443; // "CTMT"
+
+void fread_(void *ptr, size_t size, size_t n, FILE *f) {
+    assert(fread(ptr, size, n, f) == n, "Unexpected end of file\n");
+}
+
+void fwrite_(const void *ptr, size_t size, size_t n, FILE *f) {
+    assert(fwrite(ptr, size, n, f) == n, "Could not write to file\n");
+}
+
+// An LZ77 coder using an LZ4-style sequence layout: a token byte
+// holding the literal count and the match length minus four (four
+// bits each, with 15 meaning more length bytes follow), the literals,
+// then a 16-bit match offset. The final sequence is literals only.
+void putLength(vector<unsigned char> &out, size_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back((unsigned char)len);
+}
+
+void putSequence(vector<unsigned char> &out, const unsigned char *literals,
+                 size_t lit, size_t offset, size_t match) {
+    size_t ml = match ? match - 4 : 0;
+    out.push_back((unsigned char)((min(lit, (size_t)15) << 4) | min(ml, (size_t)15)));
+    if (lit >= 15) putLength(out, lit - 15);
+    out.insert(out.end(), literals, literals + lit);
+    if (!match) return;
+    out.push_back((unsigned char)(offset & 255));
+    out.push_back((unsigned char)(offset >> 8));
+    if (ml >= 15) putLength(out, ml - 15);
+}
+
+void lzCompress(const unsigned char *src, size_t n, vector<unsigned char> &out) {
+    const int hashBits = 14;
+    vector<int64_t> table(1 << hashBits, -1);
+    out.clear();
+    out.reserve(n/2);
+
+    size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - hashBits);
+        int64_t cand = table[h];
+        table[h] = (int64_t)i;
+        if (cand >= 0 && i - cand <= 65535 && memcmp(src + cand, src + i, 4) == 0) {
+            size_t len = 4;
+            while (i + len < n && src[cand + len] == src[i + len]) len++;
+            putSequence(out, src + anchor, i - anchor, i - cand, len);
+            i += len;
+            anchor = i;
+        } else {
+            // Step faster through data that isn't compressing
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    putSequence(out, src + anchor, n - anchor, 0, 0);
+}
+
+size_t getLength(const unsigned char *src, size_t n, size_t &ip) {
+    size_t len = 0;
+    unsigned char b;
+    do {
+        assert(ip < n, "Corrupt chunk in .ctmp file\n");
+        b = src[ip++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// The destination must have room for COPY_SLACK bytes past dstLen, so
+// that short copies can be done in whole words.
+const size_t COPY_SLACK = 16;
+
+void lzDecompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dstLen) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        unsigned token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) lit += getLength(src, n, ip);
+        assert(ip + lit <= n && op + lit <= dstLen, "Corrupt chunk in .ctmp file\n");
+        if (lit < 16 && ip + 16 <= n) {
+            memcpy(dst + op, src + ip, 16);
+        } else {
+            memcpy(dst + op, src + ip, lit);
+        }
+        ip += lit;
+        op += lit;
+        if (ip == n) break;
+
+        assert(ip + 2 <= n, "Corrupt chunk in .ctmp file\n");
+        size_t offset = src[ip] | (src[ip+1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15) match += getLength(src, n, ip);
+        match += 4;
+        assert(offset > 0 && offset <= op && op + match <= dstLen,
+               "Corrupt chunk in .ctmp file\n");
+        // Matches may overlap their own output. Word copies are safe as
+        // long as each word is read before it is written.
+        unsigned char *d = dst + op;
+        const unsigned char *s = d - offset;
+        if (offset >= 8) {
+            for (size_t k = 0; k < match; k += 8) memcpy(d + k, s + k, 8);
+        } else {
+            for (size_t k = 0; k < match; k++) d[k] = s[k];
+        }
+        op += match;
+    }
+    assert(op == dstLen, "Corrupt chunk in .ctmp file\n");
+}
+
+// Compress n floats into out, returning the codec used. The scratch
+// buffer is reused across calls to avoid reallocating it per chunk.
+Codec encode(const float *data, size_t n, vector<unsigned char> &out,
+             vector<unsigned char> &shuffled) {
+    bool zero = true;
+    for (size_t i = 0; i < n && zero; i++) {
+        zero = (data[i] == 0);
+    }
+    if (zero) {
+        out.clear();
+        return Empty;
+    }
+
+    // Shuffle the bytes of each float into four planes. The sign and
+    // exponent bytes of neighboring samples tend to match.
+    const uint32_t *words = (const uint32_t *)data;
+    shuffled.resize(n * 4);
+    unsigned char *p0 = &shuffled[0], *p1 = p0 + n, *p2 = p1 + n, *p3 = p2 + n;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t w = words[i];
+        p0[i] = (unsigned char)w;
+        p1[i] = (unsigned char)(w >> 8);
+        p2[i] = (unsigned char)(w >> 16);
+        p3[i] = (unsigned char)(w >> 24);
+    }
+
+    lzCompress(&shuffled[0], n*4, out);
+    if (out.size() < n*4) return ShuffleLZ;
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    out.assign(bytes, bytes + n*4);
+    return Raw;
+}
+
+void decode(const vector<unsigned char> &in, Codec codec, float *data, size_t n,
+            vector<unsigned char> &shuffled) {
+    if (codec == Empty) {
+        memset(data, 0, n * sizeof(float));
+    } else if (codec == Raw) {
+        assert(in.size() == n*4, "Corrupt chunk in .ctmp file\n");
+        memcpy(data, &in[0], n * sizeof(float));
+    } else if (codec == ShuffleLZ) {
+        shuffled.resize(n*4 + COPY_SLACK);
+        lzDecompress(&in[0], in.size(), &shuffled[0], n*4);
+        const unsigned char *p0 = &shuffled[0], *p1 = p0 + n, *p2 = p1 + n, *p3 = p2 + n;
+        uint32_t *words = (uint32_t *)data;
+        for (size_t i = 0; i < n; i++) {
+            words[i] = (p0[i] | (p1[i] << 8) | (p2[i] << 16) | ((uint32_t)p3[i] << 24));
+        }
+    } else {
+        panic("Unknown chunk encoding %d in .ctmp file\n", (int)codec);
+    }
+}
+
+// An open .ctmp file and its chunk index
+class Volume {
+public:
+    Header header;
+    vector<Entry> index;
+    int chunksX, chunksY, chunksT, chunksC;
+
+    Volume(string filename, bool writable) {
+        f = fopen(filename.c_str(), writable ? "rb+" : "rb");
+        assert(f, "Could not open file: %s\n", filename.c_str());
+        try {
+            fread_(&header, sizeof(Header), 1, f);
+            assert(header.magic == MAGIC, "%s is not a .ctmp file\n", filename.c_str());
+            assert(header.width > 0 && header.height > 0 &&
+                   header.frames > 0 && header.channels > 0 &&
+                   header.chunkWidth > 0 && header.chunkHeight > 0 &&
+                   header.chunkFrames > 0 && header.chunkChannels > 0,
+                   "Invalid dimensions in the header of %s\n", filename.c_str());
+            setup();
+            fread_(&index[0], sizeof(Entry), index.size(), f);
+        } catch (...) {
+            fclose(f);
+            throw;
+        }
+    }
+
+    // Create a new file in which every chunk is empty
+    Volume(string filename, Header h) : header(h) {
+        setup();
+        f = fopen(filename.c_str(), "wb+");
+        assert(f, "Could not open/create file %s\n", filename.c_str());
+        Entry empty = {0, 0, Empty};
+        std::fill(index.begin(), index.end(), empty);
+        try {
+            fwrite_(&header, sizeof(Header), 1, f);
+            fwrite_(&index[0], sizeof(Entry), index.size(), f);
+        } catch (...) {
+            fclose(f);
+            throw;
+        }
+    }
+
+    ~Volume() {
+        fclose(f);
+    }
+
+    // The region of the image covered by a chunk
+    void bounds(int i, int *x, int *y, int *t, int *c,
+                int *w, int *h, int *fr, int *ch) const {
+        *x = (i % chunksX) * header.chunkWidth;
+        i /= chunksX;
+        *y = (i % chunksY) * header.chunkHeight;
+        i /= chunksY;
+        *t = (i % chunksT) * header.chunkFrames;
+        *c = (i / chunksT) * header.chunkChannels;
+        *w = min(header.chunkWidth, header.width - *x);
+        *h = min(header.chunkHeight, header.height - *y);
+        *fr = min(header.chunkFrames, header.frames - *t);
+        *ch = min(header.chunkChannels, header.channels - *c);
+    }
+
+    // The chunks overlapping the given (clipped) region
+    vector<int> chunksIn(int x0, int y0, int t0, int c0,
+                         int x1, int y1, int t1, int c1) const {
+        vector<int> result;
+        if (x0 >= x1 || y0 >= y1 || t0 >= t1 || c0 >= c1) return result;
+        for (int c = c0 / header.chunkChannels; c <= (c1-1) / header.chunkChannels; c++) {
+            for (int t = t0 / header.chunkFrames; t <= (t1-1) / header.chunkFrames; t++) {
+                for (int y = y0 / header.chunkHeight; y <= (y1-1) / header.chunkHeight; y++) {
+                    for (int x = x0 / header.chunkWidth; x <= (x1-1) / header.chunkWidth; x++) {
+                        result.push_back(((c*chunksT + t)*chunksY + y)*chunksX + x);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    void read(int i, vector<unsigned char> &data) {
+        const Entry &e = index[i];
+        data.resize(e.bytes);
+        if (!e.bytes) return;
+        fseeko(f, e.offset, SEEK_SET);
+        fread_(&data[0], 1, e.bytes, f);
+    }
+
+    // Write a chunk in place if it fits, otherwise append it to the
+    // end of the file. Either way the index entry is updated on disk.
+    void write(int i, const vector<unsigned char> &data, Codec codec) {
+        Entry &e = index[i];
+        if (data.size() > e.bytes) {
+            fseeko(f, 0, SEEK_END);
+            e.offset = ftello(f);
+        } else if (data.size()) {
+            fseeko(f, e.offset, SEEK_SET);
+        }
+        if (data.size()) fwrite_(&data[0], 1, data.size(), f);
+        e.bytes = (uint32_t)data.size();
+        e.codec = codec;
+        fseeko(f, sizeof(Header) + (off_t)i * sizeof(Entry), SEEK_SET);
+        fwrite_(&e, sizeof(Entry), 1, f);
+    }
+
+private:
+    FILE *f;
+
+    void setup() {
+        chunksX = (header.width + header.chunkWidth - 1) / header.chunkWidth;
+        chunksY = (header.height + header.chunkHeight - 1) / header.chunkHeight;
+        chunksT = (header.frames + header.chunkFrames - 1) / header.chunkFrames;
+        chunksC = (header.channels + header.chunkChannels - 1) / header.chunkChannels;
+        index.resize((size_t)chunksX * chunksY * chunksT * chunksC);
+    }
+};
+
+Header makeHeader(int width, int height, int frames, int channels, string chunkSize) {
+    Header h = {MAGIC, width, height, frames, channels, 64, 64, 16, 1};
+    if (chunkSize != "") {
+        int n = sscanf(chunkSize.c_str(), "%dx%dx%dx%d",
+                       &h.chunkWidth, &h.chunkHeight, &h.chunkFrames, &h.chunkChannels);
+        assert(n == 3 || n == 4, "The chunk size for a .ctmp file should be of the form WxHxF or WxHxFxC\n");
+        assert(h.chunkWidth > 0 && h.chunkHeight > 0 && h.chunkFrames > 0 && h.chunkChannels > 0,
+               "Chunk dimensions must be positive\n");
+    }
+    // Chunks must fit in a 32-bit index entry
+    assert((double)h.chunkWidth * h.chunkHeight * h.chunkFrames * h.chunkChannels < (1 << 29),
+           "Chunks of size %dx%dx%dx%d are too large\n",
+           h.chunkWidth, h.chunkHeight, h.chunkFrames, h.chunkChannels);
+    return h;
+}
+
+}
+
+void create(string filename, int width, int height, int frames, int channels) {
+    Volume v(filename, makeHeader(width, height, frames, channels, ""));
+}
+
+Image loadBlock(string filename, int xoff, int yoff, int toff, int coff,
+                int width, int height, int frames, int channels) {
+    Volume v(filename, false);
+    const Header &h = v.header;
+
+    if (width    <= 0) { width    = h.width; }
+    if (height   <= 0) { height   = h.height; }
+    if (frames   <= 0) { frames   = h.frames; }
+    if (channels <= 0) { channels = h.channels; }
+
+    Image out(width, height, frames, channels);
+
+    int xmin = max(xoff, 0), xmax = min(xoff+width, (int)h.width);
+    int ymin = max(yoff, 0), ymax = min(yoff+height, (int)h.height);
+    int tmin = max(toff, 0), tmax = min(toff+frames, (int)h.frames);
+    int cmin = max(coff, 0), cmax = min(coff+channels, (int)h.channels);
+
+    vector<int> chunks = v.chunksIn(xmin, ymin, tmin, cmin, xmax, ymax, tmax, cmax);
+
+    // Reads are serial, decompression is parallel. Batching bounds the
+    // amount of compressed data held at once.
+    const int batch = 256;
+    vector<vector<unsigned char> > data(min((int)chunks.size(), batch));
+    for (size_t start = 0; start < chunks.size(); start += batch) {
+        int n = min((int)(chunks.size() - start), batch);
+        for (int j = 0; j < n; j++) {
+            v.read(chunks[start + j], data[j]);
+        }
+
+        bool failed = false;
+        Exception failure("");
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+        vector<float> chunk;
+        vector<unsigned char> scratch;
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int j = 0; j < n; j++) {
+            try {
+                int i = chunks[start + j];
+                int x, y, t, c, w, hh, fr, ch;
+                v.bounds(i, &x, &y, &t, &c, &w, &hh, &fr, &ch);
+                chunk.resize((size_t)w*hh*fr*ch);
+                decode(data[j], (Codec)v.index[i].codec, &chunk[0], chunk.size(), scratch);
+
+                // Copy the intersection with the requested block
+                int x0 = max(x, xmin), x1 = min(x + w, xmax);
+                int y0 = max(y, ymin), y1 = min(y + hh, ymax);
+                int t0 = max(t, tmin), t1 = min(t + fr, tmax);
+                int c0 = max(c, cmin), c1 = min(c + ch, cmax);
+                for (int cc = c0; cc < c1; cc++) {
+                    for (int tt = t0; tt < t1; tt++) {
+                        for (int yy = y0; yy < y1; yy++) {
+                            memcpy(&out(x0 - xoff, yy - yoff, tt - toff, cc - coff),
+                                   &chunk[(((cc - c)*fr + tt - t)*hh + yy - y)*w + x0 - x],
+                                   (x1 - x0) * sizeof(float));
+                        }
+                    }
+                }
+            } catch (Exception &e) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                {
+                    if (!failed) {
+                        failed = true;
+                        failure = e;
+                    }
+                }
+            }
+        }
+        }
+        if (failed) throw failure;
+    }
+
+    return out;
+}
+
+void saveBlock(Image im, string filename, int xoff, int yoff, int toff, int coff) {
+    Volume v(filename, true);
+    const Header &h = v.header;
+
+    int xmin = max(xoff, 0), xmax = min(xoff+im.width, (int)h.width);
+    int ymin = max(yoff, 0), ymax = min(yoff+im.height, (int)h.height);
+    int tmin = max(toff, 0), tmax = min(toff+im.frames, (int)h.frames);
+    int cmin = max(coff, 0), cmax = min(coff+im.channels, (int)h.channels);
+
+    vector<int> chunks = v.chunksIn(xmin, ymin, tmin, cmin, xmax, ymax, tmax, cmax);
+
+    // Chunks only partially covered by the image are read, decompressed,
+    // updated, and recompressed. Chunks fully covered are just compressed.
+    const int batch = 256;
+    vector<vector<unsigned char> > data(min((int)chunks.size(), batch));
+    vector<Codec> codecs(data.size());
+    vector<char> covered(data.size());
+    for (size_t start = 0; start < chunks.size(); start += batch) {
+        int n = min((int)(chunks.size() - start), batch);
+        for (int j = 0; j < n; j++) {
+            int x, y, t, c, w, hh, fr, ch;
+            v.bounds(chunks[start + j], &x, &y, &t, &c, &w, &hh, &fr, &ch);
+            covered[j] = (x >= xmin && x + w <= xmax &&
+                          y >= ymin && y + hh <= ymax &&
+                          t >= tmin && t + fr <= tmax &&
+                          c >= cmin && c + ch <= cmax);
+            if (covered[j]) data[j].clear();
+            else v.read(chunks[start + j], data[j]);
+        }
+
+        bool failed = false;
+        Exception failure("");
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+        vector<float> chunk;
+        vector<unsigned char> scratch;
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int j = 0; j < n; j++) {
+            try {
+                int i = chunks[start + j];
+                int x, y, t, c, w, hh, fr, ch;
+                v.bounds(i, &x, &y, &t, &c, &w, &hh, &fr, &ch);
+                chunk.resize((size_t)w*hh*fr*ch);
+                // Fully covered chunks had nothing read, and get
+                // entirely overwritten. Partly covered ones are always
+                // decoded, as an Empty chunk reads back as no data but
+                // must still be zeroed.
+                if (!covered[j]) {
+                    decode(data[j], (Codec)v.index[i].codec, &chunk[0], chunk.size(), scratch);
+                }
+
+                int x0 = max(x, xmin), x1 = min(x + w, xmax);
+                int y0 = max(y, ymin), y1 = min(y + hh, ymax);
+                int t0 = max(t, tmin), t1 = min(t + fr, tmax);
+                int c0 = max(c, cmin), c1 = min(c + ch, cmax);
+                for (int cc = c0; cc < c1; cc++) {
+                    for (int tt = t0; tt < t1; tt++) {
+                        for (int yy = y0; yy < y1; yy++) {
+                            memcpy(&chunk[(((cc - c)*fr + tt - t)*hh + yy - y)*w + x0 - x],
+                                   &im(x0 - xoff, yy - yoff, tt - toff, cc - coff),
+                                   (x1 - x0) * sizeof(float));
+                        }
+                    }
+                }
+                codecs[j] = encode(&chunk[0], chunk.size(), data[j], scratch);
+            } catch (Exception &e) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                {
+                    if (!failed) {
+                        failed = true;
+                        failure = e;
+                    }
+                }
+            }
+        }
+        }
+        if (failed) throw failure;
+
+        for (int j = 0; j < n; j++) {
+            v.write(chunks[start + j], data[j], codecs[j]);
+        }
+    }
+}
+
+Image load(string filename) {
+    return loadBlock(filename, 0, 0, 0, 0, -1, -1, -1, -1);
+}
+
+void save(Image im, string filename, string chunkSize) {
+    {
+        Volume v(filename, makeHeader(im.width, im.height, im.frames, im.channels, chunkSize));
+    }
+    saveBlock(im, filename, 0, 0, 0, 0);
+}
+
+}
+}
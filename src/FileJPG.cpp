@@ -1,5 +1,6 @@
 #include "main.h"
 #include "File.h"
+#include "Interleave.h"
 
 #ifdef NO_JPEG
 
@@ -11,6 +12,7 @@ namespace FileJPG {
 
 #else
 
+#include <setjmp.h>
 extern "C" {
 #include <jpeglib.h>
 }
@@ -24,93 +26,216 @@ void help() {
            "and may have either one or three channels.\n");
 }
 
-void save(Image im, string filename, int quality) {
-    assert(im.channels == 1 || im.channels == 3, "Can only save jpg images with 1 or 3 channels\n");
-    assert(im.frames == 1, "Can't save multiframe jpg images\n");
-    assert(quality > 0 && quality <= 100, "jpeg quality must lie between 1 and 100\n");
+namespace {
+// By default libjpeg exits on errors. The reader and writer jump back
+// to the most recent setjmp instead, so that they can clean up and
+// throw.
+struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void errorExit(j_common_ptr cinfo) {
+    longjmp(((ErrorManager *)cinfo->err)->jump, 1);
+}
 
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    FILE *f = fopen(filename.c_str(), "wb");
-    assert(f, "Could not open file %s\n", filename.c_str());
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, f);
-
-    cinfo.image_width = im.width;
-    cinfo.image_height = im.height;
-    cinfo.input_components = im.channels;
-    if (im.channels == 3) {
-        cinfo.in_color_space = JCS_RGB;
-    } else { // channels must be 1
-        cinfo.in_color_space = JCS_GRAYSCALE;
-    }
+string errorMessage(j_common_ptr cinfo) {
+    char buffer[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, buffer);
+    return buffer;
+}
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+class Reader : public RowReader {
+public:
+    // If a minimum size is given, libjpeg scales the image down by the
+    // largest power of two (up to 8) that keeps it at least that big
+    // while it does the inverse DCT, which is much cheaper than
+    // decoding the full image.
+    Reader(string filename, int minWidth = 0, int minHeight = 0) {
+        f = fopen(filename.c_str(), "rb");
+        assert(f, "Could not open file %s\n", filename.c_str());
+
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = errorExit;
+        jpeg_create_decompress(&cinfo);
+        if (setjmp(jerr.jump)) {
+            string message = errorMessage((j_common_ptr)&cinfo);
+            jpeg_destroy_decompress(&cinfo);
+            fclose(f);
+            panic("Could not read jpeg %s: %s\n", filename.c_str(), message.c_str());
+        }
+        jpeg_stdio_src(&cinfo, f);
+
+        jpeg_read_header(&cinfo, TRUE);
+
+        if (minWidth > 0 || minHeight > 0) {
+            for (unsigned int denom = 8; denom > 1; denom /= 2) {
+                if ((int)((cinfo.image_width + denom - 1) / denom) >= minWidth &&
+                    (int)((cinfo.image_height + denom - 1) / denom) >= minHeight) {
+                    cinfo.scale_num = 1;
+                    cinfo.scale_denom = denom;
+                    break;
+                }
+            }
+        }
 
-    jpeg_start_compress(&cinfo, TRUE);
+        jpeg_start_decompress(&cinfo);
 
-    JSAMPLE *row = new JSAMPLE[im.width * im.channels];
+        width = cinfo.output_width;
+        height = cinfo.output_height;
+        frames = 1;
+        channels = cinfo.output_components;
+    }
 
-    while (cinfo.next_scanline < cinfo.image_height) {
-        // convert the row
-        JSAMPLE *dstPtr = row;
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                *dstPtr++ = (JSAMPLE)(HDRtoLDR(im(x, cinfo.next_scanline, c)));
-            }
+    ~Reader() {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+    }
+
+    void read(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the jpeg being read\n");
+        int y = cinfo.output_scanline;
+        assert(y + rows.height <= height, "Reading past the end of a jpeg\n");
+
+        const int rowBytes = width * channels;
+        vector<JSAMPLE> data((size_t)rowBytes * rows.height);
+        vector<JSAMPROW> ptrs(rows.height);
+        for (int i = 0; i < rows.height; i++) {
+            ptrs[i] = &data[(size_t)i * rowBytes];
+        }
+        if (setjmp(jerr.jump)) {
+            panic("Could not read jpeg: %s\n", errorMessage((j_common_ptr)&cinfo).c_str());
+        }
+        while ((int)cinfo.output_scanline < y + rows.height) {
+            jpeg_read_scanlines(&cinfo, &ptrs[cinfo.output_scanline - y], y + rows.height - cinfo.output_scanline);
         }
-        jpeg_write_scanlines(&cinfo, &row, 1);
+        unpack8(&data[0], rowBytes, rows);
     }
 
-    jpeg_finish_compress(&cinfo);
-    fclose(f);
+private:
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    FILE *f;
+};
+
+class Writer : public RowWriter {
+public:
+    Writer(string filename, int width, int height, int channels, int quality) {
+        assert(channels == 1 || channels == 3, "Can only save jpg images with 1 or 3 channels\n");
+        assert(quality > 0 && quality <= 100, "jpeg quality must lie between 1 and 100\n");
+
+        f = fopen(filename.c_str(), "wb");
+        assert(f, "Could not open file %s\n", filename.c_str());
+
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = errorExit;
+        jpeg_create_compress(&cinfo);
+        if (setjmp(jerr.jump)) {
+            string message = errorMessage((j_common_ptr)&cinfo);
+            jpeg_destroy_compress(&cinfo);
+            fclose(f);
+            panic("Could not write jpeg %s: %s\n", filename.c_str(), message.c_str());
+        }
+        jpeg_stdio_dest(&cinfo, f);
 
-    // clean up
-    delete[] row;
-    jpeg_destroy_compress(&cinfo);
+        cinfo.image_width = width;
+        cinfo.image_height = height;
+        cinfo.input_components = channels;
+        cinfo.in_color_space = channels == 3 ? JCS_RGB : JCS_GRAYSCALE;
 
-}
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        jpeg_start_compress(&cinfo, TRUE);
+    }
 
+    ~Writer() {
+        jpeg_destroy_compress(&cinfo);
+        fclose(f);
+    }
 
+    void write(Image rows) {
+        assert(rows.width == (int)cinfo.image_width &&
+               rows.channels == cinfo.input_components &&
+               rows.frames == 1,
+               "Rows do not match the size of the jpeg being written\n");
+        assert(cinfo.next_scanline + rows.height <= cinfo.image_height,
+               "Writing past the end of a jpeg\n");
+
+        const int rowBytes = rows.width * rows.channels;
+        vector<JSAMPLE> data((size_t)rowBytes * rows.height);
+        pack8(rows, &data[0], rowBytes);
+        if (setjmp(jerr.jump)) {
+            panic("Could not write jpeg: %s\n", errorMessage((j_common_ptr)&cinfo).c_str());
+        }
+        for (int y = 0; y < rows.height; y++) {
+            JSAMPROW row = &data[(size_t)y * rowBytes];
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+    }
 
-Image load(string filename) {
+    void finish() {
+        if (setjmp(jerr.jump)) {
+            panic("Could not write jpeg: %s\n", errorMessage((j_common_ptr)&cinfo).c_str());
+        }
+        jpeg_finish_compress(&cinfo);
+    }
 
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+private:
+    struct jpeg_compress_struct cinfo;
+    ErrorManager jerr;
+    FILE *f;
+};
+}
 
-    FILE *f = fopen(filename.c_str(), "rb");
-    assert(f, "Could not open file %s\n", filename.c_str());
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, f);
+namespace {
+// Decode the rest of a jpeg into an image of the same size. libjpeg
+// hands back a few scanlines at a time, so we read in bands.
+void readAll(Reader &reader, Image im) {
+    const int bandHeight = 64;
+    for (int y = 0; y < im.height; y += bandHeight) {
+        int h = min(bandHeight, im.height - y);
+        reader.read(im.region(0, y, 0, 0, im.width, h, 1, im.channels));
+    }
+}
+}
 
-    jpeg_read_header(&cinfo, TRUE);
-    jpeg_start_decompress(&cinfo);
+Image load(string filename) {
+    Reader reader(filename);
+    Image im(reader.width, reader.height, 1, reader.channels);
+    readAll(reader, im);
+    return im;
+}
 
-    Image im(cinfo.output_width, cinfo.output_height, 1, cinfo.output_components);
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, im.width * im.channels, 1);
+void load(string filename, Image into) {
+    Reader reader(filename);
+    assert(into.width == reader.width && into.height == reader.height &&
+           into.frames == 1 && into.channels == reader.channels,
+           "%s does not match the size of the image it is being loaded into\n", filename.c_str());
+    readAll(reader, into);
+}
 
-    while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        JSAMPLE *srcPtr = buffer[0];
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                im(x, cinfo.output_scanline-1, c) = LDRtoHDR(*srcPtr++);
-            }
-        }
-    }
+Image loadScaled(string filename, int minWidth, int minHeight) {
+    Reader reader(filename, minWidth, minHeight);
+    Image im(reader.width, reader.height, 1, reader.channels);
+    readAll(reader, im);
+    return im;
+}
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+void save(Image im, string filename, int quality) {
+    assert(im.frames == 1, "Can't save multiframe jpg images\n");
+    Writer writer(filename, im.width, im.height, im.channels, quality);
+    writer.write(im);
+    writer.finish();
+}
 
-    fclose(f);
+RowReader *openReader(string filename) {
+    return new Reader(filename);
+}
 
-    return im;
+RowWriter *openWriter(string filename, int width, int height, int channels, int quality) {
+    return new Writer(filename, width, height, channels, quality);
 }
 }
 }
@@ -7,6 +7,15 @@ Image load(string filename) {
     return im;
 }
 
+void load(string filename, Image into) {
+    panic("This file type not implemented in this build\n");
+}
+
+Image loadScaled(string filename, int minWidth, int minHeight) {
+    panic("This file type not implemented in this build\n");
+    return Image();
+}
+
 void save(Image im, string filename) {
     panic("This file type not implemented in this build\n");
 }
@@ -18,3 +27,13 @@ void save(Image im, string filename, int opt) {
 void save(Image im, string filename, string opt) {
     panic("This file type not implemented in this build\n");
 }
+
+RowReader *openReader(string filename) {
+    panic("This file type not implemented in this build\n");
+    return NULL;
+}
+
+RowWriter *openWriter(string filename, int width, int height, int channels, int arg) {
+    panic("This file type not implemented in this build\n");
+    return NULL;
+}
@@ -1,5 +1,6 @@
 #include "main.h"
 #include "File.h"
+#include "Interleave.h"
 namespace ImageStack {
 
 #ifdef NO_PNG
@@ -17,160 +18,200 @@ void help() {
     pprintf(".png files. These have a bit depth of 8 or 16, and may have 1-4 channels. They may only have 1 frame.");
 }
 
-Image load(string filename) {
-    png_byte header[8];        // 8 is the maximum size that can be checked
-
-    /* open file and test for it being a png */
-    FILE *f = fopen(filename.c_str(), "rb");
-    assert(f, "File %s could not be opened for reading\n", filename.c_str());
-    assert(fread(header, 1, 8, f) == 8, "File ended before end of header\n");
-    assert(!png_sig_cmp(header, 0, 8), "File %s is not recognized as a PNG file\n", filename.c_str());
-
-    /* initialize stuff */
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-    assert(png_ptr, "[read_png_file] png_create_read_struct failed\n");
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    assert(info_ptr, "[read_png_file] png_create_info_struct failed\n");
-
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[read_png_file] Error during init_io\n");
-
-    png_init_io(png_ptr, f);
-    png_set_sig_bytes(png_ptr, 8);
-
-    png_read_info(png_ptr, info_ptr);
-
-    int width = png_get_image_width(png_ptr, info_ptr);
-    int height = png_get_image_height(png_ptr, info_ptr);
-    int channels = png_get_channels(png_ptr, info_ptr);
-    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-
-    // Expand low-bpp images to have only 1 pixel per byte (As opposed to tight packing)
-    if (bit_depth < 8) {
-        png_set_packing(png_ptr);
+namespace {
+class Reader : public RowReader {
+public:
+    Reader(string filename) : png_ptr(NULL), info_ptr(NULL), nextRow(0) {
+        png_byte header[8];
+        f = fopen(filename.c_str(), "rb");
+        assert(f, "File %s could not be opened for reading\n", filename.c_str());
+        try {
+            assert(fread(header, 1, 8, f) == 8, "File ended before end of header\n");
+            assert(!png_sig_cmp(header, 0, 8), "File %s is not recognized as a PNG file\n", filename.c_str());
+
+            png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            assert(png_ptr, "[read_png_file] png_create_read_struct failed\n");
+            info_ptr = png_create_info_struct(png_ptr);
+            assert(info_ptr, "[read_png_file] png_create_info_struct failed\n");
+
+            assert(!setjmp(png_jmpbuf(png_ptr)), "[read_png_file] Error during init_io\n");
+
+            png_init_io(png_ptr, f);
+            png_set_sig_bytes(png_ptr, 8);
+            png_read_info(png_ptr, info_ptr);
+
+            width = png_get_image_width(png_ptr, info_ptr);
+            height = png_get_image_height(png_ptr, info_ptr);
+            frames = 1;
+            channels = png_get_channels(png_ptr, info_ptr);
+            bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+            // Expand low-bpp images to have only 1 pixel per byte (As opposed to tight packing)
+            if (bit_depth < 8) {
+                png_set_packing(png_ptr);
+            }
+            // Interlaced rows arrive in several passes over the whole
+            // image, so those are decoded whole on the first read
+            interlaced = png_set_interlace_handling(png_ptr) > 1;
+            png_read_update_info(png_ptr, info_ptr);
+            row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+        } catch (...) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            fclose(f);
+            throw;
+        }
     }
 
-    Image im(width, height, 1, channels);
-
-    //number_of_passes = png_set_interlace_handling(png_ptr);
-    png_read_update_info(png_ptr, info_ptr);
-
-    // read the file
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[read_png_file] Error during read_image\n");
-
-    std::vector<png_bytep> row_pointers(im.height);
-    int row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-    std::vector<png_byte> data(row_bytes * im.height);
-    for (int y = 0; y < im.height; y++) {
-        row_pointers[y] = &data[y * row_bytes];
+    ~Reader() {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(f);
     }
 
-    png_read_image(png_ptr, &row_pointers[0]);
-
-    fclose(f);
-
-    // convert the data to floats
-    if (bit_depth <= 8) {
-        int bit_scale = 8/bit_depth;
-        for (int y = 0; y < im.height; y++) {
-            png_bytep srcPtr = row_pointers[y];
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    im(x, y, c) = LDRtoHDR(bit_scale* (*srcPtr++));
+    void read(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the png being read\n");
+        assert(nextRow + rows.height <= height, "Reading past the end of a png\n");
+
+        if (interlaced) {
+            if (whole.empty()) {
+                whole.resize((size_t)row_bytes * height);
+                std::vector<png_bytep> row_pointers(height);
+                for (int y = 0; y < height; y++) {
+                    row_pointers[y] = &whole[(size_t)y * row_bytes];
                 }
+                assert(!setjmp(png_jmpbuf(png_ptr)), "[read_png_file] Error during read_image\n");
+                png_read_image(png_ptr, &row_pointers[0]);
             }
-        }
-    } else if (bit_depth == 16) {
-        for (int y = 0; y < im.height; y++) {
-            png_bytep srcPtr = row_pointers[y];
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    unsigned short val = srcPtr[0]*256 + srcPtr[1];
-                    im(x, y, c) = LDR16toHDR(val);
-                    srcPtr += 2;
-                }
+            convert(&whole[(size_t)nextRow * row_bytes], rows);
+        } else {
+            std::vector<png_byte> data((size_t)row_bytes * rows.height);
+            assert(!setjmp(png_jmpbuf(png_ptr)), "[read_png_file] Error during read_row\n");
+            for (int y = 0; y < rows.height; y++) {
+                png_read_row(png_ptr, &data[(size_t)y * row_bytes], NULL);
             }
+            convert(&data[0], rows);
         }
+        nextRow += rows.height;
     }
 
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-
-    return im;
-}
-
-
-  void save(Image im, string filename, int bits) {
-    assert(bits == 8 || bits == 16, "Can only save 8 or 16 bit pngs\n");
-    assert(im.frames == 1, "Can't save a multi-frame PNG image\n");
-    assert(im.channels > 0 && im.channels < 5,
-           "Imagestack can't write PNG files that have other than 1, 2, 3, or 4 channels\n");
-
-    png_byte color_types[4] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
-                               PNG_COLOR_TYPE_RGB,  PNG_COLOR_TYPE_RGB_ALPHA
-                              };
-    png_byte color_type = color_types[im.channels - 1];
-
-    // open file
-    FILE *f = fopen(filename.c_str(), "wb");
-    assert(f, "[write_png_file] File %s could not be opened for writing\n", filename.c_str());
-
-    // initialize stuff
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    assert(png_ptr, "[write_png_file] png_create_write_struct failed\n");
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    assert(info_ptr, "[write_png_file] png_create_info_struct failed\n");
-
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during init_io\n");
-
-    png_init_io(png_ptr, f);
+private:
+    // Convert rows of png data to floats
+    void convert(const png_byte *data, Image rows) {
+        if (bit_depth <= 8) {
+            int bit_scale = 8/bit_depth;
+            unpack8(data, row_bytes, rows, bit_scale/255.0f);
+        } else {
+            unpack16(data, row_bytes, rows);
+        }
+    }
 
-    // write header
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during writing header\n");
+    FILE *f;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int bit_depth, row_bytes, nextRow;
+    bool interlaced;
+    std::vector<png_byte> whole;
+};
+
+class Writer : public RowWriter {
+public:
+    Writer(string filename, int width_, int height, int channels_, int bits_) :
+        png_ptr(NULL), info_ptr(NULL), bits(bits_), width(width_), channels(channels_) {
+        assert(bits == 8 || bits == 16, "Can only save 8 or 16 bit pngs\n");
+        assert(channels > 0 && channels < 5,
+               "Imagestack can't write PNG files that have other than 1, 2, 3, or 4 channels\n");
+
+        png_byte color_types[4] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                                   PNG_COLOR_TYPE_RGB,  PNG_COLOR_TYPE_RGB_ALPHA
+                                  };
+
+        f = fopen(filename.c_str(), "wb");
+        assert(f, "[write_png_file] File %s could not be opened for writing\n", filename.c_str());
+        try {
+            png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            assert(png_ptr, "[write_png_file] png_create_write_struct failed\n");
+            info_ptr = png_create_info_struct(png_ptr);
+            assert(info_ptr, "[write_png_file] png_create_info_struct failed\n");
+
+            assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during writing header\n");
+
+            png_init_io(png_ptr, f);
+            png_set_IHDR(png_ptr, info_ptr, width, height,
+                         bits, color_types[channels - 1], PNG_INTERLACE_NONE,
+                         PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+            png_write_info(png_ptr, info_ptr);
+
+            row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+        } catch (...) {
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            fclose(f);
+            throw;
+        }
+    }
 
-    png_set_IHDR(png_ptr, info_ptr, im.width, im.height,
-                 bits, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    ~Writer() {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        fclose(f);
+    }
 
-    png_write_info(png_ptr, info_ptr);
+    void write(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the png being written\n");
 
-    // convert the floats to bytes
-    int row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-    std::vector<png_bytep> row_pointers(im.height);
-    std::vector<png_byte> data(row_bytes * im.height);
-    for (int y = 0; y < im.height; y++) {
-        png_bytep dstPtr = row_pointers[y] = &data[y*row_bytes];
+        std::vector<png_byte> data(row_bytes * rows.height);
         if (bits == 8) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {                
-                    *dstPtr++ = (png_byte)(HDRtoLDR(im(x, y, c)));
-                }
-            }
-        } else if (bits == 16) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {                
-                    unsigned short val = HDRtoLDR16(im(x, y, c));
-                    *dstPtr++ = (png_byte)(val >> 8);
-                    *dstPtr++ = (png_byte)(val & 0xff);
-                }
-            }            
+            pack8(rows, &data[0], row_bytes);
+        } else {
+            pack16(rows, &data[0], row_bytes);
         }
+
+        assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during writing bytes");
+        for (int y = 0; y < rows.height; y++) {
+            png_write_row(png_ptr, &data[y * row_bytes]);
+        }
+    }
+
+    void finish() {
+        assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during end of write");
+        png_write_end(png_ptr, NULL);
     }
 
-    // write data
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during writing bytes");
+private:
+    FILE *f;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int bits, width, channels, row_bytes;
+};
+}
 
-    png_write_image(png_ptr, &row_pointers[0]);
+Image load(string filename) {
+    Reader reader(filename);
+    Image im(reader.width, reader.height, 1, reader.channels);
+    reader.read(im);
+    return im;
+}
 
-    // finish write
-    assert(!setjmp(png_jmpbuf(png_ptr)), "[write_png_file] Error during end of write");
+void load(string filename, Image into) {
+    Reader reader(filename);
+    assert(into.width == reader.width && into.height == reader.height &&
+           into.frames == 1 && into.channels == reader.channels,
+           "%s does not match the size of the image it is being loaded into\n", filename.c_str());
+    reader.read(into);
+}
 
-    png_write_end(png_ptr, NULL);
+void save(Image im, string filename, int bits) {
+    assert(im.frames == 1, "Can't save a multi-frame PNG image\n");
+    Writer writer(filename, im.width, im.height, im.channels, bits);
+    writer.write(im);
+    writer.finish();
+}
 
-    fclose(f);
+RowReader *openReader(string filename) {
+    return new Reader(filename);
+}
 
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+RowWriter *openWriter(string filename, int width, int height, int channels, int bits) {
+    return new Writer(filename, width, height, channels, bits);
 }
 
 
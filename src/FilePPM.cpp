@@ -1,5 +1,6 @@
 #include "main.h"
 #include "File.h"
+#include "Interleave.h"
 namespace ImageStack {
 
 /* PPM file format:
@@ -44,83 +45,134 @@ void help() {
             " files have one channel.\n");
 }
 
-Image load(string filename) {
-    FILE *f = fopen(filename.c_str(), "rb");
-    assert(f, "Could not open file %s", filename.c_str());
-
-    // Check the suffix to distinguish between ppm and pgm
-    bool gray = tolower(filename[filename.size()-2]) == 'g';
-
-    // get the magic number
-    if (gray) {
-        assert(fgetc(f) == 'P' && fgetc(f) == '5',
-               "File does not start with pgm magic number: 'P5'");
-    } else {
-        assert(fgetc(f) == 'P' && fgetc(f) == '6',
-               "File does not start with ppm magic number: 'P6'");
+namespace {
+class Reader : public RowReader {
+public:
+    Reader(string filename) {
+        f = fopen(filename.c_str(), "rb");
+        assert(f, "Could not open file %s", filename.c_str());
+
+        // Check the suffix to distinguish between ppm and pgm
+        bool gray = tolower(filename[filename.size()-2]) == 'g';
+
+        try {
+            // get the magic number
+            if (gray) {
+                assert(fgetc(f) == 'P' && fgetc(f) == '5',
+                       "File does not start with pgm magic number: 'P5'");
+            } else {
+                assert(fgetc(f) == 'P' && fgetc(f) == '6',
+                       "File does not start with ppm magic number: 'P6'");
+            }
+
+            assert(fscanf(f, " %20d %20d %20d", &width, &height, &maxval) == 3, "Could not read image dimensions from ppm");
+        } catch (...) {
+            fclose(f);
+            throw;
+        }
+
+        // remove the next whitespace char
+        fgetc(f);
+
+        frames = 1;
+        channels = gray ? 1 : 3;
+        rowBytes = (size_t)width * channels * (maxval > 255 ? 2 : 1);
     }
 
-    int width, height, maxval;
-    assert(fscanf(f, " %20d %20d %20d", &width, &height, &maxval) == 3, "Could not read image dimensions from ppm");
+    ~Reader() {
+        fclose(f);
+    }
 
-    // remove the next whitespace char
-    fgetc(f);
+    void read(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the ppm being read\n");
 
-    Image im(width, height, 1, gray ? 1 : 3);
+        vector<unsigned char> data(rowBytes * rows.height);
+        assert(fread(&data[0], 1, data.size(), f) == data.size(),
+               "Unexpected end of file reading ppm\n");
 
-    for (int y = 0; y < im.height; y++) {
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                if (maxval > 255) {
-                    im(x, y, c) = (float)(((fgetc(f) & 255) << 8) + (fgetc(f) & 255)) / maxval;
-                } else {
-                    im(x, y, c) = (float)(fgetc(f)) / maxval;
-                }
-            }
+        if (maxval > 255) {
+            unpack16(&data[0], rowBytes, rows, 1.0f/maxval);
+        } else {
+            unpack8(&data[0], rowBytes, rows, 1.0f/maxval);
         }
     }
 
-    fclose(f);
+private:
+    FILE *f;
+    int maxval;
+    size_t rowBytes;
+};
+
+class Writer : public RowWriter {
+public:
+    Writer(string filename, int width_, int height, int channels_, int depth) :
+        width(width_), channels(channels_) {
+        assert(depth == 16 || depth == 8, "bit depth must be 8 or 16\n");
+        assert(channels == 3 || channels == 1, "can only save one or three channel ppms/pgms\n");
+
+        f = fopen(filename.c_str(), "wb");
+        assert(f, "Could not open file %s\n", filename.c_str());
+
+        maxval = (1 << depth) - 1;
+
+        bool gray = channels == 1;
+        if (gray) {
+            fprintf(f, "P5\n");
+        } else {
+            fprintf(f, "P6\n");
+        }
+        fprintf(f, "%d %d\n%d\n", width, height, maxval);
 
-    return im;
-}
+        rowBytes = (size_t)width * channels * (maxval > 255 ? 2 : 1);
+    }
 
-void save(Image im, string filename, int depth) {
-    FILE *f = fopen(filename.c_str(), "wb");
-    assert(f, "Could not open file %s\n", filename.c_str());
-    assert(depth == 16 || depth == 8, "bit depth must be 8 or 16\n");
-    assert(im.frames == 1, "can only save single frame ppms/pgms\n");
-    assert(im.channels == 3 || im.channels == 1, "can only save one or three channel ppms/pgms\n");
+    ~Writer() {
+        fclose(f);
+    }
 
-    int maxval = (1 << depth) - 1;
+    void write(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the ppm being written\n");
 
-    bool gray = im.channels == 1;
-    if (gray) {
-        fprintf(f, "P5\n");
-    } else {
-        fprintf(f, "P6\n");
-    }
-    fprintf(f, "%d %d\n%d\n", im.width, im.height, maxval);
-
-    for (int y = 0; y < im.height; y++) {
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                float val = im(x, y, c);
-                val = clamp(val, 0.0f, 1.0f);
-                val *= maxval;
-                if (maxval < 256) {
-                    unsigned char v = (unsigned char)val;
-                    fputc(v, f);
-                } else {
-                    unsigned short v = (unsigned short)val;
-                    fputc(v >> 8, f);
-                    fputc(v & 255, f);
-                }
-            }
+        vector<unsigned char> data(rowBytes * rows.height);
+        if (maxval > 255) {
+            pack16(rows, &data[0], rowBytes, maxval);
+        } else {
+            pack8(rows, &data[0], rowBytes, maxval);
         }
+        fwrite(&data[0], 1, data.size(), f);
     }
 
-    fclose(f);
+    void finish() {}
+
+private:
+    FILE *f;
+    int width, channels, maxval;
+    size_t rowBytes;
+};
+}
+
+RowReader *openReader(string filename) {
+    return new Reader(filename);
+}
+
+RowWriter *openWriter(string filename, int width, int height, int channels, int depth) {
+    return new Writer(filename, width, height, channels, depth);
+}
+
+Image load(string filename) {
+    Reader reader(filename);
+    Image im(reader.width, reader.height, 1, reader.channels);
+    reader.read(im);
+    return im;
+}
+
+void save(Image im, string filename, int depth) {
+    assert(im.frames == 1, "can only save single frame ppms/pgms\n");
+    Writer writer(filename, im.width, im.height, im.channels, depth);
+    writer.write(im);
+    writer.finish();
 }
 }
 }
@@ -1,6 +1,6 @@
 #include "main.h"
 #include "File.h"
-#include "Geometry.h"
+#include "Interleave.h"
 
 namespace ImageStack {
 
@@ -87,107 +87,43 @@ Image load(string filename) {
 
     Image im(width, height, 1, channels);
 
-    bool vflip = true; //!(descriptor & 0x10);
-
-
-    if (!rle && channels == 1) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                im(x, y) = LDRtoHDR(fgetc(f));
-            }
-        }
-    } else if (!rle && channels == 3) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                im(x, y, 2) = LDRtoHDR(fgetc(f));
-                im(x, y, 1) = LDRtoHDR(fgetc(f));
-                im(x, y, 0) = LDRtoHDR(fgetc(f));
-            }
-        }
-    } else if (!rle && channels == 4) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                im(x, y, 2) = LDRtoHDR(fgetc(f));
-                im(x, y, 1) = LDRtoHDR(fgetc(f));
-                im(x, y, 0) = LDRtoHDR(fgetc(f));
-                im(x, y, 3) = LDRtoHDR(fgetc(f));
-            }
-        }
-    } else if (rle && channels == 1) {
-        for (int x = 0, y = 0; y < height;) {
-            unsigned char ch = fgetc(f);
-            unsigned char runlength = ch & 0x7f;
-
-            if (ch & 0x80) { // compressed
-                float val = LDRtoHDR(fgetc(f));
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y) = val;
-                    x++; if (x == width) {x = 0; y++;}
-                }
-            } else { // normal
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y) = LDRtoHDR(fgetc(f));
-                    x++; if (x == width) {x = 0; y++;}
-                }
-            }
-        }
-    } else if (rle && channels == 3) {
-        for (int x = 0, y = 0; y < height;) {
-            unsigned char ch = fgetc(f);
-            unsigned char runlength = ch & 0x7f;
-
-            if (ch & 0x80) { // compressed
-                float b = LDRtoHDR(fgetc(f));
-                float g = LDRtoHDR(fgetc(f));
-                float r = LDRtoHDR(fgetc(f));
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y, 0) = r;
-                    im(x, y, 1) = g;
-                    im(x, y, 2) = b;
-                    x++; if (x == width) {x = 0; y++;}
-                }
-            } else { // normal
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y, 0) = LDRtoHDR(fgetc(f));
-                    im(x, y, 1) = LDRtoHDR(fgetc(f));
-                    im(x, y, 2) = LDRtoHDR(fgetc(f));
-                    x++; if (x == width) {x = 0; y++;}
-                }
-            }
-        }
-    } else if (rle && channels == 4) {
-        for (int x = 0, y = 0; y < height;) {
+    // Read the raster, expanding any run-length encoding as we go
+    size_t rowBytes = (size_t)width * channels;
+    vector<unsigned char> data(rowBytes * height);
+    if (!rle) {
+        assert(fread(&data[0], 1, data.size(), f) == data.size(),
+               "Unexpected end of file reading %s\n", filename.c_str());
+    } else {
+        unsigned char pixel[4];
+        for (size_t i = 0; i < data.size();) {
             unsigned char ch = fgetc(f);
-            unsigned char runlength = ch & 0x7f;
+            size_t runlength = min((size_t)(ch & 0x7f) + 1, (data.size() - i) / channels);
 
             if (ch & 0x80) { // compressed
-                float b = LDRtoHDR(fgetc(f));
-                float g = LDRtoHDR(fgetc(f));
-                float r = LDRtoHDR(fgetc(f));
-                float a = LDRtoHDR(fgetc(f));
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y, 0) = r;
-                    im(x, y, 1) = g;
-                    im(x, y, 2) = b;
-                    im(x, y, 3) = a;
-                    x++; if (x == width) {x = 0; y++;}
+                assert(fread(pixel, 1, channels, f) == (size_t)channels,
+                       "Unexpected end of file reading %s\n", filename.c_str());
+                for (size_t j = 0; j < runlength; j++) {
+                    for (int c = 0; c < channels; c++) {
+                        data[i++] = pixel[c];
+                    }
                 }
             } else { // normal
-                for (int j = 0; j < runlength; j++) {
-                    im(x, y, 0) = LDRtoHDR(fgetc(f));
-                    im(x, y, 1) = LDRtoHDR(fgetc(f));
-                    im(x, y, 2) = LDRtoHDR(fgetc(f));
-                    im(x, y, 3) = LDRtoHDR(fgetc(f));
-                    x++; if (x == width) {x = 0; y++;}
-                }
+                assert(fread(&data[i], 1, runlength * channels, f) == runlength * channels,
+                       "Unexpected end of file reading %s\n", filename.c_str());
+                i += runlength * channels;
             }
         }
     }
 
-
     fclose(f);
 
-    if (vflip) Flip::apply(im, 'y');
+    // tgas are stored bottom-up in bgr(a) order
+    bool vflip = true; //!(descriptor & 0x10);
+    if (vflip) {
+        unpack8(&data[rowBytes * (height - 1)], -(ptrdiff_t)rowBytes, im, 1.0f/255, true);
+    } else {
+        unpack8(&data[0], rowBytes, im, 1.0f/255, true);
+    }
     return im;
 }
 
@@ -212,30 +148,11 @@ void save(Image im, string filename) {
     fputc(im.channels * 8, f); // bits
     fputc(0, f); // descriptor
 
-    if (im.channels == 1) {
-        for (int y = im.height-1; y >= 0; y--) {
-            for (int x = 0; x < im.width; x++) {
-                fputc(HDRtoLDR(im(x, y)), f);
-            }
-        }
-    } else if (im.channels == 3) {
-        for (int y = im.height-1; y >= 0; y--) {
-            for (int x = 0; x < im.width; x++) {
-                fputc(HDRtoLDR(im(x, y, 2)), f);
-                fputc(HDRtoLDR(im(x, y, 1)), f);
-                fputc(HDRtoLDR(im(x, y, 0)), f);
-            }
-        }
-    } else if (im.channels == 4) {
-        for (int y = im.height-1; y >= 0; y--) {
-            for (int x = 0; x < im.width; x++) {
-                fputc(HDRtoLDR(im(x, y, 2)), f);
-                fputc(HDRtoLDR(im(x, y, 1)), f);
-                fputc(HDRtoLDR(im(x, y, 0)), f);
-                fputc(HDRtoLDR(im(x, y, 3)), f);
-            }
-        }
-    }
+    // tgas are stored bottom-up in bgr(a) order
+    size_t rowBytes = (size_t)im.width * im.channels;
+    vector<unsigned char> data(rowBytes * im.height);
+    pack8(im, &data[rowBytes * (im.height - 1)], -(ptrdiff_t)rowBytes, 255, true);
+    fwrite(&data[0], 1, data.size(), f);
 
     fclose(f);
 }
@@ -32,172 +32,182 @@ void help() {
             " double. The default is float32.\n");
 }
 
+namespace {
 template<typename T>
-void saveData(FILE *f, Image im) {
-
-    vector<T> buf(im.width);
-
-    for (int c = 0; c < im.channels; c++) {
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                float *srcPtr = &im(0, y, t, c);
-                for (int x = 0; x < im.width; x++) {
-                    buf[x] = (T)srcPtr[x];
-                }
-                fwrite(&buf[0], sizeof(T), im.width, f);
-            }
-        }
+void readSamples(FILE *f, float *dst, int n) {
+    vector<T> buf(n);
+    assert(fread(&buf[0], sizeof(T), n, f) == (size_t)n, "Unexpected end of file\n");
+    for (int i = 0; i < n; i++) {
+        dst[i] = (float)buf[i];
     }
 }
 
 template<>
-void saveData<float>(FILE *f, Image im) {
-
-    vector<float> buf(im.width*im.channels);
+void readSamples<float>(FILE *f, float *dst, int n) {
+    assert(fread(dst, sizeof(float), n, f) == (size_t)n, "Unexpected end of file\n");
+}
 
-    for (int c = 0; c < im.channels; c++) {
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                fwrite(&im(0, y, t, c), sizeof(float), im.width, f);
-            }
-        }
+template<typename T>
+void writeSamples(FILE *f, const float *src, int n) {
+    vector<T> buf(n);
+    for (int i = 0; i < n; i++) {
+        buf[i] = (T)src[i];
     }
+    fwrite(&buf[0], sizeof(T), n, f);
 }
 
+template<>
+void writeSamples<float>(FILE *f, const float *src, int n) {
+    fwrite(src, sizeof(float), n, f);
+}
 
-void save(Image im, string filename, string type) {
-    FILE *f = fopen(filename.c_str(), "wb");
-    assert(f, "Could not write output file %s\n", filename.c_str());
-    // write the dimensions
-    fwrite(&im.width, sizeof(int), 1, f);
-    fwrite(&im.height, sizeof(int), 1, f);
-    fwrite(&im.frames, sizeof(int), 1, f);
-    fwrite(&im.channels, sizeof(int), 1, f);
-
-    int typeCode;
-
-    if (type == "float" || type == "float32") {
-        typeCode = FLOAT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<float>(f, im);
-    } else if (type == "double" || type == "float64") {
-        typeCode = FLOAT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<double>(f, im);
-    } else if (type == "uint8" || type == "unsigned char") {
-        typeCode = UINT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint8_t>(f, im);
-    } else if (type == "int8" || type == "char") {
-        typeCode = INT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int8_t>(f, im);
-    } else if (type == "uint16" || type == "unsigned short") {
-        typeCode = UINT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint16_t>(f, im);
-    } else if (type == "int16" || type == "short") {
-        typeCode = INT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int16_t>(f, im);
-    } else if (type == "uint32" || type == "unsigned int") {
-        typeCode = UINT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint32_t>(f, im);
-    } else if (type == "int32" || type == "int") {
-        typeCode = INT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int32_t>(f, im);
-    } else if (type == "uint64") {
-        typeCode = UINT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint64_t>(f, im);
-    } else if (type == "int64") {
-        typeCode = INT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int64_t>(f, im);
+// The sample types, indexed by type code
+const struct {
+    const char *name, *alias;
+    long size;
+    void (*read)(FILE *, float *, int);
+    void (*write)(FILE *, const float *, int);
+} types[] = {
+    {"float32", "float", 4, readSamples<float>, writeSamples<float>},
+    {"float64", "double", 8, readSamples<double>, writeSamples<double>},
+    {"uint8", "unsigned char", 1, readSamples<uint8_t>, writeSamples<uint8_t>},
+    {"int8", "char", 1, readSamples<int8_t>, writeSamples<int8_t>},
+    {"uint16", "unsigned short", 2, readSamples<uint16_t>, writeSamples<uint16_t>},
+    {"int16", "short", 2, readSamples<int16_t>, writeSamples<int16_t>},
+    {"uint32", "unsigned int", 4, readSamples<uint32_t>, writeSamples<uint32_t>},
+    {"int32", "int", 4, readSamples<int32_t>, writeSamples<int32_t>},
+    {"uint64", NULL, 8, readSamples<uint64_t>, writeSamples<uint64_t>},
+    {"int64", NULL, 8, readSamples<int64_t>, writeSamples<int64_t>},
+};
+
+// The data is stored a channel at a time, so both of these seek to
+// each channel's rows in turn.
+class Reader : public RowReader {
+public:
+    Reader(string filename) : row(0) {
+        f = fopen(filename.c_str(), "rb");
+        assert(f, "Could not open file %s\n", filename.c_str());
+
+        int32_t h[5];
+        if (fread(h, sizeof(int32_t), 5, f) != 5) {
+            fclose(f);
+            panic("File ended before end of header\n");
+        }
+        width = h[0];
+        height = h[1];
+        frames = h[2];
+        channels = h[3];
+
+        if (h[4] >= FLOAT32 && h[4] <= INT64) {
+            readFn = types[h[4]].read;
+            size = types[h[4]].size;
+            dataStart = 20;
+        } else {
+            printf("Unknown type code %d. Possibly trying to load an old-style tmp file.\n", h[4]);
+            readFn = readSamples<float>;
+            size = 4;
+            dataStart = 16;
+        }
     }
-    fclose(f);
-}
 
-template<typename T>
-Image loadData(FILE *f, int width, int height, int frames, int channels) {
-    Image im(width, height, frames, channels);
-
-    vector<T> scanline(width);
-    for (int c = 0; c < channels; c++) {
-        for (int t = 0; t < frames; t++) {
-            for (int y = 0; y < height; y++) {
-                assert(fread(&scanline[0], sizeof(T), width, f) == (size_t)width,
-                       "Unexpected end of file\n");
-                for (int x = 0; x < width; x++) {
-                    im(x, y, t, c) = (float)scanline[x];
-                }
+    ~Reader() {
+        fclose(f);
+    }
+
+    void read(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the tmp file being read\n");
+        assert(row + rows.height <= (long)height * frames, "Reading past the end of a tmp file\n");
+
+        long channelSize = (long)width * height * frames;
+        for (int c = 0; c < channels; c++) {
+            fseek(f, dataStart + (c * channelSize + row * width) * size, SEEK_SET);
+            for (int y = 0; y < rows.height; y++) {
+                readFn(f, &rows(0, y, c), width);
             }
         }
+        row += rows.height;
     }
 
-    return im;
-}
+private:
+    FILE *f;
+    void (*readFn)(FILE *, float *, int);
+    long dataStart, size, row;
+};
+
+class Writer : public RowWriter {
+public:
+    Writer(string filename, int width_, int height_, int frames_, int channels_, string type) :
+        width(width_), height(height_), frames(frames_), channels(channels_), row(0) {
+        int typeCode = FLOAT32;
+        while (typeCode <= INT64 &&
+               type != types[typeCode].name &&
+               !(types[typeCode].alias && type == types[typeCode].alias)) {
+            typeCode++;
+        }
+        assert(typeCode <= INT64, "Unknown tmp type %s\n", type.c_str());
+        writeFn = types[typeCode].write;
+        size = types[typeCode].size;
 
-template<>
-Image loadData<float>(FILE *f, int width, int height, int frames, int channels) {
-    Image im(width, height, frames, channels);
-
-    for (int c = 0; c < im.channels; c++) {
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                assert(fread(&im(0, y, t, c), sizeof(float), im.width, f) == (size_t)width,
-                       "Unexpected end of file\n");
+        f = fopen(filename.c_str(), "wb");
+        assert(f, "Could not write output file %s\n", filename.c_str());
+
+        int32_t h[5] = {width, height, frames, channels, typeCode};
+        fwrite(h, sizeof(int32_t), 5, f);
+    }
+
+    ~Writer() {
+        fclose(f);
+    }
+
+    void write(Image rows) {
+        assert(rows.width == width && rows.channels == channels && rows.frames == 1,
+               "Rows do not match the size of the tmp file being written\n");
+        assert(row + rows.height <= (long)height * frames, "Writing past the end of a tmp file\n");
+
+        long channelSize = (long)width * height * frames;
+        for (int c = 0; c < channels; c++) {
+            fseek(f, 20 + (c * channelSize + row * width) * size, SEEK_SET);
+            for (int y = 0; y < rows.height; y++) {
+                writeFn(f, &rows(0, y, c), width);
             }
         }
+        row += rows.height;
     }
 
-    return im;
+    void finish() {}
+
+private:
+    FILE *f;
+    void (*writeFn)(FILE *, const float *, int);
+    int width, height, frames, channels;
+    long size, row;
+};
 }
 
-Image load(string filename) {
-    FILE *file = fopen(filename.c_str(), "rb");
-    assert(file, "Could not open file %s\n", filename.c_str());
-
-    // get the dimensions
-    struct header_t {
-        int32_t width, height, frames, channels, typeCode;
-    } h;
-    assert(fread(&h, sizeof(int), 5, file) == 5,
-           "File ended before end of header\n");
-
-    Image im;
-
-    if (h.typeCode == FLOAT32) {
-        im = loadData<float>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == FLOAT64) {
-        im = loadData<double>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == UINT8) {
-        im = loadData<uint8_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == INT8) {
-        im = loadData<int8_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == UINT16) {
-        im = loadData<uint16_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == INT16) {
-        im = loadData<int16_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == UINT32) {
-        im = loadData<uint32_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == INT32) {
-        im = loadData<int32_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == UINT64) {
-        im = loadData<uint64_t>(file, h.width, h.height, h.frames, h.channels);
-    } else if (h.typeCode == INT64) {
-        im = loadData<int64_t>(file, h.width, h.height, h.frames, h.channels);
-    } else {
-        printf("Unknown type code %d. Possibly trying to load an old-style tmp file.\n", h.typeCode);
-        fseek(file, 16, SEEK_SET);
-        im = loadData<float>(file, h.width, h.height, h.frames, h.channels);
-    }
+RowReader *openReader(string filename) {
+    return new Reader(filename);
+}
 
-    fclose(file);
+RowWriter *openWriter(string filename, int width, int height, int frames, int channels, string type) {
+    return new Writer(filename, width, height, frames, channels, type);
+}
 
+Image load(string filename) {
+    Reader reader(filename);
+    Image im(reader.width, reader.height, reader.frames, reader.channels);
+    for (int t = 0; t < im.frames; t++) {
+        reader.read(im.frame(t));
+    }
     return im;
 }
+
+void save(Image im, string filename, string type) {
+    Writer writer(filename, im.width, im.height, im.frames, im.channels, type);
+    for (int t = 0; t < im.frames; t++) {
+        writer.write(im.frame(t));
+    }
+    writer.finish();
+}
 }
 }
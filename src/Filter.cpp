@@ -56,7 +56,7 @@ void GaussianBlur::parse(vector<string> args) {
         panic("-gaussianblur takes one, two, or three arguments\n");
     }
 
-    Image im = apply(stack(0), width, height, frames);
+    Image im = apply(peek(0), width, height, frames);
     pop();
     push(im);
 }
@@ -363,6 +363,7 @@ void FastBlur::apply(Image im, float filterWidth, float filterHeight, float filt
     }
 }
 
+IMAGESTACK_MULTIVERSION
 void FastBlur::blurChunk(float *data, int size,
                          const float c0, const float c1,
                          const float c2, const float c3) {
@@ -748,7 +749,7 @@ void LanczosBlur::parse(vector<string> args) {
         panic("-lanczosblur takes one, two, or three arguments\n");
     }
 
-    Image im = apply(stack(0), width, height, frames);
+    Image im = apply(peek(0), width, height, frames);
     pop();
     push(im);
 }
@@ -2,6 +2,7 @@
 #define IMAGESTACK_FUNC_H
 
 #include "Image.h"
+#include <atomic>
 namespace ImageStack {
 
 namespace Expr {
@@ -14,29 +15,168 @@ namespace Expr {
         std::string name;
         int size[4];
 
-        vector<int> evaluated;
+        BaseFunc() : foldable(true), folded(false) {}
+
+        // Per-scanline evaluation state for lazy funcs: Unclaimed, then
+        // Claimed by the thread computing it, then Done. A thread reads
+        // a scanline's pixels only after seeing Done with acquire
+        // ordering, which pairs with the release store made after the
+        // pixels were written.
+        enum {Unclaimed = 0, Claimed, Done};
+        vector<std::atomic<int> > evaluated;
+
+        // A lazy func whose consumers each read one of its scanlines per
+        // scanline of their own is folded: rather than backing the whole
+        // domain, it keeps only the scanlines that consumers have yet to
+        // read. Consumers register their reads in phase 2 and retire
+        // them in phase 4 as they finish each scanline. When a
+        // scanline's last read is retired its slot is recycled.
+        // Consumers that sample arbitrary sites clear foldable.
+        enum {SlotsPerChunk = 8};
+        bool foldable, folded;
+        vector<std::atomic<int> > uses;
+        vector<int> slotOf;
+        vector<Image> chunks;
+        vector<int> freeSlots;
+        int slotsAllocated;
+
+        int scanlineIndex(int y, int t, int c) const {
+            return ((c-minC) * (maxT-minT) + t-minT) * (maxY-minY) + y-minY;
+        }
+
+        // Find where scanline (y, t, c) is stored, and its coordinates
+        // within that image.
+        const Image &locate(int y, int t, int c, int *by, int *bt, int *bc) const {
+            if (folded) {
+                int slot = slotOf[scanlineIndex(y, t, c)];
+                *by = slot % SlotsPerChunk;
+                *bt = 0;
+                *bc = 0;
+                return chunks[slot / SlotsPerChunk];
+            } 
+            *by = y - minY;
+            *bt = t - minT;
+            *bc = c - minC;
+            return im;
+        }
+
+        int acquireSlot() {
+            int slot;
+            #pragma omp critical (FuncSlots)
+            {
+                if (freeSlots.empty()) {
+                    // At most one slot per scanline is live, so this
+                    // never runs past the end of chunks
+                    chunks[slotsAllocated / SlotsPerChunk] = 
+                        Image(maxX - minX + Vec::width, SlotsPerChunk, 1, 1);
+                    for (int i = SlotsPerChunk-1; i >= 0; i--) {
+                        freeSlots.push_back(slotsAllocated + i);
+                    }
+                    slotsAllocated += SlotsPerChunk;
+                }
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            return slot;
+        }
+
+        void releaseSlot(int slot) {
+            #pragma omp critical (FuncSlots)
+            freeSlots.push_back(slot);
+        }
+
+        // A consumer will read scanline (y, t, c) once more
+        void addUse(int y, int t, int c) {
+            if (!folded) return;
+            uses[scanlineIndex(y, t, c)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // A consumer has finished reading scanline (y, t, c)
+        void retireUse(int y, int t, int c) {
+            if (!folded) return;
+            int idx = scanlineIndex(y, t, c);
+            if (uses[idx].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                // Nobody else will read it, so give back its slot. If a
+                // consumer registered later asks for it again, it will
+                // be recomputed.
+                evaluated[idx].store(Unclaimed, std::memory_order_relaxed);
+                releaseSlot(slotOf[idx]);
+            }
+        }
+
+        bool claimScanline(int idx) {
+            int expected = Unclaimed;
+            if (evaluated[idx].load(std::memory_order_relaxed) != Unclaimed) return false;
+            return evaluated[idx].compare_exchange_strong(expected, Claimed, 
+                                                          std::memory_order_acquire,
+                                                          std::memory_order_relaxed);
+        }
+
+        // Compute a scanline we have claimed. If it throws, we hand it
+        // back so that waiting threads don't spin forever.
+        void evalClaimedScanline(int idx, int y, int t, int c) {
+            if (folded) slotOf[idx] = acquireSlot();
+            try {
+                evalScanline(y, t, c);
+            } catch (...) {
+                if (folded) releaseSlot(slotOf[idx]);
+                evaluated[idx].store(Unclaimed, std::memory_order_release);
+                throw;
+            }
+            evaluated[idx].store(Done, std::memory_order_release);
+        }
 
         // Evaluate myself at the given scanline only if necessary
         void evalScanlineIfNeeded(int y, int t, int c) {
             if (!lazy) return;
            
-            int idx = ((c-minC) * im.frames + t-minT) * im.height + y;
-            if (!evaluated[idx])  {
-                // TODO: consider adding mem fences
-                evaluated[idx] = 1;
-                evalScanline(y, t, c);
-                evaluated[idx] = 2;
-            } else {            
-                while (evaluated[idx] < 2) {
-                    //printf("Stalling...\n");
+            int idx = scanlineIndex(y, t, c);
+            if (evaluated[idx].load(std::memory_order_acquire) == Done) return;
+
+            if (claimScanline(idx)) {
+                evalClaimedScanline(idx, y, t, c);
+                return;
+            } 
+
+            // Someone else is computing this scanline. Rather than
+            // idling, compute scanlines further along in the same
+            // plane, which are the ones this thread is likely to ask for
+            // next. Only yield once there's nothing left to take.
+            int next = y+1;
+            while (evaluated[idx].load(std::memory_order_acquire) != Done) {
+                bool helped = false;
+                for (; next < maxY; next++) {
+                    int nextIdx = idx + next - y;
+                    // A folded func only computes scanlines someone
+                    // will read, or their slots would never come back
+                    if (folded && uses[nextIdx].load(std::memory_order_relaxed) == 0) continue;
+                    if (claimScanline(nextIdx)) {
+                        if (folded && uses[nextIdx].load(std::memory_order_relaxed) == 0) {
+                            evaluated[nextIdx].store(Unclaimed, std::memory_order_relaxed);
+                            continue;
+                        }
+                        evalClaimedScanline(nextIdx, next, t, c);
+                        next++;
+                        helped = true;
+                        break;
+                    }
+                }
+                if (!helped) {
                     sched_yield();
                 }
+                // A scanline handed back after an exception is ours to redo
+                if (claimScanline(idx)) {
+                    evalClaimedScanline(idx, y, t, c);
+                    return;
+                }
             }            
         }
 
         _Shift<Image>::Iter scanline(int x, int y, int t, int c, int width) {
             evalScanlineIfNeeded(y, t, c);
-            Image::Iter iter = im.scanline(x-minX, y-minY, t-minT, c-minC, width);
+            int by, bt, bc;
+            const Image &backing = locate(y, t, c, &by, &bt, &bc);
+            Image::Iter iter = backing.scanline(x-minX, by, bt, bc, width);
             return _Shift<Image>::Iter(iter, minX);            
         }
 
@@ -92,7 +232,9 @@ namespace Expr {
 
             //printf("Image has size: %d %d %d %d\n", im.width, im.height, im.frames, im.channels);
             //printf("Computing destination address...\n");
-            float *const dst = &im(0, y-minY, t-minT, c-minC) - minX;
+            int by, bt, bc;
+            const Image &backing = locate(y, t, c, &by, &bt, &bc);
+            float *const dst = &backing(0, by, bt, bc) - minX;
 
             //printf("Destination address is %p.\n"
             //"Computing source iterator...\n", dst);
@@ -103,6 +245,10 @@ namespace Expr {
             setScanline(src, dst, minX, maxX, 
                         boundedVecX, minVecX, maxVecX);
 
+            // We're done reading the scanlines this one depends on
+            Region row = {minX, y, t, c, maxX-minX, 1, 1, 1};
+            expr.prepare(row, 4);
+
             //printf("Done\n"); fflush(stdout);
         }   
 
@@ -112,10 +258,15 @@ namespace Expr {
                    r.x, r.y, r.t, r.c, r.width, r.height, r.frames, r.channels);               
             */
 
-            if (phase == 0) {
+            if (phase == 4) {
+                // Consumers retire their reads through FuncRef or
+                // Func, not here
+                return;
+            } else if (phase == 0) {
                 // Topology discovery: How many times will prepare be called for each phase
                 if (lastPhase != 0) {
                     count = 1;
+                    foldable = true;
                     expr.prepare(r, phase);
                 } else {
                     count++;
@@ -145,7 +296,11 @@ namespace Expr {
                     maxC = std::max(r.c + r.channels, maxC);
                 }
                 if (phaseCount == count) {
-                    if (!im.defined() ||                            
+                    folded = lazy && foldable;
+                    if (folded) {
+                        // Storage is allocated on demand in phase 2
+                        im = Image();
+                    } else if (!im.defined() ||                            
                         im.width < maxX - minX ||
                         im.height < maxY - minY ||
                         im.frames < maxT - minT ||
@@ -175,12 +330,41 @@ namespace Expr {
                 // Evaluation
                 if (lastPhase != 2) {
                     phaseCount = 1;
-                    expr.prepare(r, 2);
 
                     if (lazy) {
                         // No scanlines have been evaluated
-                        evaluated.assign((maxY - minY)*(maxT - minT)*(maxC - minC), false);
-                    } else {
+                        size_t n = (size_t)(maxY - minY)*(maxT - minT)*(maxC - minC);
+                        if (evaluated.size() != n) {
+                            vector<std::atomic<int> > fresh(n);
+                            evaluated.swap(fresh);
+                        }
+                        for (size_t i = 0; i < n; i++) {
+                            evaluated[i].store(Unclaimed, std::memory_order_relaxed);
+                        }
+                        if (folded) {
+                            // Nothing is stored or read yet
+                            vector<std::atomic<int> > fresh(n);
+                            uses.swap(fresh);
+                            slotOf.assign(n, -1);
+                            chunks.assign((n + SlotsPerChunk - 1) / SlotsPerChunk, Image());
+                            freeSlots.clear();
+                            slotsAllocated = 0;
+                        }
+                    }
+
+                    // Register our reads over everything we may
+                    // evaluate, not just the first consumer's region
+                    r.x = minX;
+                    r.y = minY;
+                    r.t = minT;
+                    r.c = minC;
+                    r.width = maxX - minX;
+                    r.height = maxY - minY;
+                    r.frames = maxT - minT;
+                    r.channels = maxC - minC;
+                    expr.prepare(r, 2);
+
+                    if (!lazy) {
                         /*
                         printf("Evaluating %s(%p) over %d %d %d %d %d %d %d %d\n",
                                name.c_str(), this, minX, minY, minT, minC,
@@ -206,6 +390,11 @@ namespace Expr {
             } else if (phase == 3) {
                 // clean up
                 im = Image();
+                vector<std::atomic<int> >().swap(evaluated);
+                vector<std::atomic<int> >().swap(uses);
+                vector<int>().swap(slotOf);
+                vector<Image>().swap(chunks);
+                vector<int>().swap(freeSlots);
             }                       
 
             lastPhase = phase;
@@ -283,15 +472,20 @@ namespace Expr {
                               AffineCase, ShiftedCase> Iter;
 
             Iter scanline(int x, int y, int t, int c, int width) const {
-                auto sxIter = (sx-ptr->minX).scanline(x, y, t, c, width);
-                auto syIter = (sy-ptr->minY).scanline(x, y, t, c, width);
-                auto stIter = (st-ptr->minT).scanline(x, y, t, c, width);
-                auto scIter = (sc-ptr->minC).scanline(x, y, t, c, width);
+                const Image *backing = &ptr->im;
+                int offY = ptr->minY, offT = ptr->minT, offC = ptr->minC;
                 if (ptr->lazy) {
                     if (AffineCase || ShiftedCase) {
-                        ptr->evalScanlineIfNeeded(syIter[0]+ptr->minY, 
-                                                  stIter[0]+ptr->minT, 
-                                                  scIter[0]+ptr->minC);                    
+                        int fy = sy.scanline(x, y, t, c, width)[0];
+                        int ft = st.scanline(x, y, t, c, width)[0];
+                        int fc = sc.scanline(x, y, t, c, width)[0];
+                        ptr->evalScanlineIfNeeded(fy, ft, fc);
+                        // The scanline may live in a recycled slot
+                        int by, bt, bc;
+                        backing = &ptr->locate(fy, ft, fc, &by, &bt, &bc);
+                        offY = fy - by;
+                        offT = ft - bt;
+                        offC = fc - bc;
                     } else {
                         Region r = {x, y, t, c, width, 1, 1, 1};
                         std::pair<int, int> yb = sy.bounds(r);
@@ -311,7 +505,11 @@ namespace Expr {
                         }
                     }
                 }
-                return Iter(ptr->im, sxIter, syIter, stIter, scIter);
+                auto sxIter = (sx-ptr->minX).scanline(x, y, t, c, width);
+                auto syIter = (sy-offY).scanline(x, y, t, c, width);
+                auto stIter = (st-offT).scanline(x, y, t, c, width);
+                auto scIter = (sc-offC).scanline(x, y, t, c, width);
+                return Iter(*backing, sxIter, syIter, stIter, scIter);
             }
 
 
@@ -341,6 +539,14 @@ namespace Expr {
                 st.prepare(r, phase);
                 sc.prepare(r, phase);
 
+                if (phase == 4) {
+                    // The scanlines of r are done reading from the function
+                    if (AffineCase || ShiftedCase) {
+                        forEachScanline(r, &BaseFunc::retireUse);
+                    }
+                    return;
+                }
+
                 // Plus the function itself over the bounds of what the args could evaluate to
                 std::pair<int, int> xb = sx.bounds(r);
                 std::pair<int, int> yb = sy.bounds(r);
@@ -353,8 +559,30 @@ namespace Expr {
                              tb.second - tb.first + 1,
                              cb.second - cb.first + 1};
                 ptr->prepare(r2, phase);
+
+                if (AffineCase || ShiftedCase) {
+                    // Each scanline of r reads one scanline of the function
+                    if (phase == 2) forEachScanline(r, &BaseFunc::addUse);
+                } else if (phase == 0) {
+                    // We may sample anywhere, so the function can't fold
+                    ptr->foldable = false;
+                }
             }
 
+        private:
+            // Call method on the function's scanline read by each scanline of r
+            void forEachScanline(Region r, void (BaseFunc::*method)(int, int, int)) const {
+                if (!ptr->folded) return;
+                for (int c = r.c; c < r.c + r.channels; c++) {
+                    for (int t = r.t; t < r.t + r.frames; t++) {
+                        for (int y = r.y; y < r.y + r.height; y++) {
+                            ((*ptr).*method)(sy.scanline(r.x, y, t, c, r.width)[0],
+                                             st.scanline(r.x, y, t, c, r.width)[0],
+                                             sc.scanline(r.x, y, t, c, r.width)[0]);
+                        }
+                    }
+                }
+            }
         };
 
 #define ShiftedCase(SX, SY, ST, SC)                                     \
@@ -408,7 +636,18 @@ namespace Expr {
         int maxVecX() const {return HUGE_INT;}
 
         void prepare(Region r, int phase) const {
-            ptr->prepare(r, phase);
+            if (phase != 4) ptr->prepare(r, phase);
+            if (!ptr->folded || (phase != 2 && phase != 4)) return;
+
+            // Each scanline of r reads the same scanline of the function
+            for (int c = r.c; c < r.c + r.channels; c++) {
+                for (int t = r.t; t < r.t + r.frames; t++) {
+                    for (int y = r.y; y < r.y + r.height; y++) {
+                        if (phase == 2) ptr->addUse(y, t, c);
+                        else ptr->retireUse(y, t, c);
+                    }
+                }
+            }
         }
 
         std::pair<float, float> bounds(Region r) const {
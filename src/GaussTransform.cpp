@@ -961,7 +961,17 @@ bool FastNLMeans::test() {
     // For noisy/2 to not be nearly equal dog/2, but noisy to be
     // nearly equal to dog, a substantial improvement must have been
     // made.
-    return nearlyEqual(out, dog);
+    if (!nearlyEqual(out, dog)) return false;
+
+    // With milder noise the shape of the patches matters more. A good
+    // approximation to Gaussian patches removes about a quarter of
+    // the squared error, while a plain box of the same size removes
+    // less than a tenth.
+    Image mild = dog.copy();
+    Noise::apply(mild, -0.1, 0.1);
+    out = FastNLMeans::apply(mild, 1, 3, 0.05);
+    Stats before((mild - dog) * (mild - dog)), after((out - dog) * (out - dog));
+    return after.mean() < 0.8 * before.mean();
 }
 
 void FastNLMeans::parse(vector<string> args) {
@@ -971,69 +981,242 @@ void FastNLMeans::parse(vector<string> args) {
     push(out);
 }
 
-Image FastNLMeans::apply(Image im, float patchSize, float spatialSigma, float patchSigma) {
-    Image out = im.copy();
-    Image weight(im.width, im.height, im.frames, 1);
-    weight.set(1);
+namespace {
+// The extended box mean at x of a row of length w, given the running
+// sums of the row: the values within r of x, plus the two values just
+// beyond those with weight alpha, clipped to the row.
+inline float clippedBoxMean(const float *sums, int w, int x, int r, float alpha) {
+    const int x0 = max(x - r, 0), x1 = min(x + r + 1, w);
+    float sum = sums[x1] - sums[x0], weight = x1 - x0;
+    if (x0 > 0) {
+        sum += alpha * (sums[x0] - sums[x0-1]);
+        weight += alpha;
+    }
+    if (x1 < w) {
+        sum += alpha * (sums[x1+1] - sums[x1]);
+        weight += alpha;
+    }
+    return sum / weight;
+}
+
+// Replace each value in a w x h block with its extended box mean
+// along the row
+void boxMeanRows(float *data, int w, int h, int r, float alpha, vector<float> &sums) {
+    sums.resize(w + 1);
+    // Away from the ends of the row the box is not clipped
+    const int inner0 = min(r + 1, w), inner1 = max(w - r - 1, inner0);
+    const float invWeight = 1.0f / (2*r + 1 + 2*alpha);
+    for (int y = 0; y < h; y++) {
+        float *row = data + y*w;
+        sums[0] = 0;
+        for (int x = 0; x < w; x++) {
+            sums[x+1] = sums[x] + row[x];
+        }
+        for (int x = 0; x < inner0; x++) {
+            row[x] = clippedBoxMean(&sums[0], w, x, r, alpha);
+        }
+        for (int x = inner0; x < inner1; x++) {
+            const float *lo = &sums[x - r], *hi = &sums[x + r + 1];
+            row[x] = (hi[0] - lo[0] + alpha * (lo[0] - lo[-1] + hi[1] - hi[0])) * invWeight;
+        }
+        for (int x = inner1; x < w; x++) {
+            row[x] = clippedBoxMean(&sums[0], w, x, r, alpha);
+        }
+    }
+}
 
-    // Iterate over all offsets
+// The same along the columns, where rows are stride values apart
+void boxMeanColumns(float *data, int w, int h, int stride, int r, float alpha, vector<float> &sums) {
+    sums.resize((size_t)(h + 1) * w);
+    for (int x = 0; x < w; x++) {
+        sums[x] = 0;
+    }
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            sums[(y+1)*w + x] = sums[y*w + x] + data[y*stride + x];
+        }
+    }
+    for (int y = 0; y < h; y++) {
+        const int y0 = max(y - r, 0), y1 = min(y + r + 1, h);
+        const float *top = &sums[y0*w], *bottom = &sums[y1*w];
+        // The rows just beyond the box, as differences of sums
+        const float a0 = y0 > 0 ? alpha : 0, a1 = y1 < h ? alpha : 0;
+        const float *before = y0 > 0 ? &sums[(y0-1)*w] : top;
+        const float *after = y1 < h ? &sums[(y1+1)*w] : bottom;
+        const float invWeight = 1.0f / (y1 - y0 + a0 + a1);
+        for (int x = 0; x < w; x++) {
+            float sum = bottom[x] - top[x];
+            sum += a0 * (top[x] - before[x]) + a1 * (after[x] - bottom[x]);
+            data[y*stride + x] = sum * invWeight;
+        }
+    }
+}
+}
+
+Image FastNLMeans::apply(Image im, float patchSize, float spatialSigma, float patchSigma) {
+    // Patches are weighted by three iterated extended boxes, which
+    // approximate a Gaussian with standard deviation patchSize. Each
+    // box has a third of the variance. A box of radius r has variance
+    // r(r+1)/3, and alpha is the weight on the two extra values that
+    // makes up the rest.
+    const float boxVariance = patchSize * patchSize / 3;
+    const int boxRadius = (int)((sqrtf(1 + 12*boxVariance) - 1) / 2);
+    const float boxAlpha = ((2*boxRadius + 1) * (boxVariance - boxRadius*(boxRadius + 1)/3.0f) /
+                            (2 * ((boxRadius + 1)*(boxRadius + 1) - boxVariance)));
+    const int R = 3 * (boxRadius + 1);
+    const float invPatchVariance = 1.0f / (patchSigma*patchSigma);
+
+    // Each offset is paired with its negation, which shares the same
+    // patch distances, so we only need the ones pointing forwards.
+    struct NLOffset {
+        int dx, dy;
+        float weight;
+    };
+    vector<NLOffset> offsets;
     int radius = (int)(ceilf(spatialSigma*4));
     for (int dy = -radius; dy <= radius; dy++) {
         for (int dx = -radius; dx <= radius; dx++) {
-            if (dx == 0 && dy == 0) {
-                // Already taken care of in the initialization of out and weight
-                continue;
+            if (dx < 0 || (dx == 0 && dy <= 0)) continue;
+            NLOffset o = {dx, dy, expf(-(dx*dx + dy*dy)/(2*spatialSigma*spatialSigma))};
+            if (o.weight < 0.05) continue;
+            offsets.push_back(o);
+        }
+    }
+
+    // The image is processed in tiles, so that the neighbourhood of
+    // a tile stays in cache while we visit all the offsets. Each tile
+    // has its own accumulators.
+    const int tile = 64;
+    const int tilesX = (im.width + tile - 1) / tile;
+    const int tilesY = (im.height + tile - 1) / tile;
+    const int maxSpan = tile + radius + 2*R;
+
+    Image out(im.width, im.height, im.frames, im.channels);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int job = 0; job < tilesX * tilesY * im.frames; job++) {
+        const int t = job / (tilesX * tilesY);
+        const int x0 = (job % tilesX) * tile, x1 = min(x0 + tile, im.width);
+        const int y0 = ((job / tilesX) % tilesY) * tile, y1 = min(y0 + tile, im.height);
+        const int tw = x1 - x0, th = y1 - y0;
+
+        // The pixel itself gets a weight of one
+        vector<float> acc((size_t)im.channels * th * tw), weight(th * tw, 1.0f);
+        for (int c = 0; c < im.channels; c++) {
+            for (int y = y0; y < y1; y++) {
+                memcpy(&acc[(c*th + y - y0)*tw], &im(x0, y, t, c), tw * sizeof(float));
             }
-            if (dx < 0 || (dx == 0 && dy < 0)) {
-                // We take care of these cases using symmetry
-                continue;
+        }
+
+        vector<float> distance(maxSpan * maxSpan), sums;
+
+        for (size_t i = 0; i < offsets.size(); i++) {
+            const int dx = offsets[i].dx, dy = offsets[i].dy;
+
+            // The distance between the patches at p and p+d is defined
+            // where both are inside the image
+            const int vx0 = max(0, -dx), vx1 = im.width - max(0, dx);
+            const int vy0 = max(0, -dy), vy1 = im.height - max(0, dy);
+
+            // We need distances for the tile and the tile shifted by -d
+            const int qx0 = max(min(x0, x0 - dx), vx0), qx1 = min(max(x1, x1 - dx), vx1);
+            const int qy0 = max(min(y0, y0 - dy), vy0), qy1 = min(max(y1, y1 - dy), vy1);
+            if (qx0 >= qx1 || qy0 >= qy1) continue;
+
+            // 1) Compare the image to a shifted version of itself
+            // around those pixels, summing over color channels
+            const int sx0 = max(qx0 - R, vx0), sx1 = min(qx1 + R, vx1);
+            const int sy0 = max(qy0 - R, vy0), sy1 = min(qy1 + R, vy1);
+            const int sw = sx1 - sx0, sh = sy1 - sy0;
+            for (int y = sy0; y < sy1; y++) {
+                float *delta = &distance[(y - sy0) * sw];
+                for (int x = 0; x < sw; x++) {
+                    delta[x] = 0;
+                }
+                for (int c = 0; c < im.channels; c++) {
+                    const float *a = &im(sx0, y, t, c), *b = &im(sx0 + dx, y + dy, t, c);
+                    for (int x = 0; x < sw; x++) {
+                        delta[x] += a[x] - b[x];
+                    }
+                }
             }
 
-            float spatialWeight = expf(-(dx*dx + dy*dy)/(2*spatialSigma*spatialSigma));
-            if (spatialWeight < 0.05) continue;
-
-            // 1) Compare image to shifted version of itself
-            // size of overlap region
-            const int w = im.width - abs(dx);
-            const int h = im.height - abs(dy);
-            const int f = im.frames;
-            // Subtract
-            Image delta =
-                im.region(max(dx, 0), max(dy, 0), 0, 0, w, h, f, im.channels) -
-                im.region(max(-dx, 0), max(-dy, 0), 0, 0, w, h, f, im.channels);
-
-            // 2) blur the square difference to get the patch-space distance
-            FastBlur::apply(delta, patchSize, patchSize, 0);
-            // Sum over color channels
-            for (int c = 1; c < delta.channels; c++) {
-                delta.channel(0) += delta.channel(c);
+            // 2) Blur the difference over the patch, and square it to
+            // get the patch-space distance. The boxes are clipped
+            // where the patches leave the valid region. Elsewhere the
+            // margin of R is enough for the edges of the block not to
+            // reach the pixels we need. Once the rows are blurred,
+            // only the columns we need are blurred.
+            for (int j = 0; j < 3; j++) {
+                boxMeanRows(&distance[0], sw, sh, boxRadius, boxAlpha, sums);
+            }
+            for (int j = 0; j < 3; j++) {
+                boxMeanColumns(&distance[qx0 - sx0], qx1 - qx0, sh, sw, boxRadius, boxAlpha, sums);
+            }
+            for (int y = qy0; y < qy1; y++) {
+                float *dist = &distance[(y - sy0) * sw + qx0 - sx0];
+                for (int x = 0; x < qx1 - qx0; x++) {
+                    dist[x] *= dist[x];
+                }
             }
-            delta = delta.channel(0);
 
             // 3) Pass the patch-space distance into a
             // cheap-to-compute Gaussian-like function to get the
-            // patch weight. The -0.1 and the max makes it truncate at
-            // 3 standard deviations.
-            delta.set(spatialWeight * max(0, 1.1f/((delta*delta)/(patchSigma*patchSigma) + 1) - 0.1));
-
-            // 4) Accumulate into the output.
-            // We transfer energy in the +dx, +dy and the -dx, -dy directions using the same weights
-            weight.region(max(dx, 0), max(dy, 0), 0, 0, w, h, f, 1) += delta;
-            weight.region(max(-dx, 0), max(-dy, 0), 0, 0, w, h, f, 1) += delta;
-            for (int c = 0; c < im.channels; c++) {
-                out.region(max(dx, 0), max(dy, 0), 0, c, w, h, f, 1) += delta *
-                    im.region(max(-dx, 0), max(-dy, 0), 0, c, w, h, f, 1);
-                out.region(max(-dx, 0), max(-dy, 0), 0, c, w, h, f, 1) += delta *
-                    im.region(max(dx, 0), max(dy, 0), 0, c, w, h, f, 1);
+            // patch weight, and accumulate. The -0.1 and the max makes
+            // it truncate at 3 standard deviations. We transfer energy
+            // in the +dx, +dy and the -dx, -dy directions using the
+            // same weights.
+            const Vec::type spatial = Vec::broadcast(offsets[i].weight);
+            const Vec::type scale = Vec::broadcast(invPatchVariance);
+            const Vec::type one = Vec::broadcast(1.0f), a = Vec::broadcast(1.1f), b = Vec::broadcast(0.1f);
+            for (int dir = 1; dir >= -1; dir -= 2) {
+                const int ox = dir * dx, oy = dir * dy;
+                // The pixels p in the tile for which p+o is in the image
+                const int ax0 = max(x0, -ox), ax1 = min(x1, im.width - ox);
+                const int ay0 = max(y0, -oy), ay1 = min(y1, im.height - oy);
+                // The distance for the pair is stored at the
+                // earlier pixel of the two
+                const int ex = dir > 0 ? 0 : ox, ey = dir > 0 ? 0 : oy;
+                for (int y = ay0; y < ay1; y++) {
+                    const int n = ax1 - ax0;
+                    const float *dist = &distance[(y + ey - sy0) * sw + ax0 + ex - sx0];
+                    float *w = &weight[(y - y0) * tw + ax0 - x0];
+                    int x = 0;
+                    for (; x + Vec::width <= n; x += Vec::width) {
+                        Vec::type d = Vec::fma(Vec::load(dist + x), scale, one);
+                        Vec::type v = Vec::Max::vec(Vec::Sub::vec(Vec::Div::vec(a, d), b), Vec::zero());
+                        v = Vec::Mul::vec(v, spatial);
+                        Vec::store(Vec::Add::vec(Vec::load(w + x), v), w + x);
+                        for (int c = 0; c < im.channels; c++) {
+                            float *o = &acc[(c*th + y - y0)*tw + ax0 - x0];
+                            const float *in = &im(ax0 + ox, y + oy, t, c);
+                            Vec::store(Vec::fma(v, Vec::load(in + x), Vec::load(o + x)), o + x);
+                        }
+                    }
+                    for (; x < n; x++) {
+                        float v = offsets[i].weight * max(0.0f, 1.1f/(dist[x] * invPatchVariance + 1) - 0.1f);
+                        w[x] += v;
+                        for (int c = 0; c < im.channels; c++) {
+                            acc[(c*th + y - y0)*tw + ax0 - x0 + x] += v * im(ax0 + ox + x, y + oy, t, c);
+                        }
+                    }
+                }
             }
         }
-    }
 
-    // Normalize
-    weight.set(1.0f/weight);
-    for (int c = 0; c < out.channels; c++) {
-        out.channel(c) *= weight;
+        // Normalize
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                float invWeight = 1.0f / weight[(y - y0)*tw + x - x0];
+                for (int c = 0; c < im.channels; c++) {
+                    out(x, y, t, c) = acc[(c*th + y - y0)*tw + x - x0] * invWeight;
+                }
+            }
+        }
     }
+
     return out;
 }
 
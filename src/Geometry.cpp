@@ -3,6 +3,9 @@
 #include "Stack.h"
 #include "Arithmetic.h"
 #include "Statistics.h"
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 namespace ImageStack {
 
 void Upsample::help() {
@@ -48,7 +51,7 @@ void Upsample::parse(vector<string> args) {
         boxWidth = boxHeight = readInt(args[0]);
     }
 
-    Image im = apply(stack(0), boxWidth, boxHeight, boxFrames);
+    Image im = apply(peek(0), boxWidth, boxHeight, boxFrames);
     pop();
     push(im);
 }
@@ -117,7 +120,7 @@ void Downsample::parse(vector<string> args) {
         boxWidth = boxHeight = readInt(args[0]);
     }
 
-    Image im = apply(stack(0), boxWidth, boxHeight, boxFrames);
+    Image im = apply(peek(0), boxWidth, boxHeight, boxFrames);
     pop();
     push(im);
 }
@@ -190,11 +193,11 @@ bool Resample::test() {
 void Resample::parse(vector<string> args) {
 
     if (args.size() == 2) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]));
+        Image im = apply(peek(0), readInt(args[0]), readInt(args[1]));
         pop();
         push(im);
     } else if (args.size() == 3) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]), readInt(args[2]));
+        Image im = apply(peek(0), readInt(args[0]), readInt(args[1]), readInt(args[2]));
         pop();
         push(im);
     } else {
@@ -557,7 +560,9 @@ void Deinterleave::apply(Image im, int rx, int ry, int rt) {
 void Rotate::help() {
     printf("\n-rotate takes a number of degrees, and rotates every frame of the current image\n"
            "clockwise by that angle. The rotation preserves the image size, filling empty\n"
-           " areas with zeros, and throwing away data which will not fit in the bounds.\n\n"
+           " areas with zeros, and throwing away data which will not fit in the bounds.\n"
+           "An optional second argument selects the interpolation method, as for\n"
+           "-affinewarp.\n\n"
            "Usage: ImageStack -load a.tga -rotate 45 -save b.tga\n\n");
 }
 
@@ -585,14 +590,16 @@ bool Rotate::test() {
 
 
 void Rotate::parse(vector<string> args) {
-    assert(args.size() == 1, "-rotate takes one argument\n");
-    Image im = apply(stack(0), readFloat(args[0]));
+    assert(args.size() == 1 || args.size() == 2, "-rotate takes one or two arguments\n");
+    AffineWarp::Method method = AffineWarp::Lanczos;
+    if (args.size() == 2) method = AffineWarp::readMethod(args[1]);
+    Image im = apply(peek(0), readFloat(args[0]), method);
     pop();
     push(im);
 }
 
 
-Image Rotate::apply(Image im, float degrees) {
+Image Rotate::apply(Image im, float degrees, AffineWarp::Method method) {
 
     // figure out the rotation matrix
     float radians = degrees * M_PI / 180;
@@ -605,56 +612,222 @@ Image Rotate::apply(Image im, float degrees) {
     vector<float> matrix(6);
     matrix[0] = cosine; matrix[1] = sine; matrix[2] = xorigin - (cosine * xorigin + sine * yorigin);
     matrix[3] = -sine; matrix[4] = cosine; matrix[5] = yorigin - (-sine * xorigin + cosine * yorigin);
-    return AffineWarp::apply(im, matrix);
+    return AffineWarp::apply(im, matrix, method);
 }
 
 
 void AffineWarp::help() {
     printf("\n-affinewarp takes a 2x3 matrix in row major order, and performs that affine warp\n"
-           "on the image.\n\n"
+           "on the image. An optional seventh argument selects the interpolation method:\n"
+           "lanczos (a 6x6 lanczos-3 filter, the default), cubic (a 4x4 Catmull-Rom spline)\n"
+           "or linear (bilinear).\n\n"
            "Usage: ImageStack -load a.jpg -affinewarp 0.9 0.1 0 0.1 0.9 0 -save out.jpg\n\n");
 }
 
 bool AffineWarp::test() {
-    // already tested by rotate
+    // Lanczos warps should match sampling the image one pixel at a time
+    Image a(67, 45, 2, 3);
+    Noise::apply(a, 0, 1);
+    float matrix[] = {0.9f, 0.3f, -4.5f, -0.2f, 1.1f, 3.25f};
+    Image b = apply(a, matrix);
+    Image correct(a.width, a.height, a.frames, a.channels);
+    vector<float> sample(a.channels);
+    for (int t = 0; t < a.frames; t++) {
+        for (int y = 0; y < a.height; y++) {
+            for (int x = 0; x < a.width; x++) {
+                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
+                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
+                if (fx < 0 || fx > a.width || fy < 0 || fy > a.height) continue;
+                a.sample2D(fx, fy, t, sample);
+                for (int c = 0; c < a.channels; c++) {
+                    correct(x, y, t, c) = sample[c];
+                }
+            }
+        }
+    }
+    if (!nearlyEqual(b, correct)) return false;
+
+    // Linear and cubic interpolation should reproduce a ramp exactly
+    // away from the edges
+    Image ramp(67, 45, 1, 1);
+    ramp.set(0.25f*Expr::X() - 0.5f*Expr::Y());
+    Method methods[] = {Linear, Cubic};
+    for (int i = 0; i < 2; i++) {
+        Image warped = apply(ramp, matrix, methods[i]);
+        for (int y = 0; y < ramp.height; y++) {
+            for (int x = 0; x < ramp.width; x++) {
+                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
+                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
+                if (fx < 2 || fx > ramp.width-3 || fy < 2 || fy > ramp.height-3) continue;
+                if (fabs(warped(x, y) - (0.25f*fx - 0.5f*fy)) > 0.001f) {
+                    printf("%d %d: %f vs %f\n", x, y, warped(x, y), 0.25f*fx - 0.5f*fy);
+                    return false;
+                }
+            }
+        }
+    }
+
     return true;
 }
 
 void AffineWarp::parse(vector<string> args) {
-    assert(args.size() == 6, "-affinewarp takes six arguments\n");
+    assert(args.size() == 6 || args.size() == 7, "-affinewarp takes six or seven arguments\n");
     vector<float> matrix(6);
     for (int i = 0; i < 6; i++) { matrix[i] = readFloat(args[i]); }
-    Image im = apply(stack(0), matrix);
+    Method method = Lanczos;
+    if (args.size() == 7) method = readMethod(args[6]);
+    Image im = apply(peek(0), matrix, method);
     pop();
     push(im);
 }
 
-Image AffineWarp::apply(Image im, vector<float> matrix) {
+AffineWarp::Method AffineWarp::readMethod(string name) {
+    if (name == "lanczos") {
+        return Lanczos;
+    } else if (name == "linear" || name == "bilinear") {
+        return Linear;
+    } else if (name == "cubic" || name == "bicubic") {
+        return Cubic;
+    }
+    panic("Unknown interpolation method %s\n", name.c_str());
+    return Lanczos;
+}
+
+Image AffineWarp::apply(Image im, vector<float> matrix, Method method) {
 
     assert(matrix.size() == 6, "An affine warp requires a vector with 6 entries\n");
-    return apply(im, &matrix[0]);
+    return apply(im, &matrix[0], method);
 }
 
-Image AffineWarp::apply(Image im, float *matrix) {
+namespace {
+// Catmull-Rom spline weight for a tap at distance x
+inline float catmullRom(float x) {
+    x = fabs(x);
+    if (x < 1) return (1.5f*x - 2.5f)*x*x + 1;
+    if (x < 2) return ((-0.5f*x + 2.5f)*x - 4)*x + 2;
+    return 0;
+}
+}
+
+Image AffineWarp::apply(Image im, float *matrix, Method method) {
     Image out(im.width, im.height, im.frames, im.channels);
 
-    vector<float> sample(im.channels);
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                // figure out the sample location
-                float fx = matrix[0] * x + matrix[1] * y + matrix[2];
-                float fy = matrix[3] * x + matrix[4] * y + matrix[5];
-                // don't sample outside the image
-                if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
-                    for (int c = 0; c < im.channels; c++)
-                        out(x, y, t, c) = 0;
-                } else {
-                    im.sample2D(fx, fy, t, sample);
-                    for (int c = 0; c < im.channels; c++)
-                        out(x, y, t, c) = sample[c];
+    // The filter footprint is taps wide, and starts at the integer
+    // part of the sample location plus left
+    int taps, left;
+    switch (method) {
+    case Linear:
+        taps = 2; left = 0;
+        break;
+    case Cubic:
+        taps = 4; left = -1;
+        break;
+    default:
+        taps = 6; left = -2;
+        break;
+    }
+
+    // Each scanline is done in two passes. The first computes the
+    // sample location and the separable x and y filter weights for
+    // every output pixel. Those loops have no dependence between
+    // pixels, so they vectorize. The second pass sums the footprint
+    // of each pixel, one channel at a time. The taps are summed in the
+    // same order, with the same weights, as Image::sample2D, so
+    // lanczos results are identical to sampling one pixel at a time.
+    const int rows = im.height * im.frames;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int y = r % im.height, t = r / im.height;
+        const int width = im.width;
+
+        vector<float> fxs(width), fys(width);
+        vector<int> ixs(width), iys(width);
+        vector<float> weightX(taps * width), weightY(taps * width);
+        vector<float> sample(im.channels);
+
+        for (int x = 0; x < width; x++) {
+            fxs[x] = matrix[0] * x + matrix[1] * y + matrix[2];
+            fys[x] = matrix[3] * x + matrix[4] * y + matrix[5];
+            ixs[x] = (int)fxs[x];
+            iys[x] = (int)fys[x];
+        }
+
+        if (method == Lanczos) {
+            // These get normalized below
+            for (int k = 0; k < taps; k++) {
+                float *wx = &weightX[k*width], *wy = &weightY[k*width];
+                for (int x = 0; x < width; x++) {
+                    wx[x] = lanczos_3(fxs[x] - (k + ixs[x] + left));
+                    wy[x] = lanczos_3(fys[x] - (k + iys[x] + left));
+                }
+            }
+        } else if (method == Cubic) {
+            for (int k = 0; k < taps; k++) {
+                float *wx = &weightX[k*width], *wy = &weightY[k*width];
+                for (int x = 0; x < width; x++) {
+                    wx[x] = catmullRom(fxs[x] - (k + ixs[x] + left));
+                    wy[x] = catmullRom(fys[x] - (k + iys[x] + left));
                 }
             }
+        } else {
+            for (int x = 0; x < width; x++) {
+                float dx = fxs[x] - ixs[x], dy = fys[x] - iys[x];
+                weightX[x] = 1 - dx;
+                weightX[width + x] = dx;
+                weightY[x] = 1 - dy;
+                weightY[width + x] = dy;
+            }
+        }
+
+        for (int x = 0; x < width; x++) {
+            // don't sample outside the image
+            float fx = fxs[x], fy = fys[x];
+            if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) continue;
+
+            // clip the footprint to the image, treating the outside as zero
+            const int minX = ixs[x] + left, minY = iys[x] + left;
+            const int firstX = max(0, -minX), lastX = min(taps, im.width - minX);
+            const int firstY = max(0, -minY), lastY = min(taps, im.height - minY);
+
+            float wx[6], wy[6];
+            for (int k = 0; k < taps; k++) {
+                wx[k] = weightX[k*width + x];
+                wy[k] = weightY[k*width + x];
+            }
+            if (method == Lanczos) {
+                // Normalize one pixel at a time. Vectorized reciprocals
+                // may be approximate, which would stop this matching
+                // Image::sample2D exactly.
+                float totalX = 0, totalY = 0;
+                for (int k = 0; k < taps; k++) {
+                    totalX += wx[k];
+                    totalY += wy[k];
+                }
+                totalX = 1.0f/totalX;
+                totalY = 1.0f/totalY;
+                for (int k = 0; k < taps; k++) {
+                    wx[k] *= totalX;
+                    wy[k] *= totalY;
+                }
+            }
+
+            float *result = &sample[0];
+            for (int c = 0; c < im.channels; c++) {
+                result[c] = 0;
+            }
+            for (int ky = firstY; ky < lastY; ky++) {
+                for (int kx = firstX; kx < lastX; kx++) {
+                    float yxWeight = wy[ky] * wx[kx];
+                    for (int c = 0; c < im.channels; c++) {
+                        result[c] += im(minX + kx, minY + ky, t, c) * yxWeight;
+                    }
+                }
+            }
+            for (int c = 0; c < im.channels; c++) {
+                out(x, y, t, c) = result[c];
+            }
         }
     }
 
@@ -713,17 +886,17 @@ void Crop::parse(vector<string> args) {
     Image im;
 
     if (args.size() == 0) {
-        im = apply(stack(0));
+        im = apply(peek(0));
     } else if (args.size() == 2) {
-        im = apply(stack(0),
+        im = apply(peek(0),
                    0, 0, readInt(args[0]),
-                   stack(0).width, stack(0).height, readInt(args[1]));
+                   peek(0).width, peek(0).height, readInt(args[1]));
     } else if (args.size() == 4) {
-        im = apply(stack(0),
+        im = apply(peek(0),
                    readInt(args[0]), readInt(args[1]),
                    readInt(args[2]), readInt(args[3]));
     } else if (args.size() == 6) {
-        im = apply(stack(0),
+        im = apply(peek(0),
                    readInt(args[0]), readInt(args[1]), readInt(args[2]),
                    readInt(args[3]), readInt(args[4]), readInt(args[5]));
     } else {
@@ -957,7 +1130,7 @@ bool Adjoin::test() {
 void Adjoin::parse(vector<string> args) {
     assert(args.size() == 1, "-adjoin takes exactly one argument\n");
     char dimension = readChar(args[0]);
-    Image im = apply(stack(1), stack(0), dimension);
+    Image im = apply(peek(1), peek(0), dimension);
     pop();
     pop();
     push(im);
@@ -1035,13 +1208,13 @@ void Transpose::help() {
 void Transpose::parse(vector<string> args) {
     assert(args.size() == 0 || args.size() == 2, "-transpose takes either zero or two arguments\n");
     if (args.size() == 0) {
-        Image im = apply(stack(0), 'x', 'y');
+        Image im = apply(peek(0), 'x', 'y');
         pop();
         push(im);
     } else {
         char arg1 = readChar(args[0]);
         char arg2 = readChar(args[1]);
-        Image im = apply(stack(0), arg1, arg2);
+        Image im = apply(peek(0), arg1, arg2);
         pop();
         push(im);
     }
@@ -1064,95 +1237,191 @@ bool Transpose::test() {
     Stats s(a2);
     if (s.mean() != 0 || s.variance() != 0) return false;
 
+    // Check the blocked transposes on sizes that aren't multiples
+    // of the block size
+    Image b(83, 70, 5, 9);
+    Noise::apply(b, 0, 1);
+    char dims[] = {'y', 't', 'c'};
+    for (int i = 0; i < 3; i++) {
+        Image bt = Transpose::apply(b, 'x', dims[i]);
+        for (int c = 0; c < b.channels; c++) {
+            for (int t = 0; t < b.frames; t++) {
+                for (int y = 0; y < b.height; y++) {
+                    for (int x = 0; x < b.width; x++) {
+                        float val = (dims[i] == 'y' ? bt(y, x, t, c) :
+                                     dims[i] == 't' ? bt(t, y, x, c) :
+                                     bt(c, y, t, x));
+                        if (val != b(x, y, t, c)) return false;
+                    }
+                }
+            }
+        }
+    }
+
+    // Views share memory with the input
+    Image v = Transpose::view(b, 'c', 'y');
+    if (v.height != b.channels || v(3, 2, 1, 4) != b(3, 4, 1, 2)) return false;
+
     return true;
 }
 
-Image Transpose::apply(Image im, char arg1, char arg2) {
+namespace {
+#ifdef __AVX__
+// Transpose an 8x8 block within registers
+inline void transpose8x8(const float *src, int srcStride, float *dst, int dstStride) {
+    __m256 r0 = _mm256_loadu_ps(src + 0*srcStride), r1 = _mm256_loadu_ps(src + 1*srcStride);
+    __m256 r2 = _mm256_loadu_ps(src + 2*srcStride), r3 = _mm256_loadu_ps(src + 3*srcStride);
+    __m256 r4 = _mm256_loadu_ps(src + 4*srcStride), r5 = _mm256_loadu_ps(src + 5*srcStride);
+    __m256 r6 = _mm256_loadu_ps(src + 6*srcStride), r7 = _mm256_loadu_ps(src + 7*srcStride);
+
+    // interleave pairs of rows
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+    // then pairs of pairs, giving 4x4 transposes in each 128-bit half
+    __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    // and finally swap the off-diagonal halves
+    _mm256_storeu_ps(dst + 0*dstStride, _mm256_permute2f128_ps(u0, u4, 0x20));
+    _mm256_storeu_ps(dst + 1*dstStride, _mm256_permute2f128_ps(u1, u5, 0x20));
+    _mm256_storeu_ps(dst + 2*dstStride, _mm256_permute2f128_ps(u2, u6, 0x20));
+    _mm256_storeu_ps(dst + 3*dstStride, _mm256_permute2f128_ps(u3, u7, 0x20));
+    _mm256_storeu_ps(dst + 4*dstStride, _mm256_permute2f128_ps(u0, u4, 0x31));
+    _mm256_storeu_ps(dst + 5*dstStride, _mm256_permute2f128_ps(u1, u5, 0x31));
+    _mm256_storeu_ps(dst + 6*dstStride, _mm256_permute2f128_ps(u2, u6, 0x31));
+    _mm256_storeu_ps(dst + 7*dstStride, _mm256_permute2f128_ps(u3, u7, 0x31));
+}
+#endif
+
+// Transpose a matrix that is w wide and h tall. Element (i, j) of
+// the source is src[j*srcStride + i], and it goes to
+// dst[i*dstStride + j]. Big blocks are split in half along their
+// longer side until both sides fit in cache, whatever the cache size.
+void transposeBlock(const float *src, int srcStride, float *dst, int dstStride, int w, int h) {
+    if (w > 32 && w >= h) {
+        int half = ((w / 2) + 7) & ~7;
+        transposeBlock(src, srcStride, dst, dstStride, half, h);
+        transposeBlock(src + half, srcStride, dst + half*dstStride, dstStride, w - half, h);
+        return;
+    } else if (h > 32) {
+        int half = ((h / 2) + 7) & ~7;
+        transposeBlock(src, srcStride, dst, dstStride, w, half);
+        transposeBlock(src + half*srcStride, srcStride, dst + half, dstStride, w, h - half);
+        return;
+    }
 
+    int w8 = 0, h8 = 0;
+    #ifdef __AVX__
+    w8 = w & ~7;
+    h8 = h & ~7;
+    for (int j = 0; j < h8; j += 8) {
+        for (int i = 0; i < w8; i += 8) {
+            transpose8x8(src + j*srcStride + i, srcStride, dst + i*dstStride + j, dstStride);
+        }
+    }
+    #endif
+
+    // whatever is left over at the right and bottom edges
+    for (int j = 0; j < h; j++) {
+        for (int i = (j < h8 ? w8 : 0); i < w; i++) {
+            dst[i*dstStride + j] = src[j*srcStride + i];
+        }
+    }
+}
+}
+
+Image Transpose::view(Image im, char arg1, char arg2) {
     char dim1 = min(arg1, arg2);
     char dim2 = max(arg1, arg2);
 
     if (dim1 == 'c' && dim2 == 'y') {
-        Image out(im.width, im.channels, im.frames, im.height);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(x, c, t, y) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
+        swap(im.height, im.channels);
+        swap(im.ystride, im.cstride);
     } else if (dim1 == 'c' && dim2 == 't') {
-        Image out(im.width, im.height, im.channels, im.frames);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(x, y, c, t) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
-    } else if (dim1 == 'c' && dim2 == 'x') {
-        Image out(im.channels, im.height, im.frames, im.width);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(c, y, t, x) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
-    } else if (dim1 == 'x' && dim2 == 'y') {
+        swap(im.frames, im.channels);
+        swap(im.tstride, im.cstride);
+    } else if (dim1 == 't' && dim2 == 'y') {
+        swap(im.height, im.frames);
+        swap(im.ystride, im.tstride);
+    } else if (dim1 == 'x' || dim2 == 'x') {
+        panic("Transposes involving x can't be done by exchanging strides\n");
+    } else {
+        panic("-transpose only understands dimensions 'c', 'x', 'y', and 't'\n");
+    }
+    return im;
+}
 
-        Image out(im.height, im.width, im.frames, im.channels);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(y, x, t, c) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
+Image Transpose::apply(Image im, char arg1, char arg2) {
 
+    char dim1 = min(arg1, arg2);
+    char dim2 = max(arg1, arg2);
+
+    if (dim1 != 'x' && dim2 != 'x') {
+        // Scanlines stay contiguous, so copying the strided view is
+        // already sequential in memory
+        return view(im, dim1, dim2).copy();
+    }
+
+    // Otherwise x is exchanged with some other dimension. Every
+    // slice through x and that dimension is a matrix to be transposed
+    // blockwise. The slices, and bands of 64 rows within them, are
+    // independent and are done in parallel.
+    Image out;
+    int sliceA, sliceB, rows, inStride, outStride;
+    if (dim1 == 'x' && dim2 == 'y') {
+        out = Image(im.height, im.width, im.frames, im.channels);
+        sliceA = im.frames; sliceB = im.channels; rows = im.height;
+        inStride = im.ystride; outStride = out.ystride;
     } else if (dim1 == 't' && dim2 == 'x') {
-        Image out(im.frames, im.height, im.width, im.channels);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(t, y, x, c) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
-    } else if (dim1 == 't' && dim2 == 'y') {
-        Image out(im.width, im.frames, im.height, im.channels);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        out(x, t, y, c) = im(x, y, t, c);
-                    }
-                }
-            }
-        }
-        return out;
+        out = Image(im.frames, im.height, im.width, im.channels);
+        sliceA = im.height; sliceB = im.channels; rows = im.frames;
+        inStride = im.tstride; outStride = out.tstride;
+    } else if (dim1 == 'c' && dim2 == 'x') {
+        out = Image(im.channels, im.height, im.frames, im.width);
+        sliceA = im.height; sliceB = im.frames; rows = im.channels;
+        inStride = im.cstride; outStride = out.cstride;
     } else {
         panic("-transpose only understands dimensions 'c', 'x', 'y', and 't'\n");
+        return Image();
     }
 
-    // keep compiler happy
-    return Image();
+    const int band = 64;
+    const int bands = (rows + band - 1) / band;
+    const int tasks = sliceA * sliceB * bands;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < tasks; i++) {
+        int b = i % bands;
+        int a = (i / bands) % sliceA;
+        int s = i / (bands * sliceA);
+        const float *src;
+        float *dst;
+        if (dim2 == 'y') {
+            src = &im(0, 0, a, s);
+            dst = &out(0, 0, a, s);
+        } else if (dim1 == 't') {
+            src = &im(0, a, 0, s);
+            dst = &out(0, a, 0, s);
+        } else {
+            src = &im(0, a, s, 0);
+            dst = &out(0, a, s, 0);
+        }
+        int first = b * band, count = min(band, rows - first);
+        transposeBlock(src + first * inStride, inStride, dst + first, outStride, im.width, count);
+    }
 
+    return out;
 }
 
 void Translate::help() {
@@ -1183,11 +1452,11 @@ bool Translate::test() {
 
 void Translate::parse(vector<string> args) {
     if (args.size() == 2) {
-        Image im = apply(stack(0), readFloat(args[0]), readFloat(args[1]), 0);
+        Image im = apply(peek(0), readFloat(args[0]), readFloat(args[1]), 0);
         pop();
         push(im);
     } else if (args.size() == 3) {
-        Image im = apply(stack(0), readFloat(args[0]), readFloat(args[1]), readFloat(args[2]));
+        Image im = apply(peek(0), readFloat(args[0]), readFloat(args[1]), readFloat(args[2]));
         pop();
         push(im);
     } else {
@@ -1472,7 +1741,7 @@ void Tile::parse(vector<string> args) {
     } else {
         panic("-tile takes two or three arguments\n");
     }
-    Image im = apply(stack(0), xRepeat, yRepeat, tRepeat);
+    Image im = apply(peek(0), xRepeat, yRepeat, tRepeat);
     pop();
     push(im);
 }
@@ -1518,14 +1787,14 @@ bool Subsample::test() {
 
 void Subsample::parse(vector<string> args) {
     if (args.size() == 2) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]));
+        Image im = apply(peek(0), readInt(args[0]), readInt(args[1]));
         pop(); push(im);
     } else if (args.size() == 4) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]),
+        Image im = apply(peek(0), readInt(args[0]), readInt(args[1]),
                          readInt(args[2]), readInt(args[3]));
         pop(); push(im);
     } else if (args.size() == 6) {
-        Image im = apply(stack(0), readInt(args[0]), readInt(args[1]), readInt(args[2]),
+        Image im = apply(peek(0), readInt(args[0]), readInt(args[1]), readInt(args[2]),
                          readInt(args[3]), readInt(args[4]), readInt(args[5]));
         pop(); push(im);
     } else {
@@ -1592,7 +1861,7 @@ bool TileFrames::test() {
 void TileFrames::parse(vector<string> args) {
     assert(args.size() == 2, "-tileframes takes two arguments\n");
 
-    Image im = apply(stack(0), readInt(args[0]), readInt(args[1]));
+    Image im = apply(peek(0), readInt(args[0]), readInt(args[1]));
     pop();
     push(im);
 }
@@ -1649,7 +1918,7 @@ bool FrameTiles::test() {
 void FrameTiles::parse(vector<string> args) {
     assert(args.size() == 2, "-frametiles takes two arguments\n");
 
-    Image im = apply(stack(0), readInt(args[0]), readInt(args[1]));
+    Image im = apply(peek(0), readInt(args[0]), readInt(args[1]));
     pop();
     push(im);
 }
@@ -1719,7 +1988,7 @@ bool Warp::test() {
 
 void Warp::parse(vector<string> args) {
     assert(args.size() == 0, "warp takes no arguments\n");
-    Image im = apply(stack(0), stack(1));
+    Image im = apply(peek(0), peek(1));
     pop();
     pop();
     push(im);
@@ -1792,10 +2061,17 @@ void Reshape::parse(vector<string> args) {
 Image Reshape::apply(Image im, int x, int y, int t, int c) {
     assert(t *x *y *c == im.frames * im.width * im.height * im.channels,
            "New shape uses a different amount of memory that the old shape.\n");
-    assert(im.dense(), "Input image is not densely packed in memory");
-    Image out(x, y, t, c);
-    memcpy(&out(0, 0, 0, 0), &im(0, 0, 0, 0), x*y*t*c*sizeof(float));
-    return out;
+    // A densely packed image is reshaped by indexing the same memory
+    // differently, without copying. Anything else is packed first.
+    if (!im.dense()) im = im.copy();
+    im.width = x;
+    im.height = y;
+    im.frames = t;
+    im.channels = c;
+    im.ystride = x;
+    im.tstride = x*y;
+    im.cstride = x*y*t;
+    return im;
 }
 
 
@@ -60,21 +60,24 @@ private:
     static Image resampleY(Image im, int height);
 };
 
-class Rotate : public Operation {
+class AffineWarp : public Operation {
 public:
+    enum Method {Lanczos = 0, Linear, Cubic};
+
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, float degrees);
+    static Image apply(Image im, vector<float> warp, Method method = Lanczos);
+    static Image apply(Image im, float *warp, Method method = Lanczos);
+    static Method readMethod(string name);
 };
 
-class AffineWarp : public Operation {
+class Rotate : public Operation {
 public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, vector<float> warp);
-    static Image apply(Image im, float *warp);
+    static Image apply(Image im, float degrees, AffineWarp::Method method = AffineWarp::Lanczos);
 };
 
 class Crop : public Operation {
@@ -109,6 +112,10 @@ public:
     bool test();
     void parse(vector<string> args);
     static Image apply(Image im, char arg1, char arg2);
+    // Transposes that don't involve x just exchange two strides. This
+    // returns an image sharing the input's memory with the strides
+    // exchanged, for callers that don't need it densely packed.
+    static Image view(Image im, char arg1, char arg2);
 };
 
 class Translate : public Operation {
@@ -73,9 +73,32 @@ public:
     Image copy() const {
         Image m(width, height, frames, channels);
         m.set(*this);
+        size_t &count = bytesCopied();
+        size_t bytes = (size_t)width * height * frames * channels * sizeof(float);
+        #ifdef _OPENMP
+        #pragma omp atomic
+        #endif
+        count += bytes;
         return m;
     }
 
+    // The total amount of pixel data duplicated by copy(), for
+    // profiling. -time reports it.
+    static size_t &bytesCopied() {
+        static size_t count = 0;
+        return count;
+    }
+
+    // Whether any other image refers to the same pixel data
+    bool shared() const {
+        return data && !data.unique();
+    }
+
+    // Whether this and another image refer to the same pixel data
+    bool sameData(const Image &other) const {
+        return data && data == other.data;
+    }
+
     const Image region(int x, int y, int t, int c,
                        int xs, int ys, int ts, int cs) const {
         return Image(*this, x, y, t, c, xs, ys, ts, cs);
@@ -484,6 +507,9 @@ public:
                     FloatExprType(T)::Iter iter = expr.scanline(0, y, t, c, width);
                     float *const dst = base + c*cstride + t*tstride + y*ystride;
                     ImageStack::Expr::setScanline(iter, dst, 0, width, boundedVX, minVX, maxVX);
+                    // Let lazy functions recycle what this scanline read
+                    Expr::Region row = {0, y, t, c, width, 1, 1, 1};
+                    expr.prepare(row, 4);
                 }
             }
         }
@@ -749,6 +775,12 @@ private:
                                        dst1, dst2, dst3, dst4,
                                        0, width, 
                                        boundedVX, minVX, maxVX);                
+
+                Expr::Region row = {0, y, t, 0, w, 1, 1, 1};
+                exprA.prepare(row, 4);
+                exprB.prepare(row, 4);
+                exprC.prepare(row, 4);
+                exprD.prepare(row, 4);
             }
         }
 
@@ -33,6 +33,7 @@
 #include "Control.h"
 #include "Convolve.h"
 #include "Complex.h"
+#include "CompactImage.h"
 #include "Deconvolution.h"
 #include "DFT.h"
 #include "Display.h"
@@ -0,0 +1,153 @@
+#include "main.h"
+#include "Interleave.h"
+namespace ImageStack {
+
+namespace {
+
+// The rows of each channel of im at y, in the order they're interleaved
+void channelRows(Image im, int y, bool bgr, float **rows) {
+    for (int c = 0; c < im.channels; c++) {
+        rows[c] = &im(0, y, c);
+    }
+    if (bgr && im.channels >= 3) std::swap(rows[0], rows[2]);
+}
+
+inline float clampUnit(float x) {
+    return x < 0 ? 0 : (x > 1 ? 1 : x);
+}
+
+// C is the channel count, or zero to use the run-time count
+template<int C>
+IMAGESTACK_MULTIVERSION
+void unpackRow8(const unsigned char *src, float **rows, int width, int channels, float scale) {
+    const int n = C ? C : channels;
+    for (int c = 0; c < n; c++) {
+        float *dst = rows[c];
+        const unsigned char *s = src + c;
+        for (int x = 0; x < width; x++) {
+            dst[x] = s[x*n] * scale;
+        }
+    }
+}
+
+template<int C>
+IMAGESTACK_MULTIVERSION
+void unpackRow16(const unsigned char *src, float **rows, int width, int channels, float scale) {
+    const int n = C ? C : channels;
+    for (int c = 0; c < n; c++) {
+        float *dst = rows[c];
+        const unsigned char *s = src + 2*c;
+        for (int x = 0; x < width; x++) {
+            dst[x] = ((s[2*x*n] << 8) | s[2*x*n + 1]) * scale;
+        }
+    }
+}
+
+template<int C>
+IMAGESTACK_MULTIVERSION
+void packRow8(float **rows, unsigned char *dst, int width, int channels, float maxval) {
+    const int n = C ? C : channels;
+    for (int c = 0; c < n; c++) {
+        const float *src = rows[c];
+        unsigned char *d = dst + c;
+        for (int x = 0; x < width; x++) {
+            d[x*n] = (unsigned char)(clampUnit(src[x]) * maxval + 0.49999f);
+        }
+    }
+}
+
+template<int C>
+IMAGESTACK_MULTIVERSION
+void packRow16(float **rows, unsigned char *dst, int width, int channels, float maxval) {
+    const int n = C ? C : channels;
+    for (int c = 0; c < n; c++) {
+        const float *src = rows[c];
+        unsigned char *d = dst + 2*c;
+        for (int x = 0; x < width; x++) {
+            unsigned short v = (unsigned short)(clampUnit(src[x]) * maxval + 0.49999f);
+            d[2*x*n] = (unsigned char)(v >> 8);
+            d[2*x*n + 1] = (unsigned char)(v & 255);
+        }
+    }
+}
+
+typedef void (*UnpackRow)(const unsigned char *, float **, int, int, float);
+typedef void (*PackRow)(float **, unsigned char *, int, int, float);
+
+void unpack(UnpackRow row, const unsigned char *src, ptrdiff_t rowStride,
+            Image im, float scale, bool bgr) {
+    assert(im.frames == 1, "Can only unpack a single frame\n");
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int y = 0; y < im.height; y++) {
+        vector<float *> rows(im.channels);
+        channelRows(im, y, bgr, &rows[0]);
+        row(src + y*rowStride, &rows[0], im.width, im.channels, scale);
+    }
+}
+
+void pack(PackRow row, Image im, unsigned char *dst, ptrdiff_t rowStride,
+          int maxval, bool bgr) {
+    assert(im.frames == 1, "Can only pack a single frame\n");
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int y = 0; y < im.height; y++) {
+        vector<float *> rows(im.channels);
+        channelRows(im, y, bgr, &rows[0]);
+        row(&rows[0], dst + y*rowStride, im.width, im.channels, (float)maxval);
+    }
+}
+
+}
+
+void unpack8(const unsigned char *src, ptrdiff_t rowStride, Image im, float scale, bool bgr) {
+    UnpackRow row;
+    switch (im.channels) {
+    case 1: row = unpackRow8<1>; break;
+    case 2: row = unpackRow8<2>; break;
+    case 3: row = unpackRow8<3>; break;
+    case 4: row = unpackRow8<4>; break;
+    default: row = unpackRow8<0>;
+    }
+    unpack(row, src, rowStride, im, scale, bgr);
+}
+
+void unpack16(const unsigned char *src, ptrdiff_t rowStride, Image im, float scale, bool bgr) {
+    UnpackRow row;
+    switch (im.channels) {
+    case 1: row = unpackRow16<1>; break;
+    case 2: row = unpackRow16<2>; break;
+    case 3: row = unpackRow16<3>; break;
+    case 4: row = unpackRow16<4>; break;
+    default: row = unpackRow16<0>;
+    }
+    unpack(row, src, rowStride, im, scale, bgr);
+}
+
+void pack8(Image im, unsigned char *dst, ptrdiff_t rowStride, int maxval, bool bgr) {
+    PackRow row;
+    switch (im.channels) {
+    case 1: row = packRow8<1>; break;
+    case 2: row = packRow8<2>; break;
+    case 3: row = packRow8<3>; break;
+    case 4: row = packRow8<4>; break;
+    default: row = packRow8<0>;
+    }
+    pack(row, im, dst, rowStride, maxval, bgr);
+}
+
+void pack16(Image im, unsigned char *dst, ptrdiff_t rowStride, int maxval, bool bgr) {
+    PackRow row;
+    switch (im.channels) {
+    case 1: row = packRow16<1>; break;
+    case 2: row = packRow16<2>; break;
+    case 3: row = packRow16<3>; break;
+    case 4: row = packRow16<4>; break;
+    default: row = packRow16<0>;
+    }
+    pack(row, im, dst, rowStride, maxval, bgr);
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef IMAGESTACK_INTERLEAVE_H
+#define IMAGESTACK_INTERLEAVE_H
+namespace ImageStack {
+
+// Conversions between the interleaved 8 and 16 bit samples stored by
+// most file formats and ImageStack's planar floats. Rows are converted
+// in parallel. The inner loops are specialized on the channel count,
+// so the compiler turns them into vector shuffles.
+//
+// Each function converts a single frame. Row y of the interleaved data
+// starts at data + y*rowStride bytes. A negative rowStride handles
+// files stored bottom-up. If bgr is set, the first and third channels
+// are swapped on the way through. 16 bit samples are big-endian, as
+// they are in png and ppm files.
+
+// Multiplies each sample by scale.
+void unpack8(const unsigned char *src, ptrdiff_t rowStride, Image im,
+             float scale = 1.0f/255, bool bgr = false);
+void unpack16(const unsigned char *src, ptrdiff_t rowStride, Image im,
+              float scale = 1.0f/65535, bool bgr = false);
+
+// Clamps to [0, 1], multiplies by maxval, and rounds. With the default
+// maxval these match HDRtoLDR and HDRtoLDR16.
+void pack8(Image im, unsigned char *dst, ptrdiff_t rowStride,
+           int maxval = 255, bool bgr = false);
+void pack16(Image im, unsigned char *dst, ptrdiff_t rowStride,
+            int maxval = 65535, bool bgr = false);
+
+}
+#endif
@@ -9,12 +9,21 @@
 #include "Wavelet.h"
 #include "Filter.h"
 #include "LinearAlgebra.h"
+#include "Statistics.h"
+#ifndef NO_FFTW
+#include <fftw3.h>
+#endif
 namespace ImageStack {
 
 void LFFocalStack::help() {
     printf("\n-lffocalstack turns a 4d light field into a 3d focal stack. The five arguments\n"
            "are the lenslet width, height, the minimum alpha, the maximum alpha, and the\n"
-           "step size between adjacent depths (alpha is slope in line space).\n\n"
+           "step size between adjacent depths (alpha is slope in line space). An optional\n"
+           "sixth argument selects how the views are shifted before they are summed:\n"
+           "lanczos (the default) uses a 6-tap lanczos kernel, linear uses bilinear\n"
+           "interpolation, which is faster but blurrier, and fourier uses Fourier slice\n"
+           "refocusing, which is the fastest for many depths but treats the views as\n"
+           "periodic and is only available when ImageStack is built with FFTW.\n\n"
            "Usage: ImageStack -load lf.exr -lffocalstack 16 16 -1 1 0.1 -display\n\n");
 }
 
@@ -23,74 +32,363 @@ bool LFFocalStack::test() {
     // 16 x 16 x 16 x 16 lightfield
     LightField point(im, 16, 16);
     LFPoint::apply(point, 7, 7, 0.5);
-    Image stack = LFFocalStack::apply(point, -1, 1, 0.5);
 
-    // Should be a focused spot at one particular frame
-    float spot = stack(7, 7, 3, 0);
+    Method methods[] = {Lanczos, Linear, Fourier};
+    for (int m = 0; m < 3; m++) {
+#ifdef NO_FFTW
+        if (methods[m] == Fourier) continue;
+#endif
+        Image stack = LFFocalStack::apply(point, -1, 1, 0.5, methods[m]);
 
-    // Zero elsewhere in that frame
-    float zero = stack(10, 10, 3, 0);
+        // Should be a focused spot at one particular frame
+        float spot = stack(7, 7, 3, 0);
 
-    // At another frame it should be blurred out
-    float gray = stack(10, 10, 0, 0);
+        // Zero elsewhere in that frame
+        float zero = stack(10, 10, 3, 0);
 
-    return spot > 0.75 && nearlyEqual(zero, 0) && gray < spot/16 && gray > spot/256;
+        // At another frame it should be blurred out
+        float gray = stack(10, 10, 0, 0);
+
+        if (methods[m] == Lanczos) {
+            if (!(spot > 0.75 && nearlyEqual(zero, 0) && gray < spot/16 && gray > spot/256)) {
+                return false;
+            }
+        } else {
+            // bilinear weights and periodic sinc interpolation
+            // spread the spot further
+            if (!(spot > 0.5 && fabs(zero) < 0.01 && gray < spot/16 && gray > spot/256)) {
+                return false;
+            }
+        }
+    }
+
+    // The fused lanczos path should match shifting each view with
+    // Translate
+    Image lf(12*3, 10*4, 1, 2);
+    Noise::apply(lf, 0, 1);
+    LightField field(lf, 3, 4);
+    Image stack = LFFocalStack::apply(field, -0.75, 0.75, 0.75);
+    for (int t = 0; t < 3; t++) {
+        float alpha = -0.75f + t*0.75f;
+        Image sum(12, 10, 1, 2);
+        for (int v = 0; v < 4; v++) {
+            for (int u = 0; u < 3; u++) {
+                Image view(12, 10, 1, 2);
+                for (int y = 0; y < 10; y++) {
+                    for (int x = 0; x < 12; x++) {
+                        for (int c = 0; c < 2; c++) {
+                            view(x, y, c) = field(x, y, u, v, c);
+                        }
+                    }
+                }
+                if (alpha != 0) {
+                    view = Translate::apply(view, -(u-1)*alpha, -(v-1.5)*alpha);
+                }
+                sum += view;
+            }
+        }
+        sum /= 12;
+        if (!nearlyEqual(sum, stack.frame(t))) return false;
+    }
+
+    return true;
 }
 
 void LFFocalStack::parse(vector<string> args) {
-    assert(args.size() == 5, "-lffocalstack takes five arguments.\n");
+    assert(args.size() == 5 || args.size() == 6, "-lffocalstack takes five or six arguments.\n");
+    Method method = Lanczos;
+    if (args.size() == 6) {
+        if (args[5] == "lanczos") {
+            method = Lanczos;
+        } else if (args[5] == "linear") {
+            method = Linear;
+        } else if (args[5] == "fourier") {
+            method = Fourier;
+        } else {
+            panic("Unknown refocusing method: %s\n", args[5].c_str());
+        }
+    }
     LightField lf(stack(0), readInt(args[0]), readInt(args[1]));
-    Image im = apply(lf, readFloat(args[2]), readFloat(args[3]), readFloat(args[4]));
+    Image im = apply(lf, readFloat(args[2]), readFloat(args[3]), readFloat(args[4]), method);
     pop();
     push(im);
 }
 
+namespace {
 
-Image LFFocalStack::apply(LightField lf, float minAlpha, float maxAlpha, float deltaAlpha) {
-    assert(lf.image.frames == 1, "Can only turn a single light field into a focal stack\n");
+// The taps that shift one view along one axis. Output pixel x reads
+// input pixels x + offset + i for i in [0, taps).
+struct ShiftTaps {
+    int offset, taps;
+    float weight[6];
+};
 
-    int frames = 0;
-    for (float alpha = minAlpha; alpha <= maxAlpha; alpha += deltaAlpha) { frames++; }
+// Taps equivalent to Translate::apply with the given offset, or to
+// bilinear interpolation at the same location.
+ShiftTaps shiftTaps(float off, bool linear) {
+    ShiftTaps s;
+    int i = (int)floorf(off);
+    float f = off - i;
+    if (f == 0) {
+        s.offset = -i;
+        s.taps = 1;
+        s.weight[0] = 1;
+    } else if (linear) {
+        s.offset = -i - 1;
+        s.taps = 2;
+        s.weight[0] = f;
+        s.weight[1] = 1 - f;
+    } else {
+        s.offset = -i - 3;
+        s.taps = 6;
+        double sum = 0;
+        for (int k = 0; k < 6; k++) {
+            s.weight[k] = lanczos_3(k - 3 + f);
+            sum += s.weight[k];
+        }
+        for (int k = 0; k < 6; k++) s.weight[k] /= sum;
+    }
+    return s;
+}
 
-    Image out(lf.xSize, lf.ySize, frames, lf.image.channels);
+// Shift-and-add refocusing straight out of the light field layout. Each
+// output row is accumulated from the shifted rows of every view, so
+// no view is ever copied out.
+void refocusSpatial(LightField lf, const vector<float> &alphas, bool linear, Image out) {
+    const int U = lf.uSize, V = lf.vSize;
+    const int X = lf.xSize, Y = lf.ySize;
+    const int frames = (int)alphas.size();
 
-    Image view(lf.xSize, lf.ySize, 1, lf.image.channels);
+    vector<ShiftTaps> xTaps(frames * U), yTaps(frames * V);
+    for (int t = 0; t < frames; t++) {
+        for (int u = 0; u < U; u++) {
+            xTaps[t*U + u] = shiftTaps(-(u-(U-1)*0.5)*alphas[t], linear);
+        }
+        for (int v = 0; v < V; v++) {
+            yTaps[t*V + v] = shiftTaps(-(v-(V-1)*0.5)*alphas[t], linear);
+        }
+    }
 
-    int t = 0;
-    for (float alpha = minAlpha; alpha <= maxAlpha; alpha += deltaAlpha) {
-        printf("computing frame %i\n", t+1);
-
-        // Extract, shift, and accumulate each view
-        for (int v = 0; v < lf.vSize; v++) {
-            for (int u = 0; u < lf.uSize; u++) {
-                // Get the view
-                for (int y = 0; y < lf.ySize; y++) {
-                    for (int x = 0; x < lf.xSize; x++) {
-                        for (int c = 0; c < lf.image.channels; c++) {
-                            view(x, y, c) = lf(x, y, u, v, c);
+    const float scale = 1.0f / (U * V);
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<float> row(X);
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int i = 0; i < frames * Y; i++) {
+            const int t = i / Y, y = i % Y;
+            for (int c = 0; c < lf.image.channels; c++) {
+                std::fill(row.begin(), row.end(), 0.0f);
+                for (int v = 0; v < V; v++) {
+                    const ShiftTaps &ty = yTaps[t*V + v];
+                    for (int j = 0; j < ty.taps; j++) {
+                        int sy = y + ty.offset + j;
+                        if (sy < 0 || sy >= Y) continue;
+                        for (int u = 0; u < U; u++) {
+                            const ShiftTaps &tx = xTaps[t*U + u];
+                            // pixel x of view (u, v) is at src[x*U]
+                            const float *src = &lf.image(u, sy*V + v, c);
+                            for (int k = 0; k < tx.taps; k++) {
+                                const float w = ty.weight[j] * tx.weight[k];
+                                const int dx = tx.offset + k;
+                                const int minX = max(0, -dx), maxX = min(X, X - dx);
+                                const float *s = src + dx*U;
+                                for (int x = minX; x < maxX; x++) {
+                                    row[x] += w * s[x*U];
+                                }
+                            }
                         }
                     }
                 }
+                for (int x = 0; x < X; x++) {
+                    out(x, y, t, c) = row[x] * scale;
+                }
+            }
+        }
+    }
+}
 
-                // Shift it
-                if (alpha != 0) {
-                    view = Translate::apply(view, -(u-(lf.uSize-1)*0.5)*alpha, -(v-(lf.vSize-1)*0.5)*alpha);
+#ifndef NO_FFTW
+// Fourier slice refocusing. Shifting view (u, v) multiplies its
+// spectrum by a phase ramp, so output frequency (kx, ky) is the u-v
+// DTFT of the views' spectra at that frequency, evaluated at a
+// location proportional to alpha. We sample that DTFT on a padded grid
+// once per (kx, ky) and interpolate it for every depth, so each depth
+// costs one inverse 2D FFT instead of a pass over every view.
+void refocusFourier(LightField lf, const vector<float> &alphas, Image out) {
+    const int U = lf.uSize, V = lf.vSize;
+    const int X = lf.xSize, Y = lf.ySize;
+    const int XH = X/2 + 1;
+    const int frames = (int)alphas.size();
+
+    // Zero-padding the u-v transform keeps the interpolation accurate
+    const int PU = U * 4, PV = V * 4;
+    const float uc = (U-1)*0.5f, vc = (V-1)*0.5f;
+    const float scale = 1.0f / ((float)X * Y * U * V);
+
+    // spectrum is laid out [ky][kx][v][u], slices is [t][ky][kx]
+    fftwf_complex *spectrum = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * XH * Y * U * V);
+    fftwf_complex *slices = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * XH * Y * frames);
+
+    // Planning isn't thread-safe, so make the plans up front and run
+    // them on per-thread buffers
+    float *real = (float *)fftwf_malloc(sizeof(float) * X * Y);
+    fftwf_complex *freq = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * XH * Y);
+    fftwf_complex *pad = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * PU * PV);
+    fftwf_plan viewPlan = fftwf_plan_dft_r2c_2d(Y, X, real, freq, FFTW_ESTIMATE);
+    fftwf_plan padPlan = fftwf_plan_dft_2d(PV, PU, pad, pad, FFTW_FORWARD, FFTW_ESTIMATE);
+    fftwf_plan slicePlan = fftwf_plan_dft_c2r_2d(Y, X, freq, real, FFTW_ESTIMATE);
+    fftwf_free(real);
+    fftwf_free(freq);
+    fftwf_free(pad);
+
+    for (int c = 0; c < lf.image.channels; c++) {
+        // Transform each view
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            float *r = (float *)fftwf_malloc(sizeof(float) * X * Y);
+            fftwf_complex *f = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * XH * Y);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int i = 0; i < U*V; i++) {
+                const int u = i % U, v = i / U;
+                for (int y = 0; y < Y; y++) {
+                    for (int x = 0; x < X; x++) {
+                        r[y*X + x] = lf(x, y, u, v, c);
+                    }
+                }
+                fftwf_execute_dft_r2c(viewPlan, r, f);
+                for (int k = 0; k < XH*Y; k++) {
+                    spectrum[k*U*V + i][0] = f[k][0];
+                    spectrum[k*U*V + i][1] = f[k][1];
                 }
+            }
+            fftwf_free(r);
+            fftwf_free(f);
+        }
 
-                // Accumulate it into the output
-                out.frame(t) += view;
+        // Extract a slice of the u-v transform for every depth
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            fftwf_complex *p = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * PU * PV);
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 16)
+            #endif
+            for (int k = 0; k < XH*Y; k++) {
+                const int kx = k % XH, ky = k / XH;
+                const float fx = (float)kx / X;
+                const float fy = (float)(ky <= Y/2 ? ky : ky - Y) / Y;
+
+                memset(p, 0, sizeof(fftwf_complex) * PU * PV);
+                for (int v = 0; v < V; v++) {
+                    for (int u = 0; u < U; u++) {
+                        p[v*PU + u][0] = spectrum[k*U*V + v*U + u][0];
+                        p[v*PU + u][1] = spectrum[k*U*V + v*U + u][1];
+                    }
+                }
+                fftwf_execute_dft(padPlan, p, p);
+
+                for (int t = 0; t < frames; t++) {
+                    // Shifting view u by (u - uc)*alpha is a phase of
+                    // exp(2 pi i fx alpha (u - uc)), which is the
+                    // forward transform over u at frequency -fx alpha
+                    float su = -fx * alphas[t] * PU;
+                    float sv = -fy * alphas[t] * PV;
+                    su -= PU * floorf(su / PU);
+                    sv -= PV * floorf(sv / PV);
+                    int u0 = (int)floorf(su), v0 = (int)floorf(sv);
+                    float wu = su - u0, wv = sv - v0;
+                    u0 %= PU;
+                    v0 %= PV;
+                    int u1 = (u0 + 1) % PU, v1 = (v0 + 1) % PV;
+
+                    float re = ((1-wv) * ((1-wu) * p[v0*PU + u0][0] + wu * p[v0*PU + u1][0]) +
+                                wv * ((1-wu) * p[v1*PU + u0][0] + wu * p[v1*PU + u1][0]));
+                    float im = ((1-wv) * ((1-wu) * p[v0*PU + u0][1] + wu * p[v0*PU + u1][1]) +
+                                wv * ((1-wu) * p[v1*PU + u0][1] + wu * p[v1*PU + u1][1]));
+
+                    // Then undo the centering of u and v
+                    float phase = -2 * M_PI * alphas[t] * (fx * uc + fy * vc);
+                    float cs = cosf(phase), sn = sinf(phase);
+                    slices[t*XH*Y + k][0] = (re * cs - im * sn) * scale;
+                    slices[t*XH*Y + k][1] = (re * sn + im * cs) * scale;
+                }
             }
+            fftwf_free(p);
         }
 
-        // Filter if necessary
-        if (fabs(alpha) > 1) {
-            out.frame(t).set(LanczosBlur::apply(out.frame(t), fabs(alpha), fabs(alpha), 0));
+        // Bring each slice back to the spatial domain
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            float *r = (float *)fftwf_malloc(sizeof(float) * X * Y);
+            fftwf_complex *f = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * XH * Y);
+            #ifdef _OPENMP
+            #pragma omp for
+            #endif
+            for (int t = 0; t < frames; t++) {
+                // c2r clobbers its input
+                memcpy(f, slices + t*XH*Y, sizeof(fftwf_complex) * XH * Y);
+                fftwf_execute_dft_c2r(slicePlan, f, r);
+                for (int y = 0; y < Y; y++) {
+                    for (int x = 0; x < X; x++) {
+                        out(x, y, t, c) = r[y*X + x];
+                    }
+                }
+            }
+            fftwf_free(r);
+            fftwf_free(f);
         }
-        t++;
     }
 
-    // renormalize
-    out /= lf.uSize * lf.vSize;
+    fftwf_destroy_plan(viewPlan);
+    fftwf_destroy_plan(padPlan);
+    fftwf_destroy_plan(slicePlan);
+    fftwf_free(spectrum);
+    fftwf_free(slices);
+}
+#endif
+
+}
+
+Image LFFocalStack::apply(LightField lf, float minAlpha, float maxAlpha, float deltaAlpha,
+                          Method method) {
+    assert(lf.image.frames == 1, "Can only turn a single light field into a focal stack\n");
+
+    vector<float> alphas;
+    for (float alpha = minAlpha; alpha <= maxAlpha; alpha += deltaAlpha) {
+        alphas.push_back(alpha);
+    }
+
+    Image out(lf.xSize, lf.ySize, (int)alphas.size(), lf.image.channels);
+
+    if (method == Fourier) {
+        #ifdef NO_FFTW
+        panic("Fourier slice refocusing requires ImageStack to be compiled with FFTW\n");
+        #else
+        refocusFourier(lf, alphas, out);
+        #endif
+    } else {
+        refocusSpatial(lf, alphas, method == Linear, out);
+    }
+
+    // Filter if necessary
+    for (size_t t = 0; t < alphas.size(); t++) {
+        if (fabs(alphas[t]) > 1) {
+            out.frame(t).set(LanczosBlur::apply(out.frame(t), fabs(alphas[t]), fabs(alphas[t]), 0));
+        }
+    }
 
     return out;
 }
@@ -100,7 +100,9 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(LightField im, float minAlpha, float maxAlpha, float deltaAlpha);
+    enum Method {Lanczos = 0, Linear, Fourier};
+    static Image apply(LightField im, float minAlpha, float maxAlpha, float deltaAlpha,
+                       Method method = Lanczos);
 };
 
 class LFPoint : public Operation {
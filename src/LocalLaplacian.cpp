@@ -6,6 +6,9 @@
 #include "Filter.h"
 #include "File.h"
 #include "Func.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 namespace ImageStack {
 
 using namespace Expr;
@@ -28,6 +31,10 @@ Image pyramidUp(Image im) {
     return upy;
 }
 
+namespace {
+void applyFrame(Image im, float alpha, float beta, int K, int J, int tileSize);
+}
+
 void LocalLaplacian::help() {
     pprintf("-locallaplacian modifies contrast at various scales. It is similar to"
             " the clarity slider in Photoshop. This operation is an implementation"
@@ -45,6 +52,13 @@ void LocalLaplacian::help() {
             " tone-mapper because it amplifies contrast at fine scales and reduces"
             " it at coarse scales.\n"
             "\n"
+            "Two optional arguments set the number of discrete intensity levels"
+            " used to approximate the filter (default 8), and the number of pyramid"
+            " levels (default 8, and at least 2). Fine pyramid levels are"
+            " processed in tiles, so memory use is a small multiple of the size"
+            " of the input, regardless of the number of intensity levels. Frames"
+            " are processed independently.\n"
+            "\n"
             "Usage: ImageStack -load input.jpg -locallaplacian 1 0 -save boosted.jpg\n");
 }
 
@@ -54,42 +68,61 @@ bool LocalLaplacian::test() {
     si.variance();
     LocalLaplacian::apply(im, 1.2, 0.2);
     Stats se(im);
-    return (se.minimum() < si.minimum() &&
-            se.maximum() > si.maximum() &&
-            se.variance() > si.variance());
+    if (!(se.minimum() < si.minimum() &&
+          se.maximum() > si.maximum() &&
+          se.variance() > si.variance())) {
+        return false;
+    }
+
+    // Processing in many small tiles should match processing the
+    // whole image as one tile
+    Image a = Downsample::apply(Load::apply("pics/dog1.jpg"), 2, 2, 1);
+    Image b = a.copy();
+    applyFrame(a, 1.2, 0.2, 8, 8, 64);
+    applyFrame(b, 1.2, 0.2, 8, 8, 1 << 16);
+    Stats sd(a - b);
+    return std::max(sd.maximum(), -sd.minimum()) < 1e-4;
 }
 
 void LocalLaplacian::parse(vector<string> args) {
-    assert(args.size() == 2, "-locallaplacian takes two arguments");
-    Image im = stack(0);
-    apply(stack(0), readFloat(args[0]), readFloat(args[1]));
+    assert(args.size() >= 2 && args.size() <= 4, "-locallaplacian takes two, three, or four arguments\n");
+    int K = 8, J = 8;
+    if (args.size() > 2) { K = readInt(args[2]); }
+    if (args.size() > 3) { J = readInt(args[3]); }
+    apply(stack(0), readFloat(args[0]), readFloat(args[1]), K, J);
 }
 
-void LocalLaplacian::apply(Image im, float alpha, float beta) {
-    const int K = 8, J = 8;
-
-    assert(im.channels == 3, "-locallaplacian only works on three-channel images\n");
-
-    // For multi-frame images, process each frame independently
-    if (im.frames > 1) {
-        for (int t = 0; t < im.frames; t++) {
-            apply(im.frame(t), alpha, beta);
-        }
-        return;
-    }
+namespace {
+// Build one level of the output Laplacian pyramid. The K remapped
+// Laplacian levels are interpolated according to the intensity in the
+// Gaussian pyramid of the input, and then mixed with the input's own
+// Laplacian level.
+void blendLevel(Image out, Image gauss, Image lap, Image remapped,
+                float minIntensity, float intensityDelta, int K, float scale) {
+    Expr::X x; Expr::Y y;
+    auto level = (gauss - minIntensity)/intensityDelta;
+    auto intLevel = clamp(toInt(level), 0, K-2);
+    auto interp = level - toFloat(intLevel);
+    auto modified =
+        interp * remapped(x, y, intLevel+1) +
+        (1 - interp) * remapped(x, y, intLevel);
+    out.set((1-scale) * lap + scale * modified);
+}
 
+// Process a single frame. Fine levels are done in tiles of the given
+// size, or of a size chosen to fit a memory budget if it is zero.
+void applyFrame(Image im, float alpha, float beta, int K, int J, int tileSize) {
     // Compute a discretized set of K intensities that span the values in the image
     Stats s = Stats(im);
     float minIntensity = s.minimum();
     float intensityDelta = (s.maximum() - s.minimum()) / (K-1);
     alpha /= (K-1);
 
-    // Convert to grayscale and add a boundary condition
+    // Convert to grayscale
     Image gray = (im.channel(0) + im.channel(1) + im.channel(2))/3;
 
     // Compute a Gaussian and Laplacian pyramid for the input
-    Image imPyramid[J];
-    Image imLPyramid[J];
+    vector<Image> imPyramid(J), imLPyramid(J);
     imPyramid[0] = gray;
     for (int j = 1; j < J; j++) {
         imPyramid[j] = pyramidDown(imPyramid[j-1]);
@@ -97,57 +130,154 @@ void LocalLaplacian::apply(Image im, float alpha, float beta) {
     }
     imLPyramid[J-1] = imPyramid[J-1];
 
+    // The scale factor controlling the amount of effect at each level
+    vector<float> scale(J);
+    for (int j = 0; j < J; j++) {
+        if (beta < 0) {
+            scale[j] = ((float)j/(J-1))*(-beta) + 1-(-beta);
+        } else {
+            scale[j] = (1.0f - ((float)j/(J-1)))*beta + 1-beta;
+        }
+    }
+
     // Make a lookup table for remapping
     // It's the derivative of a Gaussian centered at 1024 with std.dev 256
     Image remap(16*256, 1, 1, 1);
     auto fx = (Expr::X()-8*256) / 256.0f;
     remap.set(alpha*fx*exp(-fx*fx/2.0f));
-    
-    // Make a set of K processed images
-    Image pyramid[J];
-    pyramid[0] = Image(gray.width, gray.height, 1, K);
-    Expr::X x; Expr::Y y; Expr::C c;
-    auto diff = (gray(x, y) - minIntensity) / intensityDelta;
-    auto idx = clamp(toInt(diff * 256) - c*256 + remap.width/2, 0, remap.width-1);        
-    pyramid[0].set(gray(x, y) + remap(idx));
-
-    // Compute a J-level Laplacian pyramid of the processed images
-    for (int j = 1; j < J; j++) {
-        pyramid[j] = pyramidDown(pyramid[j-1]);
-        pyramid[j-1] = pyramid[j-1] - zeroBoundary(pyramidUp(pyramid[j]));
+
+    // The output Laplacian pyramid
+    vector<Image> output(J);
+    for (int j = 0; j < J; j++) {
+        output[j] = Image(imPyramid[j].width, imPyramid[j].height, 1, 1);
     }
 
-    // Now construct output laplacian pyramid by looking up the
-    // Laplacian pyramids as a function of intensity found in the
-    // Gaussian pyramid
-    Image output;
-    for (int j = J-1; j >= 0; j--) {
+    // Processing the K remapped images at full resolution would take
+    // K times the memory of the input times the pyramid overhead, so
+    // we do the fine levels (0 to JT-1) in tiles. Each tile remaps a
+    // padded region of the input, builds its pyramid down to level JT,
+    // and writes its interior into the output pyramid, and into a
+    // low-resolution K-channel image at level JT. The coarse levels
+    // are then processed from that image in one go.
+    //
+    // Tiles are aligned to multiples of 2^JT, so that the pyramid
+    // levels of a tile line up exactly with those of the whole
+    // image. A level j coefficient depends on input pixels at most
+    // 3*2^(j+1) pixels away, so a halo of 4*2^JT makes the tiled
+    // result identical to an untiled one.
+    const int JT = std::min(J-1, 4);
+    const int align = 1 << JT;
+    const int halo = 4*align;
 
-        float scale;
-        if (beta < 0) {
-            scale = ((float)j/(J-1))*(-beta) + 1-(-beta);
-        } else {
-            scale = (1.0f - ((float)j/(J-1)))*beta + 1-beta;
+    // Pick the largest tile size that keeps the per-thread scratch
+    // space (the remapped pyramid, its Laplacian, and temporaries)
+    // within budget.
+    if (tileSize <= 0) {
+        const size_t budget = 64 << 20;
+        tileSize = 2*align;
+        while (tileSize < 1024) {
+            size_t side = 2*tileSize + 2*halo;
+            if (side * side * K * sizeof(float) * 4 > budget) break;
+            tileSize *= 2;
         }
+    } else {
+        tileSize = ((tileSize + align - 1) / align) * align;
+    }
 
-        auto level = (imPyramid[j] - minIntensity)/intensityDelta;
-        auto intLevel = clamp(toInt(level), 0, K-2);
-        auto interp = level - toFloat(intLevel);
-        // Add in the next pyramid level        
-        auto modified = 
-            interp * pyramid[j](x, y, intLevel+1) + 
-            (1 - interp) * pyramid[j](x, y, intLevel);
-        auto newVal = (1-scale) * imLPyramid[j] + scale * modified;
-        if (j == J-1) {
-            output = newVal;
-        } else {
-            output = zeroBoundary(pyramidUp(output)) + newVal;
+    const int tilesX = (gray.width + tileSize - 1) / tileSize;
+    const int tilesY = (gray.height + tileSize - 1) / tileSize;
+    Image coarse(imPyramid[JT].width, imPyramid[JT].height, 1, K);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int tile = 0; tile < tilesX * tilesY; tile++) {
+        const int tx = (tile % tilesX) * tileSize;
+        const int ty = (tile / tilesX) * tileSize;
+        const int tw = std::min(tileSize, gray.width - tx);
+        const int th = std::min(tileSize, gray.height - ty);
+        const int x0 = std::max(0, tx - halo), y0 = std::max(0, ty - halo);
+        const int x1 = std::min(gray.width, tx + tw + halo);
+        const int y1 = std::min(gray.height, ty + th + halo);
+
+        // Make a set of K processed versions of the padded tile
+        Image g = gray.region(x0, y0, 0, 0, x1 - x0, y1 - y0, 1, 1);
+        vector<Image> pyramid(JT+1);
+        pyramid[0] = Image(g.width, g.height, 1, K);
+        Expr::X x; Expr::Y y; Expr::C c;
+        auto diff = (g(x, y) - minIntensity) / intensityDelta;
+        auto idx = clamp(toInt(diff * 256) - c*256 + remap.width/2, 0, remap.width-1);
+        pyramid[0].set(g(x, y) + remap(idx));
+
+        // Compute its Gaussian pyramid
+        for (int j = 1; j <= JT; j++) {
+            pyramid[j] = pyramidDown(pyramid[j-1]);
+        }
+
+        // Write the interior of each fine Laplacian level into the output
+        for (int j = 0; j <= JT; j++) {
+            const int ox = tx >> j, oy = ty >> j;
+            const int ow = ((tx + tw + (1 << j) - 1) >> j) - ox;
+            const int oh = ((ty + th + (1 << j) - 1) >> j) - oy;
+            const int ix = ox - (x0 >> j), iy = oy - (y0 >> j);
+            if (j == JT) {
+                coarse.region(ox, oy, 0, 0, ow, oh, 1, K).set(
+                    pyramid[j].region(ix, iy, 0, 0, ow, oh, 1, K));
+            } else {
+                Image lap = pyramid[j] - zeroBoundary(pyramidUp(pyramid[j+1]));
+                blendLevel(output[j].region(ox, oy, 0, 0, ow, oh, 1, 1),
+                           imPyramid[j].region(ox, oy, 0, 0, ow, oh, 1, 1),
+                           imLPyramid[j].region(ox, oy, 0, 0, ow, oh, 1, 1),
+                           lap.region(ix, iy, 0, 0, ow, oh, 1, K),
+                           minIntensity, intensityDelta, K, scale[j]);
+            }
         }
     }
 
+    // Compute the coarse levels of the Laplacian pyramid of the
+    // processed images
+    vector<Image> pyramid(J);
+    pyramid[JT] = coarse;
+    for (int j = JT+1; j < J; j++) {
+        pyramid[j] = pyramidDown(pyramid[j-1]);
+        pyramid[j-1] = pyramid[j-1] - zeroBoundary(pyramidUp(pyramid[j]));
+    }
+    for (int j = JT; j < J; j++) {
+        blendLevel(output[j], imPyramid[j], imLPyramid[j], pyramid[j],
+                   minIntensity, intensityDelta, K, scale[j]);
+    }
+
+    // Collapse the output Laplacian pyramid
+    Image result = output[J-1];
+    for (int j = J-2; j >= 0; j--) {
+        result = zeroBoundary(pyramidUp(result)) + output[j];
+    }
+
     // Reintroduce color
-    output /= gray;
-    im *= output(x, y, 0);
+    Expr::X x; Expr::Y y;
+    result /= gray;
+    im *= result(x, y, 0);
+}
+}
+
+void LocalLaplacian::apply(Image im, float alpha, float beta, int K, int J) {
+    assert(im.channels == 3, "-locallaplacian only works on three-channel images\n");
+    assert(K >= 2, "-locallaplacian requires at least two intensity levels\n");
+    assert(J >= 2, "-locallaplacian requires at least two pyramid levels\n");
+
+    // For multi-frame images, process each frame independently. If
+    // there are enough frames to go around, do them in parallel,
+    // otherwise parallelize within each frame.
+    if (im.frames > 1) {
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) if (im.frames >= omp_get_max_threads())
+        #endif
+        for (int t = 0; t < im.frames; t++) {
+            applyFrame(im.frame(t), alpha, beta, K, J, 0);
+        }
+    } else {
+        applyFrame(im, alpha, beta, K, J, 0);
+    }
 }
 
 }
@@ -7,7 +7,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static void apply(Image im, float alpha, float beta);
+    static void apply(Image im, float alpha, float beta, int K = 8, int J = 8);
 };
 
 
@@ -48,6 +48,7 @@ void loadOperations() {
     operationMap["-loop"] = new Loop();
     operationMap["-pause"] = new Pause();
     operationMap["-time"] = new Time();
+    operationMap["-seed"] = new Seed();
 
     // statistics
 
@@ -61,6 +62,7 @@ void loadOperations() {
     operationMap["-shuffle"] = new Shuffle();
     operationMap["-kmeans"] = new KMeans();
     operationMap["-sort"] = new Sort();
+    operationMap["-percentile"] = new Percentile();
     operationMap["-localmaxima"] = new LocalMaxima();
     operationMap["-printf"] = new Printf();
     operationMap["-fprintf"] = new FPrintf();
@@ -75,6 +77,8 @@ void loadOperations() {
     operationMap["-loadframes"] = new LoadFrames();
     operationMap["-saveframes"] = new SaveFrames();
     operationMap["-loadchannels"] = new LoadChannels();
+    operationMap["-loadscaled"] = new LoadScaled();
+    operationMap["-stream"] = new Stream();
     operationMap["-savechannels"] = new SaveChannels();
     operationMap["-loadarray"] = new LoadArray();
     operationMap["-savearray"] = new SaveArray();
@@ -197,6 +201,10 @@ void loadOperations() {
     operationMap["-inversehaar"] = new InverseHaar();
     operationMap["-daubechies"] = new Daubechies();
     operationMap["-inversedaubechies"] = new InverseDaubechies();
+    operationMap["-cdf53"] = new CDF53();
+    operationMap["-inversecdf53"] = new InverseCDF53();
+    operationMap["-cdf97"] = new CDF97();
+    operationMap["-inversecdf97"] = new InverseCDF97();
 
     // some filters
     operationMap["-gaussianblur"] = new GaussianBlur();
@@ -2,12 +2,41 @@
 #define IMAGESTACK_OPERATION_H
 namespace ImageStack {
 
+class Image;
+
+// A function applied in place to each sample of an image
+// independently. Runs of operations that are just such a function of
+// the top of the stack are fused by parseCommands into a single pass
+// over the image, rather than one pass per operation.
+class Pointwise {
+public:
+    virtual ~Pointwise() {};
+    // Apply to n consecutive samples from channel c
+    virtual void apply(float *samples, int n, int c) const = 0;
+
+    // Apply a sequence of stages to an image, one scanline at a time
+    static void apply(Image im, const vector<Pointwise *> &stages);
+};
+
 class Operation {
 public:
     virtual ~Operation() {};
     virtual void parse(vector<string>) = 0;
     virtual void help() = 0;
     virtual bool test() = 0;
+
+    // If this operation with the given arguments is a pointwise
+    // function of the top of the stack, return it. The caller takes
+    // ownership. Otherwise return NULL, and parse will be called.
+    virtual Pointwise *pointwise(vector<string>) {return NULL;}
+};
+
+// An operation that is always pointwise. It need only implement
+// pointwise, help, and test.
+class PointwiseOperation : public Operation {
+public:
+    void parse(vector<string> args);
+    virtual Pointwise *pointwise(vector<string>) = 0;
 };
 
 void loadOperations();
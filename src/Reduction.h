@@ -71,6 +71,8 @@ double sum(const T expr_, const FloatExprType(T) *ptr = NULL) {
                 FloatExprType(T)::Iter iter = expr.scanline(0, y, t, c, width);
                 Expr::evaluateInto(iter, rowSum, 0, width, boundedVX, minVX, maxVX);                
                 rowSums[y] = rowSum.toScalar();
+                Expr::Region row = {0, y, t, c, width, 1, 1, 1};
+                expr.prepare(row, 4);
             }
 
             for (int y = 0; y < height; y++) {
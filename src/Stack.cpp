@@ -1,5 +1,6 @@
 #include "main.h"
 #include "Stack.h"
+#include "Statistics.h"
 #include <list>
 #include <map>
 namespace ImageStack {
@@ -27,7 +28,7 @@ void Push::help() {
 
 void Push::parse(vector<string> args) {
     if (args.size() == 0) {
-        push(Image(stack(0).width, stack(0).height, stack(0).frames, stack(0).channels));
+        push(Image(peek(0).width, peek(0).height, peek(0).frames, peek(0).channels));
     } else if (args.size() == 3) {
         push(Image(readInt(args[0]), readInt(args[1]), 1, readInt(args[2])));
     } else if (args.size() == 4) {
@@ -54,11 +55,11 @@ void Pull::parse(vector<string> args) {
         assert(depth > 0, "-pull only makes sense on strictly positive depths\n");
         pull(depth);
     } else {
-        map<string, Image>::iterator iter = Stash::stash.find(args[0]);
+        map<string, CompactImage>::iterator iter = Stash::stash.find(args[0]);
         assert(iter != Stash::stash.end(),
                "Image with name %s was not found in the stash\n",
                args[0].c_str());
-        Image im = iter->second;
+        Image im = iter->second.expand();
         push(im);
         Stash::stash.erase(iter);
     }
@@ -68,7 +69,11 @@ void Dup::help() {
     pprintf("-dup duplicates an image and pushes it on the stack. Given no argument"
             " it duplicates the top image in the stack. Given a numeric argument it"
             " duplicates that image from down the stack. Given a string argument it"
-            " duplicates an image that was stashed with -stash using that name\n"
+            " duplicates an image that was stashed with -stash using that name."
+            " The pixel data is not copied until one of the two images is"
+            " modified while the other still exists. Operations that only read"
+            " their input, such as -save, -statistics, -resample, or -crop, do"
+            " not trigger a copy.\n"
             "\n"
             "Usage: ImageStack -load a.tga -dup -scale 0.5 -save a_small.tga\n"
             "                  -pop -scale 2 -save a_big.tga\n\n");
@@ -81,33 +86,99 @@ void Dup::parse(vector<string> args) {
     } else {
         assert(args.size() == 1, "-dup takes zero or one arguments\n");
         if ('0' <= args[0][0] && args[0][0] <= '9') {
-            int depth = readInt(args[0]);
-            push(stack(depth).copy());
+            dup(readInt(args[0]));
         } else {
-            map<string, Image>::iterator iter = Stash::stash.find(args[0]);
+            map<string, CompactImage>::iterator iter = Stash::stash.find(args[0]);
             assert(iter != Stash::stash.end(),
                    "Image with name %s was not found in the stash\n",
                    args[0].c_str());
-            Image im = iter->second;
-            push(im.copy());
+            // Expanding a reduced precision image already makes a new one
+            if (iter->second.format == CompactImage::Float32) {
+                pushShared(iter->second.expand());
+            } else {
+                push(iter->second.expand());
+            }
         }
     }
 }
 
-map<string, Image> Stash::stash;
+map<string, CompactImage> Stash::stash;
 
 void Stash::help() {
     pprintf("-stash removes the top image from the stack and gives it a name. It"
-            " can be retrieved using -dup or -pull using its name as the argument\n"
+            " can be retrieved using -dup or -pull using its name as the"
+            " argument. An optional second argument stores the image at reduced"
+            " precision to save memory. It may be float32 (the default), float16"
+            " (or half), which keeps about three significant digits, or uint16,"
+            " which clamps to [0, 1] and is lossless for data loaded from 16-bit"
+            " files. The image is converted back to 32-bit floats when it is"
+            " retrieved.\n"
             "\n"
-            "Usage: ImageStack ... -stash foo ... -dup foo ... -pull foo\n");
+            "Usage: ImageStack ... -stash foo ... -dup foo ... -pull foo\n"
+            "       ImageStack -loadframes *.png -stash video uint16 ... -pull video\n");
+}
+
+bool Stash::test() {
+    Image a(123, 45, 6, 3);
+    Noise::apply(a, -2, 2);
+    // Some values that need care when converting to half
+    a(0, 0, 0, 0) = 0;
+    a(1, 0, 0, 0) = 1e-6f;     // subnormal in half
+    a(2, 0, 0, 0) = -1e-9f;    // underflows to -0
+    a(3, 0, 0, 0) = 70000;     // overflows to infinity
+    a(4, 0, 0, 0) = 65504;     // largest half
+    a(5, 0, 0, 0) = 1 + 1.0f/2048; // a tie, which rounds to even
+
+    CompactImage h(a.region(0, 0, 0, 0, 123, 45, 6, 3), CompactImage::Float16);
+    if (h.bytes() != (size_t)a.width * a.height * a.frames * a.channels * 2) return false;
+    Image b = h.expand();
+    if (b(0, 0, 0, 0) != 0 ||
+        fabs(b(1, 0, 0, 0) - 1e-6f) > 3e-8f ||
+        b(2, 0, 0, 0) != 0 ||
+        !(b(3, 0, 0, 0) > 65504) ||
+        b(4, 0, 0, 0) != 65504 ||
+        b(5, 0, 0, 0) != 1) return false;
+    for (int c = 0; c < a.channels; c++) {
+        for (int t = 0; t < a.frames; t++) {
+            for (int y = 0; y < a.height; y++) {
+                for (int x = (y || t || c) ? 0 : 6; x < a.width; x++) {
+                    if (fabs(b(x, y, t, c) - a(x, y, t, c)) > fabs(a(x, y, t, c)) / 2048 + 3e-8f) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    // uint16 is exact for 16-bit data, and clamps everything else
+    Image d(a.width, a.height, a.frames, a.channels);
+    for (int c = 0; c < d.channels; c++) {
+        for (int t = 0; t < d.frames; t++) {
+            for (int y = 0; y < d.height; y++) {
+                for (int x = 0; x < d.width; x++) {
+                    d(x, y, t, c) = ((x*7 + y*13 + t*101 + c*1009) % 65536) / 65535.0f;
+                }
+            }
+        }
+    }
+    Image e = CompactImage(d, CompactImage::UNorm16).expand();
+    if (!nearlyEqual(d, e)) return false;
+    e = CompactImage(a, CompactImage::UNorm16).expand();
+    Stats s(e);
+    if (s.minimum() != 0 || s.maximum() != 1) return false;
+
+    // float32 keeps the original image
+    e = CompactImage(a, CompactImage::Float32).expand();
+    return e.baseAddress() == a.baseAddress();
 }
 
 void Stash::parse(vector<string> args) {
-    assert(args.size() == 1, "-stash takes one argument\n");
+    assert(args.size() == 1 || args.size() == 2, "-stash takes one or two arguments\n");
+    CompactImage::Format format = CompactImage::Float32;
+    if (args.size() == 2) format = CompactImage::parseFormat(args[1]);
     Image im = stack(0);
     pop();
-    stash[args[0]] = im;
+    stash[args[0]] = CompactImage(im, format);
 }
 
 }
@@ -1,10 +1,11 @@
 #ifndef IMAGESTACK_STACK_H
 #define IMAGESTACK_STACK_H
 #include <map>
+#include "CompactImage.h"
 namespace ImageStack {
 
 // These operations apply only to the stack, so they have no apply
-// method. They also have no unit tests.
+// method. Only -stash, which can convert images, has a unit test.
 
 class Pop : public Operation {
 public:
@@ -37,9 +38,9 @@ public:
 class Stash : public Operation {
 public:
     void help();
-    bool test() {return true;}
+    bool test();
     void parse(vector<string> args);
-    static map<string, Image> stash;
+    static map<string, CompactImage> stash;
 };
 
 }
@@ -21,7 +21,7 @@ bool Dimensions::test() {
 void Dimensions::parse(vector<string> args) {
     assert(args.size() == 0, "-dimensions takes no arguments\n");
     printf("Width x Height x Frames x Channels: %d x %d x %d x %d\n",
-           stack(0).width, stack(0).height, stack(0).frames, stack(0).channels);
+           peek(0).width, peek(0).height, peek(0).frames, peek(0).channels);
 }
 
 
@@ -236,7 +236,7 @@ bool Statistics::test() {
 void Statistics::parse(vector<string> args) {
     assert(args.size() == 0, "-statistics takes no arguments");
 
-    apply(stack(0));
+    apply(peek(0));
 }
 
 void Statistics::apply(Image im) {
@@ -338,7 +338,23 @@ void Noise::help() {
 }
 
 bool Noise::test() {
-    // Tested by statistics
+    // The distribution is tested by statistics. Check the range, and
+    // that the noise added depends only on the seed.
+    Image a(123, 45, 3, 2), b(123, 45, 3, 2);
+    setRandomSeed(17);
+    Noise::apply(a, -1, 2);
+    setRandomSeed(17);
+    Noise::apply(b, -1, 2);
+    for (int c = 0; c < a.channels; c++) {
+        for (int t = 0; t < a.frames; t++) {
+            for (int y = 0; y < a.height; y++) {
+                for (int x = 0; x < a.width; x++) {
+                    if (a(x, y, t, c) != b(x, y, t, c)) return false;
+                    if (a(x, y, t, c) < -1 || a(x, y, t, c) >= 2) return false;
+                }
+            }
+        }
+    }
     return true;
 }
 
@@ -359,11 +375,19 @@ void Noise::parse(vector<string> args) {
 }
 
 void Noise::apply(Image im, float minVal, float maxVal) {
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    im(x, y, t, c) += randomFloat(minVal, maxVal);
+    // Each sample is keyed by its position, so the result does not
+    // depend on the number of threads.
+    uint64_t stream = randomStream();
+    for (int c = 0; c < im.channels; c++) {
+        for (int t = 0; t < im.frames; t++) {
+            #ifdef _OPENMP
+            #pragma omp parallel for
+            #endif
+            for (int y = 0; y < im.height; y++) {
+                float *imPtr = &im(0, y, t, c);
+                uint64_t idx = (((uint64_t)c * im.frames + t) * im.height + y) * im.width;
+                for (int x = 0; x < im.width; x++) {
+                    imPtr[x] += randomFloat(stream, idx + x, minVal, maxVal);
                 }
             }
         }
@@ -371,6 +395,82 @@ void Noise::apply(Image im, float minVal, float maxVal) {
 }
 
 
+namespace {
+// Find the range of the finite values in an image, over all channels
+void finiteRange(Image im, float &minVal, float &maxVal) {
+    float lo = INFINITY, hi = -INFINITY;
+    const int rows = im.channels * im.frames * im.height;
+    #ifdef _OPENMP
+    #pragma omp parallel for reduction(min:lo) reduction(max:hi)
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const float *in = &im(0, r % im.height, (r / im.height) % im.frames, r / (im.height * im.frames));
+        for (int x = 0; x < im.width; x++) {
+            if (!isfinite(in[x])) continue;
+            lo = min(lo, in[x]);
+            hi = max(hi, in[x]);
+        }
+    }
+    minVal = lo;
+    maxVal = hi;
+}
+
+// Count the finite values in each channel into buckets spanning
+// [minVal, maxVal], clamping values outside that range to the end
+// buckets. Each thread counts into its own bins, which are merged at
+// the end. count[c*buckets + b] is the count for bucket b of channel c.
+void histogramCounts(Image im, int buckets, float minVal, float maxVal, vector<size_t> &count) {
+    count.assign((size_t)buckets * im.channels, 0);
+    const float scale = buckets / (maxVal - minVal);
+    const int rows = im.channels * im.frames * im.height;
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<size_t> local(count.size(), 0);
+
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            const int c = r / (im.height * im.frames);
+            const float *in = &im(0, r % im.height, (r / im.height) % im.frames, c);
+            size_t *bins = &local[(size_t)c * buckets];
+            for (int x = 0; x < im.width; x++) {
+                if (!isfinite(in[x])) continue;
+                // Bucket positions are computed in double, so that values
+                // on a bucket boundary land in the same bucket as they
+                // always have.
+                int bucket = (int)(((double)in[x] - minVal) * scale);
+                if (bucket >= buckets) { bucket = buckets-1; }
+                if (bucket < 0) { bucket = 0; }
+                bins[bucket]++;
+            }
+        }
+
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        {
+            for (size_t i = 0; i < count.size(); i++) {
+                count[i] += local[i];
+            }
+        }
+    }
+}
+
+// Evaluate a piecewise linear function with buckets segments, given
+// its buckets+1 values at the segment ends, at position pos
+inline float lookup(const float *table, int buckets, float pos) {
+    int bucket = (int)pos;
+    if (bucket < 0) { bucket = 0; }
+    if (bucket >= buckets) { bucket = buckets-1; }
+    float alpha = pos - bucket;
+    return table[bucket] + alpha * (table[bucket+1] - table[bucket]);
+}
+}
+
 void Histogram::help() {
     pprintf("-histogram computes a per-channel histogram of the current image."
             " The first optional argument specifies the number of buckets in the"
@@ -415,41 +515,19 @@ void Histogram::parse(vector<string> args) {
         maxVal = readFloat(args[2]);
     }
 
-    push(apply(stack(0), buckets, minVal, maxVal));
+    push(apply(peek(0), buckets, minVal, maxVal));
 }
 
 
 Image Histogram::apply(Image im, int buckets, float minVal, float maxVal) {
-
-    float invBucketWidth = buckets / (maxVal - minVal);
-
-    vector<size_t> count(buckets*im.channels, 0);
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    double value = im(x, y, t, c);
-                    int bucket;
-                    if (isnan((float)value)) {
-                        continue;
-                    } else if (isinf((float)value)) {
-                        continue;
-                    } else {
-                        bucket = (int)((value - minVal) * invBucketWidth);
-                        if (bucket >= buckets) { bucket = buckets-1; }
-                        if (bucket < 0) { bucket = 0; }
-                    }
-                    count[bucket*im.channels + c]++;
-                }
-            }
-        }
-    }
+    vector<size_t> count;
+    histogramCounts(im, buckets, minVal, maxVal, count);
 
     float invScale = 1.0 / (im.width * im.height * im.frames);
     Image hg(buckets, 1, 1, im.channels);
     for (int c = 0; c < im.channels; c++) {
         for (int x = 0; x < buckets; x++) {
-            hg(x, 0, 0, c) = count[x*im.channels + c] * invScale;
+            hg(x, 0, 0, c) = count[c*buckets + x] * invScale;
         }
     }
 
@@ -504,36 +582,41 @@ void Equalize::parse(vector<string> args) {
 }
 
 void Equalize::apply(Image im, float lower, float upper) {
-    Stats stats(im);
-
-    // STEP 1) Normalize the image to the 0-1 range
-    Normalize::apply(im);
+    // STEP 1) Find the range of the image
+    float minVal, maxVal;
+    finiteRange(im, minVal, maxVal);
 
-    // STEP 2) Calculate a CDF of the image
+    // STEP 2) Calculate a histogram of the image over that range
     int buckets = 4096;
-    Image cdf = Histogram::apply(im, buckets);
-    Integrate::apply(cdf, 'x');
+    vector<size_t> count;
+    histogramCounts(im, buckets, minVal, maxVal, count);
 
-    // STEP 3) For each pixel, find out how many things are in the same bucket or smaller, and use that to set the value
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    float alpha = im(x, y, t, c) * buckets;
-                    int bucket = (int)alpha; // which bucket am I in?
-                    if (bucket < 0) { bucket = 0; }
-                    if (bucket >= buckets) { bucket = buckets-1; }
-                    alpha -= bucket; // how far along am I in this bucket?
-
-                    // how many pixels are probably less than me?
-                    float lesser = 0;
-                    if (bucket > 0) { lesser = cdf(bucket-1, 0, c); }
-                    float equal = cdf(bucket, 0, c) - lesser;
-
-                    // use the estimate to set the value
-                    im(x, y, t, c) = (lesser + alpha * equal) * (upper - lower) + lower;
-                }
-            }
+    // STEP 3) Turn it into a table of how many pixels are less than
+    // each bucket boundary, scaled to the output range
+    float invScale = (upper - lower) / (im.width * im.height * im.frames);
+    vector<float> table((size_t)(buckets + 1) * im.channels);
+    for (int c = 0; c < im.channels; c++) {
+        size_t lesser = 0;
+        for (int b = 0; b <= buckets; b++) {
+            table[c*(buckets+1) + b] = lesser * invScale + lower;
+            if (b < buckets) { lesser += count[c*buckets + b]; }
+        }
+    }
+
+    // STEP 4) For each pixel, interpolate within its bucket to
+    // estimate how many pixels are less than it, and use that to set
+    // the value
+    float scale = buckets / (maxVal - minVal);
+    const int rows = im.channels * im.frames * im.height;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int c = r / (im.height * im.frames);
+        float *ptr = &im(0, r % im.height, (r / im.height) % im.frames, c);
+        const float *t = &table[c*(buckets+1)];
+        for (int x = 0; x < im.width; x++) {
+            ptr[x] = lookup(t, buckets, (ptr[x] - minVal) * scale);
         }
     }
 }
@@ -577,23 +660,49 @@ void HistogramMatch::apply(Image im, Image model) {
     assert(im.channels == model.channels, "Images must have the same number of channels\n");
 
     // Compute cdfs of the two images
-    Stats s1(im), s2(model);
+    float min1, max1, min2, max2;
+    finiteRange(im, min1, max1);
+    finiteRange(model, min2, max2);
     int buckets = 4096;
-    Image cdf1 = Histogram::apply(im, buckets, s1.minimum(), s1.maximum());
-    Image cdf2 = Histogram::apply(model, buckets, s2.minimum(), s2.maximum());
-    Integrate::apply(cdf1, 'x');
-    Integrate::apply(cdf2, 'x');
-
-    // Invert cdf2
-    Image inverseCDF2(cdf2.width, 1, 1, cdf2.channels);
-    for (int c = 0; c < inverseCDF2.channels; c++) {
+    vector<size_t> count1, count2;
+    histogramCounts(im, buckets, min1, max1, count1);
+    histogramCounts(model, buckets, min2, max2, count2);
+
+    // The cdf of image 1 at each bucket boundary. The cdfs are running
+    // sums of float bucket fractions, as Histogram and Integrate would
+    // give, so that the inversion below makes the same comparisons it
+    // always has where a cdf lands exactly on a bucket boundary.
+    vector<float> cdf1((size_t)(buckets + 1) * im.channels);
+    float invScale1 = 1.0 / (im.width * im.height * im.frames);
+    for (int c = 0; c < im.channels; c++) {
+        float *forward = &cdf1[c*(buckets+1)];
+        forward[0] = 0;
+        for (int b = 0; b < buckets; b++) {
+            forward[b+1] = forward[b] + count1[c*buckets + b] * invScale1;
+        }
+    }
+
+    // Invert the cdf of image 2, tabulated at the same boundaries, in
+    // units of buckets of image 2
+    vector<float> inverseCDF2((size_t)(buckets + 1) * im.channels);
+    vector<float> cdf2(buckets);
+    float invScale2 = 1.0 / (model.width * model.height * model.frames);
+    float invWidth = 1.0f / buckets;
+    for (int c = 0; c < im.channels; c++) {
+        float total = 0;
+        for (int b = 0; b < buckets; b++) {
+            total += count2[c*buckets + b] * invScale2;
+            cdf2[b] = total;
+        }
+
+        float *inverse = &inverseCDF2[c*(buckets+1)];
+        inverse[0] = 0;
         int xi = 0;
-        float invWidth = 1.0f / cdf2.width;
-        for (int x = 0; x < inverseCDF2.width; x++) {
-            while (cdf2(xi, 0, c) < x * invWidth && xi < cdf2.width) { xi++; }
-            // cdf2(xi, 0, c) is now just greater than x / inverseCDF2.width
-            float lower = xi > 0 ? cdf2(xi-1, 0, c) : 0;
-            float upper = xi < cdf2.width ? cdf2(xi, 0, c) : lower;
+        for (int x = 0; x < buckets; x++) {
+            while (xi < buckets && cdf2[xi] < x * invWidth) { xi++; }
+            // cdf2[xi] is now just greater than x / buckets
+            float lower = xi > 0 ? cdf2[xi-1] : 0;
+            float upper = xi < buckets ? cdf2[xi] : lower;
 
             // where is x*invWidth between lower and upper?
             float alpha = 0;
@@ -601,48 +710,25 @@ void HistogramMatch::apply(Image im, Image model) {
                 alpha = (x*invWidth - lower)/(upper - lower);
             }
 
-            inverseCDF2(x, 0, c) = xi + alpha;
+            inverse[x+1] = xi + alpha;
         }
     }
 
     // Now apply the cdf of image 1 followed by the inverse cdf of image 2
-    float invBucketWidth = buckets / (s1.maximum() - s1.minimum());
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    float alpha = (im(x, y, t, c) - s1.minimum()) * invBucketWidth;
-                    int bucket = (int)alpha; // which bucket am I in?
-                    if (bucket < 0) { bucket = 0; }
-                    if (bucket >= buckets) { bucket = buckets-1; }
-                    alpha -= bucket; // how far along am I in this bucket?
-
-                    // how many pixels are probably less than me?
-                    float lesser = 0;
-                    if (bucket > 0) { lesser = cdf1(bucket-1, 0, c); }
-                    float equal = cdf1(bucket, 0, c) - lesser;
-
-                    // use the estimate to get the percentile
-                    float percentile = lesser + alpha * equal;
-
-                    //im(x, y, t, c) = percentile;
-
-
-                    // look up the percentile in inverseCDF2 in the same way
-                    alpha = percentile * buckets;
-                    bucket = (int)alpha;
-                    if (bucket < 0) { bucket = 0; }
-                    if (bucket >= buckets) { bucket = buckets-1; }
-                    alpha -= bucket;
-
-                    lesser = 0;
-                    if (bucket > 0) { lesser = inverseCDF2(bucket-1, 0, c); }
-                    equal = inverseCDF2(bucket, 0, c) - lesser;
-
-                    im(x, y, t, c) = (lesser + alpha * equal) * (s2.maximum() - s2.minimum()) / buckets + s2.minimum();
-
-                }
-            }
+    float scale1 = buckets / (max1 - min1);
+    const int rows = im.channels * im.frames * im.height;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        const int c = r / (im.height * im.frames);
+        float *ptr = &im(0, r % im.height, (r / im.height) % im.frames, c);
+        const float *forward = &cdf1[c*(buckets+1)];
+        const float *inverse = &inverseCDF2[c*(buckets+1)];
+        for (int x = 0; x < im.width; x++) {
+            float percentile = lookup(forward, buckets, (ptr[x] - min1) * scale1);
+            float pos = lookup(inverse, buckets, percentile * buckets);
+            ptr[x] = pos * (max2 - min2) / buckets + min2;
         }
     }
 }
@@ -686,14 +772,26 @@ void Shuffle::parse(vector<string> args) {
 
 void Shuffle::apply(Image im) {
     int maxIdx = im.width * im.height * im.frames - 1;
+
+    // The swaps must happen in order, but the random new location
+    // after each pixel can be chosen up front in parallel.
+    uint64_t stream = randomStream();
+    vector<int> target(max(maxIdx, 0));
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < maxIdx; i++) {
+        target[i] = randomInt(stream, i, i+1, maxIdx);
+    }
+
     int idx = 0;
     for (int t = 0; t < im.frames; t++) {
         for (int y = 0; y < im.height; y++) {
             for (int x = 0; x < im.width; x++) {
-                // pick a random new location after this one
+                // swap with the location picked for this one
                 idx++;
                 if (idx > maxIdx) return;
-                int idx2 = randomInt(idx, maxIdx);
+                int idx2 = target[idx-1];
                 int ot = idx2 / (im.width * im.height);
                 int oy = (idx2 % (im.width * im.height)) / im.width;
                 int ox = idx2 % im.width;
@@ -707,8 +805,12 @@ void Shuffle::apply(Image im) {
 
 void KMeans::help() {
     printf("-kmeans clusters the image into a number of clusters given by the"
-           " single integer argument.\n\n"
-           "Usage: ImageStack -load in.jpg -kmeans 3 -save out.jpg\n\n");
+           " first integer argument. An optional second argument gives a batch size."
+           " With it, the clusters are estimated from random batches of that many"
+           " pixels at a time, which is much faster for large images but less"
+           " accurate.\n\n"
+           "Usage: ImageStack -load in.jpg -kmeans 3 -save out.jpg\n"
+           "       ImageStack -load big.jpg -kmeans 64 1000 -save out.jpg\n\n");
 }
 
 bool KMeans::test() {
@@ -745,18 +847,24 @@ bool KMeans::test() {
 
     a += b;
 
+    // Try both the full and mini-batch versions
+    Image batch = a.copy();
     KMeans::apply(a, 3);
+    KMeans::apply(batch, 3, 500);
 
     for (int t = 0; t < a.frames; t++) {
         for (int y = 0; y < a.height; y++) {
             for (int x = 0; x < a.width; x++) {
-                float R = a(x, y, t, 0), G = a(x, y, t, 1), B = a(x, y, t, 2);
-                bool ok = ((nearlyEqual(R, 1) && nearlyEqual(G, 5) && nearlyEqual(B, 4)) ||
-                           (nearlyEqual(R, 5) && nearlyEqual(G, 2) && nearlyEqual(B, -4)) ||
-                           (nearlyEqual(R, 2) && nearlyEqual(G, 2) && nearlyEqual(B, 8)));
-                if (!ok) {
-                    printf("%d %d %f %f %f\n", x, y, R, G, B);
-                    return false;
+                for (int i = 0; i < 2; i++) {
+                    Image im = i ? batch : a;
+                    float R = im(x, y, t, 0), G = im(x, y, t, 1), B = im(x, y, t, 2);
+                    bool ok = ((nearlyEqual(R, 1) && nearlyEqual(G, 5) && nearlyEqual(B, 4)) ||
+                               (nearlyEqual(R, 5) && nearlyEqual(G, 2) && nearlyEqual(B, -4)) ||
+                               (nearlyEqual(R, 2) && nearlyEqual(G, 2) && nearlyEqual(B, 8)));
+                    if (!ok) {
+                        printf("%d %d %f %f %f\n", x, y, R, G, B);
+                        return false;
+                    }
                 }
             }
         }
@@ -766,37 +874,280 @@ bool KMeans::test() {
 }
 
 void KMeans::parse(vector<string> args) {
-    assert(args.size() == 1, "-kmeans takes one argument\n");
-    apply(stack(0), readInt(args[0]));
+    assert(args.size() == 1 || args.size() == 2, "-kmeans takes one or two arguments\n");
+    int batchSize = 0;
+    if (args.size() == 2) batchSize = readInt(args[1]);
+    apply(stack(0), readInt(args[0]), batchSize);
+}
+
+namespace {
+// Cluster centers are stored one channel after another, each padded
+// to a whole number of vectors with centers too far away to ever be
+// the nearest.
+const float kmeansFar = 1e10f;
+
+// Find the nearest and second nearest centers to the pixel at px,
+// with their squared distances. dist is scratch space for one
+// distance per padded center.
+inline void kmeansNearest(const float *center, int padded, int channels,
+                          const float *px, size_t cstride, float *dist,
+                          int &best, float &d1, float &d2) {
+    for (int j = 0; j < padded; j += Vec::width) {
+        Vec::type acc = Vec::zero();
+        for (int c = 0; c < channels; c++) {
+            Vec::type d = Vec::Sub::vec(Vec::load(center + c*padded + j), Vec::broadcast(px[c*cstride]));
+            acc = Vec::fma(d, d, acc);
+        }
+        Vec::store(acc, dist + j);
+    }
+    best = 0;
+    d1 = dist[0];
+    d2 = 1e30f;
+    for (int j = 1; j < padded; j++) {
+        if (dist[j] < d1) {
+            d2 = d1;
+            d1 = dist[j];
+            best = j;
+        } else if (dist[j] < d2) {
+            d2 = dist[j];
+        }
+    }
 }
 
-void KMeans::apply(Image im, int clusters) {
-    assert(clusters > 1, "must have at least one cluster\n");
+inline float kmeansDistance(const float *center, int padded, int channels,
+                            const float *px, size_t cstride, int j) {
+    float dist = 0;
+    for (int c = 0; c < channels; c++) {
+        float d = center[c*padded + j] - px[c*cstride];
+        dist += d*d;
+    }
+    return sqrtf(dist);
+}
 
-    vector< vector<float> > cluster, newCluster;
-    vector<int> newClusterMembers(clusters);
+// Lloyd's algorithm with Hamerly's bounds. Each pixel keeps an upper
+// bound on the distance to its center, and a lower bound on the
+// distance to every other center. Those only need checking when the
+// bounds overlap, so once things settle down most pixels are skipped.
+void kmeansHamerly(Image im, vector<float> &center, int clusters, int padded,
+                   vector<int> &label, uint64_t stream, uint64_t &draw) {
+    const int channels = im.channels;
+    const int rows = im.frames * im.height;
+    const size_t n = (size_t)rows * im.width;
+    label.resize(n);
+    vector<float> upper(n), lower(n);
+    vector<float> move(clusters), half(clusters);
 
-    for (int c = 0; c < im.channels; c++) {
-        cluster.push_back(vector<float>(clusters, 0));
-        newCluster.push_back(vector<float>(clusters, 0));
+    // Centroid sums are accumulated per block of rows, and then
+    // added up in order, so the result doesn't depend on the number
+    // of threads.
+    const int blocks = min(rows, 64);
+    vector<double> sums((size_t)blocks * clusters * channels);
+    vector<int> counts((size_t)blocks * clusters);
+
+    for (int iter = 0;; iter++) {
+        bool full = (iter == 0);
+        fill(sums.begin(), sums.end(), 0.0);
+        fill(counts.begin(), counts.end(), 0);
+
+        int changed = 0;
+        #ifdef _OPENMP
+        #pragma omp parallel for reduction(+:changed)
+        #endif
+        for (int b = 0; b < blocks; b++) {
+            vector<float> dist(padded);
+            double *blockSums = &sums[(size_t)b * clusters * channels];
+            int *blockCounts = &counts[(size_t)b * clusters];
+            for (int r = b * rows / blocks; r < (b+1) * rows / blocks; r++) {
+                int t = r / im.height, y = r % im.height;
+                size_t i = (size_t)r * im.width;
+                for (int x = 0; x < im.width; x++, i++) {
+                    const float *px = &im(x, y, t, 0);
+                    if (full) {
+                        float d1, d2;
+                        kmeansNearest(&center[0], padded, channels, px, im.cstride, &dist[0], label[i], d1, d2);
+                        upper[i] = sqrtf(d1);
+                        lower[i] = sqrtf(d2);
+                        changed++;
+                    } else {
+                        int a = label[i];
+                        float m = max(half[a], lower[i]);
+                        if (upper[i] > m) {
+                            // Tighten the upper bound and try again
+                            upper[i] = kmeansDistance(&center[0], padded, channels, px, im.cstride, a);
+                            if (upper[i] > m) {
+                                float d1, d2;
+                                kmeansNearest(&center[0], padded, channels, px, im.cstride, &dist[0], label[i], d1, d2);
+                                upper[i] = sqrtf(d1);
+                                lower[i] = sqrtf(d2);
+                                if (label[i] != a) changed++;
+                            }
+                        }
+                    }
+                    int a = label[i];
+                    blockCounts[a]++;
+                    for (int c = 0; c < channels; c++) {
+                        blockSums[c * clusters + a] += px[c * im.cstride];
+                    }
+                }
+            }
+        }
+
+        // Move the centers to the means of their pixels (reset any
+        // empty ones to random)
+        bool reset = false;
+        float moveMax = 0, moveSecond = 0;
+        int moveArg = 0;
+        for (int j = 0; j < clusters; j++) {
+            int count = 0;
+            for (int b = 0; b < blocks; b++) {
+                count += counts[(size_t)b * clusters + j];
+            }
+            float delta = 0;
+            if (count == 0) {
+                reset = true;
+                int x = randomInt(stream, draw++, 0, im.width-1);
+                int y = randomInt(stream, draw++, 0, im.height-1);
+                int t = randomInt(stream, draw++, 0, im.frames-1);
+                for (int c = 0; c < channels; c++) {
+                    float v = im(x, y, t, c) + randomFloat(stream, draw++, -0.1, 0.1);
+                    delta += (v - center[c*padded + j]) * (v - center[c*padded + j]);
+                    center[c*padded + j] = v;
+                }
+            } else {
+                for (int c = 0; c < channels; c++) {
+                    double sum = 0;
+                    for (int b = 0; b < blocks; b++) {
+                        sum += sums[((size_t)b * channels + c) * clusters + j];
+                    }
+                    float v = (float)(sum / count);
+                    delta += (v - center[c*padded + j]) * (v - center[c*padded + j]);
+                    center[c*padded + j] = v;
+                }
+            }
+            move[j] = sqrtf(delta);
+            if (move[j] > moveMax) {
+                moveSecond = moveMax;
+                moveMax = move[j];
+                moveArg = j;
+            } else if (move[j] > moveSecond) {
+                moveSecond = move[j];
+            }
+        }
+
+        // If no pixel changed cluster then the centers didn't move
+        if (!changed && !reset) break;
+
+        // Loosen the bounds by how far the centers moved
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            size_t i = (size_t)r * im.width;
+            for (int x = 0; x < im.width; x++, i++) {
+                upper[i] += move[label[i]];
+                lower[i] -= (label[i] == moveArg) ? moveSecond : moveMax;
+            }
+        }
+
+        // A pixel is definitely closest to its own center if it is
+        // within half the distance to the next nearest center.
+        for (int j = 0; j < clusters; j++) {
+            float nearest = 1e30f;
+            for (int k = 0; k < clusters; k++) {
+                if (k == j) continue;
+                float dist = 0;
+                for (int c = 0; c < channels; c++) {
+                    float d = center[c*padded + j] - center[c*padded + k];
+                    dist += d*d;
+                }
+                nearest = min(nearest, dist);
+            }
+            half[j] = 0.5f * sqrtf(nearest);
+        }
+    }
+}
+
+// Sculley's mini-batch k-means. Each step assigns a random batch of
+// pixels to their nearest centers, then moves each center towards
+// its pixels by one over the number of pixels it has seen so far.
+void kmeansMiniBatch(Image im, vector<float> &center, int clusters, int padded,
+                     int batchSize, uint64_t stream, uint64_t &draw) {
+    const int channels = im.channels;
+    const int pixels = im.width * im.height * im.frames;
+    vector<int> sample(batchSize), sampleLabel(batchSize);
+    vector<int> seen(clusters, 0);
+
+    for (int iter = 0; iter < 1000; iter++) {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int k = 0; k < batchSize; k++) {
+            vector<float> dist(padded);
+            float d1, d2;
+            sample[k] = randomInt(stream, draw + k, 0, pixels-1);
+            int x = sample[k] % im.width;
+            int y = (sample[k] / im.width) % im.height;
+            int t = sample[k] / (im.width * im.height);
+            kmeansNearest(&center[0], padded, channels, &im(x, y, t, 0), im.cstride,
+                          &dist[0], sampleLabel[k], d1, d2);
+        }
+        draw += batchSize;
+
+        vector<float> old(center);
+        for (int k = 0; k < batchSize; k++) {
+            int j = sampleLabel[k];
+            int x = sample[k] % im.width;
+            int y = (sample[k] / im.width) % im.height;
+            int t = sample[k] / (im.width * im.height);
+            float eta = 1.0f / (++seen[j]);
+            for (int c = 0; c < channels; c++) {
+                center[c*padded + j] += eta * (im(x, y, t, c) - center[c*padded + j]);
+            }
+        }
+
+        // Stop once the centers have settled down
+        float moveMax = 0;
+        for (int j = 0; j < clusters; j++) {
+            float delta = 0;
+            for (int c = 0; c < channels; c++) {
+                float d = center[c*padded + j] - old[c*padded + j];
+                delta += d*d;
+            }
+            moveMax = max(moveMax, delta);
+        }
+        if (iter >= 10 && moveMax < 1e-8f) break;
     }
+}
+}
 
+void KMeans::apply(Image im, int clusters, int batchSize) {
+    assert(clusters > 1, "must have at least one cluster\n");
+    assert(batchSize >= 0, "batch size must be non-negative\n");
+
+    const int channels = im.channels;
+    const int padded = ((clusters + Vec::width - 1) / Vec::width) * Vec::width;
+    vector<float> center((size_t)channels * padded, kmeansFar);
+
+    // All random choices come from one stream, so the clustering
+    // depends only on the seed.
+    uint64_t stream = randomStream();
+    uint64_t draw = 0;
 
     // Initialization is super-important for k-means. We initialize
     // using k-means++ on a subset of the data
-    Image subset(1000 + clusters, 1, 1, im.channels);
+    Image subset(1000 + clusters, 1, 1, channels);
     for (int i = 0; i < subset.width; i++) {
-        int x = randomInt(0, im.width-1);
-        int y = randomInt(0, im.height-1);
-        int t = randomInt(0, im.frames-1);
-        for (int c = 0; c < im.channels; c++) {
+        int x = randomInt(stream, draw++, 0, im.width-1);
+        int y = randomInt(stream, draw++, 0, im.height-1);
+        int t = randomInt(stream, draw++, 0, im.frames-1);
+        for (int c = 0; c < channels; c++) {
             subset(i, 0, 0, c) = im(x, y, t, c);
         }
     }
 
     // Initialize the first cluster to a randomly selected pixel
-    for (int c = 0; c < im.channels; c++) {
-        cluster[c][0] = subset(0, 0, 0, c);
+    for (int c = 0; c < channels; c++) {
+        center[c*padded] = subset(0, 0, 0, c);
     }
 
     Image distance(subset.width, 1, 1, 1);
@@ -807,8 +1158,8 @@ void KMeans::apply(Image im, int clusters) {
             float bestDistance = 1e20;
             for (int j = 0; j < i; j++) {
                 float dist = 0;
-                for (int c = 0; c < im.channels; c++) {
-                    float delta = subset(x, 0, 0, c) - cluster[c][j];
+                for (int c = 0; c < channels; c++) {
+                    float delta = subset(x, 0, 0, c) - center[c*padded + j];
                     dist += delta*delta;
                 }
                 if (dist < bestDistance) bestDistance = dist;
@@ -825,107 +1176,40 @@ void KMeans::apply(Image im, int clusters) {
 
         // Now select one with probability proportional to the square distance
         int x;
-        float choice = randomFloat(0, 1);
-        for (x = 0; x < subset.width; x++) {
+        float choice = randomFloat(stream, draw++, 0, 1);
+        for (x = 0; x < subset.width - 1; x++) {
             if (choice < distance(x, 0)) break;
         }
-        for (int c = 0; c < im.channels; c++) {
-            cluster[c][i] = subset(x, 0, 0, c);
+        for (int c = 0; c < channels; c++) {
+            center[c*padded + i] = subset(x, 0, 0, c);
         }
     }
 
-    for (int iter = 0;; iter++) {
-
-        // print the clusters
-        /*
-        for (int i = 0; i < clusters; i++) {
-            printf("cluster %d: ", i);
-            for (int c = 0; c < im.channels; c++) {
-                printf(" %f", cluster[c][i]);
-            }
-            printf("\n");
-        }
-        */
-
-        // wipe the newCluster
-        for (int i = 0; i < clusters; i++) {
-            newClusterMembers[i] = 0;
-            for (int c = 0; c < im.channels; c++) {
-                newCluster[c][i] = 0;
-            }
-        }
-
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                for (int x = 0; x < im.width; x++) {
-                    // assign this pixel to a cluster
-                    int bestCluster = 0;
-                    float bestDistance = 1e10;
-                    for (int i = 0; i < clusters; i++) {
-                        float dist = 0;
-                        for (int c = 0; c < im.channels; c++) {
-                            float d = cluster[c][i] - im(x, y, t, c);
-                            dist += d*d;
-                        }
-                        if (dist < bestDistance) {
-                            bestCluster = i;
-                            bestDistance = dist;
-                        }
-                    }
-
-                    for (int c = 0; c < im.channels; c++) {
-                        newCluster[c][bestCluster] += im(x, y, t, c);
-                    }
-                    newClusterMembers[bestCluster]++;
-                }
-            }
-        }
-
-        // normalize the new clusters (reset any zero ones to random)
-        for (int i = 0; i < clusters; i++) {
-            if (newClusterMembers[i] == 0) {
-                int x = randomInt(0, im.width-1);
-                int y = randomInt(0, im.height-1);
-                int t = randomInt(0, im.frames-1);
-                for (int c = 0; c < im.channels; c++) {
-                    newCluster[c][i] = im(x, y, t, c) + randomFloat(-0.1, 0.1);
-                }
-            } else {
-                for (int c = 0; c < im.channels; c++) {
-                    newCluster[c][i] /= newClusterMembers[i];
-                }
-            }
-        }
-
-        // break if the clusters are unchanged
-        if (cluster == newCluster) { break; }
-
-        // swap over the pointers
-        cluster.swap(newCluster);
+    vector<int> label;
+    if (batchSize) {
+        kmeansMiniBatch(im, center, clusters, padded, batchSize, stream, draw);
+    } else {
+        kmeansHamerly(im, center, clusters, padded, label, stream, draw);
     }
 
     // now color each pixel according to the closest cluster
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                // assign this pixel to a cluster
-                int bestCluster = 0;
-                float bestDistance = 1e10;
-                for (int i = 0; i < clusters; i++) {
-                    float dist = 0;
-                    for (int c = 0; c < im.channels; c++) {
-                        float d = cluster[c][i] - im(x, y, t, c);
-                        dist += d*d;
-                    }
-                    if (dist < bestDistance) {
-                        bestCluster = i;
-                        bestDistance = dist;
-                    }
-                }
-
-                for (int c = 0; c < im.channels; c++) {
-                    im(x, y, t, c) = cluster[c][bestCluster];
-                }
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < im.frames * im.height; r++) {
+        int t = r / im.height, y = r % im.height;
+        vector<float> dist(padded);
+        for (int x = 0; x < im.width; x++) {
+            int best;
+            if (label.empty()) {
+                float d1, d2;
+                kmeansNearest(&center[0], padded, channels, &im(x, y, t, 0), im.cstride,
+                              &dist[0], best, d1, d2);
+            } else {
+                best = label[(size_t)r * im.width + x];
+            }
+            for (int c = 0; c < channels; c++) {
+                im(x, y, t, c) = center[c*padded + best];
             }
         }
     }
@@ -934,7 +1218,8 @@ void KMeans::apply(Image im, int clusters) {
 void Sort::help() {
     pprintf("-sort sorts the data along the given dimension for every value of the"
             " other dimensions. For example, the following command computes the"
-            " median frame of a video.\n\n"
+            " median frame of a video. To get just a few percentiles, -percentile"
+            " is faster.\n\n"
             "ImageStack -loadframes frame*.jpg -sort t -crop frames/2 1 -save median.jpg\n\n");
 }
 
@@ -997,6 +1282,29 @@ bool Sort::test() {
                 if (!nearlyEqual(h1(x, 0, 0, c), h2(x, 0, 0, c))) return false;
             }
         }
+    } { // test long lines, which are radix sorted
+        Image a(5, 3, 300, 2);
+        Noise::apply(a, -5, 5);
+        a(1, 1, 7, 1) = -0.0f;
+        a(1, 1, 8, 1) = 0.0f;
+        a(2, 1, 9, 0) = 1e30f;
+        a(2, 1, 10, 0) = -1e-30f;
+        Image b = a.copy();
+        Sort::apply(a, 't');
+        vector<float> line(a.frames);
+        for (int c = 0; c < a.channels; c++) {
+            for (int y = 0; y < a.height; y++) {
+                for (int x = 0; x < a.width; x++) {
+                    for (int t = 0; t < a.frames; t++) {
+                        line[t] = b(x, y, t, c);
+                    }
+                    sort(line.begin(), line.end());
+                    for (int t = 0; t < a.frames; t++) {
+                        if (a(x, y, t, c) != line[t]) return false;
+                    }
+                }
+            }
+        }
     } { // test c
         Image a(12, 34, 2, 7);
         Noise::apply(a, -5, 5);
@@ -1018,72 +1326,247 @@ void Sort::parse(vector<string> args) {
     apply(stack(0), readChar(args[0]));
 }
 
-void Sort::apply(Image im, char dimension) {
-    assert(dimension == 'x' || dimension == 'y' || dimension == 't' || dimension == 'c',
-           "Dimension must be x, y, t, or c\n");
+namespace {
+// Sort floats with a least-significant-digit radix sort on their bits.
+// Flipping the sign bit of positive numbers and every bit of negative
+// numbers makes unsigned integer order match float order. scratch must
+// have room for 2n keys. in and out may be the same.
+void radixSort(const float *in, uint32_t *scratch, int n, float *out) {
+    // Comparison sorts win for short lines
+    if (n < 32) {
+        if (out != in) memcpy(out, in, n * sizeof(float));
+        ::std::sort(out, out + n);
+        return;
+    }
+
+    uint32_t *keys = scratch, *tmp = scratch + n;
+    int counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < n; i++) {
+        uint32_t u;
+        memcpy(&u, in + i, sizeof(u));
+        u ^= (uint32_t)(-(int32_t)(u >> 31)) | 0x80000000u;
+        keys[i] = u;
+        for (int pass = 0; pass < 4; pass++) {
+            counts[pass][(u >> (8 * pass)) & 255]++;
+        }
+    }
 
-    if (dimension == 'c') {
-        vector<float> tmp(im.channels);
-        for (int t = 0; t < im.frames; t++) {
-            for (int y = 0; y < im.height; y++) {
-                for (int x = 0; x < im.width; x++) {
-                    for (int c = 0; c < im.channels; c++) {
-                        tmp[c] = im(x, y, t, c);
-                    }
-                    ::std::sort(tmp.begin(), tmp.end());
-                    for (int c = 0; c < im.channels; c++) {
-                        im(x, y, t, c) = tmp[c];
-                    }
-                }
+    for (int pass = 0; pass < 4; pass++) {
+        int shift = 8 * pass;
+        int *count = counts[pass];
+        // Skip passes where every key has the same digit
+        if (count[(keys[0] >> shift) & 255] == n) continue;
+        int offset = 0;
+        for (int d = 0; d < 256; d++) {
+            int c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for (int i = 0; i < n; i++) {
+            tmp[count[(keys[i] >> shift) & 255]++] = keys[i];
+        }
+        swap(keys, tmp);
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint32_t u = keys[i];
+        u ^= ((u >> 31) - 1) | 0x80000000u;
+        memcpy(out + i, &u, sizeof(u));
+    }
+}
+
+// Sorts a whole line
+struct SortLine {
+    void operator()(float *line, uint32_t *scratch, int n, float *result) const {
+        radixSort(line, scratch, n, result);
+    }
+};
+
+// Selects particular ranks from a line. Short lines are partially
+// sorted with nth_element, but for long ones a full radix sort is
+// faster.
+struct SelectLine {
+    // The ranks to select in increasing order, and where each one goes
+    vector<int> rank, slot;
+    void operator()(float *line, uint32_t *scratch, int n, float *result) const {
+        if (n >= 128) {
+            radixSort(line, scratch, n, line);
+            for (size_t i = 0; i < rank.size(); i++) {
+                result[slot[i]] = line[rank[i]];
             }
+            return;
         }
-    } else if (dimension == 'x') {
-        vector<float> tmp(im.width);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    for (int x = 0; x < im.width; x++) {
-                        tmp[x] = im(x, y, t, c);
-                    }
-                    sort(tmp.begin(), tmp.end());
-                    for (int x = 0; x < im.width; x++) {
-                        im(x, y, t, c) = tmp[x];
-                    }
-                }
+        int lo = 0;
+        for (size_t i = 0; i < rank.size(); i++) {
+            if (rank[i] >= lo) {
+                ::std::nth_element(line + lo, line + rank[i], line + n);
+                lo = rank[i] + 1;
             }
+            result[slot[i]] = line[rank[i]];
         }
-    } else if (dimension == 'y') {
-        vector<float> tmp(im.height);
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int x = 0; x < im.width; x++) {
-                    for (int y = 0; y < im.height; y++) {
-                        tmp[y] = im(x, y, t, c);
-                    }
-                    sort(tmp.begin(), tmp.end());
-                    for (int y = 0; y < im.height; y++) {
-                        im(x, y, t, c) = tmp[y];
-                    }
-                }
+    }
+};
+
+// Call f on every line of the input along the given dimension, writing
+// to the matching line of the output, which may be a different length
+// but must match in the other dimensions. Lines along y, t, and c are
+// strided, so they are gathered a block of adjacent x at a time into
+// contiguous scratch, and the results scattered back out the same way.
+template<typename F>
+void forEachLine(Image in, Image out, char dimension, const F &f) {
+    if (dimension == 'x') {
+        const int rows = in.channels * in.frames * in.height;
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int r = 0; r < rows; r++) {
+            int y = r % in.height, t = (r / in.height) % in.frames, c = r / (in.height * in.frames);
+            vector<float> line(&in(0, y, t, c), &in(0, y, t, c) + in.width);
+            vector<uint32_t> scratch(2 * in.width);
+            f(&line[0], &scratch[0], in.width, &out(0, y, t, c));
+        }
+        return;
+    }
+
+    // The y, t, and c dimensions, and which one the lines run along
+    int size[] = {in.height, in.frames, in.channels};
+    size_t inStride[] = {(size_t)in.ystride, (size_t)in.tstride, (size_t)in.cstride};
+    size_t outStride[] = {(size_t)out.ystride, (size_t)out.tstride, (size_t)out.cstride};
+    int d = dimension == 'y' ? 0 : (dimension == 't' ? 1 : 2);
+    int o1 = d == 0 ? 1 : 0, o2 = d == 2 ? 1 : 2;
+    int n = size[d];
+    int m = d == 0 ? out.height : (d == 1 ? out.frames : out.channels);
+
+    const int block = 32;
+    const int xBlocks = (in.width + block - 1) / block;
+    const int jobs = xBlocks * size[o1] * size[o2];
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int job = 0; job < jobs; job++) {
+        int x0 = (job % xBlocks) * block;
+        int i1 = (job / xBlocks) % size[o1];
+        int i2 = job / (xBlocks * size[o1]);
+        int w = min(block, in.width - x0);
+        const float *src = &in(x0, 0, 0, 0) + i1 * inStride[o1] + i2 * inStride[o2];
+        float *dst = &out(x0, 0, 0, 0) + i1 * outStride[o1] + i2 * outStride[o2];
+
+        vector<float> lines(w * n), results(w * m);
+        vector<uint32_t> scratch(2 * n);
+        for (int i = 0; i < n; i++) {
+            const float *row = src + i * inStride[d];
+            for (int b = 0; b < w; b++) {
+                lines[b * n + i] = row[b];
             }
         }
+        for (int b = 0; b < w; b++) {
+            f(&lines[b * n], &scratch[0], n, &results[b * m]);
+        }
+        for (int i = 0; i < m; i++) {
+            float *row = dst + i * outStride[d];
+            for (int b = 0; b < w; b++) {
+                row[b] = results[b * m + i];
+            }
+        }
+    }
+}
+}
 
-    } else if (dimension == 't') {
-        vector<float> tmp(im.frames);
-        for (int c = 0; c < im.channels; c++) {
-            for (int y = 0; y < im.height; y++) {
-                for (int x = 0; x < im.width; x++) {
-                    for (int t = 0; t < im.frames; t++) {
-                        tmp[t] = im(x, y, t, c);
-                    }
-                    sort(tmp.begin(), tmp.end());
-                    for (int t = 0; t < im.frames; t++) {
-                        im(x, y, t, c) = tmp[t];
-                    }
-                }
+void Sort::apply(Image im, char dimension) {
+    assert(dimension == 'x' || dimension == 'y' || dimension == 't' || dimension == 'c',
+           "Dimension must be x, y, t, or c\n");
+    forEachLine(im, im, dimension, SortLine());
+}
+
+void Percentile::help() {
+    pprintf("-percentile selects percentiles of the data along the given dimension"
+            " for every value of the other dimensions. The first argument is the"
+            " dimension, and the remaining arguments are the percentiles, between"
+            " zero and one. The result has one slice along that dimension for each"
+            " percentile, in the order given. It gives the same results as sorting"
+            " and then cropping out the value at the percentile times the length"
+            " of the dimension, but it only does as much sorting as it needs to. For"
+            " example, the following computes the median and the 90th percentile"
+            " frames of a video.\n\n"
+            "ImageStack -loadframes frame*.jpg -percentile t 0.5 0.9 -saveframes out%d.jpg\n\n");
+}
+
+bool Percentile::test() {
+    Image a(37, 5, 101, 3);
+    Noise::apply(a, -5, 5);
+    vector<float> percentiles;
+    percentiles.push_back(0.9);
+    percentiles.push_back(0);
+    percentiles.push_back(0.5);
+    percentiles.push_back(1);
+    Image b = Percentile::apply(a, 't', percentiles);
+    Sort::apply(a, 't');
+    for (int c = 0; c < a.channels; c++) {
+        for (int y = 0; y < a.height; y++) {
+            for (int x = 0; x < a.width; x++) {
+                if (b(x, y, 0, c) != a(x, y, 90, c) ||
+                    b(x, y, 1, c) != a(x, y, 0, c) ||
+                    b(x, y, 2, c) != a(x, y, 50, c) ||
+                    b(x, y, 3, c) != a(x, y, 100, c)) return false;
             }
         }
     }
+    return true;
+}
+
+void Percentile::parse(vector<string> args) {
+    assert(args.size() > 1, "-percentile takes a dimension and at least one percentile\n");
+    vector<float> percentiles;
+    for (size_t i = 1; i < args.size(); i++) {
+        percentiles.push_back(readFloat(args[i]));
+    }
+    Image im = apply(peek(0), readChar(args[0]), percentiles);
+    pop();
+    push(im);
+}
+
+Image Percentile::apply(Image im, char dimension, vector<float> percentiles) {
+    assert(dimension == 'x' || dimension == 'y' || dimension == 't' || dimension == 'c',
+           "Dimension must be x, y, t, or c\n");
+
+    int n = 0, m = (int)percentiles.size();
+    Image out;
+    switch (dimension) {
+    case 'x':
+        n = im.width;
+        out = Image(m, im.height, im.frames, im.channels);
+        break;
+    case 'y':
+        n = im.height;
+        out = Image(im.width, m, im.frames, im.channels);
+        break;
+    case 't':
+        n = im.frames;
+        out = Image(im.width, im.height, m, im.channels);
+        break;
+    case 'c':
+        n = im.channels;
+        out = Image(im.width, im.height, im.frames, m);
+        break;
+    }
+
+    // Work out which ranks to select, in increasing order
+    vector<pair<int, int> > order(m);
+    for (int i = 0; i < m; i++) {
+        assert(0 <= percentiles[i] && percentiles[i] <= 1, "percentile must be between zero and one\n");
+        order[i] = make_pair(min((int)(percentiles[i] * n), n - 1), i);
+    }
+    sort(order.begin(), order.end());
+    SelectLine select;
+    for (int i = 0; i < m; i++) {
+        select.rank.push_back(order[i].first);
+        select.slot.push_back(order[i].second);
+    }
+
+    forEachLine(im, out, dimension, select);
+    return out;
 }
 
 
@@ -1307,7 +1790,7 @@ void LocalMaxima::parse(vector<string> args) {
     }
     assert(tCheck || xCheck || yCheck, "-localmaxima requires at least one active dimension to find local maxima\n");
 
-    vector<LocalMaxima::Maximum> maxima = apply(stack(0), xCheck, yCheck, tCheck, readFloat(args[1]), readFloat(args[2]));
+    vector<LocalMaxima::Maximum> maxima = apply(peek(0), xCheck, yCheck, tCheck, readFloat(args[1]), readFloat(args[2]));
     for (unsigned int i = 0; i < maxima.size(); i++) {
         fprintf(f, "%f,%f,%f,%f\n",
                 maxima[i].t,
@@ -1530,7 +2013,7 @@ void Printf::parse(vector<string> args) {
     for (unsigned i = 1; i < args.size(); i++) {
         fargs.push_back(readFloat(args[args.size()-i]));
     }
-    apply(stack(0), args[0], fargs);
+    apply(peek(0), args[0], fargs);
 }
 
 
@@ -1571,7 +2054,7 @@ void FPrintf::parse(vector<string> args) {
     for (unsigned i = 2; i < args.size(); i++) {
         fargs.push_back(readFloat(args[args.size()-i+1]));
     }
-    apply(stack(0), args[0], args[1], fargs);
+    apply(peek(0), args[0], args[1], fargs);
 }
 
 void FPrintf::apply(Image im, string filename, string fmt, vector<float> a) {
@@ -1633,6 +2116,36 @@ bool PCA::test() {
         if (!nearlyEqual(dist_a, dist_b)) return false;
     }
 
+    // Now try a many-channel image that lies in a 3d subspace, which
+    // takes the randomized path
+    Image basis(1, 1, 3, 40);
+    Noise::apply(basis, -1, 1);
+    Image c(200, 200, 1, 40), coords(200, 200, 1, 3);
+    Noise::apply(coords, -1, 1);
+    for (int i = 0; i < c.channels; i++) {
+        c.channel(i).set(coords.channel(0) * basis(0, 0, 0, i) +
+                         coords.channel(1) * basis(0, 0, 1, i) +
+                         coords.channel(2) * basis(0, 0, 2, i));
+    }
+    Image d = PCA::apply(c, 3);
+    for (int i = 0; i < 1000; i++) {
+        int x1 = randomInt(0, c.width-1);
+        int y1 = randomInt(0, c.height-1);
+        int x2 = randomInt(0, c.width-1);
+        int y2 = randomInt(0, c.height-1);
+        float dist_c = 0, dist_d = 0;
+        for (int ch = 0; ch < c.channels; ch++) {
+            float delta = c(x1, y1, ch) - c(x2, y2, ch);
+            dist_c += delta*delta;
+        }
+        for (int ch = 0; ch < d.channels; ch++) {
+            float delta = d(x1, y1, ch) - d(x2, y2, ch);
+            dist_d += delta*delta;
+        }
+        if (dist_c < 0.1) continue;
+        if (!nearlyEqual(dist_c, dist_d)) return false;
+    }
+
     return true;
 }
 
@@ -1650,26 +2163,60 @@ Image PCA::apply(Image im, int newChannels) {
 
     Eigenvectors e(im.channels, out.channels);
 
-    vector<float> imSample(im.channels), outSample(out.channels);
-    for (int iter = 0; iter < min(10000, im.width*im.height*im.frames); iter++) {
-        int t = randomInt(0, im.frames-1);
-        int x = randomInt(0, im.width-1);
-        int y = randomInt(0, im.height-1);
-        for (int c = 0; c < im.channels; c++) {
-            imSample[c] = im(x, y, t, c);
+    // Estimate the covariance from a random sample of pixels, a block
+    // at a time
+    const int samples = min(10000, im.width*im.height*im.frames);
+    const int block = 256;
+    uint64_t stream = randomStream();
+    vector<float> imSample(block * im.channels);
+    for (int start = 0; start < samples; start += block) {
+        int n = min(block, samples - start);
+        for (int k = 0; k < n; k++) {
+            uint64_t draw = 3 * (uint64_t)(start + k);
+            int t = randomInt(stream, draw, 0, im.frames-1);
+            int x = randomInt(stream, draw+1, 0, im.width-1);
+            int y = randomInt(stream, draw+2, 0, im.height-1);
+            for (int c = 0; c < im.channels; c++) {
+                imSample[k*im.channels + c] = im(x, y, t, c);
+            }
         }
-        e.add(&imSample[0]);
+        e.addBlock(&imSample[0], n);
     }
+    e.compute();
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                for (int c = 0; c < im.channels; c++) {
-                    imSample[c] = im(x, y, t, c);
+    vector<float> weights(out.channels * im.channels);
+    for (int i = 0; i < out.channels; i++) {
+        e.getEigenvector(i, &weights[i*im.channels]);
+    }
+
+    // Project each pixel onto the eigenvectors, a vector of pixels at
+    // a time. Rows are done in tiles so that all the input channels
+    // stay in cache while computing each output channel.
+    const int tile = 256;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < im.frames * im.height; r++) {
+        int t = r / im.height, y = r % im.height;
+        for (int x0 = 0; x0 < im.width; x0 += tile) {
+            int x1 = min(x0 + tile, im.width);
+            for (int i = 0; i < out.channels; i++) {
+                const float *w = &weights[i*im.channels];
+                float *outPtr = &out(0, y, t, i);
+                int x = x0;
+                for (; x + Vec::width <= x1; x += Vec::width) {
+                    Vec::type acc = Vec::zero();
+                    for (int c = 0; c < im.channels; c++) {
+                        acc = Vec::fma(Vec::broadcast(w[c]), Vec::load(&im(x, y, t, c)), acc);
+                    }
+                    Vec::store(acc, outPtr + x);
                 }
-                e.apply(&imSample[0], &outSample[0]);
-                for (int c = 0; c < out.channels; c++) {
-                    out(x, y, t, c) = outSample[c];
+                for (; x < x1; x++) {
+                    float acc = 0;
+                    for (int c = 0; c < im.channels; c++) {
+                        acc += w[c] * im(x, y, t, c);
+                    }
+                    outPtr[x] = acc;
                 }
             }
         }
@@ -1724,26 +2271,41 @@ Image PatchPCA::apply(Image im, float sigma, int newChannels) {
     for (int i = 0; i < patchSize; i++) { mask[i] /= sum; }
     printf("\n");
 
-    vector<float> vec(patchSize*patchSize*im.channels);
-
-    Eigenvectors e(patchSize*patchSize*im.channels, newChannels);
-    for (int iter = 0; iter < min(10000, im.width*im.height*im.frames); iter++) {
-        // Select a random patch
-        int t = randomInt(0, im.frames-1);
-        int x = randomInt(patchSize/2, im.width-1-patchSize/2);
-        int y = randomInt(patchSize/2, im.height-1-patchSize/2);
-        int j = 0;
-        for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
-            for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
-                for (int c = 0; c < im.channels; c++) {
-                    vec[j] = (mask[dx+patchSize/2]*
-                              mask[dy+patchSize/2]*
-                              im(x+dx, y+dy, t, c));
-                    j++;
+    const int dimensions = patchSize*patchSize*im.channels;
+    vector<float> vec(dimensions);
+
+    // Gather random patches a block at a time, and add each block to
+    // the covariance in one go
+    Eigenvectors e(dimensions, newChannels);
+    const int samples = min(10000, im.width*im.height*im.frames);
+    const int block = 256;
+    uint64_t stream = randomStream();
+    vector<float> patches((size_t)block * dimensions);
+    for (int start = 0; start < samples; start += block) {
+        int n = min(block, samples - start);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int k = 0; k < n; k++) {
+            // Select a random patch
+            uint64_t draw = 3 * (uint64_t)(start + k);
+            int t = randomInt(stream, draw, 0, im.frames-1);
+            int x = randomInt(stream, draw+1, patchSize/2, im.width-1-patchSize/2);
+            int y = randomInt(stream, draw+2, patchSize/2, im.height-1-patchSize/2);
+            float *patch = &patches[(size_t)k * dimensions];
+            int j = 0;
+            for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
+                for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
+                    for (int c = 0; c < im.channels; c++) {
+                        patch[j] = (mask[dx+patchSize/2]*
+                                    mask[dy+patchSize/2]*
+                                    im(x+dx, y+dy, t, c));
+                        j++;
+                    }
                 }
             }
         }
-        e.add(&vec[0]);
+        e.addBlock(&patches[0], n);
     }
 
     e.compute();
@@ -1809,28 +2371,43 @@ Image PatchPCA3D::apply(Image im, float sigma, int newChannels) {
     for (int i = 0; i < patchSize; i++) { mask[i] /= sum; }
     printf("\n");
 
-    vector<float> vec(patchSize*patchSize*patchSize*im.channels);
-
-    Eigenvectors e(patchSize*patchSize*patchSize*im.channels, newChannels);
-    for (int iter = 0; iter < min(1000, im.width*im.height*im.frames); iter++) {
-        int t = randomInt(patchSize/2, im.frames-1-patchSize/2);
-        int x = randomInt(patchSize/2, im.width-1-patchSize/2);
-        int y = randomInt(patchSize/2, im.height-1-patchSize/2);
-        int j = 0;
-        for (int dt = -patchSize/2; dt <= patchSize/2; dt++) {
-            for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
-                for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
-                    for (int c = 0; c < im.channels; c++) {
-                        vec[j] = (mask[dx+patchSize/2]*
-                                  mask[dy+patchSize/2]*
-                                  mask[dt+patchSize/2]*
-                                  im(x+dx, y+dy, t+dy, c));
-                        j++;
+    const int dimensions = patchSize*patchSize*patchSize*im.channels;
+    vector<float> vec(dimensions);
+
+    // Gather random patches a block at a time, and add each block to
+    // the covariance in one go
+    Eigenvectors e(dimensions, newChannels);
+    const int samples = min(1000, im.width*im.height*im.frames);
+    const int block = 256;
+    uint64_t stream = randomStream();
+    vector<float> patches((size_t)block * dimensions);
+    for (int start = 0; start < samples; start += block) {
+        int n = min(block, samples - start);
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int k = 0; k < n; k++) {
+            uint64_t draw = 3 * (uint64_t)(start + k);
+            int t = randomInt(stream, draw, patchSize/2, im.frames-1-patchSize/2);
+            int x = randomInt(stream, draw+1, patchSize/2, im.width-1-patchSize/2);
+            int y = randomInt(stream, draw+2, patchSize/2, im.height-1-patchSize/2);
+            float *patch = &patches[(size_t)k * dimensions];
+            int j = 0;
+            for (int dt = -patchSize/2; dt <= patchSize/2; dt++) {
+                for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
+                    for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
+                        for (int c = 0; c < im.channels; c++) {
+                            patch[j] = (mask[dx+patchSize/2]*
+                                        mask[dy+patchSize/2]*
+                                        mask[dt+patchSize/2]*
+                                        im(x+dx, y+dy, t+dt, c));
+                            j++;
+                        }
                     }
                 }
             }
         }
-        e.add(&vec[0]);
+        e.addBlock(&patches[0], n);
     }
 
     e.compute();
@@ -113,7 +113,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static void apply(Image im, int clusters);
+    static void apply(Image im, int clusters, int batchSize = 0);
 };
 
 class Sort : public Operation {
@@ -124,6 +124,14 @@ public:
     static void apply(Image im, char dimension);
 };
 
+class Percentile : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static Image apply(Image im, char dimension, vector<float> percentiles);
+};
+
 class DimensionReduction : public Operation {
 public:
     void help();
@@ -6,10 +6,317 @@
 #include "Convolve.h"
 namespace ImageStack {
 
+namespace {
+
+// All the wavelet transforms in this file are separable, and are
+// applied as a sequence of 1D transforms along rows and then along
+// columns. Each 1D level takes a line of length n and writes
+// (n+1)/2 lowpass coefficients followed by n/2 highpass coefficients.
+
+// We work on LANES lines at once, stored interleaved in a small
+// buffer (sample i of line l lives at buf[i*LANES + l]), so the inner
+// loops over lanes are uniform and vectorize. For rows this means
+// gathering eight rows, and for columns it means gathering eight
+// adjacent columns, which are contiguous in memory.
+const int LANES = 8;
+
+inline int clampIndex(int i, int n) {
+    return i < 0 ? 0 : (i >= n ? n-1 : i);
+}
+
+// Lifting steps on split lowpass (s) and highpass (d) arrays, with
+// whole-sample symmetric extension at the boundaries.
+// d[i] += a * (s[i] + s[i+1])
+inline void liftPredict(const float *s, float *d, int nl, int nh, float a) {
+    for (int i = 0; i < nh; i++) {
+        const float *s0 = s + i*LANES;
+        const float *s1 = s + clampIndex(i+1, nl)*LANES;
+        float *di = d + i*LANES;
+        for (int l = 0; l < LANES; l++) {
+            di[l] += a * (s0[l] + s1[l]);
+        }
+    }
+}
+
+// s[i] += a * (d[i-1] + d[i])
+inline void liftUpdate(float *s, const float *d, int nl, int nh, float a) {
+    for (int i = 0; i < nl; i++) {
+        const float *d0 = d + clampIndex(i-1, nh)*LANES;
+        const float *d1 = d + clampIndex(i, nh)*LANES;
+        float *si = s + i*LANES;
+        for (int l = 0; l < LANES; l++) {
+            si[l] += a * (d0[l] + d1[l]);
+        }
+    }
+}
+
+inline void liftScale(float *v, int n, float a) {
+    for (int i = 0; i < n*LANES; i++) {
+        v[i] *= a;
+    }
+}
+
+// Copy the even samples of in to the front of out, and the odd
+// samples to the back
+inline void split(const float *in, float *out, int n) {
+    const int nl = (n+1)/2;
+    for (int i = 0; i < n; i++) {
+        float *dst = out + ((i & 1) ? (nl + i/2) : (i/2))*LANES;
+        const float *src = in + i*LANES;
+        for (int l = 0; l < LANES; l++) { dst[l] = src[l]; }
+    }
+}
+
+// The inverse of split
+inline void merge(const float *in, float *out, int n) {
+    const int nl = (n+1)/2;
+    for (int i = 0; i < n; i++) {
+        const float *src = in + ((i & 1) ? (nl + i/2) : (i/2))*LANES;
+        float *dst = out + i*LANES;
+        for (int l = 0; l < LANES; l++) { dst[l] = src[l]; }
+    }
+}
+
+// Haar: lowpass is the average, highpass is the difference. An odd
+// sample left over at the end is passed through as a lowpass
+// coefficient.
+struct HaarKernel {
+    static bool canSplit(int n) {return n > 1;}
+
+    static void forward(const float *in, float *out, int n) {
+        split(in, out, n);
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = out, *d = out + nl*LANES;
+        for (int i = 0; i < nh*LANES; i++) {
+            float a = s[i], b = d[i];
+            s[i] = (a+b)/2;
+            d[i] = b-a;
+        }
+    }
+
+    static void inverse(float *in, float *out, int n) {
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = in, *d = in + nl*LANES;
+        for (int i = 0; i < nh*LANES; i++) {
+            float avg = s[i], diff = d[i];
+            s[i] = avg-diff/2;
+            d[i] = avg+diff/2;
+        }
+        merge(in, out, n);
+    }
+};
+
+// Daubechies 4, with periodic boundary conditions. This is applied as
+// a pair of 4-tap filters rather than by lifting, which keeps the
+// output identical to the historical implementation. It only
+// supports even lengths.
+#define DAUB0 0.4829629131445341
+#define DAUB1 0.83651630373780772
+#define DAUB2 0.22414386804201339
+#define DAUB3 -0.12940952255126034
+
+struct DaubechiesKernel {
+    static bool canSplit(int n) {return n > 1 && (n & 1) == 0;}
+
+    static void forward(const float *in, float *out, int n) {
+        const int nh = n/2;
+        for (int i = 0; i < nh; i++) {
+            const float *v0 = in + (2*i)*LANES;
+            const float *v1 = in + (2*i+1)*LANES;
+            const float *v2 = in + ((2*i+2) % n)*LANES;
+            const float *v3 = in + ((2*i+3) % n)*LANES;
+            float *s = out + i*LANES, *d = out + (nh+i)*LANES;
+            for (int l = 0; l < LANES; l++) {
+                s[l] = DAUB0 * v0[l] + DAUB1 * v1[l] + DAUB2 * v2[l] + DAUB3 * v3[l];
+                d[l] = DAUB3 * v0[l] - DAUB2 * v1[l] + DAUB1 * v2[l] - DAUB0 * v3[l];
+            }
+        }
+    }
+
+    static void inverse(float *in, float *out, int n) {
+        const int nh = n/2;
+        for (int j = 0; j < nh; j++) {
+            const int k = (j + nh - 1) % nh;
+            const float *s0 = in + k*LANES, *d0 = in + (nh+k)*LANES;
+            const float *s1 = in + j*LANES, *d1 = in + (nh+j)*LANES;
+            float *even = out + (2*j)*LANES, *odd = out + (2*j+1)*LANES;
+            for (int l = 0; l < LANES; l++) {
+                even[l] = DAUB2 * s0[l] + DAUB1 * d0[l] + DAUB0 * s1[l] + DAUB3 * d1[l];
+                odd[l] = DAUB3 * s0[l] - DAUB0 * d0[l] + DAUB1 * s1[l] - DAUB2 * d1[l];
+            }
+        }
+    }
+};
+
+// The CDF 5/3 biorthogonal wavelet (the reversible JPEG 2000 filter,
+// without the integer rounding). The lowpass has unit DC gain.
+struct CDF53Kernel {
+    static bool canSplit(int n) {return n > 1;}
+
+    static void forward(const float *in, float *out, int n) {
+        split(in, out, n);
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = out, *d = out + nl*LANES;
+        liftPredict(s, d, nl, nh, -0.5f);
+        liftUpdate(s, d, nl, nh, 0.25f);
+    }
+
+    static void inverse(float *in, float *out, int n) {
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = in, *d = in + nl*LANES;
+        liftUpdate(s, d, nl, nh, -0.25f);
+        liftPredict(s, d, nl, nh, 0.5f);
+        merge(in, out, n);
+    }
+};
+
+// The CDF 9/7 biorthogonal wavelet (the irreversible JPEG 2000
+// filter), computed with the standard four lifting steps. The lowpass
+// is scaled to have unit DC gain.
+struct CDF97Kernel {
+    static bool canSplit(int n) {return n > 1;}
+
+    static const float alpha, beta, gamma, delta, kappa;
+
+    static void forward(const float *in, float *out, int n) {
+        split(in, out, n);
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = out, *d = out + nl*LANES;
+        liftPredict(s, d, nl, nh, alpha);
+        liftUpdate(s, d, nl, nh, beta);
+        liftPredict(s, d, nl, nh, gamma);
+        liftUpdate(s, d, nl, nh, delta);
+        liftScale(s, nl, 1.0f/kappa);
+        liftScale(d, nh, kappa/2);
+    }
+
+    static void inverse(float *in, float *out, int n) {
+        const int nl = (n+1)/2, nh = n/2;
+        float *s = in, *d = in + nl*LANES;
+        liftScale(s, nl, kappa);
+        liftScale(d, nh, 2/kappa);
+        liftUpdate(s, d, nl, nh, -delta);
+        liftPredict(s, d, nl, nh, -gamma);
+        liftUpdate(s, d, nl, nh, -beta);
+        liftPredict(s, d, nl, nh, -alpha);
+        merge(in, out, n);
+    }
+};
+
+const float CDF97Kernel::alpha = -1.586134342059924f;
+const float CDF97Kernel::beta  = -0.052980118572961f;
+const float CDF97Kernel::gamma =  0.882911075530934f;
+const float CDF97Kernel::delta =  0.443506852043971f;
+const float CDF97Kernel::kappa =  1.230174104914001f;
+
+// The lengths of the lines at each level of a transform of a line of
+// length n, recursing at most 'levels' times (or as far as possible
+// if levels is zero or negative).
+template<typename Kernel>
+vector<int> levelSizes(int n, int levels) {
+    vector<int> sizes;
+    while (Kernel::canSplit(n) && (levels <= 0 || (int)sizes.size() < levels)) {
+        sizes.push_back(n);
+        n = (n+1)/2;
+    }
+    return sizes;
+}
+
+// Each kernel provides forward and inverse methods which transform
+// one level of LANES lines of length n from in to out. They may
+// clobber their input.
+
+// Apply a multi-level 1D transform along x (dim 0) or y (dim 1) of
+// every line in the image, in place. Lines are processed in groups of
+// LANES in parallel, and each group is read once and written once, no
+// matter how many levels there are.
+template<typename Kernel>
+void transformLines(Image im, int dim, int levels, bool inverse) {
+    const int n = dim == 0 ? im.width : im.height;
+    const int lines = dim == 0 ? im.height : im.width;
+    const vector<int> sizes = levelSizes<Kernel>(n, levels);
+    if (sizes.empty()) { return; }
+
+    const int groups = (lines + LANES - 1) / LANES;
+    const int jobs = groups * im.frames * im.channels;
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        vector<float> buf(n * LANES, 0), tmp(n * LANES, 0);
+
+        #ifdef _OPENMP
+        #pragma omp for
+        #endif
+        for (int job = 0; job < jobs; job++) {
+            const int g = job % groups;
+            const int t = (job / groups) % im.frames;
+            const int c = job / (groups * im.frames);
+            const int first = g * LANES;
+            const int count = std::min(LANES, lines - first);
+
+            // Gather the lines
+            for (int i = 0; i < n; i++) {
+                float *dst = &buf[i*LANES];
+                if (dim == 0) {
+                    for (int l = 0; l < count; l++) { dst[l] = im(i, first+l, t, c); }
+                } else {
+                    const float *src = &im(first, i, t, c);
+                    for (int l = 0; l < count; l++) { dst[l] = src[l]; }
+                }
+            }
+
+            // Transform them
+            if (!inverse) {
+                for (size_t k = 0; k < sizes.size(); k++) {
+                    Kernel::forward(&buf[0], &tmp[0], sizes[k]);
+                    std::copy(tmp.begin(), tmp.begin() + sizes[k]*LANES, buf.begin());
+                }
+            } else {
+                for (int k = (int)sizes.size()-1; k >= 0; k--) {
+                    Kernel::inverse(&buf[0], &tmp[0], sizes[k]);
+                    std::copy(tmp.begin(), tmp.begin() + sizes[k]*LANES, buf.begin());
+                }
+            }
+
+            // Scatter them back
+            for (int i = 0; i < n; i++) {
+                const float *src = &buf[i*LANES];
+                if (dim == 0) {
+                    for (int l = 0; l < count; l++) { im(i, first+l, t, c) = src[l]; }
+                } else {
+                    float *dst = &im(first, i, t, c);
+                    for (int l = 0; l < count; l++) { dst[l] = src[l]; }
+                }
+            }
+        }
+    }
+}
+
+// A 2D transform does every level in x, then every level in y. The
+// inverse undoes them in the opposite order.
+template<typename Kernel>
+void forward2D(Image im, int levels) {
+    transformLines<Kernel>(im, 0, levels, false);
+    transformLines<Kernel>(im, 1, levels, false);
+}
+
+template<typename Kernel>
+void inverse2D(Image im, int levels) {
+    transformLines<Kernel>(im, 1, levels, true);
+    transformLines<Kernel>(im, 0, levels, true);
+}
+
+}
+
 void Haar::help() {
-    pprintf("-haar performs the standard 2D haar transform of an image. The image"
-            " size must be a power of two. If given an integer argument k, it only"
-            " recurses k times, and the image size must be a multiple of 2^k.\n"
+    pprintf("-haar performs the standard 2D haar transform of an image. Every"
+            " level is applied in x, and then every level in y. By default it recurses"
+            " until each dimension has been reduced to a single coefficient. If"
+            " given an integer argument k, it only recurses k times. Sizes need not"
+            " be powers of two; at each level a dimension of size n is split into"
+            " (n+1)/2 averages followed by n/2 differences.\n"
             "\n"
             "Usage: ImageStack -load in.jpg -haar 1 -save out.jpg\n\n");
 }
@@ -42,62 +349,7 @@ void Haar::parse(vector<string> args) {
 }
 
 void Haar::apply(Image im, int times) {
-
-    if (times <= 0) {
-        assert(im.width == im.height, "to perform a full haar transform, the image must be square.\n");
-        times = 0;
-        int w = im.width >> 1;
-        while (w) {
-            times++;
-            w >>= 1;
-        }
-    }
-
-    int factor = 1 << times;
-    assert(im.width % factor == 0, "the image width is not a multiple of 2^%i", times);
-    assert(im.height % factor == 0, "the image height is not a multiple of 2^%i", times);
-
-    // transform in x
-    Image win = im.region(0, 0, 0, 0, im.width, im.height, im.frames, im.channels);
-    for (int i = 0; i < times; i++) {
-        for (int c = 0; c < win.channels; c++) {
-            for (int t = 0; t < win.frames; t++) {
-                for (int y = 0; y < win.height; y++) {
-                    for (int x = 0; x < win.width; x+=2) {
-                        float a = win(x, y, t, c);
-                        float b = win(x+1, y, t, c);
-                        win(x, y, t, c) = (a+b)/2;
-                        win(x+1, y, t, c) = b-a;
-                    }
-                }
-            }
-        }
-        // separate into averages and differences
-        Deinterleave::apply(win, 2, 1, 1);
-        // repeat on the averages
-        win = win.region(0, 0, 0, 0, win.width/2, win.height, win.frames, win.channels);
-    }
-
-    // transform in y
-    win = im.region(0, 0, 0, 0, im.width, im.height, im.frames, im.channels);
-    for (int i = 0; i < times; i++) {
-        for (int c = 0; c < win.channels; c++) {
-            for (int t = 0; t < win.frames; t++) {
-                for (int y = 0; y < win.height; y+=2) {
-                    for (int x = 0; x < win.width; x++) {
-                        float a = win(x, y, t, c);
-                        float b = win(x, y+1, t, c);
-                        win(x, y, t, c) = (a+b)/2;
-                        win(x, y+1, t, c) = b-a;
-                    }
-                }
-            }
-        }
-        // separate into averages and differences
-        Deinterleave::apply(win, 1, 2, 1);
-        // repeat on the averages
-        win = win.region(0, 0, 0, 0, win.width, win.height/2, win.frames, win.channels);
-    }
+    forward2D<HaarKernel>(im, times);
 }
 
 
@@ -113,7 +365,15 @@ bool InverseHaar::test() {
     Image b = a.copy();
     Haar::apply(b, 3);
     InverseHaar::apply(b, 3);
-    return nearlyEqual(a, b);
+    if (!nearlyEqual(a, b)) return false;
+
+    // Sizes that aren't powers of two should also invert
+    Image c(101, 37, 2, 3);
+    Noise::apply(c, 0, 1);
+    Image d = c.copy();
+    Haar::apply(d);
+    InverseHaar::apply(d);
+    return nearlyEqual(c, d);
 }
 
 void InverseHaar::parse(vector<string> args) {
@@ -127,82 +387,14 @@ void InverseHaar::parse(vector<string> args) {
 }
 
 void InverseHaar::apply(Image im, int times) {
-    if (times <= 0) {
-        assert(im.width == im.height, "to perform a full haar transorm, the image must be square.\n");
-        times = 0;
-        int w = im.width >> 1;
-        while (w) {
-            times++;
-            w >>= 1;
-        }
-    }
-
-    int factor = 1 << times;
-    assert(im.width % factor == 0, "the image width is not a multiple of 2^%i", times);
-    assert(im.height % factor == 0, "the image height is not a multiple of 2^%i", times);
-
-    // transform in y
-    int h = 2*im.height/factor;
-    Image win = im.region(0, 0, 0, 0, im.width, h, im.frames, im.channels);
-    while (1) {
-        // combine the averages and differences
-        Interleave::apply(win, 1, 2, 1);
-
-        for (int c = 0; c < win.frames; c++) {
-            for (int t = 0; t < win.frames; t++) {
-                for (int y = 0; y < win.height; y+=2) {
-                    for (int x = 0; x < win.width; x++) {
-                        float avg = win(x, y, t, c);
-                        float diff = win(x, y+1, t, c);
-                        win(x, y, t, c) = avg-diff/2;
-                        win(x, y+1, t, c) = avg+diff/2;
-                    }
-                }
-            }
-        }
-        // repeat
-        h *= 2;
-        if (h > im.height) { break; }
-        win = im.region(0, 0, 0, 0, im.width, h, im.frames, im.channels);
-    }
-
-    // transform in x
-    int w = 2*im.width/factor;
-    win = im.region(0, 0, 0, 0, w, im.height, im.frames, im.channels);
-    while (1) {
-        // combine the averages and differences
-        Interleave::apply(win, 2, 1, 1);
-
-        for (int c = 0; c < win.channels; c++) {
-            for (int t = 0; t < win.frames; t++) {
-                for (int y = 0; y < win.height; y++) {
-                    for (int x = 0; x < win.width; x+=2) {
-                        float avg = win(x, y, t, c);
-                        float diff = win(x+1, y, t, c);
-                        win(x, y, t, c) = avg-diff/2;
-                        win(x+1, y, t, c) = avg+diff/2;
-                    }
-                }
-            }
-        }
-        // repeat
-        w *= 2;
-        if (w > im.width) { break; }
-        win = im.region(0, 0, 0, 0, w, im.height, im.frames, im.channels);
-    }
+    inverse2D<HaarKernel>(im, times);
 }
 
-
-
-
-#define DAUB0 0.4829629131445341
-#define DAUB1 0.83651630373780772
-#define DAUB2 0.22414386804201339
-#define DAUB3 -0.12940952255126034
-
 void Daubechies::help() {
     pprintf("-daubechies performs the standard 2D daubechies 4 wavelet transform of"
-            " an image. The image size must be a power of two.\n"
+            " an image, with periodic boundary conditions. Each dimension is"
+            " recursively halved for as long as its size is even, so power-of-two"
+            " sizes get a full transform.\n"
             "\n"
             "Usage: ImageStack -load in.jpg -daubechies -save out.jpg\n\n");
 }
@@ -232,81 +424,13 @@ void Daubechies::parse(vector<string> args) {
 }
 
 void Daubechies::apply(Image im) {
-
-    int i;
-    for (i = 1; i < im.width; i <<= 1);
-    assert(i == im.width, "Image width must be a power of two\n");
-    for (i = 1; i < im.height; i <<= 1);
-    assert(i == im.height, "Image height must be a power of two\n");
-
-    // transform in x
-    for (int width = im.width; width > 1; width /= 2) {
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    float saved1st = im(0, y, t, c);
-                    float saved2nd = im(1, y, t, c);
-
-                    for (int x = 0; x < width-2; x+=2) {
-                        float v0 = im(x, y, t, c);
-                        float v1 = im(x+1, y, t, c);
-                        float v2 = im(x+2, y, t, c);
-                        float v3 = im(x+3, y, t, c);
-                        im(x, y, t, c) = DAUB0 * v0 + DAUB1 * v1 + DAUB2 * v2 + DAUB3 * v3;
-                        im(x+1, y, t, c) = DAUB3 * v0 - DAUB2 * v1 + DAUB1 * v2 - DAUB0 * v3;
-                    }
-                    // special case the last two elements using rotation
-                    float v0 = im(width-2, y, t, c);
-                    float v1 = im(width-1, y, t, c);
-                    float v2 = saved1st;
-                    float v3 = saved2nd;
-                    im(width-2, y, t, c) = DAUB0 * v0 + DAUB1 * v1 + DAUB2 * v2 + DAUB3 * v3;
-                    im(width-1, y, t, c) = DAUB3 * v0 - DAUB2 * v1 + DAUB1 * v2 - DAUB0 * v3;
-                }
-            }
-        }
-        // separate into averages and differences
-        Deinterleave::apply(im.region(0, 0, 0, 0,
-                                      width, im.height, im.frames, im.channels),
-                            2, 1, 1);
-    }
-
-    // transform in y
-    for (int height = im.height; height > 1; height /= 2) {
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int x = 0; x < im.width; x++) {
-                    float saved1st = im(x, 0, t, c);
-                    float saved2nd = im(x, 1, t, c);
-                    for (int y = 0; y < height-2; y+=2) {
-                        float v0 = im(x, y, t, c);
-                        float v1 = im(x, y+1, t, c);
-                        float v2 = im(x, y+2, t, c);
-                        float v3 = im(x, y+3, t, c);
-                        im(x, y, t, c) = DAUB0 * v0 + DAUB1 * v1 + DAUB2 * v2 + DAUB3 * v3;
-                        im(x, y+1, t, c) = DAUB3 * v0 - DAUB2 * v1 + DAUB1 * v2 - DAUB0 * v3;
-                    }
-                    // special case the last two elements using rotation
-                    float v0 = im(x, height-2, t, c);
-                    float v1 = im(x, height-1, t, c);
-                    float v2 = saved1st;
-                    float v3 = saved2nd;
-                    im(x, height-2, t, c) = DAUB0 * v0 + DAUB1 * v1 + DAUB2 * v2 + DAUB3 * v3;
-                    im(x, height-1, t, c) = DAUB3 * v0 - DAUB2 * v1 + DAUB1 * v2 - DAUB0 * v3;
-                }
-            }
-        }
-        // separate into averages and differences
-        Deinterleave::apply(im.region(0, 0, 0, 0,
-                                      im.width, height, im.frames, im.channels),
-                            1, 2, 1);
-    }
+    forward2D<DaubechiesKernel>(im, -1);
 }
 
 
 void InverseDaubechies::help() {
-    pprintf("-inversedaubechies performs the standard 2D daubechies 4 wavelet "
-            " transform of an image. The image size must be a power of two.\n"
+    pprintf("-inversedaubechies inverts the standard 2D daubechies 4 wavelet"
+            " transform of an image. See -help daubechies for detail.\n"
             "\n"
             "Usage: ImageStack -load in.jpg -inversedaubechies -save out.jpg\n");
 }
@@ -326,84 +450,142 @@ void InverseDaubechies::parse(vector<string> args) {
 }
 
 void InverseDaubechies::apply(Image im) {
+    inverse2D<DaubechiesKernel>(im, -1);
+}
 
-    int i;
-    for (i = 1; i < im.width; i <<= 1) { ; }
-    assert(i == im.width, "Image width must be a power of two\n");
-    for (i = 1; i < im.height; i <<= 1) { ; }
-    assert(i == im.height, "Image height must be a power of two\n");
-
-
-    // transform in x
-    for (int width = 2; width <= im.width; width *= 2) {
-        // Collect averages and differences
-        Interleave::apply(im.region(0, 0, 0, 0,
-                                    width, im.height, im.frames, im.channels),
-                          2, 1, 1);
-
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int y = 0; y < im.height; y++) {
-                    float saved1st = im(width-1, y, t, c);
-                    float saved2nd = im(width-2, y, t, c);
-
-                    for (int x = width-4; x >= 0; x-=2) {
-                        float v0 = im(x, y, t, c);
-                        float v1 = im(x+1, y, t, c);
-                        float v2 = im(x+2, y, t, c);
-                        float v3 = im(x+3, y, t, c);
-                        im(x+2, y, t, c) = DAUB2 * v0 + DAUB1 * v1 + DAUB0 * v2 + DAUB3 * v3;
-                        im(x+3, y, t, c) = DAUB3 * v0 - DAUB0 * v1 + DAUB1 * v2 - DAUB2 * v3;
-                    }
-
-
-                    // special case the first two elements using rotation
-                    float v0 = saved2nd;
-                    float v1 = saved1st;
-                    float v2 = im(0, y, t, c);
-                    float v3 = im(1, y, t, c);
-                    im(0, y, t, c) = DAUB2 * v0 + DAUB1 * v1 + DAUB0 * v2 + DAUB3 * v3;
-                    im(1, y, t, c) = DAUB3 * v0 - DAUB0 * v1 + DAUB1 * v2 - DAUB2 * v3;
-                }
-            }
+void CDF53::help() {
+    pprintf("-cdf53 performs a 2D wavelet transform using the CDF 5/3 biorthogonal"
+            " wavelet (the reversible JPEG 2000 filter, without integer rounding),"
+            " computed by lifting with symmetric boundary conditions. The layout of"
+            " the result and the optional argument are the same as for -haar. The"
+            " lowpass coefficients are scaled to preserve the mean.\n"
+            "\n"
+            "Usage: ImageStack -load in.jpg -cdf53 3 -save out.tmp\n");
+}
+
+bool CDF53::test() {
+    // A linear ramp should have no detail coefficients after one
+    // level, away from the boundary.
+    Image a(64, 64, 1, 1);
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            a(x, y) = x + 2*y;
         }
     }
+    Image b = a.copy();
+    CDF53::apply(b, 1);
+    if (!nearlyEqual(b.region(33, 0, 0, 0, 30, 30, 1, 1), Image(30, 30, 1, 1))) return false;
+    if (!nearlyEqual(b.region(0, 33, 0, 0, 30, 30, 1, 1), Image(30, 30, 1, 1))) return false;
+
+    // The lowpass should be a subsampled version of the original
+    Image smaller = Subsample::apply(a, 2, 2, 0, 0);
+    return nearlyEqual(smaller.region(1, 1, 0, 0, 30, 30, 1, 1),
+                       b.region(1, 1, 0, 0, 30, 30, 1, 1));
+}
 
-    // transform in y
-    for (int height = 2; height <= im.height; height *= 2) {
-        // Collect averages and differences
-        Interleave::apply(im.region(0, 0, 0, 0,
-                                    im.width, height, im.frames, im.channels),
-                          1, 2, 1);
-
-        for (int c = 0; c < im.channels; c++) {
-            for (int t = 0; t < im.frames; t++) {
-                for (int x = 0; x < im.width; x++) {
-                    float saved1st = im(x, height-1, t, c);
-                    float saved2nd = im(x, height-2, t, c);
-
-                    for (int y = height-4; y >= 0; y-=2) {
-                        float v0 = im(x, y, t, c);
-                        float v1 = im(x, y+1, t, c);
-                        float v2 = im(x, y+2, t, c);
-                        float v3 = im(x, y+3, t, c);
-                        im(x, y+2, t, c) = DAUB2 * v0 + DAUB1 * v1 + DAUB0 * v2 + DAUB3 * v3;
-                        im(x, y+3, t, c) = DAUB3 * v0 - DAUB0 * v1 + DAUB1 * v2 - DAUB2 * v3;
-                    }
-
-                    // special case the first two elements using rotation
-                    float v0 = saved2nd;
-                    float v1 = saved1st;
-                    float v2 = im(x, 0, t, c);
-                    float v3 = im(x, 1, t, c);
-                    im(x, 0, t, c) = DAUB2 * v0 + DAUB1 * v1 + DAUB0 * v2 + DAUB3 * v3;
-                    im(x, 1, t, c) = DAUB3 * v0 - DAUB0 * v1 + DAUB1 * v2 - DAUB2 * v3;
-                }
-            }
-        }
+void CDF53::parse(vector<string> args) {
+    if (args.size() == 0) {
+        apply(stack(0));
+    } else if (args.size() == 1) {
+        apply(stack(0), readInt(args[0]));
+    } else {
+        panic("-cdf53 requires zero or one arguments\n");
     }
 }
 
+void CDF53::apply(Image im, int times) {
+    forward2D<CDF53Kernel>(im, times);
+}
 
+void InverseCDF53::help() {
+    pprintf("-inversecdf53 inverts the -cdf53 transformation with the same"
+            " argument. See -help cdf53 for detail.\n");
+}
+
+bool InverseCDF53::test() {
+    Image a(97, 64, 2, 3);
+    Noise::apply(a, 0, 1);
+    Image b = a.copy();
+    CDF53::apply(b);
+    InverseCDF53::apply(b);
+    return nearlyEqual(a, b);
+}
+
+void InverseCDF53::parse(vector<string> args) {
+    if (args.size() == 0) {
+        apply(stack(0));
+    } else if (args.size() == 1) {
+        apply(stack(0), readInt(args[0]));
+    } else {
+        panic("-inversecdf53 requires zero or one arguments\n");
+    }
+}
+
+void InverseCDF53::apply(Image im, int times) {
+    inverse2D<CDF53Kernel>(im, times);
+}
+
+void CDF97::help() {
+    pprintf("-cdf97 performs a 2D wavelet transform using the CDF 9/7 biorthogonal"
+            " wavelet (the irreversible JPEG 2000 filter), computed by lifting with"
+            " symmetric boundary conditions. The layout of the result and the"
+            " optional argument are the same as for -haar. The lowpass coefficients"
+            " are scaled to preserve the mean.\n"
+            "\n"
+            "Usage: ImageStack -load in.jpg -cdf97 3 -save out.tmp\n");
+}
+
+bool CDF97::test() {
+    // A constant image should have no detail coefficients, and a
+    // constant lowpass
+    Image a(50, 40, 1, 2);
+    a.set(3.0f);
+    CDF97::apply(a, 2);
+    if (!nearlyEqual(a.region(0, 0, 0, 0, 13, 10, 1, 2) - 3.0f, Image(13, 10, 1, 2))) return false;
+    if (!nearlyEqual(a.region(25, 0, 0, 0, 25, 40, 1, 2), Image(25, 40, 1, 2))) return false;
+    return nearlyEqual(a.region(0, 20, 0, 0, 50, 20, 1, 2), Image(50, 20, 1, 2));
+}
+
+void CDF97::parse(vector<string> args) {
+    if (args.size() == 0) {
+        apply(stack(0));
+    } else if (args.size() == 1) {
+        apply(stack(0), readInt(args[0]));
+    } else {
+        panic("-cdf97 requires zero or one arguments\n");
+    }
+}
+
+void CDF97::apply(Image im, int times) {
+    forward2D<CDF97Kernel>(im, times);
+}
+
+void InverseCDF97::help() {
+    pprintf("-inversecdf97 inverts the -cdf97 transformation with the same"
+            " argument. See -help cdf97 for detail.\n");
+}
+
+bool InverseCDF97::test() {
+    Image a(128, 75, 2, 3);
+    Noise::apply(a, 0, 1);
+    Image b = a.copy();
+    CDF97::apply(b, 4);
+    InverseCDF97::apply(b, 4);
+    return nearlyEqual(a, b);
+}
+
+void InverseCDF97::parse(vector<string> args) {
+    if (args.size() == 0) {
+        apply(stack(0));
+    } else if (args.size() == 1) {
+        apply(stack(0), readInt(args[0]));
+    } else {
+        panic("-inversecdf97 requires zero or one arguments\n");
+    }
+}
+
+void InverseCDF97::apply(Image im, int times) {
+    inverse2D<CDF97Kernel>(im, times);
+}
 
 }
@@ -34,5 +34,37 @@ public:
     static void apply(Image im);
 };
 
+class CDF53 : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(Image im, int times = -1);
+};
+
+class InverseCDF53 : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(Image im, int times = -1);
+};
+
+class CDF97 : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(Image im, int times = -1);
+};
+
+class InverseCDF97 : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+    static void apply(Image im, int times = -1);
+};
+
 }
 #endif
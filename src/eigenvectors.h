@@ -28,9 +28,11 @@ public:
         count = 0;
     }
 
+    // Only the upper triangle of the covariance is accumulated. The
+    // rest is filled in by compute.
     void add(const float *v) {
         for (int i = 0; i < d_in; i++) {
-            for (int j = 0; j < d_in; j++) {
+            for (int j = i; j < d_in; j++) {
                 covariance[i *d_in+j] += v[i]*v[j];
             }
             mean[i] += v[i];
@@ -38,6 +40,31 @@ public:
         count++;
     }
 
+    // Add n vectors stored one after the other. This is the same as
+    // calling add on each one, but it updates the covariance as a
+    // matrix product, with each thread handling some of its rows.
+    void addBlock(const float *v, int n) {
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 4)
+        #endif
+        for (int i = 0; i < d_in; i++) {
+            double *row = &covariance[i*d_in];
+            for (int k = 0; k < n; k++) {
+                const float *vk = v + (size_t)k*d_in;
+                const double vi = vk[i];
+                for (int j = i; j < d_in; j++) {
+                    row[j] += vi * vk[j];
+                }
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            for (int i = 0; i < d_in; i++) {
+                mean[i] += v[(size_t)k*d_in + i];
+            }
+        }
+        count += n;
+    }
+
     // how much of each eigenvector is in a particular vector?
     // multiply the vector by the transpose of the eigenvector matrix
     void apply(const float *v_in, float *v_out) {
@@ -68,12 +95,21 @@ public:
     void compute() {
         // first remove the mean and normalize by the count
         for (int i = 0; i < d_in; i++) {
-            for (int j = 0; j < d_in; j++) {
+            for (int j = i; j < d_in; j++) {
                 covariance[i *d_in+j] -= mean[i]*mean[j]/count;
                 covariance[i *d_in+j] /= count;
+                covariance[j *d_in+i] = covariance[i *d_in+j];
             }
         }
 
+        // When only a few eigenvectors are wanted, find them in a
+        // small random subspace instead
+        if (d_out * 4 <= d_in) {
+            computeRandomized();
+            computed = true;
+            return;
+        }
+
         // now compute the eigenvectors
         // TODO: do this using a non-retarded algorithm
         for (int i = 0; i < d_in; i++) {
@@ -92,56 +128,7 @@ public:
 
 
         while (1) {
-            // orthonormalize
-            for (int i = 0; i < d_out; i++) {
-                // first make this column independent of all the
-                // previous columns
-                for (int j = 0; j < i; j++) {
-                    // compute the dot product
-                    double dot = 0;
-                    for (int k = 0; k < d_in; k++) {
-                        dot += eigenvectors[k*d_out+i]*eigenvectors[k*d_out+j];
-                    }
-                    // The previous column is of unit length, so it's
-                    // easy to make this one independent
-                    for (int k = 0; k < d_in; k++) {
-                        eigenvectors[k *d_out+i] -= eigenvectors[k*d_out+j]*dot;
-                    }
-                }
-
-                // now normalize this column
-                double dot = 0;
-                for (int k = 0; k < d_in; k++) {
-                    dot += eigenvectors[k*d_out+i]*eigenvectors[k*d_out+i];
-                }
-
-                // Add some noise if the column is too small to be normalized
-                while (dot < 1e-20) {
-                    dot = 0;
-                    for (int k = 0; k < d_in; k++) {
-                        eigenvectors[k*d_out+i] += randomFloat(-0.001, 0.001);
-                        dot += eigenvectors[k*d_out+i]*eigenvectors[k*d_out+i];
-                    }
-                }
-
-                dot = ::sqrt(dot);
-
-                dot = 1.0/dot;
-
-                /*
-                // make sure the largest element of each eigenvector is positive
-                int max_elt = 0;
-                for (int k = 1; k < d_in; k++) {
-                    if (fabs(eigenvectors[k*d_out+i]) > fabs(eigenvectors[k*d_out+max_elt])) max_elt = k;
-                }
-                if (max_elt < 0) { dot = -dot; }
-                */
-
-                for (int k = 0; k < d_in; k++) {
-                    eigenvectors[k *d_out+i] *= dot;
-                }
-
-            }
+            orthonormalize(eigenvectors, d_out);
 
             /*
             printf("eigenvector matrix:\n");
@@ -166,14 +153,7 @@ public:
             //printf("%f\n", dist);
 
             // multiply by the covariance matrix
-            for (int i = 0; i < d_in; i++) {
-                for (int j = 0; j < d_out; j++) {
-                    tmp[i *d_out+j] = 0;
-                    for (int k = 0; k < d_in; k++) {
-                        tmp[i *d_out+j] += covariance[i*d_in+k]*eigenvectors[k*d_out+j];
-                    }
-                }
-            }
+            multiply(eigenvectors, tmp, d_out);
             tmp.swap(eigenvectors);
 
         }
@@ -183,6 +163,155 @@ public:
 
 private:
 
+    // Randomized eigendecomposition after Halko, Martinsson, and
+    // Tropp. Power iteration on a few more random vectors than needed
+    // captures the dominant subspace of the covariance. The
+    // eigenvectors are then found exactly within that subspace.
+    void computeRandomized() {
+        const int k = min(d_in, d_out + 8);
+        vector<double> q(d_in*k), y(d_in*k);
+        uint64_t stream = randomStream();
+        for (int i = 0; i < d_in*k; i++) {
+            q[i] = randomFloat(stream, i, -1, 1);
+        }
+        orthonormalize(q, k);
+
+        for (int iter = 0; iter < 5; iter++) {
+            multiply(q, y, k);
+            y.swap(q);
+            orthonormalize(q, k);
+        }
+
+        // Project the covariance onto the subspace: b = q' * C * q
+        multiply(q, y, k);
+        vector<double> b(k*k, 0), u(k*k, 0), lambda(k);
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < k; j++) {
+                for (int l = 0; l < d_in; l++) {
+                    b[i*k+j] += q[l*k+i] * y[l*k+j];
+                }
+            }
+        }
+        symmetricEigen(b, k, u, lambda);
+
+        // Rotate the basis onto the eigenvectors, largest first
+        vector<pair<double, int> > order(k);
+        for (int i = 0; i < k; i++) { order[i] = make_pair(-lambda[i], i); }
+        sort(order.begin(), order.end());
+        for (int i = 0; i < d_in; i++) {
+            for (int j = 0; j < d_out; j++) {
+                double v = 0;
+                for (int l = 0; l < k; l++) {
+                    v += q[i*k+l] * u[l*k+order[j].second];
+                }
+                eigenvectors[i*d_out+j] = v;
+            }
+        }
+    }
+
+    // out = covariance * in, where in and out have cols columns
+    void multiply(const vector<double> &in, vector<double> &out, int cols) {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int i = 0; i < d_in; i++) {
+            double *o = &out[i*cols];
+            for (int j = 0; j < cols; j++) { o[j] = 0; }
+            for (int l = 0; l < d_in; l++) {
+                const double c = covariance[i*d_in+l];
+                for (int j = 0; j < cols; j++) {
+                    o[j] += c * in[l*cols+j];
+                }
+            }
+        }
+    }
+
+    // Gram-Schmidt on the columns of a d_in x cols matrix. Each column
+    // is made independent of the previous ones twice, which keeps
+    // them orthogonal even when the column is tiny to begin with.
+    void orthonormalize(vector<double> &m, int cols) {
+        for (int i = 0; i < cols; i++) {
+            double dot = 0;
+            while (1) {
+                for (int pass = 0; pass < 2; pass++) {
+                    for (int j = 0; j < i; j++) {
+                        dot = 0;
+                        for (int k = 0; k < d_in; k++) {
+                            dot += m[k*cols+i]*m[k*cols+j];
+                        }
+                        for (int k = 0; k < d_in; k++) {
+                            m[k*cols+i] -= m[k*cols+j]*dot;
+                        }
+                    }
+                }
+                dot = 0;
+                for (int k = 0; k < d_in; k++) {
+                    dot += m[k*cols+i]*m[k*cols+i];
+                }
+                if (dot >= 1e-20) { break; }
+
+                // Add some noise if the column is too small to be
+                // normalized, and try again
+                for (int k = 0; k < d_in; k++) {
+                    m[k*cols+i] += randomFloat(-0.001, 0.001);
+                }
+            }
+            dot = 1.0/::sqrt(dot);
+            for (int k = 0; k < d_in; k++) {
+                m[k*cols+i] *= dot;
+            }
+        }
+    }
+
+    // Cyclic Jacobi eigendecomposition of a small symmetric n x n
+    // matrix a, which is destroyed. The eigenvectors go in the columns
+    // of v, and the eigenvalues in lambda.
+    static void symmetricEigen(vector<double> &a, int n, vector<double> &v, vector<double> &lambda) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                v[i*n+j] = (i == j) ? 1 : 0;
+            }
+        }
+        for (int sweep = 0; sweep < 50; sweep++) {
+            double off = 0, diag = 0;
+            for (int i = 0; i < n; i++) {
+                diag += a[i*n+i]*a[i*n+i];
+                for (int j = i+1; j < n; j++) {
+                    off += a[i*n+j]*a[i*n+j];
+                }
+            }
+            if (off <= 1e-24 * diag) { break; }
+
+            for (int p = 0; p < n; p++) {
+                for (int r = p+1; r < n; r++) {
+                    double apr = a[p*n+r];
+                    if (apr == 0) { continue; }
+                    double theta = (a[r*n+r] - a[p*n+p]) / (2*apr);
+                    double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + ::sqrt(theta*theta + 1));
+                    double c = 1/::sqrt(t*t + 1), s = t*c;
+                    for (int k = 0; k < n; k++) {
+                        double akp = a[k*n+p], akr = a[k*n+r];
+                        a[k*n+p] = c*akp - s*akr;
+                        a[k*n+r] = s*akp + c*akr;
+                    }
+                    for (int k = 0; k < n; k++) {
+                        double apk = a[p*n+k], ark = a[r*n+k];
+                        a[p*n+k] = c*apk - s*ark;
+                        a[r*n+k] = s*apk + c*ark;
+                    }
+                    for (int k = 0; k < n; k++) {
+                        double vkp = v[k*n+p], vkr = v[k*n+r];
+                        v[k*n+p] = c*vkp - s*vkr;
+                        v[k*n+r] = s*vkp + c*vkr;
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            lambda[i] = a[i*n+i];
+        }
+    }
+
     int d_in, d_out;
     vector<double> covariance, mean, eigenvectors, tmp;
     bool computed;
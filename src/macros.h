@@ -10,6 +10,18 @@ namespace ImageStack {
 #undef max
 #endif
 
+// Marks a plain loop kernel to be compiled for several instruction
+// sets, with the best one the cpu supports picked when the program
+// loads. This lets a binary built for a baseline cpu still use avx2
+// and avx512 in its hottest loops. Expr code can't be dispatched this
+// way, because its vector width is part of its types.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 && \
+    defined(__x86_64__) && defined(__linux__) && !defined(__AVX512F__)
+#define IMAGESTACK_MULTIVERSION __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#else
+#define IMAGESTACK_MULTIVERSION
+#endif
+
 template<typename T>
 inline T max(const T &a, const T &b) {
     if (a > b) { return a; }
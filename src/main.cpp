@@ -8,14 +8,48 @@
 #endif
 namespace ImageStack {
 
-vector<Image> stack_;
+// Stack entries may share pixel data with each other or with stashed
+// images. Such entries are copy-on-write: they get their own copy of
+// the pixels the first time they're accessed, unless by then nothing
+// else refers to them.
+struct StackEntry {
+    Image im;
+    bool copyOnWrite;
+    StackEntry(Image im_, bool cow) : im(im_), copyOnWrite(cow) {}
+};
+
+vector<StackEntry> stack_;
 Image &stack(size_t idx) {
     assert(idx < stack_.size(), "Stack underflow\n");
-    return stack_[stack_.size() - 1 - idx];
+    StackEntry &e = stack_[stack_.size() - 1 - idx];
+    if (e.copyOnWrite) {
+        if (e.im.shared()) e.im = e.im.copy();
+        e.copyOnWrite = false;
+    }
+    return e.im;
+}
+
+Image peek(size_t idx) {
+    assert(idx < stack_.size(), "Stack underflow\n");
+    return stack_[stack_.size() - 1 - idx].im;
 }
 
 void push(Image im) {
-    stack_.push_back(im);
+    // An operation that only read its input through peek() may
+    // return that input, or a view of it. Then both entries must be
+    // copied before they are modified.
+    bool cow = false;
+    for (size_t i = 0; i < stack_.size(); i++) {
+        if (stack_[i].im.sameData(im)) {
+            stack_[i].copyOnWrite = true;
+            cow = true;
+        }
+    }
+    stack_.push_back(StackEntry(im, cow));
+}
+
+void pushShared(Image im) {
+    stack_.push_back(StackEntry(im, true));
 }
 
 void pop() {
@@ -23,8 +57,11 @@ void pop() {
     stack_.pop_back();
 }
 
-void dup() {
-    push(stack(0).copy());
+void dup(size_t idx) {
+    assert(idx < stack_.size(), "Stack underflow\n");
+    StackEntry &e = stack_[stack_.size() - 1 - idx];
+    e.copyOnWrite = true;
+    pushShared(e.im);
 }
 
 void pull(size_t n) {
@@ -34,12 +71,52 @@ void pull(size_t n) {
     }
 }
 
+namespace {
+uint32_t randomSeed = 0;
+uint64_t streamsUsed = 0, drawsUsed = 0;
+
+// Mix a seed and an index into a 64-bit stream key (splitmix64)
+uint64_t streamKey(uint32_t seed, uint64_t index) {
+    uint64_t z = ((uint64_t)seed << 32) + index * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// The stream the two functions without a stream argument draw from
+uint64_t defaultStream() {
+    uint64_t draw;
+    #ifdef _OPENMP
+    #pragma omp atomic capture
+    #endif
+    draw = drawsUsed++;
+    return draw;
+}
+}
+
+void setRandomSeed(uint32_t seed) {
+    randomSeed = seed;
+    streamsUsed = 0;
+    drawsUsed = 0;
+    srand(seed);
+}
+
+uint64_t randomStream() {
+    uint64_t index;
+    #ifdef _OPENMP
+    #pragma omp atomic capture
+    #endif
+    index = streamsUsed++;
+    // Stream zero is reserved for randomInt and randomFloat
+    return streamKey(randomSeed, index + 1);
+}
+
 int randomInt(int min, int max) {
-    return (int)(((double)rand()/(RAND_MAX+1.0)) * (max - min + 1) + min);
+    return randomInt(streamKey(randomSeed, 0), defaultStream(), min, max);
 }
 
 float randomFloat(float min, float max) {
-    return ((float)rand()/(RAND_MAX+1.0)) * (max - min) + min;
+    return randomFloat(streamKey(randomSeed, 0), defaultStream(), min, max);
 }
 
 bool nearlyEqual(Image a, Image b) {
@@ -64,14 +141,81 @@ float currentTime() {
 
 map<string, Operation *> operationMap;
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+namespace {
+// Everything else is compiled for the instruction sets given by
+// -march, so if this cpu lacks one of them, say which rather than
+// dying of an illegal instruction. This runs before any static
+// initializer, and is itself compiled for the baseline cpu.
+__attribute__((constructor(101), target("arch=x86-64")))
+void checkCpu() {
+    __builtin_cpu_init();
+    const char *missing = NULL;
+#define REQUIRE(feature) if (!missing && !__builtin_cpu_supports(feature)) missing = feature
+#ifdef __SSE3__
+    REQUIRE("sse3");
+#endif
+#ifdef __SSSE3__
+    REQUIRE("ssse3");
+#endif
+#ifdef __SSE4_1__
+    REQUIRE("sse4.1");
+#endif
+#ifdef __SSE4_2__
+    REQUIRE("sse4.2");
+#endif
+#ifdef __POPCNT__
+    REQUIRE("popcnt");
+#endif
+#ifdef __AVX__
+    REQUIRE("avx");
+#endif
+#ifdef __AVX2__
+    REQUIRE("avx2");
+#endif
+#ifdef __FMA__
+    REQUIRE("fma");
+#endif
+#ifdef __BMI__
+    REQUIRE("bmi");
+#endif
+#ifdef __BMI2__
+    REQUIRE("bmi2");
+#endif
+#ifdef __AVX512F__
+    REQUIRE("avx512f");
+#endif
+#ifdef __AVX512CD__
+    REQUIRE("avx512cd");
+#endif
+#ifdef __AVX512BW__
+    REQUIRE("avx512bw");
+#endif
+#ifdef __AVX512DQ__
+    REQUIRE("avx512dq");
+#endif
+#ifdef __AVX512VL__
+    REQUIRE("avx512vl");
+#endif
+#undef REQUIRE
+    if (missing) {
+        printf("This copy of ImageStack was compiled to use %s instructions, "
+               "which this cpu does not support. Rebuild it with a lower -march.\n",
+               missing);
+        exit(1);
+    }
+}
+}
+#endif
+
 void start() {
     // get the starting time
 #ifdef WIN32
     startTime = timeGetTime();
-    srand(startTime); rand();
+    setRandomSeed(startTime);
 #else
     gettimeofday(&startTime, NULL);
-    srand(startTime.tv_sec + startTime.tv_usec); rand();
+    setRandomSeed(startTime.tv_sec + startTime.tv_usec);
 #endif
     // make the operation map
     loadOperations();
@@ -81,54 +225,119 @@ void end() {
     unloadOperations();
 }
 
+void Pointwise::apply(Image im, const vector<Pointwise *> &stages) {
+    if (stages.empty()) return;
+    const int rows = im.height * im.frames * im.channels;
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int r = 0; r < rows; r++) {
+        int y = r % im.height, t = (r / im.height) % im.frames, c = r / (im.height * im.frames);
+        float *row = &im(0, y, t, c);
+        for (size_t i = 0; i < stages.size(); i++) {
+            stages[i]->apply(row, im.width, c);
+        }
+    }
+}
+
+void PointwiseOperation::parse(vector<string> args) {
+    vector<Pointwise *> stages(1, pointwise(args));
+    Pointwise::apply(stack(0), stages);
+    delete stages[0];
+}
+
+namespace {
+// Apply and discard any deferred pointwise operations
+void flush(vector<Pointwise *> &pending) {
+    if (pending.empty()) return;
+    Pointwise::apply(stack(0), pending);
+    for (size_t i = 0; i < pending.size(); i++) {
+        delete pending[i];
+    }
+    pending.clear();
+}
+
+// Whether an argument is a plain number, as opposed to an expression
+// that might depend on the image
+bool isLiteral(const string &arg) {
+    const char *start = arg.c_str();
+    char *end;
+    strtod(start, &end);
+    return end != start && *end == 0;
+}
+}
+
 void parseCommands(vector<string> args) {
     size_t arg = 0, opArgs;
     OperationMapIterator op;
 
-    while (arg < args.size()) {
-        // dump the stack for debugging
-        /*
-        if (0) {
-            printf("Stack: \n");
-            for (size_t i = 0; i < stack_.size(); i++) {
-                stack_[i].debug();
+    // Pointwise operations are deferred, and then fused into a single
+    // pass over the image when something else needs it.
+    vector<Pointwise *> pending;
+
+    try {
+        while (arg < args.size()) {
+            // dump the stack for debugging
+            /*
+            if (0) {
+                printf("Stack: \n");
+                for (size_t i = 0; i < stack_.size(); i++) {
+                    stack_[i].debug();
+                }
             }
-        }
-        */
+            */
 
-        // get the operation
-        op = operationMap.find(args[arg]);
+            // get the operation
+            op = operationMap.find(args[arg]);
 
-        // check the op is exists
-        if (op == operationMap.end()) {
-            panic("Unknown operation \"%s\"\n"
-                  "Try -help for a list of operations.", args[arg].c_str());
-        }
+            // check the op is exists
+            if (op == operationMap.end()) {
+                panic("Unknown operation \"%s\"\n"
+                      "Try -help for a list of operations.", args[arg].c_str());
+            }
 
-        // find the arguments, look ahead till we see -[a-zA-Z]
-        for (opArgs = 1; opArgs + arg < args.size(); opArgs++) {
-            char first = args[arg + opArgs][0];
-            assert(first != '\0', "Empty argument!");
-            if (first != '-') { continue; }
-            if (isalpha(args[arg + opArgs][1])) { break; }
-        }
+            // find the arguments, look ahead till we see -[a-zA-Z]
+            for (opArgs = 1; opArgs + arg < args.size(); opArgs++) {
+                char first = args[arg + opArgs][0];
+                assert(first != '\0', "Empty argument!");
+                if (first != '-') { continue; }
+                if (isalpha(args[arg + opArgs][1])) { break; }
+            }
 
-        printf("Performing operation %s ", op->first.c_str()); fflush(stdout);
-        if (opArgs < 8) {
-            for (size_t i = arg+1; i < arg + opArgs; i++) {
-                printf("%s ", args[i].c_str());
+            printf("Performing operation %s ", op->first.c_str()); fflush(stdout);
+            if (opArgs < 8) {
+                for (size_t i = arg+1; i < arg + opArgs; i++) {
+                    printf("%s ", args[i].c_str());
+                }
             }
-        }
-        printf("...\n");
+            printf("...\n");
 
-        vector<string> operationArgs;
-        for (size_t i = arg + 1; i < arg + opArgs; i++) { operationArgs.push_back(args[i]); }
+            vector<string> operationArgs;
+            for (size_t i = arg + 1; i < arg + opArgs; i++) { operationArgs.push_back(args[i]); }
 
-        // call the operation
-        (op->second)->parse(operationArgs);
+            // Arguments that are expressions may depend on the image, so
+            // it must be up to date before they're evaluated
+            for (size_t i = 0; i < operationArgs.size() && !pending.empty(); i++) {
+                if (!isLiteral(operationArgs[i])) flush(pending);
+            }
+
+            // call the operation, or defer it
+            Pointwise *p = (op->second)->pointwise(operationArgs);
+            if (p) {
+                pending.push_back(p);
+            } else {
+                flush(pending);
+                (op->second)->parse(operationArgs);
+            }
 
-        // skip over the args
-        arg += opArgs;
+            // skip over the args
+            arg += opArgs;
+        }
+        flush(pending);
+    } catch (...) {
+        // Finish the operations that succeeded before failing
+        flush(pending);
+        throw;
     }
 }
 
@@ -145,7 +354,7 @@ float readFloat(string arg) {
         push(Image(1, 1, 1, 1));
         needToPop = true;
     }
-    Expression::State s(stack(0));
+    Expression::State s(peek(0));
     float val = e.eval(s);
     if (needToPop) { pop(); }
     return val;
@@ -221,7 +430,12 @@ using namespace ImageStack;
 
 int main(int argc, char **argv) {
 
-    start();
+    try {
+        start();
+    } catch (Exception &e) {
+        printf("%s\n", e.message);
+        return 1;
+    }
 
     if (argc == 1 || argv[1][0] != '-') {
         operationMap["-help"]->help();
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include <cmath>
 #include <map>
@@ -62,9 +63,16 @@ namespace ImageStack {
 
 // Deal with the stack of images that gives this program its name
 Image &stack(size_t index);
+// Read a stack entry without giving it its own copy of shared pixel
+// data. The result must not be modified.
+Image peek(size_t index);
 void push(Image);
 void pop();
-void dup();
+// Duplicate a stack entry without copying it. The copy happens when
+// either entry is next modified through stack(), if both still exist.
+void dup(size_t index = 0);
+// Push an image that is also referred to elsewhere, to be copied on access
+void pushShared(Image);
 void pull(size_t);
 
 // Parse ints, floats, chars, and ImageStack commands
@@ -84,6 +92,41 @@ int randomInt(int min, int max);
 // Generate a uniform random float within [min, max]
 float randomFloat(float min, float max);
 
+// Counter-based random numbers. randomBits scrambles a stream key and
+// a counter into 32 random bits using the Philox-2x32-10 bijection of
+// Salmon et al., so each element of a stream can be generated on its
+// own, on any thread and in any order. This makes random images the
+// same regardless of how they are divided up between threads. Use a
+// fresh stream from randomStream each time, and index it by something
+// like the pixel's position.
+uint64_t randomStream();
+
+// Seed randomStream, the functions above, and rand()
+void setRandomSeed(uint32_t seed);
+
+inline uint32_t randomBits(uint64_t stream, uint64_t counter) {
+    uint32_t key = (uint32_t)stream;
+    uint32_t lo = (uint32_t)counter, hi = (uint32_t)(counter >> 32) ^ (uint32_t)(stream >> 32);
+    for (int i = 0; i < 10; i++) {
+        uint64_t product = (uint64_t)0xD256D345u * lo;
+        lo = (uint32_t)(product >> 32) ^ key ^ hi;
+        hi = (uint32_t)product;
+        key += 0x9E3779B9u;
+    }
+    return lo;
+}
+
+// A uniform random integer within [min, max] drawn from a stream
+inline int randomInt(uint64_t stream, uint64_t counter, int min, int max) {
+    uint64_t range = (uint64_t)((int64_t)max - min + 1);
+    return min + (int)((randomBits(stream, counter) * range) >> 32);
+}
+
+// A uniform random float within [min, max) drawn from a stream
+inline float randomFloat(uint64_t stream, uint64_t counter, float min, float max) {
+    return (randomBits(stream, counter) >> 8) * (1.0f / (1 << 24)) * (max - min) + min;
+}
+
 // pretty-print some help text, by word wrapping at 79 chars
 void pprintf(const char *str);
 